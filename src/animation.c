@@ -0,0 +1,249 @@
+#include "animation.h"
+
+#include <math.h>
+#include <stdio.h>
+
+// How long the finished code stays on screen before the animation loops.
+#define ANIMATION_HOLD_SECONDS 3
+
+// A line of the code text and the rows of device pixels it covers.
+typedef struct {
+    PangoLayoutLine *line;
+    double x;        // Logical x position of the start of the line
+    double baseline; // Logical y position of the baseline
+    int y0;
+    int y1;
+} TypingLine;
+
+// A token and the columns of device pixels it is revealed in. The columns
+// of a line's tokens tile the whole width of the image, so every pixel of
+// the text is drawn exactly once and the last frame matches a screenshot.
+typedef struct {
+    int line;
+    int x0;
+    int x1;
+    int tick; // Frame time, in 1/fps seconds, at which the token appears
+} TypingToken;
+
+static gboolean is_word_byte(unsigned char c) {
+    return g_ascii_isalnum(c) || c == '_' || c >= 0x80;
+}
+
+/**
+ * @brief Splits the laid out text into the tokens that are typed one at a
+ *        time: runs of letters, digits and underscores, and single
+ *        punctuation characters. Whitespace appears with the next token.
+ * @param layout The whole code text.
+ * @param lines Receives the lines of the layout.
+ * @return The tokens in typing order, with tick left at 0.
+ */
+static GArray *collect_tokens(PangoLayout *layout,
+                              double scale,
+                              int pixel_width,
+                              GArray *lines) {
+    GArray *tokens = g_array_new(FALSE, FALSE, sizeof(TypingToken));
+    const char *text = pango_layout_get_text(layout);
+    double text_x, text_y;
+    render_text_origin(&text_x, &text_y);
+
+    PangoLayoutIter *iter = pango_layout_get_iter(layout);
+    do {
+        PangoLayoutLine *line = pango_layout_iter_get_line_readonly(iter);
+        int line_y0, line_y1;
+        PangoRectangle logical;
+        pango_layout_iter_get_line_yrange(iter, &line_y0, &line_y1);
+        pango_layout_iter_get_line_extents(iter, NULL, &logical);
+
+        TypingLine typing_line;
+        typing_line.line = line;
+        typing_line.x = text_x + (double)logical.x / PANGO_SCALE;
+        typing_line.baseline =
+            text_y + (double)pango_layout_iter_get_baseline(iter) / PANGO_SCALE;
+        typing_line.y0 =
+            (int)round((text_y + (double)line_y0 / PANGO_SCALE) * scale);
+        typing_line.y1 =
+            (int)round((text_y + (double)line_y1 / PANGO_SCALE) * scale);
+        g_array_append_val(lines, typing_line);
+
+        int first_token = tokens->len;
+        int end = line->start_index + line->length;
+        for (int i = line->start_index; i < end;) {
+            unsigned char c = text[i];
+            if (c == ' ' || c == '\t') {
+                i++;
+                continue;
+            }
+            if (is_word_byte(c)) {
+                while (i < end && is_word_byte(text[i]))
+                    i++;
+            } else {
+                i++;
+            }
+
+            // The token's column ends at the trailing edge of its last
+            // character and starts where the previous one ended.
+            int last_char = g_utf8_prev_char(text + i) - text;
+            int x_pos;
+            pango_layout_line_index_to_x(line, last_char, TRUE, &x_pos);
+            TypingToken token = {0};
+            token.line = lines->len - 1;
+            if ((int)tokens->len > first_token)
+                token.x0 =
+                    g_array_index(tokens, TypingToken, tokens->len - 1).x1;
+            token.x1 = (int)round(
+                (typing_line.x + (double)x_pos / PANGO_SCALE) * scale);
+            token.x1 = CLAMP(token.x1, token.x0, pixel_width);
+            g_array_append_val(tokens, token);
+        }
+        if ((int)tokens->len > first_token)
+            g_array_index(tokens, TypingToken, tokens->len - 1).x1 =
+                pixel_width;
+    } while (pango_layout_iter_next_line(iter));
+    pango_layout_iter_free(iter);
+
+    return tokens;
+}
+
+/**
+ * @brief Draws a token onto the previous frame: its line of text, clipped
+ *        to the token's pixels.
+ */
+static void draw_token(cairo_t *cr,
+                       const TypingLine *line,
+                       const TypingToken *token,
+                       double scale) {
+    cairo_save(cr);
+    cairo_rectangle(cr,
+                    token->x0 / scale,
+                    line->y0 / scale,
+                    (token->x1 - token->x0) / scale,
+                    (line->y1 - line->y0) / scale);
+    cairo_clip(cr);
+    render_code_line(cr, line->line, line->x, line->baseline);
+    cairo_restore(cr);
+}
+
+/**
+ * @brief Renders the typing animation and encodes it as APNG. The first
+ *        frame is the empty window; each later frame adds the tokens typed
+ *        since the one before and is stored as the rectangle around them.
+ *        Frames where nothing would change are skipped by showing the
+ *        previous frame for longer.
+ * @param code_layout The shaped code text.
+ * @param opts The rendering options, including the device scale.
+ * @param animation Frame rate and typing speed.
+ * @param write_func Called with the encoded bytes, in order.
+ * @param closure Passed to write_func.
+ * @param png_settings Compression settings for the frames.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean render_typing_animation(const CodeLayout *code_layout,
+                                 const RenderOptions *opts,
+                                 const AnimationSettings *animation,
+                                 cairo_write_func_t write_func,
+                                 void *closure,
+                                 const PngSettings *png_settings) {
+    double scale = opts->scale;
+    int pixel_width = (int)ceil(code_layout->width * scale);
+    int pixel_height = (int)ceil(code_layout->height * scale);
+
+    cairo_surface_t *surface = cairo_image_surface_create(
+        CAIRO_FORMAT_ARGB32, pixel_width, pixel_height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr,
+                "Could not create a %dx%d image surface: %s\n",
+                pixel_width,
+                pixel_height,
+                cairo_status_to_string(cairo_surface_status(surface)));
+        cairo_surface_destroy(surface);
+        return FALSE;
+    }
+    cairo_surface_set_device_scale(surface, scale, scale);
+
+    // The lines keep pointers into the layout until the last frame.
+    PangoLayout *layout = code_layout_pango_layout(code_layout);
+    GArray *lines = g_array_new(FALSE, FALSE, sizeof(TypingLine));
+    GArray *tokens = collect_tokens(layout, scale, pixel_width, lines);
+
+    // Token k appears (k + 1) / tokens_per_second seconds in, rounded down
+    // to a frame; tokens that land on the same frame share it.
+    int n_frames = 1;
+    int last_tick = 0;
+    for (guint k = 0; k < tokens->len; k++) {
+        TypingToken *token = &g_array_index(tokens, TypingToken, k);
+        token->tick = (int)floor((k + 1.0) * animation->fps /
+                                 animation->tokens_per_second);
+        if (token->tick > last_tick) {
+            n_frames++;
+            last_tick = token->tick;
+        }
+    }
+
+    cairo_t *cr = cairo_create(surface);
+    TextRange range = {0, code_layout->text_height};
+    render_window_chrome(cr, code_layout, opts, &range);
+
+    ApngEncoder *encoder = apng_encoder_new(write_func,
+                                            closure,
+                                            pixel_width,
+                                            pixel_height,
+                                            TRUE,
+                                            n_frames,
+                                            png_settings);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    guint k = 0;
+    gboolean ok = TRUE;
+    for (int frame = 0; ok && frame < n_frames; frame++) {
+        int tick = frame == 0 ? 0 : g_array_index(tokens, TypingToken, k).tick;
+        int x0 = pixel_width, y0 = pixel_height, x1 = 0, y1 = 0;
+        for (; k < tokens->len; k++) {
+            const TypingToken *token = &g_array_index(tokens, TypingToken, k);
+            if (token->tick != tick)
+                break;
+            const TypingLine *line =
+                &g_array_index(lines, TypingLine, token->line);
+            if (token->x1 <= token->x0 || line->y1 <= line->y0)
+                continue;
+            draw_token(cr, line, token, scale);
+            x0 = MIN(x0, token->x0);
+            x1 = MAX(x1, token->x1);
+            y0 = MIN(y0, line->y0);
+            y1 = MAX(y1, line->y1);
+        }
+        cairo_surface_flush(surface);
+
+        if (frame == 0) {
+            x0 = y0 = 0;
+            x1 = pixel_width;
+            y1 = pixel_height;
+        } else if (x1 <= x0 || y1 <= y0) {
+            // Only empty tokens: repeat a pixel that did not change.
+            x0 = y0 = 0;
+            x1 = y1 = 1;
+        }
+        x1 = MIN(x1, pixel_width);
+        y1 = MIN(y1, pixel_height);
+
+        int next_tick = k < tokens->len
+                            ? g_array_index(tokens, TypingToken, k).tick
+                            : tick + ANIMATION_HOLD_SECONDS * animation->fps;
+        ok = apng_encoder_add_frame(encoder,
+                                    data + (size_t)y0 * stride + x0 * 4,
+                                    stride,
+                                    x0,
+                                    y0,
+                                    x1 - x0,
+                                    y1 - y0,
+                                    MIN(next_tick - tick, 65535),
+                                    animation->fps);
+    }
+    ok = apng_encoder_finish(encoder) && ok;
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    g_array_free(tokens, TRUE);
+    g_array_free(lines, TRUE);
+    g_object_unref(layout);
+    return ok;
+}
@@ -0,0 +1,34 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <cairo.h>
+#include <glib.h>
+
+#include "png_writer.h"
+#include "render.h"
+
+// Defaults for -animate.
+#define ANIMATION_DEFAULT_FPS 30
+#define ANIMATION_DEFAULT_TOKENS_PER_SECOND 20.0
+
+// APNG stores the frame delay as a 16-bit fraction of a second.
+#define ANIMATION_MAX_FPS 1000
+
+// Timing of a typing animation.
+typedef struct {
+    int fps;                  // Frame rate; 0 means write a still image
+    double tokens_per_second; // How fast the code is typed
+} AnimationSettings;
+
+// Writes an animated PNG of the code being typed in, token by token, ending
+// on a frame identical to the still screenshot. The layout is drawn once,
+// incrementally: each frame draws only the tokens that appear in it and
+// encodes only the rectangle they cover.
+gboolean render_typing_animation(const CodeLayout *code_layout,
+                                 const RenderOptions *opts,
+                                 const AnimationSettings *animation,
+                                 cairo_write_func_t write_func,
+                                 void *closure,
+                                 const PngSettings *png_settings);
+
+#endif // ANIMATION_H
@@ -0,0 +1,527 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch_io.h"
+#include "pipeline.h"
+#include "schedule.h"
+#include "tiled_render.h"
+
+// With -io uring, items are read and written in windows of this many, in
+// the order of the schedule: while the workers render one window, an I/O
+// thread reads the inputs of the next and writes the outputs of the
+// windows whose items have all finished.
+#define BATCH_IO_WINDOW 256
+
+// Items shared by the workers of a batch, in the order of their schedule.
+// Each worker takes the next item with an atomic increment, so no lock is
+// held while rendering.
+typedef struct {
+    BatchItem *items;
+    int n_items;
+    BatchSchedule schedule;
+    MemoryBudget *budget;
+    gint next_item;
+    // With -io uring only: the I/O thread's progress, guarded by mutex and
+    // announced through changed.
+    BatchIO *io;
+    GMutex mutex;
+    GCond changed;
+    int n_prefetched; // Items, in schedule order, whose inputs are read
+    int *n_running;   // Per window: items not finished yet
+} BatchQueue;
+
+/**
+ * @brief Reads the next line of a manifest, without its line break, however
+ *        long it is.
+ * @return FALSE at the end of the file.
+ */
+static gboolean read_line(FILE *file, GString *line) {
+    char buffer[4096];
+    g_string_truncate(line, 0);
+    while (fgets(buffer, sizeof(buffer), file)) {
+        g_string_append(line, buffer);
+        if (line->len > 0 && line->str[line->len - 1] == '\n') {
+            g_string_truncate(line, line->len - 1);
+            return TRUE;
+        }
+    }
+    return line->len > 0;
+}
+
+/**
+ * @brief Parses one manifest item into item->job.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+static gboolean parse_item(BatchItem *item,
+                           const Job *defaults,
+                           const char *line,
+                           gboolean manifest_is_stdin) {
+    int argc;
+    GError *error = NULL;
+    if (!g_shell_parse_argv(line, &argc, &item->argv, &error)) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    JobParseResult parsed = job_parse_args(&item->job, argc, item->argv);
+    if (parsed != JOB_PARSE_OK)
+        return FALSE;
+    if (item->job.batch_filename || item->job.watch ||
+        item->job.workers != defaults->workers ||
+        item->job.io_uring != defaults->io_uring ||
+        item->job.memory_budget_mb != defaults->memory_budget_mb ||
+        memcmp(item->job.stage_threads,
+               defaults->stage_threads,
+               sizeof(defaults->stage_threads)) != 0 ||
+        !job_same_cache(&item->job, defaults)) {
+        fprintf(stderr,
+                "Error: -batch, -watch, -j, -pipeline, -io, -memory-budget "
+                "and the -cache and -line-cache options cannot be used in a "
+                "manifest.\n");
+        return FALSE;
+    }
+    if (item->job.more_pairs) {
+        fprintf(stderr, "Too many arguments provided.\n");
+        return FALSE;
+    }
+    if (manifest_is_stdin && !item->job.input_from_git &&
+        g_strcmp0(item->job.input_filename, "-") == 0) {
+        fprintf(stderr,
+                "Error: the manifest is read from stdin, so no item can read "
+                "its input from it.\n");
+        return FALSE;
+    }
+    if (!job_finish_args(&item->job))
+        return FALSE;
+    if (!job_is_complete(&item->job)) {
+        fprintf(stderr, "Error: expected [OPTIONS] <input_file> <output>.\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Reads and parses every item of the manifest named by
+ *        defaults->batch_filename ("-" for stdin). Items that do not parse
+ *        are reported with their line number and kept, marked as failed.
+ * @return FALSE if the manifest could not be read (an error is printed).
+ */
+static gboolean read_manifest(const Job *defaults, GArray *items) {
+    const char *manifest = defaults->batch_filename;
+    gboolean manifest_is_stdin = strcmp(manifest, "-") == 0;
+    FILE *file = manifest_is_stdin ? stdin : fopen(manifest, "r");
+    if (!file) {
+        fprintf(stderr, "Error: could not open manifest %s.\n", manifest);
+        return FALSE;
+    }
+
+    GString *line = g_string_new(NULL);
+    int line_number = 0;
+    while (read_line(file, line)) {
+        line_number++;
+        g_strstrip(line->str);
+        if (line->str[0] == '\0' || line->str[0] == '#')
+            continue;
+
+        BatchItem item = {0};
+        job_init_from(&item.job, defaults);
+        item.name = g_strdup_printf(
+            "%s:%d", manifest_is_stdin ? "<stdin>" : manifest, line_number);
+        item.ok = parse_item(&item, defaults, line->str, manifest_is_stdin);
+        if (!item.ok)
+            fprintf(stderr, "%s: item failed.\n", item.name);
+        g_array_append_val(items, item);
+    }
+
+    gboolean ok = !ferror(file);
+    if (!ok)
+        fprintf(stderr, "Error: could not read manifest %s.\n", manifest);
+    g_string_free(line, TRUE);
+    if (!manifest_is_stdin)
+        fclose(file);
+    return ok;
+}
+
+/**
+ * @brief Makes an item of each <input> <output> pair of the command line.
+ */
+static void add_pairs(const Job *defaults, GArray *items) {
+    for (guint i = 0; i < defaults->more_pairs->len + 2; i += 2) {
+        BatchItem item = {0};
+        job_init_from(&item.job, defaults);
+        if (i == 0) {
+            item.job.input_filename = defaults->input_filename;
+            item.job.output_filename = defaults->output_filename;
+        } else {
+            item.job.input_filename = defaults->more_pairs->pdata[i - 2];
+            item.job.output_filename = defaults->more_pairs->pdata[i - 1];
+        }
+        item.name = g_strdup(item.job.input_filename);
+        item.ok = job_finish_args(&item.job);
+        g_array_append_val(items, item);
+    }
+}
+
+/**
+ * @brief Waits until the I/O thread has read the inputs of the item at the
+ *        given position of the schedule, waking it up to read further.
+ */
+static void wait_for_prefetch(BatchQueue *queue, int position) {
+    g_mutex_lock(&queue->mutex);
+    g_cond_broadcast(&queue->changed);
+    while (queue->n_prefetched <= position)
+        g_cond_wait(&queue->changed, &queue->mutex);
+    g_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Counts the item at the given position of the schedule as
+ *        finished, so that its window is written once all of it is.
+ */
+static void finish_prefetched(BatchQueue *queue, int position) {
+    g_mutex_lock(&queue->mutex);
+    if (--queue->n_running[position / BATCH_IO_WINDOW] == 0)
+        g_cond_broadcast(&queue->changed);
+    g_mutex_unlock(&queue->mutex);
+}
+
+static gpointer batch_worker(gpointer data) {
+    BatchQueue *queue = data;
+    for (;;) {
+        int next = g_atomic_int_add(&queue->next_item, 1);
+        if (next >= queue->n_items)
+            break;
+        if (queue->io)
+            wait_for_prefetch(queue, next);
+        int index = queue->schedule.order[next];
+        BatchItem *item = &queue->items[index];
+        gint64 memory = queue->schedule.memory[index];
+        if (item->ok) {
+            memory_budget_acquire(queue->budget, memory);
+            int status = job_run(&item->job);
+            item->ok = status == 0;
+            item->over_limit = status == JOB_EXIT_LIMIT;
+            memory_budget_release(queue->budget, memory);
+            if (!item->ok)
+                fprintf(stderr, "%s: item failed.\n", item->name);
+        }
+        if (queue->schedule.shared[index])
+            tiled_render_share_end();
+        if (queue->io)
+            finish_prefetched(queue, next);
+    }
+    // With nothing left to start, help draw the bands of the largest items
+    // still running.
+    tiled_render_help();
+    return NULL;
+}
+
+/**
+ * @brief Reads the inputs of items that are plain files in one batch of
+ *        requests, and has their outputs that are plain files collected in
+ *        memory, to be written the same way. An input over the item's
+ *        -max-bytes is not read past it: a regular file is not read at all,
+ *        anything else is read one byte past the limit. Inputs that cannot
+ *        be read here are left for the job to open, which reports them.
+ */
+static void prefetch_items(BatchIO *io, BatchItem **items, int n_items) {
+    BatchFile *files = g_new0(BatchFile, n_items);
+    BatchItem **file_items = g_new(BatchItem *, n_items);
+    int n_files = 0;
+    for (int i = 0; i < n_items; i++) {
+        Job *job = &items[i]->job;
+        if (!items[i]->ok)
+            continue;
+        // Raster pages are numbered files of their own, written directly.
+        for (guint j = 0; job->page_lines == 0 && j < job->outputs->len; j++) {
+            OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, j);
+            if (spec->fd < 0 && spec->page_lines == 0)
+                spec->buffer = g_string_new(NULL);
+        }
+        if (job->input_from_git || strcmp(job->input_filename, "-") == 0)
+            continue;
+        // Compressed data over the limit may still decompress to less, so
+        // an oversized regular file is left for the job, which only looks
+        // at its first page to tell.
+        size_t max_bytes = job_input_limit(job).max_bytes;
+        files[n_files].path = job->input_filename;
+        files[n_files].max_length = max_bytes > 0 ? max_bytes + 1 : 0;
+        file_items[n_files++] = items[i];
+    }
+
+    batch_io_read(io, files, n_files);
+    for (int i = 0; i < n_files; i++) {
+        if (files[i].error != 0)
+            continue;
+        BatchItem *item = file_items[i];
+        InputLimit limit = job_input_limit(&item->job);
+        item->job.prefetched_input = input_text_from_data(
+            files[i].data, files[i].length, files[i].path, &limit);
+        if (!item->job.prefetched_input) {
+            item->ok = FALSE;
+            item->over_limit = limit.exceeded;
+            fprintf(stderr, "%s: item failed.\n", item->name);
+        }
+    }
+    g_free(files);
+    g_free(file_items);
+}
+
+/**
+ * @brief Writes the outputs prefetch_items had collected in memory, in one
+ *        batch of requests, and reports them. Outputs of failed items are
+ *        not written.
+ */
+static void write_items(BatchIO *io, BatchItem **items, int n_items) {
+    GArray *files = g_array_new(FALSE, TRUE, sizeof(BatchFile));
+    for (int i = 0; i < n_items; i++) {
+        GArray *outputs = items[i]->job.outputs;
+        for (guint j = 0; items[i]->ok && j < outputs->len; j++) {
+            OutputSpec *spec = &g_array_index(outputs, OutputSpec, j);
+            if (!spec->buffer)
+                continue;
+            BatchFile file = {
+                spec->filename, spec->buffer->str, spec->buffer->len, 0, 0};
+            g_array_append_val(files, file);
+        }
+    }
+
+    batch_io_write(io, (BatchFile *)files->data, files->len);
+
+    guint next_file = 0;
+    for (int i = 0; i < n_items; i++) {
+        GArray *outputs = items[i]->job.outputs;
+        // Status messages must not end up in an image written to stdout.
+        FILE *status_out = stdout;
+        for (guint j = 0; j < outputs->len; j++) {
+            if (g_array_index(outputs, OutputSpec, j).fd == STDOUT_FILENO)
+                status_out = stderr;
+        }
+
+        gboolean ok = items[i]->ok;
+        for (guint j = 0; j < outputs->len; j++) {
+            OutputSpec *spec = &g_array_index(outputs, OutputSpec, j);
+            if (!spec->buffer)
+                continue;
+            if (items[i]->ok) {
+                BatchFile *file = &g_array_index(files, BatchFile, next_file);
+                next_file++;
+                if (file->error != 0) {
+                    fprintf(stderr,
+                            "Could not write %s: %s\n",
+                            spec->filename,
+                            strerror(file->error));
+                    ok = FALSE;
+                } else {
+                    fprintf(status_out,
+                            "Screenshot saved to %s\n",
+                            spec->filename);
+                }
+            }
+            g_string_free(spec->buffer, TRUE);
+            spec->buffer = NULL;
+        }
+        if (items[i]->ok && !ok) {
+            items[i]->ok = FALSE;
+            fprintf(stderr, "%s: item failed.\n", items[i]->name);
+        }
+    }
+    g_array_free(files, TRUE);
+}
+
+/**
+ * @brief Runs the I/O of a batch: reads the inputs of each window once the
+ *        workers have reached the window before it, and writes the outputs
+ *        of each window once all its items have finished, whichever comes
+ *        first. Reads come first, since workers may be waiting for them.
+ */
+static gpointer batch_io_worker(gpointer data) {
+    BatchQueue *queue = data;
+    int n_windows = (queue->n_items + BATCH_IO_WINDOW - 1) / BATCH_IO_WINDOW;
+    BatchItem **window = g_new(BatchItem *, BATCH_IO_WINDOW);
+    int n_read = 0;
+    int n_written = 0;
+    gboolean *written = g_new0(gboolean, MAX(n_windows, 1));
+
+    g_mutex_lock(&queue->mutex);
+    while (n_written < n_windows) {
+        int started = g_atomic_int_get(&queue->next_item) / BATCH_IO_WINDOW;
+        gboolean read = n_read < n_windows && n_read <= started + 1;
+        int to_write = -1;
+        for (int i = 0; !read && to_write < 0 && i < n_read; i++) {
+            if (!written[i] && queue->n_running[i] == 0)
+                to_write = i;
+        }
+        if (!read && to_write < 0) {
+            g_cond_wait(&queue->changed, &queue->mutex);
+            continue;
+        }
+        g_mutex_unlock(&queue->mutex);
+
+        int first = (read ? n_read : to_write) * BATCH_IO_WINDOW;
+        int n = MIN(queue->n_items - first, BATCH_IO_WINDOW);
+        for (int i = 0; i < n; i++)
+            window[i] = &queue->items[queue->schedule.order[first + i]];
+        if (read)
+            prefetch_items(queue->io, window, n);
+        else
+            write_items(queue->io, window, n);
+
+        g_mutex_lock(&queue->mutex);
+        if (read) {
+            n_read++;
+            queue->n_prefetched = first + n;
+            g_cond_broadcast(&queue->changed);
+        } else {
+            written[to_write] = TRUE;
+            n_written++;
+        }
+    }
+    g_mutex_unlock(&queue->mutex);
+
+    g_free(window);
+    g_free(written);
+    return NULL;
+}
+
+/**
+ * @brief Renders items on up to n_workers threads, the calling thread
+ *        included, longest first (see schedule_batch). Threads exit when
+ *        the items run out, releasing their Pango contexts.
+ * @param memory_budget Bytes of surfaces the items may hold at once.
+ * @param io With -io uring, where the inputs and outputs go through: an I/O
+ *        thread reads and writes them a window at a time, and the workers
+ *        wait for each window's inputs. NULL otherwise.
+ */
+static void run_items(BatchItem *items,
+                      int n_items,
+                      int n_workers,
+                      gint64 memory_budget,
+                      BatchIO *io) {
+    BatchQueue queue = {
+        items, n_items, {0}, NULL, 0, io, {0}, {0}, 0, NULL};
+    schedule_batch(items, n_items, n_workers, memory_budget, &queue.schedule);
+    queue.budget = memory_budget_new(memory_budget);
+    for (int i = 0; i < n_items; i++) {
+        if (queue.schedule.shared[i])
+            tiled_render_share_begin();
+    }
+    GThread *io_thread = NULL;
+    if (io) {
+        g_mutex_init(&queue.mutex);
+        g_cond_init(&queue.changed);
+        int n_windows = (n_items + BATCH_IO_WINDOW - 1) / BATCH_IO_WINDOW;
+        queue.n_running = g_new(int, MAX(n_windows, 1));
+        for (int i = 0; i < n_windows; i++)
+            queue.n_running[i] = MIN(n_items - i * BATCH_IO_WINDOW,
+                                     BATCH_IO_WINDOW);
+        io_thread = g_thread_new("batch-io", batch_io_worker, &queue);
+    }
+
+    n_workers = MIN(n_workers, n_items) - 1;
+    GThread **workers = g_new0(GThread *, MAX(n_workers, 1));
+    for (int i = 0; i < n_workers; i++)
+        workers[i] = g_thread_new("batch", batch_worker, &queue);
+    batch_worker(&queue);
+    for (int i = 0; i < n_workers; i++)
+        g_thread_join(workers[i]);
+    g_free(workers);
+
+    if (io_thread) {
+        g_thread_join(io_thread);
+        g_free(queue.n_running);
+        g_mutex_clear(&queue.mutex);
+        g_cond_clear(&queue.changed);
+    }
+    memory_budget_free(queue.budget);
+    batch_schedule_clear(&queue.schedule);
+}
+
+/**
+ * @brief Renders a batch. A failed item is reported with its manifest line
+ *        (or input) and does not stop the others.
+ * @return 0 if every item succeeded, JOB_EXIT_LIMIT if the only failures
+ *         were items reaching their limits, 1 otherwise.
+ */
+int run_batch(const Job *defaults) {
+    gboolean pipelined = defaults->stage_threads[0] > 0;
+    if (pipelined && defaults->workers > 1) {
+        fprintf(stderr,
+                "Error: -j and -pipeline cannot be used together; "
+                "-pipeline sets the threads of each stage.\n");
+        return 1;
+    }
+    if (pipelined && defaults->io_uring) {
+        fprintf(stderr,
+                "Error: -io uring cannot be used with -pipeline, whose read "
+                "stage has threads of its own.\n");
+        return 1;
+    }
+
+    GArray *items = g_array_new(FALSE, TRUE, sizeof(BatchItem));
+    gboolean ok = TRUE;
+    if (defaults->batch_filename)
+        ok = read_manifest(defaults, items);
+    else
+        add_pairs(defaults, items);
+
+    gint64 memory_budget = (gint64)defaults->memory_budget_mb * 1024 * 1024;
+
+    // Unless told otherwise, the PNG encoders of concurrent items share the
+    // processors instead of each using all of them.
+    int n_workers = MIN(defaults->workers, MAX((int)items->len, 1));
+    int n_encoders =
+        pipelined ? defaults->stage_threads[JOB_STEP_ENCODE] : n_workers;
+    for (guint i = 0; i < items->len; i++) {
+        BatchItem *item = &g_array_index(items, BatchItem, i);
+        if (item->job.png_settings.threads == 0 && n_encoders > 1)
+            item->job.png_settings.threads =
+                MAX(1, (int)g_get_num_processors() / n_encoders);
+    }
+
+    BatchIO *io = NULL;
+    if (ok && !pipelined && defaults->io_uring) {
+        io = batch_io_new();
+        if (!batch_io_uses_uring(io))
+            fprintf(stderr,
+                    "Warning: io_uring is not available; using blocking "
+                    "I/O.\n");
+    }
+    if (ok && pipelined)
+        run_pipeline((BatchItem *)items->data,
+                     items->len,
+                     defaults->stage_threads);
+    else if (ok)
+        run_items((BatchItem *)items->data,
+                  items->len,
+                  n_workers,
+                  memory_budget,
+                  io);
+    batch_io_free(io);
+
+    int n_failed = 0;
+    int n_over_limit = 0;
+    for (guint i = 0; i < items->len; i++) {
+        BatchItem *item = &g_array_index(items, BatchItem, i);
+        if (!item->ok)
+            n_failed++;
+        if (item->over_limit)
+            n_over_limit++;
+        job_clear(&item->job);
+        g_strfreev(item->argv);
+        g_free(item->name);
+    }
+    if (ok && n_failed > 0)
+        fprintf(stderr,
+                "%d of %u batch items failed.\n",
+                n_failed,
+                items->len);
+    g_array_free(items, TRUE);
+    if (ok && n_failed > 0 && n_failed == n_over_limit)
+        return JOB_EXIT_LIMIT;
+    return ok && n_failed == 0 ? 0 : 1;
+}
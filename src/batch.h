@@ -0,0 +1,28 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "job.h"
+
+// One screenshot of a batch. Items are all parsed, in order, before any is
+// rendered.
+typedef struct {
+    Job job;
+    char **argv; // Owns the strings job borrows, for manifest items
+    char *name;  // "manifest:line" or the input, for error messages
+    gboolean ok; // Parsed, then rendered, successfully
+    gboolean over_limit; // Failed because it reached one of its limits
+} BatchItem;
+
+// Renders many screenshots in this process: every item of a batch manifest
+// (defaults->batch_filename), or every <input> <output> pair given on the
+// command line. Each non-empty line of a manifest is an item written like a
+// command line, options first, e.g. `-l -t "Demo" demo.c demo.png` or `-git
+// repo:HEAD:a.go -o a.webp`; lines starting with # are comments. Items start
+// from the options of defaults (the command line) and may override them.
+// With -j N, N items are rendered at once, each worker thread with its own
+// Pango contexts; fonts and syntax tables are set up once per process.
+// Returns 0 if every item succeeded, JOB_EXIT_LIMIT if the only failures
+// were items reaching their limits, 1 otherwise.
+int run_batch(const Job *defaults);
+
+#endif // BATCH_H
@@ -0,0 +1,571 @@
+// openat, statx and the io_uring system calls are not C99.
+#define _GNU_SOURCE
+
+#include "batch_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Size of the io_uring submission queue. Larger sets of files are submitted
+// in several rounds of this many requests.
+#define BATCH_IO_RING_ENTRIES 256
+
+// Buffer growth step for files whose size is not known up front.
+#define BATCH_IO_CHUNK_SIZE (64 * 1024)
+
+#ifdef __linux__
+// The shared rings of an io_uring instance, mapped from the kernel.
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Ring;
+#endif
+
+struct BatchIO {
+    gboolean uring;
+#ifdef __linux__
+    Ring ring;
+#endif
+};
+
+/**
+ * @brief Reads from an open file until the end, or until file->max_length
+ *        bytes, into file->data.
+ * @param size_hint The expected size, or 0 if unknown.
+ */
+static void read_fd(int fd, BatchFile *file, size_t size_hint) {
+    size_t capacity = size_hint > 0 ? size_hint + 1 : BATCH_IO_CHUNK_SIZE;
+    size_t max_length = file->max_length > 0 ? file->max_length : G_MAXSIZE;
+    char *data = g_malloc(capacity);
+    size_t length = 0;
+    while (length < max_length) {
+        if (length + 1 == capacity) {
+            // A file of the expected size ends here; only grow for more.
+            char probe;
+            ssize_t n = read(fd, &probe, 1);
+            if (n == 0)
+                break;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                file->error = errno;
+                break;
+            }
+            capacity += BATCH_IO_CHUNK_SIZE;
+            data = g_realloc(data, capacity);
+            data[length++] = probe;
+            continue;
+        }
+        ssize_t n =
+            read(fd, data + length, MIN(capacity - 1, max_length) - length);
+        if (n == 0)
+            break;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            file->error = errno;
+            break;
+        }
+        length += n;
+    }
+
+    if (file->error != 0) {
+        g_free(data);
+        return;
+    }
+    data[length] = '\0';
+    file->data = data;
+    file->length = length;
+}
+
+static void read_file_sync(BatchFile *file) {
+    int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        file->error = errno;
+        return;
+    }
+    struct stat st;
+    size_t size_hint =
+        fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? (size_t)st.st_size : 0;
+    if (file->max_length > 0 && size_hint > file->max_length)
+        file->error = EFBIG;
+    else
+        read_fd(fd, file, size_hint);
+    close(fd);
+}
+
+static void write_file_sync(BatchFile *file) {
+    int fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        file->error = errno;
+        return;
+    }
+    size_t done = 0;
+    while (done < file->length) {
+        ssize_t n = write(fd, file->data + done, file->length - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            file->error = n < 0 ? errno : EIO;
+            break;
+        }
+        done += n;
+    }
+    if (close(fd) != 0 && file->error == 0)
+        file->error = errno;
+}
+
+#ifdef __linux__
+
+static void ring_free(Ring *ring) {
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+/**
+ * @brief Tells whether the kernel supports every operation used here, so
+ *        that kernels with an older io_uring use the blocking calls.
+ */
+static gboolean ring_supports_ops(const Ring *ring) {
+    static const int needed[] = {IORING_OP_OPENAT,
+                                 IORING_OP_STATX,
+                                 IORING_OP_READ,
+                                 IORING_OP_WRITE,
+                                 IORING_OP_CLOSE};
+    size_t size =
+        sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = g_malloc0(size);
+    gboolean ok = syscall(__NR_io_uring_register,
+                          ring->fd,
+                          IORING_REGISTER_PROBE,
+                          probe,
+                          256) == 0;
+    for (size_t i = 0; ok && i < G_N_ELEMENTS(needed); i++)
+        ok = needed[i] <= probe->last_op &&
+             (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    g_free(probe);
+    return ok;
+}
+
+/**
+ * @brief Sets up an io_uring instance and maps its rings.
+ * @return TRUE on success, FALSE if io_uring cannot be used here.
+ */
+static gboolean ring_init(Ring *ring) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, BATCH_IO_RING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return FALSE;
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    gboolean single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        ring->sq_ring_size = ring->cq_ring_size =
+            MAX(ring->sq_ring_size, ring->cq_ring_size);
+
+    ring->sq_ring = mmap(NULL,
+                         ring->sq_ring_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE,
+                         ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        ring_free(ring);
+        return FALSE;
+    }
+    ring->cq_ring = single_mmap ? ring->sq_ring
+                                : mmap(NULL,
+                                       ring->cq_ring_size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE,
+                                       ring->fd,
+                                       IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL,
+                      ring->sqes_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring == MAP_FAILED)
+            ring->cq_ring = NULL;
+        if (ring->sqes == MAP_FAILED)
+            ring->sqes = NULL;
+        ring_free(ring);
+        return FALSE;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (!ring_supports_ops(ring)) {
+        ring_free(ring);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Submits requests and waits for all of them, a ring's worth per
+ *        round: one io_uring_enter call submits a round and waits for it.
+ * @param ops The requests; their user_data is overwritten.
+ * @param results Receives each request's result: a descriptor or byte
+ *        count, or minus an errno.
+ */
+static void ring_run(Ring *ring,
+                     struct io_uring_sqe *ops,
+                     int *results,
+                     int n_ops) {
+    gboolean *completions = g_new(gboolean, ring->entries);
+    for (int first = 0; first < n_ops; first += ring->entries) {
+        unsigned n = MIN((unsigned)(n_ops - first), ring->entries);
+        memset(completions, 0, n * sizeof(gboolean));
+        unsigned tail = *ring->sq_tail;
+        for (unsigned i = 0; i < n; i++) {
+            unsigned index = (tail + i) & *ring->sq_mask;
+            ring->sqes[index] = ops[first + i];
+            ring->sqes[index].user_data = first + i;
+            ring->sq_array[index] = index;
+        }
+        g_atomic_int_set((gint *)ring->sq_tail, tail + n);
+
+        unsigned to_submit = n;
+        unsigned completed = 0;
+        while (completed < n) {
+            int ret = syscall(__NR_io_uring_enter,
+                              ring->fd,
+                              to_submit,
+                              n - completed,
+                              IORING_ENTER_GETEVENTS,
+                              NULL,
+                              0);
+            if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+                errno != EBUSY) {
+                // The ring is unusable; fail what has not completed.
+                int error = errno;
+                for (unsigned i = 0; i < n; i++) {
+                    if (!completions[i])
+                        results[first + i] = -error;
+                }
+                for (int i = first + n; i < n_ops; i++)
+                    results[i] = -error;
+                g_free(completions);
+                return;
+            }
+            if (ret > 0)
+                to_submit -= MIN((unsigned)ret, to_submit);
+
+            unsigned head = *ring->cq_head;
+            unsigned cq_tail = g_atomic_int_get((gint *)ring->cq_tail);
+            for (; head != cq_tail; head++) {
+                struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                results[cqe->user_data] = cqe->res;
+                completions[cqe->user_data - first] = TRUE;
+                completed++;
+            }
+            g_atomic_int_set((gint *)ring->cq_head, head);
+        }
+    }
+    g_free(completions);
+}
+
+static void prep_op(struct io_uring_sqe *op, int opcode, int fd) {
+    memset(op, 0, sizeof(*op));
+    op->opcode = opcode;
+    op->fd = fd;
+}
+
+/**
+ * @brief Closes descriptors in one round. Errors only matter for writes.
+ */
+static void ring_close(Ring *ring, const int *fds, BatchFile *files, int n) {
+    struct io_uring_sqe *ops = g_new(struct io_uring_sqe, n);
+    int *results = g_new(int, n);
+    int *file_of = g_new(int, n);
+    int n_ops = 0;
+    for (int i = 0; i < n; i++) {
+        if (fds[i] < 0)
+            continue;
+        prep_op(&ops[n_ops], IORING_OP_CLOSE, fds[i]);
+        file_of[n_ops++] = i;
+    }
+    ring_run(ring, ops, results, n_ops);
+    for (int i = 0; i < n_ops; i++) {
+        if (results[i] < 0 && files[file_of[i]].error == 0)
+            files[file_of[i]].error = -results[i];
+    }
+    g_free(ops);
+    g_free(results);
+    g_free(file_of);
+}
+
+/**
+ * @brief Reads or writes the open files in rounds until each is complete,
+ *        resubmitting the rest of short transfers.
+ * @param pending Per file: whether it is left to transfer, or NULL for
+ *        every open file.
+ */
+static void ring_transfer(Ring *ring,
+                          const int *fds,
+                          BatchFile *files,
+                          int n,
+                          const gboolean *pending,
+                          gboolean writing) {
+    struct io_uring_sqe *ops = g_new(struct io_uring_sqe, n);
+    int *results = g_new(int, n);
+    int *file_of = g_new(int, n);
+    size_t *done = g_new0(size_t, n);
+    gboolean *active = g_new0(gboolean, n);
+    for (int i = 0; i < n; i++)
+        active[i] = (!pending || pending[i]) && fds[i] >= 0 &&
+                    files[i].error == 0 && files[i].length > 0;
+
+    for (;;) {
+        int n_ops = 0;
+        for (int i = 0; i < n; i++) {
+            if (!active[i])
+                continue;
+            struct io_uring_sqe *op = &ops[n_ops];
+            prep_op(op, writing ? IORING_OP_WRITE : IORING_OP_READ, fds[i]);
+            op->addr = (guint64)(guintptr)(files[i].data + done[i]);
+            op->len = (guint32)MIN(files[i].length - done[i], G_MAXINT32);
+            op->off = done[i];
+            file_of[n_ops++] = i;
+        }
+        if (n_ops == 0)
+            break;
+        ring_run(ring, ops, results, n_ops);
+
+        for (int j = 0; j < n_ops; j++) {
+            int i = file_of[j];
+            if (results[j] < 0) {
+                files[i].error = -results[j];
+                active[i] = FALSE;
+            } else if (results[j] == 0) {
+                // A file that shrank since it was measured ends early.
+                if (writing)
+                    files[i].error = EIO;
+                else
+                    files[i].length = done[i];
+                active[i] = FALSE;
+            } else {
+                done[i] += results[j];
+                active[i] = done[i] < files[i].length;
+            }
+        }
+    }
+
+    g_free(ops);
+    g_free(results);
+    g_free(file_of);
+    g_free(done);
+    g_free(active);
+}
+
+/**
+ * @brief Reads files through the ring: one round stats and opens them all,
+ *        the next reads them all and the last closes them all. A regular
+ *        file over its max_length is rejected by its size before any read.
+ *        Files that are not regular, whose size is unknown, are read with
+ *        blocking calls from the open descriptor.
+ */
+static void ring_read(Ring *ring, BatchFile *files, int n) {
+    struct io_uring_sqe *ops = g_new(struct io_uring_sqe, 2 * n);
+    int *results = g_new(int, 2 * n);
+    struct statx *stats = g_new0(struct statx, n);
+    int *fds = g_new(int, n);
+    gboolean *pending = g_new0(gboolean, n);
+
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *stat_op = &ops[2 * i];
+        prep_op(stat_op, IORING_OP_STATX, AT_FDCWD);
+        stat_op->addr = (guint64)(guintptr)files[i].path;
+        stat_op->len = STATX_TYPE | STATX_SIZE;
+        stat_op->off = (guint64)(guintptr)&stats[i];
+
+        struct io_uring_sqe *open_op = &ops[2 * i + 1];
+        prep_op(open_op, IORING_OP_OPENAT, AT_FDCWD);
+        open_op->addr = (guint64)(guintptr)files[i].path;
+        open_op->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    ring_run(ring, ops, results, 2 * n);
+
+    for (int i = 0; i < n; i++) {
+        fds[i] = results[2 * i + 1];
+        if (fds[i] < 0) {
+            files[i].error = -fds[i];
+            continue;
+        }
+        gboolean regular =
+            results[2 * i] == 0 && S_ISREG(stats[i].stx_mode);
+        if (regular && files[i].max_length > 0 &&
+            stats[i].stx_size > files[i].max_length) {
+            files[i].error = EFBIG;
+        } else if (regular && stats[i].stx_size > 0) {
+            files[i].length = stats[i].stx_size;
+            files[i].data = g_malloc(files[i].length + 1);
+            pending[i] = TRUE;
+        } else {
+            // Already read to the end: a pipe has nothing left for the ring.
+            read_fd(fds[i], &files[i], 0);
+        }
+    }
+
+    ring_transfer(ring, fds, files, n, pending, FALSE);
+    for (int i = 0; i < n; i++) {
+        if (files[i].error != 0) {
+            g_free(files[i].data);
+            files[i].data = NULL;
+            files[i].length = 0;
+        } else if (files[i].data) {
+            files[i].data[files[i].length] = '\0';
+        }
+    }
+    ring_close(ring, fds, files, n);
+
+    g_free(ops);
+    g_free(results);
+    g_free(stats);
+    g_free(fds);
+    g_free(pending);
+}
+
+/**
+ * @brief Writes files through the ring: one round creates them all, the
+ *        next writes them all and the last closes them all.
+ */
+static void ring_write(Ring *ring, BatchFile *files, int n) {
+    struct io_uring_sqe *ops = g_new(struct io_uring_sqe, n);
+    int *fds = g_new(int, n);
+
+    for (int i = 0; i < n; i++) {
+        prep_op(&ops[i], IORING_OP_OPENAT, AT_FDCWD);
+        ops[i].addr = (guint64)(guintptr)files[i].path;
+        ops[i].open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        ops[i].len = 0666;
+    }
+    ring_run(ring, ops, fds, n);
+    for (int i = 0; i < n; i++) {
+        if (fds[i] < 0)
+            files[i].error = -fds[i];
+    }
+
+    ring_transfer(ring, fds, files, n, NULL, TRUE);
+    ring_close(ring, fds, files, n);
+
+    g_free(ops);
+    g_free(fds);
+}
+
+#endif // __linux__
+
+/**
+ * @brief Sets up batched file I/O, through io_uring if the system allows
+ *        it and with blocking calls otherwise.
+ */
+BatchIO *batch_io_new(void) {
+    BatchIO *io = g_new0(BatchIO, 1);
+#ifdef __linux__
+    io->uring = ring_init(&io->ring);
+#endif
+    return io;
+}
+
+/**
+ * @brief Tells whether requests go through io_uring.
+ */
+gboolean batch_io_uses_uring(const BatchIO *io) {
+    return io->uring;
+}
+
+/**
+ * @brief Reads whole files. Each file's error is set if it could not be
+ *        read, in which case it has no data.
+ */
+void batch_io_read(BatchIO *io, BatchFile *files, int n_files) {
+    for (int i = 0; i < n_files; i++) {
+        files[i].data = NULL;
+        files[i].length = 0;
+        files[i].error = 0;
+    }
+#ifdef __linux__
+    if (io->uring) {
+        ring_read(&io->ring, files, n_files);
+        return;
+    }
+#endif
+    for (int i = 0; i < n_files; i++)
+        read_file_sync(&files[i]);
+}
+
+/**
+ * @brief Creates (or truncates) files and writes their data. Each file's
+ *        error is set if it could not be written completely.
+ */
+void batch_io_write(BatchIO *io, BatchFile *files, int n_files) {
+    for (int i = 0; i < n_files; i++)
+        files[i].error = 0;
+#ifdef __linux__
+    if (io->uring) {
+        ring_write(&io->ring, files, n_files);
+        return;
+    }
+#endif
+    for (int i = 0; i < n_files; i++)
+        write_file_sync(&files[i]);
+}
+
+void batch_io_free(BatchIO *io) {
+    if (!io)
+        return;
+#ifdef __linux__
+    if (io->uring)
+        ring_free(&io->ring);
+#endif
+    g_free(io);
+}
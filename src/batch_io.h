@@ -0,0 +1,33 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+#include <glib.h>
+
+// Reads and writes whole files many at a time. On Linux the system calls
+// for a whole set of files (open, stat, read or write, close) are submitted
+// together through io_uring, a few submissions per set instead of several
+// blocking calls per file. Where io_uring is unavailable (other systems,
+// old kernels, or forbidden by a sandbox) the same requests are made with
+// ordinary blocking calls.
+typedef struct BatchIO BatchIO;
+
+// One file to read or write.
+typedef struct {
+    const char *path;
+    char *data;    // Read: receives the contents, followed by a NUL byte,
+                   // to be freed with g_free. Write: the bytes to write.
+    size_t length; // Read: receives the size. Write: the number of bytes.
+    int error;     // Receives 0, or the errno of the call that failed
+    size_t max_length; // Read: the most bytes to read, or 0 for no limit.
+                       // A regular file larger than this is not read at
+                       // all (error is EFBIG); any other file is read up to
+                       // this many bytes.
+} BatchFile;
+
+BatchIO *batch_io_new(void);
+gboolean batch_io_uses_uring(const BatchIO *io);
+void batch_io_read(BatchIO *io, BatchFile *files, int n_files);
+void batch_io_write(BatchIO *io, BatchFile *files, int n_files);
+void batch_io_free(BatchIO *io);
+
+#endif // BATCH_IO_H
@@ -0,0 +1,408 @@
+#include "decompress.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+// The output grows by at least this many bytes at a time.
+#define DECOMPRESS_CHUNK_SIZE (256 * 1024)
+
+struct Decompressor {
+    Compression compression;
+    gboolean ok;
+    gboolean ended; // The last stream or frame so far is complete
+    gboolean over_limit; // Stopped because the output passed max_len
+    size_t max_len;      // Longest output allowed so far, or 0 for any
+    z_stream zs;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream xz;
+#endif
+};
+
+static const char *compression_names[] = {"plain", "gzip", "zstd", "xz"};
+
+/**
+ * @brief Recognizes gzip, zstd and xz data by its first bytes.
+ * @return The compression, or COMPRESSION_NONE for anything else.
+ */
+Compression compression_detect(const unsigned char *data, size_t len) {
+    static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+    static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    static const unsigned char xz_magic[] = {0xfd, '7', 'z', 'X', 'Z', 0};
+
+    if (len >= sizeof(gzip_magic) &&
+        memcmp(data, gzip_magic, sizeof(gzip_magic)) == 0)
+        return COMPRESSION_GZIP;
+    if (len >= sizeof(zstd_magic) &&
+        memcmp(data, zstd_magic, sizeof(zstd_magic)) == 0)
+        return COMPRESSION_ZSTD;
+    if (len >= sizeof(xz_magic) &&
+        memcmp(data, xz_magic, sizeof(xz_magic)) == 0)
+        return COMPRESSION_XZ;
+    return COMPRESSION_NONE;
+}
+
+/**
+ * @brief Tells whether a file extension (with its dot) is one of the
+ *        compressed suffixes, so that the language can be detected from the
+ *        one before it ("foo.c.gz").
+ */
+gboolean compression_is_suffix(const char *extension) {
+    static const char *suffixes[] = {".gz", ".zst", ".xz", NULL};
+    for (int i = 0; suffixes[i] != NULL; i++) {
+        if (g_ascii_strcasecmp(extension, suffixes[i]) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Reads an xz variable-length integer: 7 bits per byte, least
+ *        significant first, the top bit set on every byte but the last.
+ */
+static gboolean read_xz_number(const unsigned char **data,
+                               const unsigned char *end,
+                               guint64 *value) {
+    *value = 0;
+    for (int shift = 0; *data < end && shift < 63; shift += 7) {
+        unsigned char byte = *(*data)++;
+        *value |= (guint64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Adds up the uncompressed sizes of the blocks of an xz stream, from
+ *        the index the stream footer points back to.
+ */
+static gint64 xz_content_size(const unsigned char *data, size_t len) {
+    // The footer: CRC32, the index size in 4-byte units minus one, the
+    // stream flags and "YZ".
+    if (len < 24 || memcmp(data + len - 2, "YZ", 2) != 0)
+        return -1;
+    const unsigned char *footer = data + len - 12;
+    size_t index_size = ((size_t)footer[4] | (size_t)footer[5] << 8 |
+                         (size_t)footer[6] << 16 | (size_t)footer[7] << 24) +
+                        1;
+    index_size *= 4;
+    if (index_size > len - 24)
+        return -1;
+
+    const unsigned char *index = footer - index_size;
+    guint64 n_records, total = 0;
+    if (*index++ != 0 || !read_xz_number(&index, footer, &n_records))
+        return -1;
+    for (guint64 i = 0; i < n_records; i++) {
+        guint64 unpadded_size, uncompressed_size;
+        if (!read_xz_number(&index, footer, &unpadded_size) ||
+            !read_xz_number(&index, footer, &uncompressed_size) ||
+            uncompressed_size > (guint64)G_MAXINT64 - total)
+            return -1;
+        total += uncompressed_size;
+    }
+    return (gint64)total;
+}
+
+/**
+ * @brief Finds the size compressed data decompresses to, as its format
+ *        records it, without decompressing anything: the size at the end
+ *        of a gzip member (modulo 4 GiB), the content size in a zstd frame
+ *        header, or the sizes in an xz stream's index. Only the last gzip
+ *        member, the first zstd frame and the last xz stream are looked at.
+ * @return The size, or -1 if the data does not record it.
+ */
+gint64 compression_content_size(const unsigned char *data, size_t len) {
+    switch (compression_detect(data, len)) {
+    case COMPRESSION_GZIP:
+        if (len < 18)
+            return -1;
+        return (gint64)data[len - 4] | (gint64)data[len - 3] << 8 |
+               (gint64)data[len - 2] << 16 | (gint64)data[len - 1] << 24;
+    case COMPRESSION_ZSTD: {
+#ifdef HAVE_ZSTD
+        unsigned long long size = ZSTD_getFrameContentSize(data, len);
+        if (size != ZSTD_CONTENTSIZE_UNKNOWN &&
+            size != ZSTD_CONTENTSIZE_ERROR && size <= G_MAXINT64)
+            return (gint64)size;
+#endif
+        return -1;
+    }
+    case COMPRESSION_XZ:
+        return xz_content_size(data, len);
+    default:
+        return -1;
+    }
+}
+
+static void decompressor_free(Decompressor *decompressor) {
+    if (decompressor->compression == COMPRESSION_GZIP)
+        inflateEnd(&decompressor->zs);
+#ifdef HAVE_ZSTD
+    if (decompressor->zstd)
+        ZSTD_freeDStream(decompressor->zstd);
+#endif
+#ifdef HAVE_LZMA
+    if (decompressor->compression == COMPRESSION_XZ)
+        lzma_end(&decompressor->xz);
+#endif
+    g_free(decompressor);
+}
+
+/**
+ * @brief Starts decompressing a stream. zstd and xz are only available when
+ *        screenCODE is built with libzstd (HAVE_ZSTD) and liblzma
+ *        (HAVE_LZMA).
+ * @return A new decompressor, or NULL on failure (an error is printed).
+ */
+Decompressor *decompressor_new(Compression compression) {
+    Decompressor *decompressor = g_new0(Decompressor, 1);
+    decompressor->compression = compression;
+    const char *missing_library = NULL;
+
+    if (compression == COMPRESSION_GZIP) {
+        // 15 + 16: the largest window, gzip wrapper only.
+        decompressor->ok = inflateInit2(&decompressor->zs, 15 + 16) == Z_OK;
+    } else if (compression == COMPRESSION_ZSTD) {
+#ifdef HAVE_ZSTD
+        decompressor->zstd = ZSTD_createDStream();
+        decompressor->ok =
+            decompressor->zstd &&
+            !ZSTD_isError(ZSTD_initDStream(decompressor->zstd));
+#else
+        missing_library = "libzstd";
+#endif
+    } else if (compression == COMPRESSION_XZ) {
+#ifdef HAVE_LZMA
+        lzma_stream init = LZMA_STREAM_INIT;
+        decompressor->xz = init;
+        decompressor->ok = lzma_stream_decoder(&decompressor->xz,
+                                               UINT64_MAX,
+                                               LZMA_CONCATENATED) == LZMA_OK;
+#else
+        missing_library = "liblzma";
+#endif
+    }
+
+    if (!decompressor->ok) {
+        if (missing_library)
+            fprintf(stderr,
+                    "Cannot read %s input: screenCODE was built without "
+                    "%s.\n",
+                    compression_names[compression],
+                    missing_library);
+        else
+            fprintf(stderr,
+                    "Could not start decompressing %s input.\n",
+                    compression_names[compression]);
+        decompressor_free(decompressor);
+        return NULL;
+    }
+    return decompressor;
+}
+
+/**
+ * @brief Makes room for more bytes at the end of out, which keeps its
+ *        length. The room grows with the output, so appending is amortized
+ *        linear. Under a limit, only one byte more than it allows is
+ *        offered, so passing it is noticed without producing the rest.
+ * @param avail Receives the number of bytes that fit.
+ * @return Where the next bytes go.
+ */
+static unsigned char *reserve(const Decompressor *decompressor,
+                              GString *out,
+                              size_t *avail) {
+    size_t len = out->len;
+    size_t room = MAX(DECOMPRESS_CHUNK_SIZE, len / 2);
+    if (decompressor->max_len > 0)
+        room = MIN(room, decompressor->max_len + 1 - len);
+    g_string_set_size(out, len + room);
+    g_string_truncate(out, len);
+    *avail = MIN(room, out->allocated_len - len - 1);
+    return (unsigned char *)out->str + len;
+}
+
+/**
+ * @brief Tells whether the output has passed the limit, which stops the
+ *        decompressor.
+ */
+static gboolean passed_limit(Decompressor *decompressor, const GString *out) {
+    if (decompressor->max_len == 0 || out->len <= decompressor->max_len)
+        return FALSE;
+    decompressor->over_limit = TRUE;
+    return TRUE;
+}
+
+/**
+ * @brief Inflates gzip data. Concatenated gzip members are read one after
+ *        another, like gzip -d does.
+ */
+static gboolean write_gzip(Decompressor *decompressor,
+                           const unsigned char *data,
+                           size_t len,
+                           GString *out) {
+    z_stream *zs = &decompressor->zs;
+    while (len > 0) {
+        if (decompressor->ended) {
+            inflateReset(zs);
+            decompressor->ended = FALSE;
+        }
+        // zlib counts in 32-bit units, so huge mappings go in pieces.
+        uInt piece = (uInt)MIN(len, (size_t)1 << 30);
+        zs->next_in = (unsigned char *)data;
+        zs->avail_in = piece;
+        do {
+            size_t avail;
+            zs->next_out = reserve(decompressor, out, &avail);
+            zs->avail_out = (uInt)MIN(avail, (size_t)1 << 30);
+            int zret = inflate(zs, Z_NO_FLUSH);
+            g_string_set_size(out, (char *)zs->next_out - out->str);
+            if (passed_limit(decompressor, out))
+                return FALSE;
+            if (zret == Z_STREAM_END)
+                decompressor->ended = TRUE;
+            else if (zret == Z_BUF_ERROR)
+                break; // Needs more input
+            else if (zret != Z_OK)
+                return FALSE;
+        } while (!decompressor->ended &&
+                 (zs->avail_in > 0 || zs->avail_out == 0));
+        data += piece - zs->avail_in;
+        len -= piece - zs->avail_in;
+    }
+    return TRUE;
+}
+
+#ifdef HAVE_ZSTD
+/**
+ * @brief Decompresses zstd data. Several frames in a row are read one
+ *        after another.
+ */
+static gboolean write_zstd(Decompressor *decompressor,
+                           const unsigned char *data,
+                           size_t len,
+                           GString *out) {
+    ZSTD_inBuffer in = {data, len, 0};
+    ZSTD_outBuffer output;
+    do {
+        size_t avail;
+        output.dst = reserve(decompressor, out, &avail);
+        output.size = avail;
+        output.pos = 0;
+        size_t ret = ZSTD_decompressStream(decompressor->zstd, &output, &in);
+        if (ZSTD_isError(ret))
+            return FALSE;
+        g_string_set_size(out, out->len + output.pos);
+        if (passed_limit(decompressor, out))
+            return FALSE;
+        decompressor->ended = ret == 0; // A frame has just been completed
+    } while (in.pos < in.size || output.pos == output.size);
+    return TRUE;
+}
+#endif
+
+#ifdef HAVE_LZMA
+/**
+ * @brief Decompresses xz data. With LZMA_FINISH, what is left is flushed
+ *        and the end of the last stream is checked.
+ */
+static gboolean write_xz(Decompressor *decompressor,
+                         const unsigned char *data,
+                         size_t len,
+                         lzma_action action,
+                         GString *out) {
+    lzma_stream *xz = &decompressor->xz;
+    xz->next_in = data;
+    xz->avail_in = len;
+    for (;;) {
+        size_t avail;
+        xz->next_out = reserve(decompressor, out, &avail);
+        xz->avail_out = avail;
+        lzma_ret ret = lzma_code(xz, action);
+        g_string_set_size(out, (char *)xz->next_out - out->str);
+        if (passed_limit(decompressor, out))
+            return FALSE;
+        if (ret == LZMA_STREAM_END) {
+            decompressor->ended = TRUE;
+            return TRUE;
+        }
+        if (ret == LZMA_BUF_ERROR && action == LZMA_FINISH)
+            return TRUE; // Truncated; ended stays FALSE
+        if (ret != LZMA_OK)
+            return FALSE;
+        if (action == LZMA_RUN && xz->avail_in == 0 && xz->avail_out > 0)
+            return TRUE;
+    }
+}
+#endif
+
+/**
+ * @brief Decompresses the next piece of the input and appends the result
+ *        to out.
+ * @param max_len Stop as soon as out is longer than this, or 0 for no
+ *        limit. out then has max_len + 1 bytes.
+ * @return TRUE on success, FALSE on corrupt data (reported by
+ *         decompressor_finish) or once out is over max_len.
+ */
+gboolean decompressor_write(Decompressor *decompressor,
+                            const unsigned char *data,
+                            size_t len,
+                            size_t max_len,
+                            GString *out) {
+    if (!decompressor->ok || len == 0)
+        return decompressor->ok;
+
+    decompressor->max_len = max_len;
+
+    if (decompressor->compression == COMPRESSION_GZIP)
+        decompressor->ok = write_gzip(decompressor, data, len, out);
+#ifdef HAVE_ZSTD
+    else if (decompressor->compression == COMPRESSION_ZSTD)
+        decompressor->ok = write_zstd(decompressor, data, len, out);
+#endif
+#ifdef HAVE_LZMA
+    else if (decompressor->compression == COMPRESSION_XZ)
+        decompressor->ok = write_xz(decompressor, data, len, LZMA_RUN, out);
+#endif
+    return decompressor->ok;
+}
+
+/**
+ * @brief Flushes the rest of the output, checks that the input ended with
+ *        a complete stream and frees the decompressor.
+ * @return TRUE on success, FALSE on corrupt or truncated input (an error is
+ *         printed) or if decompressor_write stopped at its limit (no error
+ *         is printed: the caller knows what the input is called).
+ */
+gboolean decompressor_finish(Decompressor *decompressor, GString *out) {
+#ifdef HAVE_LZMA
+    if (decompressor->ok && decompressor->compression == COMPRESSION_XZ)
+        decompressor->ok =
+            write_xz(decompressor, NULL, 0, LZMA_FINISH, out);
+#else
+    (void)out;
+#endif
+
+    gboolean ok = decompressor->ok && decompressor->ended;
+    if (!decompressor->ok && !decompressor->over_limit)
+        fprintf(stderr,
+                "Error reading %s input: the data is corrupt.\n",
+                compression_names[decompressor->compression]);
+    else if (decompressor->ok && !decompressor->ended)
+        fprintf(stderr,
+                "Error reading %s input: the data is truncated.\n",
+                compression_names[decompressor->compression]);
+    decompressor_free(decompressor);
+    return ok;
+}
@@ -0,0 +1,33 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <glib.h>
+
+// Compressed input formats, recognized by their magic bytes.
+typedef enum {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD,
+    COMPRESSION_XZ
+} Compression;
+
+// Bytes needed to recognize any of the formats.
+#define COMPRESSION_MAGIC_SIZE 6
+
+Compression compression_detect(const unsigned char *data, size_t len);
+gboolean compression_is_suffix(const char *extension);
+gint64 compression_content_size(const unsigned char *data, size_t len);
+
+// Streaming decompressor: compressed data is fed in pieces of any size and
+// the decompressed text is appended to a GString as it is produced.
+typedef struct Decompressor Decompressor;
+
+Decompressor *decompressor_new(Compression compression);
+gboolean decompressor_write(Decompressor *decompressor,
+                            const unsigned char *data,
+                            size_t len,
+                            size_t max_len,
+                            GString *out);
+gboolean decompressor_finish(Decompressor *decompressor, GString *out);
+
+#endif // DECOMPRESS_H
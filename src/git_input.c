@@ -0,0 +1,372 @@
+#include "git_input.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_LIBGIT2
+#include <git2.h>
+#endif
+
+/**
+ * @brief Finds the ':' that ends the repository part of a "repo:rev:path"
+ *        spec. The repository path may itself contain colons, so the
+ *        longest prefix that is a directory is taken; if none is, the first
+ *        ':'. The revision then ends at the next ':', and the rest is the
+ *        path, which may contain colons too.
+ * @return The ':', or NULL if the spec has none.
+ */
+static const char *find_repo_end(const char *spec) {
+    const char *repo_end = strchr(spec, ':');
+    for (const char *colon = repo_end; colon != NULL;
+         colon = strchr(colon + 1, ':')) {
+        char *prefix = g_strndup(spec, colon - spec);
+        if (g_file_test(prefix, G_FILE_TEST_IS_DIR))
+            repo_end = colon;
+        g_free(prefix);
+    }
+    return repo_end;
+}
+
+/**
+ * @brief Splits a "repo:rev:path" spec at the colons around the revision.
+ * @return TRUE if the spec has a repository, a revision and a path.
+ */
+static gboolean split_spec(const char *spec,
+                           const char **rev,
+                           const char **path) {
+    const char *repo_end = find_repo_end(spec);
+    if (!repo_end || repo_end == spec)
+        return FALSE;
+    const char *rev_end = strchr(repo_end + 1, ':');
+    if (!rev_end || rev_end == repo_end + 1 || rev_end[1] == '\0')
+        return FALSE;
+    *rev = repo_end + 1;
+    *path = rev_end + 1;
+    return TRUE;
+}
+
+/**
+ * @brief Returns the path part of a "repo:rev:path" spec, which the language
+ *        is detected from, or NULL if the spec is malformed.
+ */
+const char *git_spec_path(const char *spec) {
+    const char *rev, *path;
+    return split_spec(spec, &rev, &path) ? path : NULL;
+}
+
+#ifdef HAVE_LIBGIT2
+
+// Root trees kept per repository. Past this many, the table is emptied:
+// a -serve daemon resolving HEAD as it moves on would otherwise keep the
+// tree of every commit it has seen.
+#define GIT_MAX_TREES 64
+
+// An opened repository and the root trees of the revisions read from it.
+// Trees are keyed by the id of the object a revision resolved to, never by
+// the revision's name, so that a branch or HEAD moving on is seen.
+// libgit2 objects must not be used by two threads at once, so every call
+// on the repository or its trees is made with mutex held.
+typedef struct {
+    git_repository *repo;
+    GHashTable *trees; // Hex object id -> git_tree *
+    GMutex mutex;
+} GitRepoEntry;
+
+static GHashTable *repositories; // Repository path -> GitRepoEntry *
+
+// Guards the table of repositories; each repository has its own mutex, so
+// reads from different repositories run in parallel.
+G_LOCK_DEFINE_STATIC(repositories);
+
+static void git_repo_entry_free(gpointer data) {
+    GitRepoEntry *entry = data;
+    g_hash_table_destroy(entry->trees);
+    git_repository_free(entry->repo);
+    g_mutex_clear(&entry->mutex);
+    g_free(entry);
+}
+
+static void print_git_error(const char *what, const char *name) {
+    const git_error *error = git_error_last();
+    fprintf(stderr,
+            "Error: %s '%s': %s\n",
+            what,
+            name,
+            error && error->message ? error->message : "unknown error");
+}
+
+/**
+ * @brief Returns the cached repository at path, opening it on first use.
+ *        The path may be a work tree, any directory inside one, or a bare
+ *        repository. Called with the repositories lock held.
+ * @param report Whether to print an error if it cannot be opened.
+ */
+static GitRepoEntry *open_repository(const char *path, gboolean report) {
+    if (!repositories) {
+        git_libgit2_init();
+        repositories = g_hash_table_new_full(g_str_hash,
+                                             g_str_equal,
+                                             g_free,
+                                             git_repo_entry_free);
+    }
+
+    GitRepoEntry *entry = g_hash_table_lookup(repositories, path);
+    if (entry)
+        return entry;
+
+    git_repository *repo = NULL;
+    if (git_repository_open_ext(&repo, path, 0, NULL) != 0) {
+        if (report)
+            print_git_error("Could not open git repository", path);
+        return NULL;
+    }
+    entry = g_new0(GitRepoEntry, 1);
+    entry->repo = repo;
+    g_mutex_init(&entry->mutex);
+    entry->trees =
+        g_hash_table_new_full(g_str_hash,
+                              g_str_equal,
+                              g_free,
+                              (GDestroyNotify)git_tree_free);
+    g_hash_table_insert(repositories, g_strdup(path), entry);
+    return entry;
+}
+
+/**
+ * @brief Returns the root tree of a revision. The revision is resolved on
+ *        every call, and its tree is only looked up the first time the
+ *        object it resolves to is seen. Called with the entry's mutex held.
+ * @param report Whether to print an error if there is no such tree.
+ */
+static git_tree *lookup_tree(GitRepoEntry *entry,
+                             const char *rev,
+                             gboolean report) {
+    git_object *object = NULL;
+    if (git_revparse_single(&object, entry->repo, rev) != 0) {
+        if (report)
+            print_git_error("Could not resolve revision", rev);
+        return NULL;
+    }
+    char *id = g_strdup(git_oid_tostr_s(git_object_id(object)));
+    git_tree *tree = g_hash_table_lookup(entry->trees, id);
+    if (tree) {
+        git_object_free(object);
+        g_free(id);
+        return tree;
+    }
+
+    git_object *peeled = NULL;
+    int error = git_object_peel(&peeled, object, GIT_OBJECT_TREE);
+    git_object_free(object);
+    if (error != 0) {
+        if (report)
+            print_git_error("Revision has no tree", rev);
+        g_free(id);
+        return NULL;
+    }
+    if (g_hash_table_size(entry->trees) >= GIT_MAX_TREES)
+        g_hash_table_remove_all(entry->trees);
+    tree = (git_tree *)peeled;
+    g_hash_table_insert(entry->trees, id, tree);
+    return tree;
+}
+
+/**
+ * @brief Reads the size of a blob from the header of the object alone,
+ *        without inflating it.
+ * @return TRUE on success, FALSE if the header could not be read.
+ */
+static gboolean blob_size(GitRepoEntry *entry,
+                          const git_oid *id,
+                          size_t *size) {
+    git_odb *odb = NULL;
+    git_object_t type;
+    gboolean found = git_repository_odb(&odb, entry->repo) == 0 &&
+                     git_odb_read_header(size, &type, odb, id) == 0;
+    git_odb_free(odb);
+    return found;
+}
+
+/**
+ * @brief Tells whether a blob is larger than max_bytes, from the header of
+ *        the object alone. If the header cannot be read, the blob is read
+ *        and the lookup reports the error.
+ * @param length Receives the size of the blob if it is too large.
+ */
+static gboolean blob_over_limit(GitRepoEntry *entry,
+                                const git_oid *id,
+                                size_t max_bytes,
+                                size_t *length) {
+    size_t size = 0;
+    gboolean over =
+        max_bytes > 0 && blob_size(entry, id, &size) && size > max_bytes;
+    if (over)
+        *length = size;
+    return over;
+}
+
+/**
+ * @brief Finds the size of the blob at path in a revision's tree, without
+ *        printing anything. Called with the entry's mutex held.
+ * @return TRUE on success, FALSE if there is no such blob.
+ */
+static gboolean tree_blob_size(GitRepoEntry *entry,
+                               git_tree *tree,
+                               const char *path,
+                               size_t *size) {
+    git_tree_entry *tree_entry = NULL;
+    if (git_tree_entry_bypath(&tree_entry, tree, path) != 0)
+        return FALSE;
+    gboolean found =
+        git_tree_entry_type(tree_entry) == GIT_OBJECT_BLOB &&
+        blob_size(entry, git_tree_entry_id(tree_entry), size);
+    git_tree_entry_free(tree_entry);
+    return found;
+}
+
+/**
+ * @brief Reads the blob at path in a revision's tree, unless it is larger
+ *        than max_bytes (0 for no limit).
+ * @return A copy of its contents followed by a NUL byte, to be freed with
+ *         g_free, or NULL on failure (an error is printed) or if it is too
+ *         large (no error is printed; length receives its size).
+ *         Called with the entry's mutex held.
+ */
+static char *read_blob(GitRepoEntry *entry,
+                       git_tree *tree,
+                       const char *path,
+                       size_t max_bytes,
+                       size_t *length) {
+    git_tree_entry *tree_entry = NULL;
+    if (git_tree_entry_bypath(&tree_entry, tree, path) != 0) {
+        print_git_error("Could not find", path);
+        return NULL;
+    }
+    if (git_tree_entry_type(tree_entry) != GIT_OBJECT_BLOB) {
+        fprintf(stderr, "Error: '%s' is not a file.\n", path);
+        git_tree_entry_free(tree_entry);
+        return NULL;
+    }
+
+    const git_oid *id = git_tree_entry_id(tree_entry);
+    if (blob_over_limit(entry, id, max_bytes, length)) {
+        git_tree_entry_free(tree_entry);
+        return NULL;
+    }
+
+    git_blob *blob = NULL;
+    int error = git_blob_lookup(&blob, entry->repo, id);
+    git_tree_entry_free(tree_entry);
+    if (error != 0) {
+        print_git_error("Could not read", path);
+        return NULL;
+    }
+
+    size_t size = (size_t)git_blob_rawsize(blob);
+    char *data = g_malloc(size + 1);
+    memcpy(data, git_blob_rawcontent(blob), size);
+    data[size] = '\0';
+    git_blob_free(blob);
+    *length = size;
+    return data;
+}
+
+#endif // HAVE_LIBGIT2
+
+/**
+ * @brief Reads a file from a git repository, given as "repo:rev:path". A
+ *        file larger than max_bytes is not read: its size is taken from the
+ *        object's header.
+ * @param max_bytes The largest file to read, or 0 for no limit.
+ * @param length Receives the size of the file, or 0 on failure.
+ * @return Its contents followed by a NUL byte, to be freed with g_free, or
+ *         NULL on failure (an error is printed) or if the file is larger
+ *         than max_bytes (no error is printed; length is its size).
+ */
+char *git_read_file(const char *spec, size_t max_bytes, size_t *length) {
+    *length = 0;
+    const char *rev_start, *path;
+    if (!split_spec(spec, &rev_start, &path)) {
+        fprintf(stderr,
+                "Error: invalid git input '%s', expected "
+                "<repo>:<rev>:<path>.\n",
+                spec);
+        return NULL;
+    }
+
+#ifdef HAVE_LIBGIT2
+    char *repo_path = g_strndup(spec, rev_start - 1 - spec);
+    char *rev = g_strndup(rev_start, path - 1 - rev_start);
+    char *data = NULL;
+
+    G_LOCK(repositories);
+    GitRepoEntry *entry = open_repository(repo_path, TRUE);
+    G_UNLOCK(repositories);
+    if (entry) {
+        g_mutex_lock(&entry->mutex);
+        git_tree *tree = lookup_tree(entry, rev, TRUE);
+        if (tree)
+            data = read_blob(entry, tree, path, max_bytes, length);
+        g_mutex_unlock(&entry->mutex);
+    }
+
+    g_free(repo_path);
+    g_free(rev);
+    return data;
+#else
+    (void)max_bytes;
+    fprintf(stderr,
+            "Cannot read git input: screenCODE was built without libgit2.\n");
+    return NULL;
+#endif
+}
+
+/**
+ * @brief Finds the size of a file in a git repository, given as
+ *        "repo:rev:path", from the object's header, without reading the
+ *        file or printing anything. The repository stays open for
+ *        git_read_file.
+ * @return TRUE on success, FALSE if the file cannot be found (or
+ *         screenCODE was built without libgit2).
+ */
+gboolean git_file_size(const char *spec, size_t *size) {
+    const char *rev_start, *path;
+    if (!split_spec(spec, &rev_start, &path))
+        return FALSE;
+
+#ifdef HAVE_LIBGIT2
+    char *repo_path = g_strndup(spec, rev_start - 1 - spec);
+    char *rev = g_strndup(rev_start, path - 1 - rev_start);
+    gboolean found = FALSE;
+
+    G_LOCK(repositories);
+    GitRepoEntry *entry = open_repository(repo_path, FALSE);
+    G_UNLOCK(repositories);
+    if (entry) {
+        g_mutex_lock(&entry->mutex);
+        git_tree *tree = lookup_tree(entry, rev, FALSE);
+        found = tree && tree_blob_size(entry, tree, path, size);
+        g_mutex_unlock(&entry->mutex);
+    }
+
+    g_free(repo_path);
+    g_free(rev);
+    return found;
+#else
+    (void)size;
+    return FALSE;
+#endif
+}
+
+/**
+ * @brief Closes the repositories opened by git_read_file.
+ */
+void git_input_shutdown(void) {
+#ifdef HAVE_LIBGIT2
+    if (!repositories)
+        return;
+    g_hash_table_destroy(repositories);
+    repositories = NULL;
+    git_libgit2_shutdown();
+#endif
+}
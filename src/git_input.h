@@ -0,0 +1,20 @@
+#ifndef GIT_INPUT_H
+#define GIT_INPUT_H
+
+#include <glib.h>
+
+// Reads files straight from a git repository's object database, given as
+// "repo:rev:path" (e.g. "~/src/project:v1.2:src/main.c"), without a
+// checkout. Any revision git understands works ("HEAD~3", a tag, a commit
+// id). Opened repositories and resolved trees are kept until
+// git_input_shutdown, so reading several paths from one repository only
+// opens it and loads its pack indexes once. Reads from one repository
+// take turns; reads from different repositories run in parallel. This
+// needs screenCODE to be built with libgit2 (HAVE_LIBGIT2); otherwise an
+// error is printed.
+char *git_read_file(const char *spec, size_t max_bytes, size_t *length);
+gboolean git_file_size(const char *spec, size_t *size);
+const char *git_spec_path(const char *spec);
+void git_input_shutdown(void);
+
+#endif // GIT_INPUT_H
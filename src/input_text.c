@@ -0,0 +1,501 @@
+// mmap is POSIX, not C99; MAP_ANONYMOUS is not in POSIX.1-2008 either.
+#define _DEFAULT_SOURCE
+
+#include "input_text.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "decompress.h"
+#include "git_input.h"
+
+// Pipes and other unmappable inputs are read this many bytes at a time.
+#define INPUT_CHUNK_SIZE (64 * 1024)
+
+struct InputText {
+    char *data;
+    size_t length;
+    size_t map_length; // Size of the mapping, or 0 if data is on the heap
+};
+
+// Whether regular files opened by path are mapped; see input_text_map_files.
+static gboolean map_files = TRUE;
+
+/**
+ * @brief Chooses whether regular files opened by path are mapped (the
+ *        default) or read into memory. Pages of a mapped file are read as
+ *        the lexer reaches them, so if another process truncates the file
+ *        meanwhile, the access past its new end raises SIGBUS and kills
+ *        the process. A one-off render takes that risk for the speed;
+ *        long-running modes, whose inputs are rewritten in place by editors
+ *        and build tools (-watch, -serve), read them instead. Descriptors
+ *        given to input_text_open_fd are mapped either way: the caller must
+ *        have sealed them against shrinking. Call before any input is
+ *        opened.
+ */
+void input_text_map_files(gboolean map) {
+    map_files = map;
+}
+
+/**
+ * @brief Maps a regular file read-only, followed by at least one zero byte.
+ *        The file is mapped over a slightly larger anonymous mapping: the
+ *        rest of the file's last page reads as zeros, and when the file
+ *        ends exactly on a page boundary the anonymous page after it
+ *        provides the NUL. Pages are only read in as the lexer reaches
+ *        them.
+ * @return TRUE on success, FALSE if the file could not be mapped.
+ */
+static gboolean map_file(InputText *input, int fd, size_t size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_length = (size / page_size + 1) * page_size;
+
+    void *base = mmap(NULL,
+                      map_length,
+                      PROT_READ,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+    if (base == MAP_FAILED)
+        return FALSE;
+    if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+        MAP_FAILED) {
+        munmap(base, map_length);
+        return FALSE;
+    }
+    posix_madvise(base, size, POSIX_MADV_SEQUENTIAL);
+
+    input->data = base;
+    input->length = size;
+    input->map_length = map_length;
+    return TRUE;
+}
+
+static ssize_t read_retrying(int fd, void *buf, size_t len) {
+    ssize_t n;
+    do {
+        n = read(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/**
+ * @brief Returns the most bytes the input may have, or 0 for any number.
+ */
+static size_t limit_bytes(const InputLimit *limit) {
+    return limit ? limit->max_bytes : 0;
+}
+
+/**
+ * @brief Tells whether length bytes are more than the limit allows.
+ */
+static gboolean over_limit(const InputLimit *limit, size_t length) {
+    return limit_bytes(limit) > 0 && length > limit->max_bytes;
+}
+
+/**
+ * @brief Reports an input that is longer than its limit.
+ * @return FALSE, for the caller to return.
+ */
+static gboolean report_over_limit(InputLimit *limit, const char *name) {
+    fprintf(stderr,
+            "Error: %s is over the limit of %zu bytes.\n",
+            name,
+            limit->max_bytes);
+    limit->exceeded = TRUE;
+    return FALSE;
+}
+
+/**
+ * @brief Unmaps or frees the text of an input.
+ */
+static void release_text(InputText *input) {
+    if (input->map_length > 0)
+        munmap(input->data, input->map_length);
+    else
+        g_free(input->data);
+    input->data = NULL;
+    input->map_length = 0;
+}
+
+/**
+ * @brief Replaces the compressed text of an input, mapped or in memory,
+ *        with the text it decompresses to. It is fed to the decompressor in
+ *        one go; a mapping's pages are read in as it goes. Decompression
+ *        stops as soon as the text passes the limit.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+static gboolean decompress_text(InputText *input,
+                                Compression compression,
+                                const char *name,
+                                InputLimit *limit) {
+    Decompressor *decompressor = decompressor_new(compression);
+    if (!decompressor)
+        return FALSE;
+
+    GString *out = g_string_sized_new(INPUT_CHUNK_SIZE);
+    decompressor_write(decompressor,
+                       (const unsigned char *)input->data,
+                       input->length,
+                       limit_bytes(limit),
+                       out);
+    gboolean ok = decompressor_finish(decompressor, out);
+    if (!ok && over_limit(limit, out->len))
+        report_over_limit(limit, name);
+
+    release_text(input);
+    input->length = out->len;
+    input->data = g_string_free(out, !ok);
+    return ok;
+}
+
+/**
+ * @brief Reads the rest of a compressed stream from fd in chunks, each
+ *        decompressed as soon as it arrives, so the compressed data is
+ *        never held in full. Reading stops as soon as the text passes the
+ *        limit.
+ * @param fd Where the rest of the stream comes from, or -1 if the prefix
+ *        is all of it.
+ * @param chunk A buffer of INPUT_CHUNK_SIZE bytes holding the first
+ *        prefix_len bytes of the stream; freed here.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+static gboolean read_compressed(InputText *input,
+                                int fd,
+                                const char *name,
+                                Compression compression,
+                                unsigned char *chunk,
+                                size_t prefix_len,
+                                InputLimit *limit) {
+    Decompressor *decompressor = decompressor_new(compression);
+    if (!decompressor) {
+        g_free(chunk);
+        return FALSE;
+    }
+
+    GString *out = g_string_sized_new(INPUT_CHUNK_SIZE);
+    ssize_t n = prefix_len;
+    size_t max_bytes = limit_bytes(limit);
+    while (n > 0 && decompressor_write(decompressor, chunk, n, max_bytes, out))
+        n = fd >= 0 ? read_retrying(fd, chunk, INPUT_CHUNK_SIZE) : 0;
+    if (n < 0)
+        fprintf(stderr, "Error reading %s: %s\n", name, strerror(errno));
+    gboolean ok = decompressor_finish(decompressor, out) && n == 0;
+    if (!ok && over_limit(limit, out->len))
+        report_over_limit(limit, name);
+    g_free(chunk);
+
+    input->length = out->len;
+    input->data = g_string_free(out, !ok);
+    return ok;
+}
+
+/**
+ * @brief Reads everything left on fd in fixed-size chunks into a buffer
+ *        that grows geometrically, so a pipe is copied only once. The first
+ *        bytes are checked for a compressed stream, which is decompressed
+ *        on the fly instead. Reading stops as soon as the text passes the
+ *        limit, leaving the rest of the stream unread.
+ * @param size_hint The size of a regular file, so that it is read without
+ *        growing the buffer, or 0.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+static gboolean read_chunks(InputText *input,
+                            int fd,
+                            const char *name,
+                            size_t size_hint,
+                            InputLimit *limit) {
+    if (limit_bytes(limit) > 0)
+        size_hint = MIN(size_hint, limit->max_bytes);
+    size_t capacity = size_hint + INPUT_CHUNK_SIZE;
+    size_t length = 0;
+    char *data = g_malloc(capacity + 1);
+
+    // Enough of the start to recognize compressed data by its magic bytes.
+    ssize_t n = 1;
+    while (length < COMPRESSION_MAGIC_SIZE && n > 0) {
+        n = read_retrying(fd, data + length, capacity - length);
+        length += MAX(n, 0);
+    }
+    Compression compression =
+        compression_detect((const unsigned char *)data, length);
+    if (n >= 0 && compression != COMPRESSION_NONE)
+        return read_compressed(input,
+                               n > 0 ? fd : -1,
+                               name,
+                               compression,
+                               (unsigned char *)data,
+                               length,
+                               limit);
+
+    while (n > 0 && !over_limit(limit, length)) {
+        if (capacity - length < INPUT_CHUNK_SIZE) {
+            capacity *= 2;
+            data = g_realloc(data, capacity + 1);
+        }
+        n = read_retrying(fd, data + length, capacity - length);
+        length += MAX(n, 0);
+    }
+    if (n < 0 || over_limit(limit, length)) {
+        if (n < 0)
+            fprintf(stderr, "Error reading %s: %s\n", name, strerror(errno));
+        else
+            report_over_limit(limit, name);
+        g_free(data);
+        return FALSE;
+    }
+    data[length] = '\0';
+    input->data = data;
+    input->length = length;
+    input->map_length = 0;
+    return TRUE;
+}
+
+/**
+ * @brief Reads an input from an open descriptor: maps it if it is a
+ *        non-empty regular file (unless input_text_map_files turned that
+ *        off), reads it in chunks otherwise.
+ * @param whole_file Map a regular file from its start even if the offset
+ *        is past it, whatever input_text_map_files says; otherwise only a
+ *        file positioned at its start (such as stdin redirected from one)
+ *        is mapped.
+ * @return The input, or NULL on failure (an error is printed).
+ */
+static InputText *read_fd(int fd,
+                          const char *name,
+                          gboolean whole_file,
+                          InputLimit *limit) {
+    InputText *input = g_new0(InputText, 1);
+    struct stat st;
+    gboolean regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                       st.st_size > 0 &&
+                       (off_t)(size_t)st.st_size == st.st_size;
+    gboolean ok;
+    if (regular &&
+        (whole_file || (map_files && lseek(fd, 0, SEEK_CUR) == 0)) &&
+        map_file(input, fd, (size_t)st.st_size)) {
+        // Only the first page has been read in to tell, so a file over the
+        // limit costs nothing more.
+        Compression compression = compression_detect(
+            (const unsigned char *)input->data, input->length);
+        if (compression != COMPRESSION_NONE)
+            ok = decompress_text(input, compression, name, limit);
+        else
+            ok = !over_limit(limit, input->length) ||
+                 report_over_limit(limit, name);
+    } else {
+        ok = read_chunks(
+            input, fd, name, regular ? (size_t)st.st_size : 0, limit);
+    }
+
+    if (!ok) {
+        input_text_close(input);
+        return NULL;
+    }
+    return input;
+}
+
+/**
+ * @brief Opens the source code to highlight; "-" means stdin. Regular
+ *        files (including stdin redirected from one) are memory-mapped,
+ *        unless input_text_map_files turned that off; pipes, terminals and
+ *        empty or special files are read in chunks.
+ *        gzip, zstd and xz data is recognized by its magic bytes and
+ *        decompressed while it is read.
+ * @param limit The most bytes to read, or NULL for no limit.
+ * @return The input, or NULL on failure (an error is printed).
+ */
+InputText *input_text_open(const char *filename, InputLimit *limit) {
+    gboolean is_stdin = strcmp(filename, "-") == 0;
+    const char *name = is_stdin ? "stdin" : filename;
+    int fd = is_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error reading %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    InputText *input = read_fd(fd, name, FALSE, limit);
+    if (!is_stdin)
+        close(fd);
+    return input;
+}
+
+/**
+ * @brief Opens the whole of a file given as a descriptor, such as a memfd
+ *        passed by another process, which is mapped rather than copied
+ *        whatever its offset. The descriptor stays open.
+ * @param name What to call the input in error messages.
+ * @param limit The most bytes to read, or NULL for no limit.
+ * @return The input, or NULL on failure (an error is printed).
+ */
+InputText *input_text_open_fd(int fd, const char *name, InputLimit *limit) {
+    return read_fd(fd, name, TRUE, limit);
+}
+
+/**
+ * @brief Wraps text already read into memory, such as a file read together
+ *        with others or a git blob. Compressed data is decompressed like a
+ *        file's.
+ * @param data The bytes, allocated with g_malloc and followed by a NUL
+ *        byte; the input takes them over (they are freed on failure too).
+ * @param name What to call the input in error messages.
+ * @param limit The most bytes the text may have, or NULL for no limit.
+ * @return The input, or NULL on failure (an error is printed).
+ */
+InputText *input_text_from_data(char *data,
+                                size_t length,
+                                const char *name,
+                                InputLimit *limit) {
+    InputText *input = g_new0(InputText, 1);
+    input->data = data;
+    input->length = length;
+
+    Compression compression = compression_detect(
+        (const unsigned char *)input->data, input->length);
+    gboolean ok;
+    if (compression != COMPRESSION_NONE)
+        ok = decompress_text(input, compression, name, limit);
+    else
+        ok = !over_limit(limit, length) || report_over_limit(limit, name);
+    if (!ok) {
+        input_text_close(input);
+        return NULL;
+    }
+    return input;
+}
+
+/**
+ * @brief Opens a file stored in a git repository, given as
+ *        "repo:rev:path", reading the blob from the object database without
+ *        a checkout. Compressed blobs are decompressed like files. A blob
+ *        larger than the limit is not read at all.
+ * @param limit The most bytes the text may have, or NULL for no limit.
+ * @return The input, or NULL on failure (an error is printed).
+ */
+InputText *input_text_open_git(const char *spec, InputLimit *limit) {
+    size_t length;
+    char *data = git_read_file(spec, limit_bytes(limit), &length);
+    if (!data) {
+        if (over_limit(limit, length))
+            report_over_limit(limit, spec);
+        return NULL;
+    }
+    return input_text_from_data(data, length, spec, limit);
+}
+
+/**
+ * @brief Returns the text, followed by a NUL byte.
+ */
+const char *input_text_data(const InputText *input) {
+    return input->data;
+}
+
+/**
+ * @brief Returns the length of the text in bytes, after decompression.
+ */
+size_t input_text_length(const InputText *input) {
+    return input->length;
+}
+
+/**
+ * @brief Counts the lines of the text and the characters of the longest
+ *        one, a tab counting as one, with memchr rather than a layout. A
+ *        last line without a newline counts.
+ */
+void input_text_measure(const InputText *input,
+                        gint64 *n_lines,
+                        gint64 *longest_line) {
+    const char *end = input->data + input->length;
+    *n_lines = 0;
+    *longest_line = 0;
+    for (const char *line = input->data; line < end;) {
+        const char *newline = memchr(line, '\n', end - line);
+        const char *line_end = newline ? newline : end;
+        // A line has no more characters than bytes, so only lines longer in
+        // bytes than the longest so far are decoded.
+        if (line_end - line > *longest_line)
+            *longest_line =
+                MAX(*longest_line, g_utf8_strlen(line, line_end - line));
+        (*n_lines)++;
+        line = line_end + 1;
+    }
+}
+
+/**
+ * @brief Sizes up an input before it is opened, without printing anything
+ *        (the job reports any error when it opens the input). A regular
+ *        file is mapped and scanned for its lines (see input_text_measure),
+ *        unless it is over max_bytes. Compressed data is not decompressed:
+ *        its length is what its format records (see
+ *        compression_content_size), or else the compressed size, with
+ *        compressed set. A git blob's length comes from its object header.
+ *        Lines are not counted in compressed data or git blobs. Stdin and
+ *        files that are not regular are left alone.
+ * @param from_git Whether name is a git input, "repo:rev:path".
+ * @param max_bytes Files longer than this are not scanned, or 0.
+ * @return TRUE on success, FALSE if the input cannot be sized up front.
+ */
+gboolean input_text_estimate(const char *name,
+                             gboolean from_git,
+                             size_t max_bytes,
+                             InputEstimate *estimate) {
+    estimate->length = 0;
+    estimate->n_lines = -1;
+    estimate->longest_line = -1;
+    estimate->compressed = FALSE;
+    if (from_git) {
+        size_t size;
+        if (!git_file_size(name, &size))
+            return FALSE;
+        estimate->length = (gint64)size;
+        return TRUE;
+    }
+
+    // A FIFO is not even opened: its writer would get a reader that goes
+    // away. O_NONBLOCK covers one swapped in after the stat.
+    struct stat st;
+    int fd = strcmp(name, "-") != 0 && stat(name, &st) == 0 &&
+                     S_ISREG(st.st_mode)
+                 ? open(name, O_RDONLY | O_NONBLOCK)
+                 : -1;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (off_t)(size_t)st.st_size != st.st_size) {
+        if (fd >= 0)
+            close(fd);
+        return FALSE;
+    }
+    estimate->length = st.st_size;
+    InputText input = {NULL, 0, 0};
+    if (st.st_size == 0) {
+        estimate->n_lines = estimate->longest_line = 0;
+    } else if (map_file(&input, fd, (size_t)st.st_size)) {
+        const unsigned char *data = (const unsigned char *)input.data;
+        if (compression_detect(data, input.length) != COMPRESSION_NONE) {
+            gint64 length = compression_content_size(data, input.length);
+            estimate->compressed = length < 0;
+            if (length >= 0)
+                estimate->length = length;
+        } else if (max_bytes == 0 || input.length <= max_bytes) {
+            input_text_measure(
+                &input, &estimate->n_lines, &estimate->longest_line);
+        }
+        release_text(&input);
+    }
+    close(fd);
+    return TRUE;
+}
+
+/**
+ * @brief Unmaps or frees the text.
+ */
+void input_text_close(InputText *input) {
+    if (!input)
+        return;
+    release_text(input);
+    g_free(input);
+}
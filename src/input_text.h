@@ -0,0 +1,50 @@
+#ifndef INPUT_TEXT_H
+#define INPUT_TEXT_H
+
+#include <glib.h>
+
+// The source code to highlight, read from a file or stdin. Regular files
+// are mapped read-only rather than copied; anything else is read in chunks.
+// The text is always followed by a NUL byte, so it can be used as a string.
+// A mapped file must not be truncated while it is open: reading past its
+// new end raises SIGBUS. Processes that keep running while files change
+// turn mapping off with input_text_map_files.
+typedef struct InputText InputText;
+
+// The most bytes an input may have after decompression, 0 for any number.
+// Reading stops as soon as the input is found to be longer, and exceeded
+// is set, before the rest is read or decompressed.
+typedef struct {
+    size_t max_bytes;
+    gboolean exceeded;
+} InputLimit;
+
+// What an input holds, found before it is opened (input_text_estimate).
+typedef struct {
+    gint64 length;       // Bytes of text, after decompression
+    gint64 n_lines;      // Lines, or -1 if the text was not scanned
+    gint64 longest_line; // Characters of its longest line, likewise
+    gboolean compressed; // length is the compressed size, the format not
+                         // recording the size of the text
+} InputEstimate;
+
+InputText *input_text_open(const char *filename, InputLimit *limit);
+InputText *input_text_open_git(const char *spec, InputLimit *limit);
+InputText *input_text_open_fd(int fd, const char *name, InputLimit *limit);
+InputText *input_text_from_data(char *data,
+                                size_t length,
+                                const char *name,
+                                InputLimit *limit);
+const char *input_text_data(const InputText *input);
+size_t input_text_length(const InputText *input);
+void input_text_measure(const InputText *input,
+                        gint64 *n_lines,
+                        gint64 *longest_line);
+gboolean input_text_estimate(const char *name,
+                             gboolean from_git,
+                             size_t max_bytes,
+                             InputEstimate *estimate);
+void input_text_close(InputText *input);
+void input_text_map_files(gboolean map);
+
+#endif // INPUT_TEXT_H
@@ -0,0 +1,1087 @@
+#include "job.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "decompress.h"
+#include "git_input.h"
+#include "input_text.h"
+#include "output_cache.h"
+#include "syntax_highlighting.h"
+
+// Helper function to detect the programming language from the filename
+// extension. A compression suffix is skipped, so "foo.c.gz" is C.
+static LanguageType get_language_from_filename(const char *filename) {
+    char *name = g_strdup(filename);
+    char *dot = strrchr(name, '.');
+    if (dot && dot != name && compression_is_suffix(dot)) {
+        *dot = '\0';
+        dot = strrchr(name, '.');
+    }
+
+    LanguageType lang = LANG_UNKNOWN;
+    if (!dot || dot == name)
+        lang = LANG_UNKNOWN;
+    else if (strcmp(dot, ".c") == 0)
+        lang = LANG_C;
+    else if (strcmp(dot, ".py") == 0)
+        lang = LANG_PYTHON;
+    else if (strcmp(dot, ".go") == 0)
+        lang = LANG_GO;
+    g_free(name);
+    return lang;
+}
+
+/**
+ * @brief Parses the -pipeline thread counts, one per step, e.g. "1,1,4,2".
+ * @return TRUE if there is one positive count per step, FALSE otherwise.
+ */
+static gboolean parse_stage_threads(const char *arg,
+                                    int stage_threads[JOB_N_STEPS]) {
+    char **counts = g_strsplit(arg, ",", -1);
+    gboolean ok = g_strv_length(counts) == JOB_N_STEPS;
+    for (int i = 0; ok && i < JOB_N_STEPS; i++) {
+        char *end;
+        stage_threads[i] = strtol(counts[i], &end, 10);
+        ok = *end == '\0' && end != counts[i] && stage_threads[i] > 0;
+    }
+    g_strfreev(counts);
+    return ok;
+}
+
+/**
+ * @brief Returns the limit a limit option such as -max-lines sets, or NULL
+ *        if option is not one.
+ */
+static gint64 *limit_option(Job *job, const char *option) {
+    if (strcmp(option, "-max-bytes") == 0)
+        return &job->limits.max_input_bytes;
+    if (strcmp(option, "-max-lines") == 0)
+        return &job->limits.max_lines;
+    if (strcmp(option, "-max-pixels") == 0)
+        return &job->limits.max_pixels;
+    if (strcmp(option, "-deadline") == 0)
+        return &job->limits.deadline_ms;
+    return NULL;
+}
+
+/**
+ * @brief Parses the value of a limit option: a non-negative number, with 0
+ *        meaning no limit.
+ * @return TRUE on success, FALSE if arg is not such a number.
+ */
+static gboolean parse_limit(const char *arg, gint64 *limit) {
+    char *end;
+    gint64 value = g_ascii_strtoll(arg, &end, 10);
+    if (*end != '\0' || end == arg || value < 0)
+        return FALSE;
+    *limit = value;
+    return TRUE;
+}
+
+/**
+ * @brief Sets up a job with the default options and no input or outputs.
+ */
+void job_init(Job *job) {
+    memset(job, 0, sizeof(*job));
+    render_options_init(&job->opts);
+    png_settings_init(&job->png_settings);
+    job->format = OUTPUT_FORMAT_AUTO;
+    job->animation.fps = 0;
+    job->animation.tokens_per_second = ANIMATION_DEFAULT_TOKENS_PER_SECOND;
+    job->outputs = g_array_new(FALSE, TRUE, sizeof(OutputSpec));
+    job->workers = 1;
+    job->memory_budget_mb = JOB_DEFAULT_MEMORY_BUDGET_MB;
+    job->max_queue = JOB_DEFAULT_MAX_QUEUE;
+    job->cache_size_mb = JOB_DEFAULT_CACHE_SIZE_MB;
+}
+
+/**
+ * @brief Sets up a job with the options of another one (e.g. those given
+ *        on the command line for a whole batch), but without its input,
+ *        outputs, manifest or socket.
+ */
+void job_init_from(Job *job, const Job *defaults) {
+    *job = *defaults;
+    job->input_filename = NULL;
+    job->input_from_git = FALSE;
+    job->output_filename = NULL;
+    job->batch_filename = NULL;
+    job->serve_socket = NULL;
+    job->more_pairs = NULL;
+    job->prefetched_input = NULL;
+    job->outputs = g_array_new(FALSE, TRUE, sizeof(OutputSpec));
+}
+
+/**
+ * @brief Frees the outputs of a job.
+ */
+void job_clear(Job *job) {
+    input_text_close(job->prefetched_input);
+    job->prefetched_input = NULL;
+    if (job->more_pairs)
+        g_ptr_array_free(job->more_pairs, TRUE);
+    job->more_pairs = NULL;
+    if (!job->outputs)
+        return;
+    for (guint i = 0; i < job->outputs->len; i++)
+        output_spec_clear(&g_array_index(job->outputs, OutputSpec, i));
+    g_array_free(job->outputs, TRUE);
+    job->outputs = NULL;
+}
+
+/**
+ * @brief Parses options and the input and output arguments into a job.
+ *        Arguments are read from argv[0]; strings are borrowed from argv.
+ *        Positional arguments after the first input and output are kept in
+ *        more_pairs for the caller to check.
+ * @return JOB_PARSE_OK, JOB_PARSE_ERROR (an error is printed) or
+ *         JOB_PARSE_DONE when an option such as -list-lang has done all
+ *         there was to do.
+ */
+JobParseResult job_parse_args(Job *job, int argc, char **argv) {
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-lang") == 0) {
+            job->lang_option_used = TRUE;
+            if (i + 1 < argc) {
+                if (strcmp(argv[i + 1], "c") == 0)
+                    job->opts.lang = LANG_C;
+                else if (strcmp(argv[i + 1], "python") == 0)
+                    job->opts.lang = LANG_PYTHON;
+                else if (strcmp(argv[i + 1], "go") == 0)
+                    job->opts.lang = LANG_GO;
+                i++;
+            } else {
+                fprintf(stderr, "-lang option requires a language argument.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-list-lang") == 0) {
+            printf("Supported languages:\n");
+            printf("  c\n");
+            printf("  python\n");
+            printf("  go\n");
+            return JOB_PARSE_DONE;
+        } else if (strcmp(argv[i], "-no-gradient") == 0) {
+            job->opts.use_gradient_header = FALSE;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            job->opts.show_line_numbers = TRUE;
+        } else if (strcmp(argv[i], "-no-color") == 0) {
+            job->opts.no_color = TRUE;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            if (i + 1 < argc) {
+                job->opts.title = argv[i + 1];
+                i++;
+            } else {
+                fprintf(stderr, "-t option requires a title argument.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-Ts") == 0) {
+            if (i + 1 < argc) {
+                job->opts.title_size = atoi(argv[i + 1]);
+                if (job->opts.title_size <= 0) {
+                    fprintf(stderr,
+                            "-Ts option requires a positive integer value.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr, "-Ts option requires a size argument.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-scale") == 0) {
+            if (i + 1 < argc) {
+                char *end;
+                job->opts.scale = strtod(argv[i + 1], &end);
+                if (end == argv[i + 1] || *end != '\0' ||
+                    job->opts.scale <= 0) {
+                    fprintf(stderr,
+                            "-scale option requires a positive number.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr, "-scale option requires a factor argument.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-quality") == 0) {
+            if (i + 1 < argc) {
+                if (strcmp(argv[i + 1], "draft") == 0)
+                    job->opts.quality = RENDER_QUALITY_DRAFT;
+                else if (strcmp(argv[i + 1], "default") == 0)
+                    job->opts.quality = RENDER_QUALITY_DEFAULT;
+                else {
+                    fprintf(stderr,
+                            "-quality option must be 'default' or "
+                            "'draft'.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr, "-quality option requires a mode argument.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-band-height") == 0) {
+            if (i + 1 < argc) {
+                job->band_height = atoi(argv[i + 1]);
+                if (job->band_height <= 0) {
+                    fprintf(stderr,
+                            "-band-height option requires a positive integer "
+                            "value.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-band-height option requires a pixel argument.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-page-lines") == 0) {
+            if (i + 1 < argc) {
+                job->page_lines = atoi(argv[i + 1]);
+                if (job->page_lines <= 0) {
+                    fprintf(stderr,
+                            "-page-lines option requires a positive integer "
+                            "value.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-page-lines option requires a line count.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-png-level") == 0) {
+            if (i + 1 < argc) {
+                char *end;
+                job->png_settings.compression_level =
+                    strtol(argv[i + 1], &end, 10);
+                if (*end != '\0' || job->png_settings.compression_level < 0 ||
+                    job->png_settings.compression_level > 9) {
+                    fprintf(stderr,
+                            "-png-level option requires a level from 0 to "
+                            "9.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                job->png_level_set = TRUE;
+                i++;
+            } else {
+                fprintf(stderr, "-png-level option requires a level.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-png-filter") == 0) {
+            if (i + 1 < argc) {
+                if (!png_filter_from_string(argv[i + 1],
+                                            &job->png_settings.filter)) {
+                    fprintf(stderr,
+                            "-png-filter option must be none, sub, up, "
+                            "average, paeth or adaptive.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                job->png_filter_set = TRUE;
+                i++;
+            } else {
+                fprintf(stderr, "-png-filter option requires a filter.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-png-threads") == 0) {
+            if (i + 1 < argc) {
+                job->png_settings.threads = atoi(argv[i + 1]);
+                if (job->png_settings.threads <= 0) {
+                    fprintf(stderr,
+                            "-png-threads option requires a positive integer "
+                            "value.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-png-threads option requires a thread count.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-png-writer") == 0) {
+            if (i + 1 < argc) {
+                if (strcmp(argv[i + 1], "cairo") == 0)
+                    job->use_cairo_png = TRUE;
+                else if (strcmp(argv[i + 1], "builtin") == 0)
+                    job->use_cairo_png = FALSE;
+                else {
+                    fprintf(stderr,
+                            "-png-writer option must be 'builtin' or "
+                            "'cairo'.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr, "-png-writer option requires a writer.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-format") == 0) {
+            if (i + 1 < argc) {
+                if (!output_format_from_string(argv[i + 1], &job->format)) {
+                    fprintf(stderr,
+                            "-format option must be auto, png, qoi, webp, "
+                            "svg, pdf, raw, ansi or html.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr, "-format option requires a format.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-optimize-size") == 0) {
+            job->png_settings.optimize_size = TRUE;
+        } else if (strcmp(argv[i], "-verbose") == 0) {
+            job->png_settings.verbose = TRUE;
+        } else if (strcmp(argv[i], "-animate") == 0) {
+            if (job->animation.fps == 0)
+                job->animation.fps = ANIMATION_DEFAULT_FPS;
+        } else if (strcmp(argv[i], "-fps") == 0) {
+            if (i + 1 < argc) {
+                job->animation.fps = atoi(argv[i + 1]);
+                if (job->animation.fps <= 0 ||
+                    job->animation.fps > ANIMATION_MAX_FPS) {
+                    fprintf(stderr,
+                            "-fps option must be between 1 and %d.\n",
+                            ANIMATION_MAX_FPS);
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr, "-fps option requires a frame rate.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-typing-speed") == 0) {
+            if (i + 1 < argc) {
+                char *end;
+                job->animation.tokens_per_second = strtod(argv[i + 1], &end);
+                if (end == argv[i + 1] || *end != '\0' ||
+                    job->animation.tokens_per_second <= 0) {
+                    fprintf(stderr,
+                            "-typing-speed option must be a positive number "
+                            "of tokens per second.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr, "-typing-speed option requires a speed.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-fd") == 0) {
+            if (i + 1 < argc) {
+                char *end;
+                int fd = strtol(argv[i + 1], &end, 10);
+                if (*end != '\0' || end == argv[i + 1] || fd < 0) {
+                    fprintf(stderr,
+                            "-fd option requires a file descriptor "
+                            "number.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                // Named after the descriptor for format detection and
+                // messages; the bytes go to fd itself.
+                char *name = g_strdup_printf("/dev/fd/%d", fd);
+                OutputSpec spec;
+                output_spec_init(&spec, name);
+                g_free(name);
+                spec.fd = fd;
+                g_array_append_val(job->outputs, spec);
+                i++;
+            } else {
+                fprintf(stderr, "-fd option requires a file descriptor.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-git") == 0) {
+            if (i + 1 < argc) {
+                if (job->input_filename != NULL) {
+                    fprintf(stderr,
+                            "-git option replaces the input file; only one "
+                            "input can be given.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                job->input_filename = argv[i + 1];
+                job->input_from_git = TRUE;
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-git option requires <repo>:<rev>:<path>.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-batch") == 0) {
+            if (i + 1 < argc) {
+                job->batch_filename = argv[i + 1];
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-batch option requires a manifest file (or -).\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-serve") == 0) {
+            if (i + 1 < argc) {
+                job->serve_socket = argv[i + 1];
+                i++;
+            } else {
+                fprintf(stderr, "-serve option requires a socket path.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 < argc) {
+                job->workers = atoi(argv[i + 1]);
+                if (job->workers <= 0) {
+                    fprintf(stderr,
+                            "-j option requires a positive number of "
+                            "workers.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr, "-j option requires a number of workers.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-pipeline") == 0) {
+            if (i + 1 < argc) {
+                if (!parse_stage_threads(argv[i + 1], job->stage_threads)) {
+                    fprintf(stderr,
+                            "-pipeline option requires %d positive thread "
+                            "counts: read,highlight,render,encode.\n",
+                            JOB_N_STEPS);
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-pipeline option requires thread counts.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-memory-budget") == 0) {
+            if (i + 1 < argc) {
+                job->memory_budget_mb = atoi(argv[i + 1]);
+                if (job->memory_budget_mb <= 0) {
+                    fprintf(stderr,
+                            "-memory-budget option requires a positive "
+                            "number of MiB.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-memory-budget option requires a number of MiB.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-cache") == 0) {
+            if (i + 1 < argc) {
+                job->cache_dir = argv[i + 1];
+                i++;
+            } else {
+                fprintf(stderr, "-cache option requires a directory.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-cache-size") == 0) {
+            if (i + 1 < argc) {
+                job->cache_size_mb = atoi(argv[i + 1]);
+                if (job->cache_size_mb <= 0) {
+                    fprintf(stderr,
+                            "-cache-size option requires a positive number "
+                            "of MiB.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-cache-size option requires a number of MiB.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-cache-link") == 0) {
+            job->cache_links = TRUE;
+        } else if (strcmp(argv[i], "-cache-stats") == 0) {
+            job->cache_stats = TRUE;
+        } else if (strcmp(argv[i], "-line-cache") == 0) {
+            if (i + 1 < argc) {
+                job->line_cache_mb = atoi(argv[i + 1]);
+                if (job->line_cache_mb <= 0) {
+                    fprintf(stderr,
+                            "-line-cache option requires a positive number "
+                            "of MiB.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-line-cache option requires a number of MiB.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-line-cache-dir") == 0) {
+            if (i + 1 < argc) {
+                job->line_cache_dir = argv[i + 1];
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-line-cache-dir option requires a directory.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-watch") == 0) {
+            job->watch = TRUE;
+        } else if (strcmp(argv[i], "-max-queue") == 0) {
+            if (i + 1 < argc) {
+                job->max_queue = atoi(argv[i + 1]);
+                if (job->max_queue <= 0) {
+                    fprintf(stderr,
+                            "-max-queue option requires a positive number "
+                            "of connections.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr,
+                        "-max-queue option requires a number of "
+                        "connections.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (limit_option(job, argv[i])) {
+            gint64 *limit = limit_option(job, argv[i]);
+            if (i + 1 < argc && parse_limit(argv[i + 1], limit)) {
+                i++;
+            } else {
+                fprintf(stderr,
+                        "%s option requires a number (0 for no limit).\n",
+                        argv[i]);
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-io") == 0) {
+            if (i + 1 < argc) {
+                if (strcmp(argv[i + 1], "uring") == 0)
+                    job->io_uring = TRUE;
+                else if (strcmp(argv[i + 1], "default") == 0)
+                    job->io_uring = FALSE;
+                else {
+                    fprintf(stderr,
+                            "-io option must be 'default' or 'uring'.\n");
+                    return JOB_PARSE_ERROR;
+                }
+                i++;
+            } else {
+                fprintf(stderr, "-io option requires a backend argument.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 < argc) {
+                OutputSpec spec;
+                if (!output_spec_parse(argv[i + 1], &spec))
+                    return JOB_PARSE_ERROR;
+                g_array_append_val(job->outputs, spec);
+                i++;
+            } else {
+                fprintf(stderr, "-o option requires an output argument.\n");
+                return JOB_PARSE_ERROR;
+            }
+        } else if (job->input_filename == NULL) {
+            job->input_filename = argv[i];
+        } else if (job->output_filename == NULL) {
+            job->output_filename = argv[i];
+        } else {
+            // Only valid on the command line, as more files to render.
+            if (!job->more_pairs)
+                job->more_pairs = g_ptr_array_new();
+            g_ptr_array_add(job->more_pairs, argv[i]);
+        }
+    }
+    return JOB_PARSE_OK;
+}
+
+/**
+ * @brief Adds the positional output argument, if any, to the outputs. Call
+ *        once all arguments of the job have been parsed. Unlike -o, the
+ *        argument is a path as is, with no options. Options that only make
+ *        sense together are checked here, once all of them are known.
+ * @return TRUE on success, FALSE if the options conflict (an error is
+ *         printed).
+ */
+gboolean job_finish_args(Job *job) {
+    if (job->png_settings.optimize_size && job->use_cairo_png) {
+        fprintf(stderr,
+                "-optimize-size needs the builtin PNG writer, not "
+                "-png-writer cairo.\n");
+        return FALSE;
+    }
+    if (job->output_filename == NULL)
+        return TRUE;
+    OutputSpec spec;
+    output_spec_init(&spec, job->output_filename);
+    g_array_append_val(job->outputs, spec);
+    job->output_filename = NULL;
+    return TRUE;
+}
+
+/**
+ * @brief Tells whether a job has an input and at least one output.
+ */
+gboolean job_is_complete(const Job *job) {
+    return job->input_filename != NULL && job->outputs->len > 0;
+}
+
+/**
+ * @brief Tells whether two jobs have the same output and line cache
+ *        options, which are process-wide.
+ */
+gboolean job_same_cache(const Job *job, const Job *other) {
+    return g_strcmp0(job->cache_dir, other->cache_dir) == 0 &&
+           job->cache_size_mb == other->cache_size_mb &&
+           job->cache_links == other->cache_links &&
+           job->cache_stats == other->cache_stats &&
+           job->line_cache_mb == other->line_cache_mb &&
+           g_strcmp0(job->line_cache_dir, other->line_cache_dir) == 0;
+}
+
+/**
+ * @brief Returns the -max-bytes limit of a job, for reading its input.
+ */
+InputLimit job_input_limit(const Job *job) {
+    InputLimit limit = {(size_t)job->limits.max_input_bytes, FALSE};
+    return limit;
+}
+
+/**
+ * @brief Sets up the progress of a job that has not started yet.
+ */
+void job_progress_init(JobProgress *progress, Job *job) {
+    memset(progress, 0, sizeof(*progress));
+    progress->job = job;
+    progress->pending = g_new0(PendingOutput *, job->outputs->len);
+    progress->n_files = g_new0(int, job->outputs->len);
+    progress->cache_keys = g_new0(char *, job->outputs->len);
+    progress->from_cache = g_new0(gboolean, job->outputs->len);
+    progress->ok = TRUE;
+}
+
+/**
+ * @brief Frees what a job still holds between steps.
+ */
+void job_progress_clear(JobProgress *progress) {
+    input_text_close(progress->input);
+    g_free(progress->highlighted_text);
+    for (guint i = 0; progress->pending && i < progress->job->outputs->len;
+         i++) {
+        pending_output_free(progress->pending[i]);
+        g_free(progress->cache_keys[i]);
+    }
+    g_free(progress->pending);
+    g_free(progress->n_files);
+    g_free(progress->cache_keys);
+    g_free(progress->from_cache);
+    progress->input = NULL;
+    progress->highlighted_text = NULL;
+    progress->pending = NULL;
+    progress->n_files = NULL;
+    progress->cache_keys = NULL;
+    progress->from_cache = NULL;
+}
+
+/**
+ * @brief Fails a job that reached one of its limits.
+ * @return FALSE, for the caller to return.
+ */
+static gboolean job_over_limit(JobProgress *progress) {
+    progress->over_limit = TRUE;
+    return FALSE;
+}
+
+/**
+ * @brief Checks that a job is still within its deadline.
+ * @return TRUE if it is, FALSE if not (an error is printed).
+ */
+static gboolean job_check_deadline(JobProgress *progress) {
+    Job *job = progress->job;
+    if (progress->deadline == 0 ||
+        g_get_monotonic_time() <= progress->deadline)
+        return TRUE;
+    fprintf(stderr,
+            "Error: %s: deadline of %" G_GINT64_FORMAT " ms exceeded.\n",
+            job->input_filename,
+            job->limits.deadline_ms);
+    return job_over_limit(progress);
+}
+
+/**
+ * @brief Checks the line count of the input against the job's limit,
+ *        before any of it is highlighted. A mapped input has not been
+ *        copied yet. The size was checked while the input was read.
+ * @param n_lines Receives the line count, and longest_line the characters
+ *        of the longest line, if either limit on lines or pixels is set;
+ *        both are left at 0 otherwise.
+ * @return TRUE if it is within it, FALSE if not (an error is printed).
+ */
+static gboolean job_check_input(JobProgress *progress,
+                                gint64 *n_lines,
+                                gint64 *longest_line) {
+    const JobLimits *limits = &progress->job->limits;
+    *n_lines = 0;
+    *longest_line = 0;
+    if (limits->max_lines == 0 && limits->max_pixels == 0)
+        return TRUE;
+
+    input_text_measure(progress->input, n_lines, longest_line);
+    if (limits->max_lines > 0 && *n_lines > limits->max_lines) {
+        fprintf(stderr,
+                "Error: %s has more lines than the limit of "
+                "%" G_GINT64_FORMAT ".\n",
+                progress->job->input_filename,
+                limits->max_lines);
+        return job_over_limit(progress);
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Checks the size of every raster output against the job's pixel
+ *        limit from an estimate made from the line count and the longest
+ *        line, before the text is highlighted or shaped. Outputs sized by
+ *        width are left to job_check_pixels.
+ * @return TRUE if they seem within it, FALSE if not (an error is printed).
+ */
+static gboolean job_estimate_pixels(JobProgress *progress,
+                                    gint64 n_lines,
+                                    gint64 longest_line) {
+    Job *job = progress->job;
+    if (job->limits.max_pixels == 0)
+        return TRUE;
+    if (job->opts.show_line_numbers) {
+        // The digits of the widest number and the space after it.
+        for (gint64 n = n_lines; n > 0; n /= 10)
+            longest_line++;
+        longest_line++;
+    }
+    CodeLayout estimate = {0};
+    if (!code_layout_estimate_size(&job->opts,
+                                   n_lines,
+                                   longest_line,
+                                   &estimate.width,
+                                   &estimate.height))
+        return TRUE;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        if (progress->from_cache[i] || spec->width > 0)
+            continue;
+        gint64 pixels = output_spec_pixels(&estimate, &job->opts, spec);
+        if (pixels > job->limits.max_pixels) {
+            fprintf(stderr,
+                    "Error: %s would be about %" G_GINT64_FORMAT " pixels, "
+                    "over the limit of %" G_GINT64_FORMAT ".\n",
+                    spec->filename,
+                    pixels,
+                    job->limits.max_pixels);
+            return job_over_limit(progress);
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Checks the size of every raster output against the job's pixel
+ *        limit, once the layout is measured and before any surface is
+ *        allocated. This is exact where job_estimate_pixels is not.
+ * @return TRUE if they are within it, FALSE if not (an error is printed).
+ */
+static gboolean job_check_pixels(JobProgress *progress,
+                                 const CodeLayout *code_layout) {
+    Job *job = progress->job;
+    if (!code_layout || job->limits.max_pixels == 0)
+        return TRUE;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        if (progress->from_cache[i])
+            continue;
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        gint64 pixels = output_spec_pixels(code_layout, &job->opts, spec);
+        if (pixels > job->limits.max_pixels) {
+            fprintf(stderr,
+                    "Error: %s would be %" G_GINT64_FORMAT " pixels, over "
+                    "the limit of %" G_GINT64_FORMAT ".\n",
+                    spec->filename,
+                    pixels,
+                    job->limits.max_pixels);
+            return job_over_limit(progress);
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Applies the job's options to its outputs, unless an output
+ *        overrides them.
+ */
+static void job_apply_output_defaults(Job *job) {
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        if (spec->band_height == 0)
+            spec->band_height = job->band_height;
+        if (spec->page_lines == 0)
+            spec->page_lines = job->page_lines;
+        if (spec->format == OUTPUT_FORMAT_AUTO)
+            spec->format = job->format;
+        if (spec->animation.fps == 0)
+            spec->animation.fps = job->animation.fps;
+        spec->animation.tokens_per_second = job->animation.tokens_per_second;
+    }
+}
+
+/**
+ * @brief Writes the outputs that are in the output cache straight from it,
+ *        and keeps the keys of the others to store them once written.
+ */
+static void job_fetch_cached(JobProgress *progress) {
+    Job *job = progress->job;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        progress->cache_keys[i] =
+            output_cache_key(input_text_data(progress->input),
+                             input_text_length(progress->input),
+                             &job->opts,
+                             job->use_cairo_png ? NULL : &job->png_settings,
+                             spec);
+        if (!progress->cache_keys[i])
+            continue;
+        if (output_cache_fetch(progress->cache_keys[i], spec)) {
+            progress->from_cache[i] = TRUE;
+            progress->n_files[i] = 1;
+        } else {
+            output_cache_prepare(spec);
+        }
+    }
+}
+
+/**
+ * @brief Tells whether every output of a job was written from the output
+ *        cache, leaving nothing to highlight or render.
+ */
+static gboolean job_all_cached(const JobProgress *progress) {
+    for (guint i = 0; i < progress->job->outputs->len; i++) {
+        if (!progress->from_cache[i])
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Detects the language, builds its syntax tables and opens the
+ *        input. Outputs found in the output cache are written at once.
+ */
+static gboolean job_read(JobProgress *progress) {
+    Job *job = progress->job;
+
+    // Draft output favours latency: fastest zlib level and no row filters,
+    // unless asked otherwise.
+    if (job->opts.quality == RENDER_QUALITY_DRAFT) {
+        if (!job->png_level_set)
+            job->png_settings.compression_level = PNG_COMPRESSION_FASTEST;
+        if (!job->png_filter_set)
+            job->png_settings.filter = PNG_FILTER_NONE;
+    }
+
+    // Auto-detect language from file extension if not specified by the user.
+    if (!job->lang_option_used) {
+        const char *name = job->input_filename;
+        if (job->input_from_git && git_spec_path(job->input_filename))
+            name = git_spec_path(job->input_filename);
+        job->opts.lang = get_language_from_filename(name);
+    }
+
+    // If no_color is true, we can proceed even if the language is unknown.
+    if (job->opts.lang == LANG_UNKNOWN && !job->opts.no_color) {
+        fprintf(stderr,
+                "Error: Unsupported file type or language not specified.\n");
+        fprintf(stderr,
+                "This program currently only supports .c, .py, and .go "
+                "files for syntax highlighting.\n");
+        fprintf(stderr,
+                "Please use a supported file, specify the language with "
+                "-lang c|python|go, or use -no-color.\n");
+        return FALSE;
+    }
+
+    // Tables are built the first time a language is used and kept for the
+    // rest of the process, so a batch only pays for each language once.
+    init_syntax_tables(job->opts.lang);
+
+    // The file is highlighted straight from a read-only mapping where
+    // possible, without copying it first. A batch may have read it already,
+    // under the same limit.
+    if (job->prefetched_input) {
+        progress->input = job->prefetched_input;
+        job->prefetched_input = NULL;
+    } else {
+        InputLimit limit = job_input_limit(job);
+        progress->input =
+            job->input_from_git
+                ? input_text_open_git(job->input_filename, &limit)
+                : input_text_open(job->input_filename, &limit);
+        if (limit.exceeded)
+            return job_over_limit(progress);
+    }
+    gint64 n_lines, longest_line;
+    if (!progress->input ||
+        !job_check_input(progress, &n_lines, &longest_line))
+        return FALSE;
+
+    job_apply_output_defaults(job);
+    if (output_cache_enabled())
+        job_fetch_cached(progress);
+    return job_estimate_pixels(progress, n_lines, longest_line);
+}
+
+/**
+ * @brief Highlights the input into Pango markup and releases the input.
+ */
+static gboolean job_highlight(JobProgress *progress) {
+    Job *job = progress->job;
+    if (job_all_cached(progress)) {
+        input_text_close(progress->input);
+        progress->input = NULL;
+        return TRUE;
+    }
+    progress->highlighted_text =
+        highlight_syntax(input_text_data(progress->input),
+                         job->opts.lang,
+                         job->opts.show_line_numbers,
+                         job->opts.no_color,
+                         progress->deadline);
+    input_text_close(progress->input);
+    progress->input = NULL;
+    if (!progress->highlighted_text) { // Check for memory allocation failure
+                                       // from highlight_syntax
+        if (!job_check_deadline(progress))
+            return FALSE;
+        fprintf(stderr,
+                "Error: Failed to highlight syntax due to memory "
+                "allocation failure.\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Lays the markup out once and renders every output from it. Single
+ *        raster images are left for job_encode; everything else is written
+ *        at once. The layout and markup are released afterwards.
+ */
+static gboolean job_render(JobProgress *progress) {
+    Job *job = progress->job;
+
+    gboolean needs_layout = FALSE;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        if (!progress->from_cache[i] &&
+            output_format_needs_layout(output_spec_format(spec)))
+            needs_layout = TRUE;
+    }
+
+    // The layout is shaped once in logical units and shared by every output;
+    // each output only changes the device scale it is rasterized at. Text
+    // outputs (ANSI, HTML) need no layout at all.
+    CodeLayout *code_layout =
+        needs_layout ? code_layout_new(progress->highlighted_text, &job->opts)
+                     : NULL;
+    gboolean ok = !needs_layout || code_layout;
+    if (!ok)
+        job_check_deadline(progress); // Layout gives up past the deadline
+    ok = ok && job_check_pixels(progress, code_layout);
+    for (guint i = 0; ok && i < job->outputs->len; i++) {
+        if (progress->from_cache[i])
+            continue;
+        ok = job_check_deadline(progress);
+        if (!ok)
+            break;
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        progress->n_files[i] = write_output_deferred(
+            code_layout,
+            progress->highlighted_text,
+            &job->opts,
+            spec,
+            job->use_cairo_png ? NULL : &job->png_settings,
+            &progress->pending[i]);
+    }
+
+    g_free(progress->highlighted_text);
+    progress->highlighted_text = NULL;
+    code_layout_free(code_layout);
+    return ok;
+}
+
+/**
+ * @brief Encodes and saves the images job_render left, then reports every
+ *        output of the job.
+ */
+static gboolean job_encode(JobProgress *progress) {
+    Job *job = progress->job;
+
+    // Status messages must not end up in an image written to stdout.
+    FILE *status_out = stdout;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        if (g_array_index(job->outputs, OutputSpec, i).fd == STDOUT_FILENO)
+            status_out = stderr;
+    }
+
+    gboolean ok = TRUE;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        if (progress->pending[i]) {
+            if (!job_check_deadline(progress))
+                return FALSE;
+            progress->n_files[i] = pending_output_finish(progress->pending[i]);
+            progress->pending[i] = NULL;
+        }
+        int n_files = progress->n_files[i];
+        if (n_files > 0 && progress->cache_keys[i] && !progress->from_cache[i])
+            output_cache_store(progress->cache_keys[i], spec);
+        if (n_files < 0)
+            ok = FALSE;
+        else if (spec->buffer || spec->shared)
+            continue; // Reported by whoever takes the bytes
+        else if (spec->page_lines > 0 || n_files > 1)
+            fprintf(status_out,
+                    "Screenshot saved to %s as %d pages\n",
+                    spec->filename,
+                    n_files);
+        else
+            fprintf(status_out, "Screenshot saved to %s\n", spec->filename);
+    }
+    return ok;
+}
+
+/**
+ * @brief Runs one step of a job. Steps must run in order, each once, and
+ *        none may run after one has failed.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean job_run_step(JobProgress *progress, JobStep step) {
+    static gboolean (*const steps[JOB_N_STEPS])(JobProgress *) = {
+        job_read, job_highlight, job_render, job_encode};
+    // The deadline runs from the first step, not from when the job was
+    // queued.
+    gint64 deadline_ms = progress->job->limits.deadline_ms;
+    if (step == JOB_STEP_READ && deadline_ms > 0)
+        progress->deadline = g_get_monotonic_time() + deadline_ms * 1000;
+    progress->job->opts.deadline = progress->deadline;
+    if (!job_check_deadline(progress) || !steps[step](progress))
+        progress->ok = FALSE;
+    return progress->ok;
+}
+
+/**
+ * @brief Reads, highlights and lays out the input of a job once and writes
+ *        every one of its outputs, running all steps on this thread. Fonts,
+ *        the Pango contexts and syntax tables are process-wide (Pango's per
+ *        thread) and reused from job to job.
+ * @return 0 on success, JOB_EXIT_LIMIT if the job reached one of its
+ *         limits, 1 if anything else failed (an error is printed).
+ */
+int job_run(Job *job) {
+    JobProgress progress;
+    job_progress_init(&progress, job);
+    for (int step = 0; step < JOB_N_STEPS; step++) {
+        if (!job_run_step(&progress, (JobStep)step))
+            break;
+    }
+    job_progress_clear(&progress);
+    if (progress.over_limit)
+        return JOB_EXIT_LIMIT;
+    return progress.ok ? 0 : 1;
+}
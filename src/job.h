@@ -0,0 +1,122 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <glib.h>
+
+#include "animation.h"
+#include "input_text.h"
+#include "output.h"
+#include "png_writer.h"
+#include "render.h"
+
+// The steps of job_run. A batch pipeline (-pipeline) runs each as a stage
+// of its own, on threads of its own.
+typedef enum {
+    JOB_STEP_READ,      // Detect the language and open the input
+    JOB_STEP_HIGHLIGHT, // Highlight the input into Pango markup
+    JOB_STEP_RENDER,    // Lay out the markup and render every output
+    JOB_STEP_ENCODE,    // Encode and save the rendered images
+    JOB_N_STEPS
+} JobStep;
+
+// Surface memory the items of a batch may hold at once, unless given with
+// -memory-budget.
+#define JOB_DEFAULT_MEMORY_BUDGET_MB 1024
+
+// Size the output cache may grow to, unless given with -cache-size.
+#define JOB_DEFAULT_CACHE_SIZE_MB 1024
+
+// Size the line cache may grow to when -line-cache-dir turns it on without
+// -line-cache.
+#define JOB_DEFAULT_LINE_CACHE_MB 256
+
+// Connections a daemon holds waiting for a worker, unless given with
+// -max-queue.
+#define JOB_DEFAULT_MAX_QUEUE 64
+
+// Exit status of a job stopped by one of its limits, unlike 1 for any other
+// failure.
+#define JOB_EXIT_LIMIT 3
+
+// What one job may cost; 0 means no limit. The input's size is checked
+// while it is read, the other sizes before the work they bound starts. The
+// deadline is checked between steps and outputs, and between lines while
+// highlighting and laying out line by line.
+typedef struct {
+    gint64 max_input_bytes; // -max-bytes: the input, after decompression
+    gint64 max_lines;       // -max-lines: lines of the input
+    gint64 max_pixels;      // -max-pixels: pixels of each raster output
+    gint64 deadline_ms;     // -deadline: wall-clock time of the whole job
+} JobLimits;
+
+// One screenshot to make: the input, its outputs and every option, as
+// given on the command line or on a line of a batch manifest. Strings are
+// borrowed from the argument vector the job was parsed from; outputs are
+// owned by the job.
+typedef struct {
+    RenderOptions opts;
+    gboolean lang_option_used;
+    int band_height; // 0 means only tile images that need it
+    int page_lines;  // 0 means write a single image
+    PngSettings png_settings;
+    gboolean png_level_set;
+    gboolean png_filter_set;
+    gboolean use_cairo_png;
+    OutputFormat format;
+    AnimationSettings animation;
+    const char *input_filename;
+    gboolean input_from_git; // input_filename is a git spec
+    const char *output_filename;
+    GArray *outputs;            // OutputSpec
+    const char *batch_filename; // -batch manifest, or NULL
+    const char *serve_socket;   // -serve socket path, or NULL
+    GPtrArray *more_pairs; // Further <input> <output> arguments, or NULL
+    int workers;           // -j: screenshots rendered at once in a batch
+    int stage_threads[JOB_N_STEPS]; // -pipeline threads per step, or all 0
+    gboolean io_uring; // -io uring: batch files go through io_uring
+    int memory_budget_mb; // -memory-budget: batch surfaces at once, in MiB
+    int max_queue;        // -max-queue: connections -serve holds waiting
+    JobLimits limits;
+    const char *cache_dir; // -cache: output cache directory, or NULL
+    int cache_size_mb;     // -cache-size: entries kept, in MiB
+    gboolean cache_links;  // -cache-link: hard link entries to outputs
+    gboolean cache_stats;  // -cache-stats: print hit rates at exit
+    int line_cache_mb;     // -line-cache: lines kept, in MiB, or 0
+    const char *line_cache_dir; // -line-cache-dir: saved line cache
+    gboolean watch; // -watch: render again whenever the input changes
+    InputText *prefetched_input; // Input already read by the batch, or NULL
+} Job;
+
+// What a job holds between two steps.
+typedef struct {
+    Job *job;
+    InputText *input;
+    char *highlighted_text;
+    PendingOutput **pending; // Per output: an image still to be encoded
+    int *n_files;            // Per output: files written, or -1 on failure
+    char **cache_keys;       // Per output: its output cache key, or NULL
+    gboolean *from_cache;    // Per output: written from the output cache
+    gint64 deadline; // Monotonic time the job must end by, or 0
+    gboolean ok;
+    gboolean over_limit; // Failed because a limit was reached
+} JobProgress;
+
+// Outcome of parsing arguments. DONE means an option such as -list-lang
+// did all there was to do.
+typedef enum { JOB_PARSE_OK, JOB_PARSE_ERROR, JOB_PARSE_DONE } JobParseResult;
+
+void job_init(Job *job);
+void job_init_from(Job *job, const Job *defaults);
+void job_clear(Job *job);
+JobParseResult job_parse_args(Job *job, int argc, char **argv);
+gboolean job_finish_args(Job *job);
+gboolean job_is_complete(const Job *job);
+gboolean job_same_cache(const Job *job, const Job *other);
+InputLimit job_input_limit(const Job *job);
+int job_run(Job *job);
+
+void job_progress_init(JobProgress *progress, Job *job);
+gboolean job_run_step(JobProgress *progress, JobStep step);
+void job_progress_clear(JobProgress *progress);
+
+#endif // JOB_H
@@ -0,0 +1,460 @@
+#include "line_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <cairo.h>
+#include <pango/pango.h>
+
+#include "screenshot.h"
+
+// Bump when a change to how lines are laid out or drawn (the text colours,
+// the renderer) changes their metrics or pixels, so that caches saved by
+// older versions are not loaded.
+#define LINE_CACHE_VERSION 1
+
+// First bytes of a saved cache. Read back in the wrong byte order, it no
+// longer matches.
+#define LINE_CACHE_MAGIC 0x53434c43u
+
+// Name of the saved cache in its directory.
+#define LINE_CACHE_FILE "lines.cache"
+
+// Memory an entry takes besides its key and pixels, roughly.
+#define LINE_CACHE_ENTRY_OVERHEAD 96
+
+// Largest strip side loaded from a saved cache; anything larger means the
+// file is damaged.
+#define LINE_CACHE_MAX_STRIP_SIDE 65536
+
+// Kinds of records in a saved cache.
+enum { LINE_RECORD_METRICS, LINE_RECORD_STRIP };
+
+// A line's metrics, or one of its strips.
+typedef struct {
+    char *key;
+    LineStrip *strip; // NULL for metrics
+    LineMetrics metrics;
+    gint64 bytes;
+    GList link; // In cache.lru, the most recently used first
+} LineCacheEntry;
+
+// The cache of the process, guarded by cache_mutex once jobs run.
+static struct {
+    gboolean enabled;
+    char *dir; // Loaded from and saved to, or NULL
+    gint64 max_bytes;
+    gint64 total_bytes;
+    GHashTable *entries; // Key -> LineCacheEntry
+    GQueue lru;
+    gint64 metrics_hits;
+    gint64 metrics_misses;
+    gint64 strip_hits;
+    gint64 strip_misses;
+    gint64 bytes_saved; // Pixels composited from strips, not drawn
+    gint64 evictions;
+    int loaded;
+} cache;
+static GMutex cache_mutex;
+
+/**
+ * @brief Creates a transparent strip of width x height pixels.
+ */
+LineStrip *line_strip_new(int x, int y, int width, int height) {
+    LineStrip *strip = g_new0(LineStrip, 1);
+    strip->x = x;
+    strip->y = y;
+    strip->refcount = 1;
+    if (width > 0 && height > 0) {
+        strip->width = width;
+        strip->height = height;
+        strip->stride =
+            cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+        strip->pixels = g_malloc0((size_t)strip->stride * height);
+    }
+    return strip;
+}
+
+void line_strip_unref(LineStrip *strip) {
+    if (strip && g_atomic_int_dec_and_test(&strip->refcount)) {
+        g_free(strip->pixels);
+        g_free(strip);
+    }
+}
+
+static LineCacheEntry *entry_new(const char *key, LineStrip *strip) {
+    LineCacheEntry *entry = g_new0(LineCacheEntry, 1);
+    entry->key = g_strdup(key);
+    entry->strip = strip;
+    entry->bytes = (gint64)strlen(key) + LINE_CACHE_ENTRY_OVERHEAD;
+    if (strip)
+        entry->bytes += (gint64)strip->stride * strip->height;
+    entry->link.data = entry;
+    return entry;
+}
+
+static void entry_free(LineCacheEntry *entry) {
+    line_strip_unref(entry->strip);
+    g_free(entry->key);
+    g_free(entry);
+}
+
+/**
+ * @brief Adds an entry, then evicts the least recently used ones while the
+ *        cache is over its limit. An entry another thread added first is
+ *        kept instead. Called with cache_mutex held.
+ */
+static void insert_entry(LineCacheEntry *entry) {
+    if (g_hash_table_contains(cache.entries, entry->key)) {
+        entry_free(entry);
+        return;
+    }
+    g_hash_table_insert(cache.entries, entry->key, entry);
+    g_queue_push_head_link(&cache.lru, &entry->link);
+    cache.total_bytes += entry->bytes;
+    while (cache.total_bytes > cache.max_bytes && cache.lru.tail) {
+        LineCacheEntry *oldest = cache.lru.tail->data;
+        g_queue_unlink(&cache.lru, &oldest->link);
+        g_hash_table_remove(cache.entries, oldest->key);
+        cache.total_bytes -= oldest->bytes;
+        cache.evictions++;
+        entry_free(oldest);
+    }
+}
+
+/**
+ * @brief Finds an entry of a kind and marks it as the most recently used.
+ *        Called with cache_mutex held.
+ * @return The entry, or NULL if there is none of that kind.
+ */
+static LineCacheEntry *find_entry(const char *key, gboolean strip) {
+    LineCacheEntry *entry = g_hash_table_lookup(cache.entries, key);
+    if (!entry || (entry->strip != NULL) != strip)
+        return NULL;
+    g_queue_unlink(&cache.lru, &entry->link);
+    g_queue_push_head_link(&cache.lru, &entry->link);
+    return entry;
+}
+
+static void put_uint32(GString *out, guint32 value) {
+    g_string_append_len(out, (const char *)&value, sizeof(value));
+}
+
+static void put_string(GString *out, const char *value) {
+    put_uint32(out, (guint32)strlen(value));
+    g_string_append(out, value);
+}
+
+// A saved cache being read: what is left of it.
+typedef struct {
+    const char *data;
+    gsize length;
+} Reader;
+
+/**
+ * @brief Takes the next length bytes of a saved cache.
+ * @return Them, or NULL if the file ends first.
+ */
+static const char *take(Reader *reader, gsize length) {
+    if (length > reader->length)
+        return NULL;
+    const char *data = reader->data;
+    reader->data += length;
+    reader->length -= length;
+    return data;
+}
+
+static gboolean take_uint32(Reader *reader, guint32 *value) {
+    const char *data = take(reader, sizeof(*value));
+    if (data)
+        memcpy(value, data, sizeof(*value));
+    return data != NULL;
+}
+
+/**
+ * @brief Takes a string and checks that it is the expected one.
+ */
+static gboolean take_string(Reader *reader, const char *expected) {
+    guint32 length;
+    const char *data;
+    return take_uint32(reader, &length) && (data = take(reader, length)) &&
+           length == strlen(expected) && memcmp(data, expected, length) == 0;
+}
+
+/**
+ * @brief Takes one record of a saved cache and adds it to the cache.
+ * @return TRUE on success, FALSE at the end of the file or if it is
+ *         damaged.
+ */
+static gboolean load_record(Reader *reader) {
+    const char *kind = take(reader, 1);
+    guint32 key_length;
+    const char *key;
+    if (!kind || !take_uint32(reader, &key_length) ||
+        !(key = take(reader, key_length)))
+        return FALSE;
+
+    gint32 values[4];
+    const char *data = take(reader, sizeof(values));
+    if (!data)
+        return FALSE;
+    memcpy(values, data, sizeof(values));
+    LineStrip *strip = NULL;
+    if (*kind == LINE_RECORD_STRIP) {
+        if (values[2] < 0 || values[2] > LINE_CACHE_MAX_STRIP_SIDE ||
+            values[3] < 0 || values[3] > LINE_CACHE_MAX_STRIP_SIDE)
+            return FALSE;
+        strip = line_strip_new(values[0], values[1], values[2], values[3]);
+        gsize size = (gsize)strip->stride * strip->height;
+        const char *pixels = take(reader, size);
+        if (!pixels) {
+            line_strip_unref(strip);
+            return FALSE;
+        }
+        if (size > 0)
+            memcpy(strip->pixels, pixels, size);
+    } else if (*kind != LINE_RECORD_METRICS) {
+        return FALSE;
+    }
+
+    char *key_string = g_strndup(key, key_length);
+    LineCacheEntry *entry = entry_new(key_string, strip);
+    g_free(key_string);
+    if (!strip) {
+        entry->metrics.x = values[0];
+        entry->metrics.width = values[1];
+        entry->metrics.height = values[2];
+        entry->metrics.baseline = values[3];
+    }
+    insert_entry(entry);
+    cache.loaded++;
+    return TRUE;
+}
+
+/**
+ * @brief Loads the cache saved in the cache directory, if there is one made
+ *        with the same font and versions. Entries are read oldest first, so
+ *        the last used ones are evicted last again.
+ */
+static void load_cache(void) {
+    char *path = g_build_filename(cache.dir, LINE_CACHE_FILE, NULL);
+    char *contents;
+    gsize length;
+    if (g_file_get_contents(path, &contents, &length, NULL)) {
+        Reader reader = {contents, length};
+        guint32 magic, version;
+        if (take_uint32(&reader, &magic) && magic == LINE_CACHE_MAGIC &&
+            take_uint32(&reader, &version) &&
+            version == LINE_CACHE_VERSION && take_string(&reader, FONT) &&
+            take_string(&reader, cairo_version_string()) &&
+            take_string(&reader, pango_version_string())) {
+            while (load_record(&reader)) {
+            }
+        }
+        g_free(contents);
+    }
+    g_free(path);
+}
+
+/**
+ * @brief Saves the cache to its directory, oldest entries first. The file
+ *        is replaced in one step, so a concurrent run loads either the old
+ *        cache or the new one.
+ */
+static void save_cache(void) {
+    GString *out = g_string_new(NULL);
+    put_uint32(out, LINE_CACHE_MAGIC);
+    put_uint32(out, LINE_CACHE_VERSION);
+    put_string(out, FONT);
+    put_string(out, cairo_version_string());
+    put_string(out, pango_version_string());
+    for (GList *link = cache.lru.tail; link; link = link->prev) {
+        const LineCacheEntry *entry = link->data;
+        const LineStrip *strip = entry->strip;
+        char kind = strip ? LINE_RECORD_STRIP : LINE_RECORD_METRICS;
+        g_string_append_c(out, kind);
+        put_string(out, entry->key);
+        gint32 values[4] = {entry->metrics.x,
+                            entry->metrics.width,
+                            entry->metrics.height,
+                            entry->metrics.baseline};
+        if (strip) {
+            values[0] = strip->x;
+            values[1] = strip->y;
+            values[2] = strip->width;
+            values[3] = strip->height;
+        }
+        g_string_append_len(out, (const char *)values, sizeof(values));
+        if (strip && strip->pixels)
+            g_string_append_len(out,
+                                (const char *)strip->pixels,
+                                (gssize)strip->stride * strip->height);
+    }
+
+    char *path = g_build_filename(cache.dir, LINE_CACHE_FILE, NULL);
+    GError *error = NULL;
+    if (!g_file_set_contents(path, out->str, out->len, &error)) {
+        fprintf(stderr,
+                "Warning: could not save the line cache: %s\n",
+                error->message);
+        g_error_free(error);
+    }
+    g_free(path);
+    g_string_free(out, TRUE);
+}
+
+/**
+ * @brief Turns the line cache on for the rest of the process.
+ * @param max_bytes Memory the entries may take before the least recently
+ *        used are evicted.
+ * @param dir Directory to load the cache from and save it to at exit, or
+ *        NULL to keep it in memory only.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean line_cache_open(gint64 max_bytes, const char *dir) {
+    if (dir && g_mkdir_with_parents(dir, 0777) != 0) {
+        fprintf(stderr,
+                "Error: could not create line cache directory %s: %s\n",
+                dir,
+                strerror(errno));
+        return FALSE;
+    }
+    cache.enabled = TRUE;
+    cache.dir = g_strdup(dir);
+    cache.max_bytes = max_bytes;
+    cache.entries = g_hash_table_new(g_str_hash, g_str_equal);
+    g_queue_init(&cache.lru);
+    if (cache.dir)
+        load_cache();
+    return TRUE;
+}
+
+gboolean line_cache_enabled(void) {
+    return cache.enabled;
+}
+
+/**
+ * @brief Builds the key of a line's metrics from its markup (without its
+ *        newline) and the rendering quality.
+ * @return The key, to be freed with g_free.
+ */
+char *line_cache_key(const char *markup, int quality) {
+    return g_strdup_printf("%d:%s", quality, markup);
+}
+
+/**
+ * @brief Builds the key of a strip of a line: its line key, the device
+ *        scale, and the sub-pixel position it is drawn at.
+ * @return The key, to be freed with g_free.
+ */
+char *line_cache_strip_key(const char *line_key,
+                           double scale,
+                           int phase_x,
+                           int phase_y) {
+    return g_strdup_printf(
+        "s%.17g,%d,%d:%s", scale, phase_x, phase_y, line_key);
+}
+
+/**
+ * @brief Looks up the metrics of a line.
+ * @return TRUE and the metrics if they are cached, FALSE if not.
+ */
+gboolean line_cache_get_metrics(const char *key, LineMetrics *metrics) {
+    g_mutex_lock(&cache_mutex);
+    LineCacheEntry *entry = find_entry(key, FALSE);
+    if (entry) {
+        *metrics = entry->metrics;
+        cache.metrics_hits++;
+    } else {
+        cache.metrics_misses++;
+    }
+    g_mutex_unlock(&cache_mutex);
+    return entry != NULL;
+}
+
+void line_cache_put_metrics(const char *key, const LineMetrics *metrics) {
+    LineCacheEntry *entry = entry_new(key, NULL);
+    entry->metrics = *metrics;
+    g_mutex_lock(&cache_mutex);
+    insert_entry(entry);
+    g_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * @brief Looks up a strip of a line.
+ * @return A reference to the strip, to be released with line_strip_unref,
+ *         or NULL if it is not cached. It stays valid if it is evicted
+ *         meanwhile, and its pixels are never written again.
+ */
+LineStrip *line_cache_get_strip(const char *key) {
+    g_mutex_lock(&cache_mutex);
+    LineCacheEntry *entry = find_entry(key, TRUE);
+    LineStrip *strip = NULL;
+    if (entry) {
+        strip = entry->strip;
+        g_atomic_int_inc(&strip->refcount);
+        cache.strip_hits++;
+        cache.bytes_saved += (gint64)strip->stride * strip->height;
+    } else {
+        cache.strip_misses++;
+    }
+    g_mutex_unlock(&cache_mutex);
+    return strip;
+}
+
+/**
+ * @brief Adds a strip that was just drawn. The cache takes a reference of
+ *        its own; the strip must not be drawn into afterwards.
+ */
+void line_cache_put_strip(const char *key, LineStrip *strip) {
+    g_atomic_int_inc(&strip->refcount);
+    LineCacheEntry *entry = entry_new(key, strip);
+    g_mutex_lock(&cache_mutex);
+    insert_entry(entry);
+    g_mutex_unlock(&cache_mutex);
+}
+
+static int percent(gint64 part, gint64 whole) {
+    return whole > 0 ? (int)(part * 100 / whole) : 0;
+}
+
+/**
+ * @brief Saves the cache if it has a directory, prints how well it did if
+ *        asked to, and frees it.
+ */
+void line_cache_close(gboolean print_stats) {
+    if (!cache.enabled)
+        return;
+    if (cache.dir)
+        save_cache();
+    if (print_stats) {
+        gint64 lines = cache.metrics_hits + cache.metrics_misses;
+        gint64 strips = cache.strip_hits + cache.strip_misses;
+        fprintf(stderr,
+                "Line cache: %" G_GINT64_FORMAT " of %" G_GINT64_FORMAT
+                " lines laid out without shaping (%d%%), %" G_GINT64_FORMAT
+                " of %" G_GINT64_FORMAT " drawn from strips (%d%%), %.1f "
+                "MiB of pixels reused, %" G_GINT64_FORMAT " evicted, %.1f "
+                "MiB held (%d loaded).\n",
+                cache.metrics_hits,
+                lines,
+                percent(cache.metrics_hits, lines),
+                cache.strip_hits,
+                strips,
+                percent(cache.strip_hits, strips),
+                cache.bytes_saved / (1024.0 * 1024.0),
+                cache.evictions,
+                cache.total_bytes / (1024.0 * 1024.0),
+                cache.loaded);
+    }
+
+    while (cache.lru.head) {
+        LineCacheEntry *entry = cache.lru.head->data;
+        g_queue_unlink(&cache.lru, &entry->link);
+        entry_free(entry);
+    }
+    g_hash_table_destroy(cache.entries);
+    g_free(cache.dir);
+    memset(&cache, 0, sizeof(cache));
+}
@@ -0,0 +1,59 @@
+#ifndef LINE_CACHE_H
+#define LINE_CACHE_H
+
+#include <glib.h>
+
+// A cache of single lines of code text (-line-cache), shared by every job
+// of the process, so that the lines files have in common (a license header,
+// "}", "return nil") are only shaped and drawn once per run. Lines are
+// keyed by their markup, which holds their text and the class of every
+// token, and so the state the highlighter entered the line in; the font,
+// theme and renderer versions are the same for every line of a run. Two
+// kinds of entries are kept:
+//  - a line's metrics, so that laying out a file does not shape lines seen
+//    before;
+//  - strips: a line's pixels at one device scale and sub-pixel position,
+//    composited into an image instead of drawing its glyphs again.
+// The least recently used entries are evicted once the cache outgrows its
+// size limit. Given a directory, the cache is loaded from it when opened
+// and saved back when closed, so later runs start warm.
+
+// Where a line sits, in Pango units: the x and width of its logical
+// extents, its height and its baseline below its top.
+typedef struct {
+    int x;
+    int width;
+    int height;
+    int baseline;
+} LineMetrics;
+
+// A line drawn on its own: premultiplied ARGB32 pixels, whose top-left
+// corner is (x, y) device pixels away from the whole pixel the line's
+// origin falls in. A line with no ink (a blank one) has no pixels.
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+    int stride;
+    unsigned char *pixels;
+    gint refcount;
+} LineStrip;
+
+gboolean line_cache_open(gint64 max_bytes, const char *dir);
+gboolean line_cache_enabled(void);
+char *line_cache_key(const char *markup, int quality);
+char *line_cache_strip_key(const char *line_key,
+                           double scale,
+                           int phase_x,
+                           int phase_y);
+gboolean line_cache_get_metrics(const char *key, LineMetrics *metrics);
+void line_cache_put_metrics(const char *key, const LineMetrics *metrics);
+LineStrip *line_cache_get_strip(const char *key);
+void line_cache_put_strip(const char *key, LineStrip *strip);
+void line_cache_close(gboolean print_stats);
+
+LineStrip *line_strip_new(int x, int y, int width, int height);
+void line_strip_unref(LineStrip *strip);
+
+#endif // LINE_CACHE_H
@@ -1,316 +1,242 @@
-#include <math.h>
 #include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
 
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif
-
-#include "screenshot.h"
+#include "batch.h"
+#include "git_input.h"
+#include "job.h"
+#include "line_cache.h"
+#include "output_cache.h"
+#include "render.h"
+#include "serve.h"
 #include "syntax_highlighting.h"
-#include "title_drawing.h"
+#include "watch.h"
 #include <fontconfig/fontconfig.h>
 
-// Helper function to detect the programming language from the filename
-// extension.
-static LanguageType get_language_from_filename(const char *filename) {
-    const char *dot = strrchr(filename, '.');
-    if (!dot || dot == filename)
-        return LANG_UNKNOWN;
-    if (strcmp(dot, ".c") == 0)
-        return LANG_C;
-    if (strcmp(dot, ".py") == 0)
-        return LANG_PYTHON;
-    if (strcmp(dot, ".go") == 0)
-        return LANG_GO;
-    return LANG_UNKNOWN;
-}
-
-// Helper function to draw the window header with properly rounded bottom
-// corners.
-void draw_header(cairo_t *cr,
-                 double x,
-                 double y,
-                 double width,
-                 double height,
-                 double radius,
-                 gboolean use_gradient) {
-    cairo_new_sub_path(cr);
-    cairo_arc(cr, x + width - radius, y + height - radius, radius, 0, M_PI / 2);
-    cairo_arc(cr, x + radius, y + height - radius, radius, M_PI / 2, M_PI);
-    cairo_line_to(cr, x, y);
-    cairo_line_to(cr, x + width, y);
-    cairo_close_path(cr);
-
-    if (use_gradient) {
-        cairo_pattern_t *header_pat =
-            cairo_pattern_create_linear(0, y, 0, y + height);
-        cairo_pattern_add_color_stop_rgb(header_pat, 0, 0.18, 0.19, 0.25);
-        cairo_pattern_add_color_stop_rgb(header_pat, 1, 0.141, 0.157, 0.231);
-        cairo_set_source(cr, header_pat);
-        cairo_pattern_destroy(header_pat);
-    } else {
-        cairo_set_source_rgb(cr, 0.141, 0.157, 0.231); // Solid color
-    }
-    cairo_fill(cr);
+static void print_usage(void) {
+    fprintf(stderr,
+            "Usage: %s [OPTIONS] <input_file> <output_png> "
+            "[<input_file> <output_png>...]\n"
+            "       %s [OPTIONS] -batch <manifest>\n"
+            "       %s [OPTIONS] -serve <socket>\n"
+            "       %s [OPTIONS] -watch <input_file> <output>\n\n",
+            "screenCODE",
+            "screenCODE",
+            "screenCODE",
+            "screenCODE");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr,
+            "  -lang <language>  Specify language (see -list-lang for "
+            "options).\n");
+    fprintf(stderr, "  -list-lang        List supported languages.\n");
+    fprintf(stderr,
+            "  -no-gradient      Disable the gradient effect on the "
+            "window header.\n");
+    fprintf(stderr, "  -l                Show line numbers.\n");
+    fprintf(stderr,
+            "  -t <title>        Set a custom title for the window.\n");
+    fprintf(stderr,
+            "  -Ts <size>        Set the font size for the title (default: "
+            "12).\n");
+    fprintf(stderr, "  -no-color         Disable syntax highlighting.\n");
+    fprintf(stderr,
+            "  -scale <factor>   Render at a HiDPI device scale (default: "
+            "1).\n");
+    fprintf(stderr,
+            "  -quality <mode>   'default' or 'draft' (fast, no "
+            "antialiasing or effects).\n");
+    fprintf(stderr,
+            "  -band-height <px> Render and encode in bands of this many "
+            "rows.\n");
+    fprintf(stderr,
+            "  -page-lines <n>   Split the output into numbered pages of "
+            "n lines (PDF: lines\n"
+            "                    per page, default 60).\n");
+    fprintf(stderr,
+            "  -o <out[:opts]>   Add an output; opts are scale=, width=, "
+            "band-height=, pages=,\n"
+            "                    format=, fps= (e.g. -o "
+            "thumb.png:width=320). May be repeated.\n"
+            "                    An output of - writes to stdout.\n");
+    fprintf(stderr,
+            "  -fd <n>           Add an output written to the inherited "
+            "file descriptor n.\n");
+    fprintf(stderr,
+            "  -git <repo>:<rev>:<path>\n"
+            "                    Read the input from a git repository "
+            "at a revision,\n"
+            "                    without a checkout (replaces "
+            "<input_file>).\n");
+    fprintf(stderr,
+            "  -batch <manifest> Render every line of the manifest (- for "
+            "stdin), each\n"
+            "                    [OPTIONS] <input_file> <output>, in one "
+            "process.\n");
+    fprintf(stderr,
+            "  -serve <socket>   Run as a daemon rendering requests sent "
+            "to a Unix socket.\n");
+    fprintf(stderr,
+            "  -watch            Render again, redrawing only the changed "
+            "lines, whenever\n"
+            "                    the input file is saved (Linux).\n");
+    fprintf(stderr,
+            "  -j <n>            Render n files of a batch, or requests of "
+            "-serve, at once\n"
+            "                    (default: 1).\n");
+    fprintf(stderr,
+            "  -memory-budget <MiB>\n"
+            "                    Surface memory a batch may hold at once "
+            "(default: 1024).\n");
+    fprintf(stderr,
+            "  -max-queue <n>    Connections -serve holds waiting for a "
+            "worker before it\n"
+            "                    turns new ones away (default: 64).\n");
+    fprintf(stderr,
+            "  -max-bytes <n>    Fail an input of more than n bytes.\n");
+    fprintf(stderr,
+            "  -max-lines <n>    Fail an input of more than n lines.\n");
+    fprintf(stderr,
+            "  -max-pixels <n>   Fail a raster output of more than n "
+            "pixels.\n");
+    fprintf(stderr,
+            "  -deadline <ms>    Fail a screenshot taking longer than this, "
+            "checked between\n"
+            "                    the lines it highlights or lays out "
+            "(exit status 3\n"
+            "                    for any limit; 0 means no limit).\n");
+    fprintf(stderr,
+            "  -io <backend>     Batch file I/O: 'default' or 'uring' "
+            "(io_uring, Linux).\n");
+    fprintf(stderr,
+            "  -cache <dir>      Keep encoded outputs in dir and reuse them "
+            "for identical\n"
+            "                    renders.\n");
+    fprintf(stderr,
+            "  -cache-size <MiB> Size the cache may grow to before the least "
+            "recently used\n"
+            "                    outputs are removed (default: 1024).\n");
+    fprintf(stderr,
+            "  -cache-link       Hard link cached outputs instead of copying "
+            "them.\n");
+    fprintf(stderr,
+            "  -cache-stats      Print the caches' hit rates at exit.\n");
+    fprintf(stderr,
+            "  -line-cache <MiB> Keep the lines of code drawn in memory and "
+            "reuse them\n"
+            "                    across files, up to this size.\n");
+    fprintf(stderr,
+            "  -line-cache-dir <dir>\n"
+            "                    Load the line cache from dir and save it "
+            "back at exit\n"
+            "                    (implies -line-cache 256).\n");
+    fprintf(stderr,
+            "  -png-level <0-9>  zlib compression level (default: 6, "
+            "draft: 1).\n");
+    fprintf(stderr,
+            "  -png-filter <f>   Row filter: none, sub, up, average, "
+            "paeth, adaptive.\n");
+    fprintf(stderr,
+            "  -png-threads <n>  Deflate threads (default: one per "
+            "processor).\n");
+    fprintf(stderr,
+            "  -png-writer <w>   'builtin' (parallel, default) or "
+            "'cairo'.\n");
+    fprintf(stderr,
+            "  -format <f>       Output format: png, qoi, webp, svg, "
+            "pdf, raw, ansi or\n"
+            "                    html (default: from the extension).\n");
+    fprintf(stderr,
+            "  -optimize-size    Write an 8-bit palette PNG, trying "
+            "every row filter.\n");
+    fprintf(stderr,
+            "  -verbose          Report the size of every row filter "
+            "-optimize-size tried.\n");
+    fprintf(stderr,
+            "  -animate          Write an animated PNG of the code being "
+            "typed.\n");
+    fprintf(stderr,
+            "  -fps <n>          Animation frame rate (default: 30; "
+            "implies -animate).\n");
+    fprintf(stderr,
+            "  -typing-speed <n> Tokens typed per second (default: "
+            "20).\n");
 }
 
 int main(int argc, char *argv[]) {
     FcInit();
-    LanguageType lang = LANG_UNKNOWN;
-    gboolean use_gradient_header = TRUE;
-    gboolean lang_option_used = FALSE;
-    gboolean show_line_numbers = FALSE; // New flag for line numbers
-    gboolean no_color = FALSE;          // New flag for no syntax highlighting
-    const char *title = NULL;
-    int title_size = 12; // Default title font size
-
-    const char *input_filename = NULL;
-    const char *output_filename = NULL;
-
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-lang") == 0) {
-            lang_option_used = TRUE;
-            if (i + 1 < argc) {
-                if (strcmp(argv[i + 1], "c") == 0)
-                    lang = LANG_C;
-                else if (strcmp(argv[i + 1], "python") == 0)
-                    lang = LANG_PYTHON;
-                else if (strcmp(argv[i + 1], "go") == 0)
-                    lang = LANG_GO;
-                i++;
-            } else {
-                fprintf(stderr, "-lang option requires a language argument.\n");
-                return 1;
-            }
-        } else if (strcmp(argv[i], "-list-lang") == 0) {
-            printf("Supported languages:\n");
-            printf("  c\n");
-            printf("  python\n");
-            printf("  go\n");
-            return 0;
-        } else if (strcmp(argv[i], "-no-gradient") == 0) {
-            use_gradient_header = FALSE;
-        } else if (strcmp(argv[i], "-l") == 0) { // New flag parsing
-            show_line_numbers = TRUE;
-        } else if (strcmp(argv[i], "-no-color") == 0) {
-            no_color = TRUE;
-        } else if (strcmp(argv[i], "-t") == 0) {
-            if (i + 1 < argc) {
-                title = argv[i + 1];
-                i++;
-            } else {
-                fprintf(stderr, "-t option requires a title argument.\n");
-                return 1;
-            }
-        } else if (strcmp(argv[i], "-Ts") == 0) {
-            if (i + 1 < argc) {
-                title_size = atoi(argv[i + 1]);
-                if (title_size <= 0) {
-                    fprintf(stderr,
-                            "-Ts option requires a positive integer value.\n");
-                    return 1;
-                }
-                i++;
-            } else {
-                fprintf(stderr, "-Ts option requires a size argument.\n");
-                return 1;
-            }
-        } else if (input_filename == NULL) {
-            input_filename = argv[i];
-        } else if (output_filename == NULL) {
-            output_filename = argv[i];
-        } else {
-            fprintf(stderr, "Too many arguments provided.\n");
-            return 1;
-        }
-    }
-
-    if (input_filename == NULL || output_filename == NULL) {
-        fprintf(stderr,
-                "Usage: %s [OPTIONS] <input_file> <output_png>\n\n",
-                "screenCODE");
-        fprintf(stderr, "OPTIONS:\n");
-        fprintf(stderr,
-                "  -lang <language>  Specify language (see -list-lang for "
-                "options).\n");
-        fprintf(stderr, "  -list-lang        List supported languages.\n");
-        fprintf(stderr,
-                "  -no-gradient      Disable the gradient effect on the "
-                "window header.\n");
-        fprintf(stderr, "  -l                Show line numbers.\n");
-        fprintf(stderr,
-                "  -t <title>        Set a custom title for the window.\n");
-        fprintf(stderr,
-                "  -Ts <size>        Set the font size for the title (default: "
-                "12).\n");
-        fprintf(stderr, "  -no-color         Disable syntax highlighting.\n");
-        return 1;
-    }
-
-    // Auto-detect language from file extension if not specified by the user.
-    if (!lang_option_used) {
-        lang = get_language_from_filename(input_filename);
-    }
-
-    // If no_color is true, we can proceed even if the language is unknown.
-    if (lang == LANG_UNKNOWN && !no_color) {
-        fprintf(stderr,
-                "Error: Unsupported file type or language not specified.\n");
-        fprintf(stderr,
-                "This program currently only supports .c, .py, and .go "
-                "files for syntax highlighting.\n");
-        fprintf(stderr,
-                "Please use a supported file, specify the language with "
-                "-lang c|python|go, or use -no-color.\n");
-        return 1;
-    }
-
-    // Initialize syntax tables once.
-    if (lang == LANG_C)
-        init_syntax_tables_c();
-    else if (lang == LANG_PYTHON)
-        init_syntax_tables_python();
-    else if (lang == LANG_GO)
-        init_syntax_tables_go();
-
-    GError *error = NULL;
-    char *code_content;
-    if (!g_file_get_contents(input_filename, &code_content, NULL, &error)) {
-        fprintf(stderr, "Error reading file: %s\n", error->message);
-        g_error_free(error);
-        return 1;
-    }
-
-    cairo_surface_t *temp_surface =
-        cairo_image_surface_create(CAIRO_FORMAT_A8, 0, 0);
-    cairo_t *temp_cr = cairo_create(temp_surface);
-    PangoLayout *layout = pango_cairo_create_layout(temp_cr);
-    PangoFontDescription *font_desc = pango_font_description_from_string(FONT);
-    pango_layout_set_font_description(layout, font_desc);
+    Job job;
+    job_init(&job);
 
-    // Pass show_line_numbers to highlight_syntax
-    char *highlighted_text =
-        highlight_syntax(code_content, lang, show_line_numbers, no_color);
-    if (!highlighted_text) { // Check for memory allocation failure from
-                             // highlight_syntax
-        fprintf(stderr,
-                "Error: Failed to highlight syntax due to memory "
-                "allocation failure.\n");
-        g_free(code_content);
-        g_object_unref(layout);
-        pango_font_description_free(font_desc);
-        cairo_destroy(temp_cr);
-        cairo_surface_destroy(temp_surface);
-        return 1;
+    JobParseResult parsed = job_parse_args(&job, argc - 1, argv + 1);
+    if (parsed != JOB_PARSE_OK) {
+        job_clear(&job);
+        return parsed == JOB_PARSE_DONE ? 0 : 1;
     }
-    pango_layout_set_markup(layout, highlighted_text, -1);
-
-    int text_width_pixels, text_height_pixels;
-    pango_layout_get_pixel_size(
-        layout, &text_width_pixels, &text_height_pixels);
-
-    // Calculate image dimensions based on wrapped text size
-    int img_width = text_width_pixels + (2 * PADDING);
-    int img_height = HEADER_HEIGHT + text_height_pixels + (2 * PADDING);
-
-    g_object_unref(layout);
-    pango_font_description_free(font_desc);
-    cairo_destroy(temp_cr);
-    cairo_surface_destroy(temp_surface);
-
-    cairo_surface_t *surface =
-        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, img_width, img_height);
-    cairo_t *cr = cairo_create(surface);
-
-    cairo_pattern_t *pat =
-        cairo_pattern_create_linear(0, 0, img_width, img_height);
-    cairo_pattern_add_color_stop_rgba(pat, 0, 0.102, 0.106, 0.149, 1);
-    cairo_pattern_add_color_stop_rgba(pat, 1, 0.141, 0.157, 0.231, 1);
-    cairo_rectangle(cr, 0, 0, img_width, img_height);
-    cairo_set_source(cr, pat);
-    cairo_fill(cr);
-    cairo_pattern_destroy(pat);
-
-    cairo_set_source_rgba(cr, 0, 0, 0, 0.4);
-    draw_rounded_rectangle(cr,
-                           PADDING / 2 + SHADOW_OFFSET,
-                           PADDING / 2 + SHADOW_OFFSET,
-                           img_width - PADDING,
-                           img_height - PADDING,
-                           BORDER_RADIUS);
-    cairo_fill(cr);
-
-    cairo_set_source_rgb(cr, 0.141, 0.157, 0.231);
-    draw_rounded_rectangle(cr,
-                           PADDING / 2,
-                           PADDING / 2,
-                           img_width - PADDING,
-                           img_height - PADDING,
-                           BORDER_RADIUS);
-    cairo_fill(cr);
-
-    // Draw the header using the new, improved function.
-    draw_header(cr,
-                PADDING / 2,
-                PADDING / 2,
-                img_width - PADDING,
-                HEADER_HEIGHT,
-                BORDER_RADIUS,
-                use_gradient_header);
-
-    cairo_set_source_rgb(cr, 0.9686, 0.4627, 0.5569); // Red
-    cairo_arc(
-        cr, PADDING / 2 + 20, PADDING / 2 + HEADER_HEIGHT / 2, 7, 0, 2 * M_PI);
-    cairo_fill(cr);
-
-    cairo_set_source_rgb(cr, 0.8784, 0.6863, 0.4078); // Yellow
-    cairo_arc(
-        cr, PADDING / 2 + 45, PADDING / 2 + HEADER_HEIGHT / 2, 7, 0, 2 * M_PI);
-    cairo_fill(cr);
-
-    cairo_set_source_rgb(cr, 0.6196, 0.8078, 0.4157); // Green
-    cairo_arc(
-        cr, PADDING / 2 + 70, PADDING / 2 + HEADER_HEIGHT / 2, 7, 0, 2 * M_PI);
-    cairo_fill(cr);
 
-    // Draw the custom title if provided
-    draw_window_title(cr, title, img_width, title_size);
-
-    layout = pango_cairo_create_layout(cr);
-    font_desc = pango_font_description_from_string(FONT);
-    pango_layout_set_font_description(layout, font_desc);
-    pango_layout_set_markup(layout, highlighted_text, -1);
-
-    cairo_set_source_rgb(cr, 0.6627, 0.6941, 0.8392); // Text color
-    cairo_move_to(cr, PADDING, PADDING / 2 + HEADER_HEIGHT + (PADDING / 2));
-    pango_cairo_show_layout(cr, layout);
-
-    cairo_status_t status =
-        cairo_surface_write_to_png(surface, output_filename);
-    if (status != CAIRO_STATUS_SUCCESS) {
+    int exit_code;
+    gboolean line_cache = job.line_cache_mb > 0 || job.line_cache_dir;
+    if (job.watch && (job.serve_socket || job.batch_filename ||
+                      job.more_pairs || job.cache_dir || line_cache)) {
         fprintf(stderr,
-                "Could not save PNG file: %s\n",
-                cairo_status_to_string(status));
+                "Error: -watch takes a single input, without -serve, -batch, "
+                "-cache or -line-cache.\n");
+        exit_code = 1;
+    } else if (job.cache_dir &&
+               !output_cache_open(job.cache_dir,
+                                  (gint64)job.cache_size_mb * 1024 * 1024,
+                                  job.cache_links)) {
+        exit_code = 1;
+    } else if (line_cache &&
+               !line_cache_open((gint64)(job.line_cache_mb > 0
+                                             ? job.line_cache_mb
+                                             : JOB_DEFAULT_LINE_CACHE_MB) *
+                                    1024 * 1024,
+                                job.line_cache_dir)) {
+        exit_code = 1;
+    } else if (job.serve_socket) {
+        // Requests give their own inputs and outputs.
+        if (job.batch_filename || job.input_filename || job.output_filename ||
+            job.outputs->len) {
+            fprintf(stderr,
+                    "Error: with -serve, inputs and outputs are given in "
+                    "each request.\n");
+            exit_code = 1;
+        } else {
+            exit_code = run_server(&job);
+        }
+    } else if (job.batch_filename) {
+        // The command line only holds options shared by every item.
+        if (job.input_filename || job.output_filename || job.outputs->len) {
+            fprintf(stderr,
+                    "Error: with -batch, inputs and outputs are given in "
+                    "the manifest.\n");
+            exit_code = 1;
+        } else {
+            exit_code = run_batch(&job);
+        }
+    } else if (job.more_pairs) {
+        if (job.more_pairs->len % 2 != 0 || job.input_from_git ||
+            job.outputs->len) {
+            fprintf(stderr,
+                    "Error: several inputs must be given as <input_file> "
+                    "<output> pairs, without -git, -o or -fd (use -batch "
+                    "for those).\n");
+            exit_code = 1;
+        } else {
+            exit_code = run_batch(&job);
+        }
+    } else if (!job_finish_args(&job)) {
+        exit_code = 1;
+    } else if (!job_is_complete(&job)) {
+        print_usage();
+        exit_code = 1;
+    } else {
+        exit_code = job.watch ? run_watch(&job) : job_run(&job);
     }
 
-    g_free(code_content);
-    g_free(highlighted_text);
-    g_object_unref(layout);
-    pango_font_description_free(font_desc);
-    cairo_destroy(cr);
-    cairo_surface_destroy(surface);
-
-    // Free syntax tables once at the end.
-    if (lang == LANG_C)
-        free_syntax_tables_c();
-    else if (lang == LANG_PYTHON)
-        free_syntax_tables_python();
-    else if (lang == LANG_GO)
-        free_syntax_tables_go();
-
-    printf("Screenshot saved to %s\n", output_filename);
-
-    return 0;
+    output_cache_close(job.cache_stats);
+    line_cache_close(job.cache_stats);
+    job_clear(&job);
+    git_input_shutdown();
+    render_shutdown();
+    free_syntax_tables();
+    return exit_code;
 }
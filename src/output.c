@@ -0,0 +1,739 @@
+#include "output.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output_stream.h"
+#include "qoi_writer.h"
+#include "raw_writer.h"
+#include "text_output.h"
+#include "tiled_render.h"
+#include "vector_output.h"
+#include "webp_writer.h"
+
+// Names accepted by -format and the format= output key, indexed by
+// OutputFormat. Each is also the file extension that selects the format.
+static const char *format_names[] = {
+    "auto", "png", "qoi", "webp", "svg", "pdf", "raw", "ansi", "html", NULL};
+
+struct PendingOutput {
+    cairo_surface_t *surface; // The image, or NULL if it is kept in bands
+    cairo_surface_t **bands;  // The bands of a tiled image, top to bottom
+    int n_bands;
+    const OutputSpec *spec;
+    OutputFormat format;
+    const PngSettings *png_settings;
+};
+
+/**
+ * @brief Opens the file, descriptor or memory an output is written to.
+ * @return The stream, or NULL on failure (an error is printed).
+ */
+OutputStream *output_spec_open_stream(const OutputSpec *spec) {
+    if (spec->buffer)
+        return output_stream_open_buffer(spec->buffer, spec->filename);
+    if (spec->shared)
+        return output_stream_open_shared(spec->shared, spec->filename);
+    if (spec->fd >= 0)
+        return output_stream_open_fd(spec->fd);
+    OutputStream *stream = output_stream_open(spec->filename);
+    if (stream && spec->cache_copy) {
+        g_string_truncate(spec->cache_copy, 0);
+        output_stream_copy_to(stream, spec->cache_copy);
+    }
+    return stream;
+}
+
+/**
+ * @brief Parses an output format name (auto, png, qoi, webp, svg, pdf,
+ *        raw, ansi, html).
+ * @return TRUE if the name is known, FALSE otherwise.
+ */
+gboolean output_format_from_string(const char *name, OutputFormat *format) {
+    for (int i = 0; format_names[i] != NULL; i++) {
+        if (strcmp(name, format_names[i]) == 0) {
+            *format = (OutputFormat)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Picks the output format from a file name's extension, e.g. ".qoi"
+ *        selects QOI. Unknown extensions are written as PNG.
+ */
+OutputFormat output_format_from_filename(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    const char *slash = strrchr(filename, '/');
+    if (!dot || (slash && dot < slash))
+        return OUTPUT_FORMAT_PNG;
+
+    for (int i = OUTPUT_FORMAT_PNG; format_names[i] != NULL; i++) {
+        if (g_ascii_strcasecmp(dot + 1, format_names[i]) == 0)
+            return (OutputFormat)i;
+    }
+    return OUTPUT_FORMAT_PNG;
+}
+
+/**
+ * @brief Resolves the format an output is written in: its own format, or
+ *        else the one its file name's extension selects.
+ */
+OutputFormat output_spec_format(const OutputSpec *spec) {
+    return spec->format != OUTPUT_FORMAT_AUTO
+               ? spec->format
+               : output_format_from_filename(spec->filename);
+}
+
+/**
+ * @brief Tells whether a format is drawn from the shaped layout. ANSI and
+ *        HTML text are produced from the highlighter's markup alone.
+ */
+gboolean output_format_needs_layout(OutputFormat format) {
+    return format != OUTPUT_FORMAT_ANSI && format != OUTPUT_FORMAT_HTML;
+}
+
+static const char *const output_keys[] = {
+    "scale", "width", "band-height", "pages", "format", "fps", NULL};
+
+/**
+ * @brief Tells whether text starts with one of the output keys and '='.
+ */
+static gboolean is_output_option(const char *text) {
+    for (int i = 0; output_keys[i] != NULL; i++) {
+        size_t length = strlen(output_keys[i]);
+        if (strncmp(text, output_keys[i], length) == 0 && text[length] == '=')
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Finds where the options of an output argument start: the first
+ *        ':' after which every ':'-separated part is a known key=value.
+ * @return The ':', or NULL if the whole argument is the path.
+ */
+static const char *find_output_options(const char *arg) {
+    for (const char *colon = strchr(arg, ':'); colon != NULL;
+         colon = strchr(colon + 1, ':')) {
+        const char *part = colon;
+        while (part != NULL && is_output_option(part + 1))
+            part = strchr(part + 1, ':');
+        if (part == NULL)
+            return colon;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Parses a positive number, rejecting anything after it.
+ */
+static gboolean parse_positive_int(const char *value, int *result) {
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || number <= 0 || number > G_MAXINT)
+        return FALSE;
+    *result = (int)number;
+    return TRUE;
+}
+
+/**
+ * @brief Sets up an output written to path as is. A path of "-" writes to
+ *        stdout.
+ * @param spec Receives the output; free it with output_spec_clear.
+ */
+void output_spec_init(OutputSpec *spec, const char *path) {
+    memset(spec, 0, sizeof(*spec));
+    spec->filename = g_strdup(path);
+    spec->fd = strcmp(spec->filename, "-") == 0 ? STDOUT_FILENO : -1;
+}
+
+/**
+ * @brief Parses an output argument of the form "path[:key=value]...".
+ *        Recognized keys are scale, width, band-height, pages, format and
+ *        fps. Only a suffix made of recognized keys is split off, so a path
+ *        that contains ':' is kept whole.
+ *        A path of "-" writes to stdout.
+ * @param arg The argument given to -o.
+ * @param spec Receives the parsed output; free it with output_spec_clear.
+ * @return TRUE on success, FALSE on a malformed argument (an error is
+ * printed).
+ */
+gboolean output_spec_parse(const char *arg, OutputSpec *spec) {
+    const char *options = find_output_options(arg);
+    char *path = options ? g_strndup(arg, options - arg) : g_strdup(arg);
+    if (path[0] == '\0') {
+        fprintf(stderr, "Output '%s' has no file name.\n", arg);
+        g_free(path);
+        memset(spec, 0, sizeof(*spec));
+        return FALSE;
+    }
+    output_spec_init(spec, path);
+    g_free(path);
+    if (!options)
+        return TRUE;
+
+    char **parts = g_strsplit(options + 1, ":", -1);
+    gboolean ok = TRUE;
+    for (int i = 0; ok && parts[i] != NULL; i++) {
+        char *eq = strchr(parts[i], '=');
+        *eq = '\0';
+        const char *key = parts[i];
+        const char *value = eq + 1;
+
+        if (strcmp(key, "scale") == 0) {
+            char *end;
+            spec->scale = strtod(value, &end);
+            ok = end != value && *end == '\0' && spec->scale > 0;
+        } else if (strcmp(key, "width") == 0) {
+            ok = parse_positive_int(value, &spec->width);
+        } else if (strcmp(key, "band-height") == 0) {
+            ok = parse_positive_int(value, &spec->band_height);
+        } else if (strcmp(key, "pages") == 0) {
+            ok = parse_positive_int(value, &spec->page_lines);
+        } else if (strcmp(key, "fps") == 0) {
+            ok = parse_positive_int(value, &spec->animation.fps) &&
+                 spec->animation.fps <= ANIMATION_MAX_FPS;
+        } else if (!output_format_from_string(value, &spec->format)) {
+            fprintf(stderr,
+                    "Output format must be auto, png, qoi, webp, svg, "
+                    "pdf, raw, ansi or html.\n");
+            ok = FALSE;
+            break;
+        }
+        if (!ok)
+            fprintf(
+                stderr, "Output option '%s' needs a positive number.\n", key);
+    }
+    g_strfreev(parts);
+    if (!ok)
+        output_spec_clear(spec);
+    return ok;
+}
+
+/**
+ * @brief Frees the memory owned by an output spec.
+ */
+void output_spec_clear(OutputSpec *spec) {
+    g_free(spec->filename);
+    spec->filename = NULL;
+    if (spec->buffer)
+        g_string_free(spec->buffer, TRUE);
+    spec->buffer = NULL;
+    shared_buffer_free(spec->shared);
+    spec->shared = NULL;
+    if (spec->cache_copy)
+        g_string_free(spec->cache_copy, TRUE);
+    spec->cache_copy = NULL;
+}
+
+/**
+ * @brief Draws a raw image straight into a shared mapping of fd, such as a
+ *        memfd the caller will mmap, so the pixels are never copied.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+static gboolean write_raw_mapped(const CodeLayout *code_layout,
+                                 const RenderOptions *opts,
+                                 int fd) {
+    cairo_surface_t *surface =
+        raw_surface_map_fd(fd,
+                           (int)ceil(code_layout->width * opts->scale),
+                           (int)ceil(code_layout->height * opts->scale));
+    if (!surface)
+        return FALSE;
+    render_into_image_surface(surface, code_layout, opts);
+    cairo_surface_destroy(surface);
+    return TRUE;
+}
+
+/**
+ * @brief Prints the sizes an indexed-color PNG was compared at, for
+ *        -verbose: what -optimize-size cost and what it saved.
+ */
+static void report_palette(const char *name, const PngPaletteStats *stats) {
+    static const char *const filters[] = {
+        "none", "sub", "up", "average", "paeth", "adaptive"};
+    GString *sizes = g_string_new(NULL);
+    for (int i = 0; i <= PNG_FILTER_ADAPTIVE; i++)
+        g_string_append_printf(sizes,
+                               "%s%s %zu",
+                               i > 0 ? ", " : "",
+                               filters[i],
+                               stats->sizes[i]);
+    fprintf(stderr,
+            "%s: %d colors, kept %s filter at %zu bytes of image data "
+            "(%s) after %.1f ms.\n",
+            name,
+            stats->n_colors,
+            filters[stats->chosen],
+            stats->sizes[stats->chosen],
+            sizes->str,
+            stats->microseconds / 1000.0);
+    g_string_free(sizes, TRUE);
+}
+
+/**
+ * @brief Encodes a rendered image in a raster format and passes the bytes
+ *        to stream.
+ * @param name The output's name, for messages.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+static gboolean encode_surface(cairo_surface_t *surface,
+                               OutputFormat format,
+                               const PngSettings *png_settings,
+                               OutputStream *stream,
+                               const char *name) {
+    gboolean ok = TRUE;
+    if (format == OUTPUT_FORMAT_QOI) {
+        ok = write_qoi_stream(surface, output_stream_write, stream);
+    } else if (format == OUTPUT_FORMAT_WEBP) {
+        ok = write_webp_stream(surface, output_stream_write, stream);
+    } else if (format == OUTPUT_FORMAT_RAW) {
+        ok = write_raw_stream(surface, output_stream_write, stream);
+    } else if (png_settings) {
+        PngPaletteStats stats;
+        ok = write_png_stream(
+            surface, output_stream_write, stream, png_settings, &stats);
+        if (ok && png_settings->verbose && stats.n_colors > 0)
+            report_palette(name, &stats);
+    } else {
+        cairo_status_t status = cairo_surface_write_to_png_stream(
+            surface, output_stream_write, stream);
+        if (status != CAIRO_STATUS_SUCCESS) {
+            fprintf(stderr,
+                    "Could not save PNG file: %s\n",
+                    cairo_status_to_string(status));
+            ok = FALSE;
+        }
+    }
+    return ok;
+}
+
+/**
+ * @brief Renders one output in the given format and passes the encoded
+ *        bytes to stream.
+ * @return The number of pages written (1 except for PDF), or -1 on failure.
+ */
+static int write_stream(const CodeLayout *code_layout,
+                        const char *highlighted_text,
+                        const RenderOptions *opts,
+                        const OutputSpec *spec,
+                        OutputFormat format,
+                        const PngSettings *png_settings,
+                        OutputStream *stream) {
+    // Vector output is drawn in logical units, so the scale does not apply
+    // and nothing is ever rasterized in bands.
+    if (format == OUTPUT_FORMAT_PDF)
+        return render_pdf_stream(code_layout,
+                                 opts,
+                                 output_stream_write,
+                                 stream,
+                                 spec->page_lines);
+    if (format == OUTPUT_FORMAT_SVG)
+        return render_svg_stream(
+                   code_layout, opts, output_stream_write, stream)
+                   ? 1
+                   : -1;
+
+    if (spec->animation.fps > 0) {
+        PngSettings default_png_settings;
+        png_settings_init(&default_png_settings);
+        return render_typing_animation(code_layout,
+                                       opts,
+                                       &spec->animation,
+                                       output_stream_write,
+                                       stream,
+                                       png_settings ? png_settings
+                                                    : &default_png_settings)
+                   ? 1
+                   : -1;
+    }
+
+    if (format != OUTPUT_FORMAT_WEBP &&
+        (spec->band_height > 0 || render_needs_tiling(code_layout, opts))) {
+        // Too large for one surface (or asked for): stream it in bands,
+        // which always needs one of the row-oriented encoders.
+        PngSettings default_png_settings;
+        png_settings_init(&default_png_settings);
+        TextRange range = {0, code_layout->text_height};
+        int band_height =
+            spec->band_height > 0 ? spec->band_height : DEFAULT_BAND_HEIGHT;
+        if (spec->share_bands)
+            return render_shared_tiled_image(code_layout,
+                                             highlighted_text,
+                                             opts,
+                                             &range,
+                                             output_stream_write,
+                                             stream,
+                                             band_height,
+                                             format,
+                                             png_settings
+                                                 ? png_settings
+                                                 : &default_png_settings)
+                       ? 1
+                       : -1;
+        return render_tiled_image(
+                   code_layout,
+                   opts,
+                   &range,
+                   output_stream_write,
+                   stream,
+                   band_height,
+                   format,
+                   png_settings ? png_settings : &default_png_settings)
+                   ? 1
+                   : -1;
+    }
+
+    cairo_surface_t *surface = render_to_image_surface(code_layout, opts);
+    if (!surface)
+        return -1;
+    gboolean ok =
+        encode_surface(surface, format, png_settings, stream, spec->filename);
+    cairo_surface_destroy(surface);
+    return ok ? 1 : -1;
+}
+
+/**
+ * @brief Rasterizes the shared layout for one output and saves it. Only the
+ *        device scale differs between outputs, so the same shaped layout
+ *        serves full-size, HiDPI and thumbnail images alike. Encoders write
+ *        through an OutputStream, so a file, stdout and an inherited file
+ *        descriptor are all handled the same way.
+ * @param code_layout The shaped code text; may be NULL for text formats.
+ * @param highlighted_text The markup the layout was shaped from.
+ * @param opts The rendering options; opts->scale is the default scale.
+ * @param spec The output to produce.
+ * @param png_settings Settings for the built-in PNG writer, or NULL to save
+ * with cairo_surface_write_to_png_stream where possible. Ignored for other
+ * formats.
+ * @return The number of files written (pages count separately, also within
+ * a PDF), or -1 on failure.
+ */
+int write_output(const CodeLayout *code_layout,
+                 const char *highlighted_text,
+                 const RenderOptions *opts,
+                 const OutputSpec *spec,
+                 const PngSettings *png_settings) {
+    return write_output_deferred(
+        code_layout, highlighted_text, opts, spec, png_settings, NULL);
+}
+
+/**
+ * @brief Returns the device scale an output is rasterized at: its own, one
+ *        fitting its width, or the default.
+ */
+static double output_scale(const CodeLayout *code_layout,
+                           const RenderOptions *opts,
+                           const OutputSpec *spec) {
+    if (spec->scale > 0)
+        return spec->scale;
+    if (spec->width > 0)
+        return spec->width / code_layout->width;
+    return opts->scale;
+}
+
+/**
+ * @brief Returns the pixels of the image a raster output of the layout
+ *        makes, all of its pages or bands together, before any of it is
+ *        drawn; 0 for vector and text outputs.
+ */
+gint64 output_spec_pixels(const CodeLayout *code_layout,
+                          const RenderOptions *opts,
+                          const OutputSpec *spec) {
+    OutputFormat format = output_spec_format(spec);
+    if (!output_format_needs_layout(format) || format == OUTPUT_FORMAT_SVG ||
+        format == OUTPUT_FORMAT_PDF)
+        return 0;
+    double scale = output_scale(code_layout, opts, spec);
+    return (gint64)ceil(code_layout->width * scale) *
+           (gint64)ceil(code_layout->height * scale);
+}
+
+/**
+ * @brief Does write_output_deferred, also keeping tiled images as bands if
+ *        keep_bands is set.
+ */
+static int write_output_pending(const CodeLayout *code_layout,
+                                const char *highlighted_text,
+                                const RenderOptions *opts,
+                                const OutputSpec *spec,
+                                const PngSettings *png_settings,
+                                PendingOutput **pending,
+                                gboolean keep_bands) {
+    if (pending)
+        *pending = NULL;
+    OutputFormat format = output_spec_format(spec);
+    if (!output_format_needs_layout(format)) {
+        if (spec->animation.fps > 0 || spec->page_lines > 0) {
+            fprintf(stderr,
+                    "%s: text output cannot be animated or split into "
+                    "pages.\n",
+                    spec->filename);
+            return -1;
+        }
+        OutputStream *stream = output_spec_open_stream(spec);
+        if (!stream)
+            return -1;
+        gboolean ok = format == OUTPUT_FORMAT_ANSI
+                          ? write_ansi_stream(
+                                highlighted_text, output_stream_write, stream)
+                          : write_html_stream(highlighted_text,
+                                              opts->title,
+                                              output_stream_write,
+                                              stream);
+        ok = output_stream_close(stream) && ok;
+        return ok ? 1 : -1;
+    }
+
+    RenderOptions output_opts = *opts;
+    output_opts.scale = output_scale(code_layout, opts, spec);
+    if (format == OUTPUT_FORMAT_SVG && spec->page_lines > 0) {
+        fprintf(stderr,
+                "%s: SVG output cannot be split into pages; use PDF.\n",
+                spec->filename);
+        return -1;
+    }
+    if (format == OUTPUT_FORMAT_WEBP &&
+        (spec->band_height > 0 || spec->page_lines > 0)) {
+        fprintf(stderr,
+                "%s: WebP output cannot be written in bands or pages.\n",
+                spec->filename);
+        return -1;
+    }
+
+    if (spec->animation.fps > 0) {
+        if (format != OUTPUT_FORMAT_PNG) {
+            fprintf(stderr,
+                    "%s: typing animations are written as animated PNG.\n",
+                    spec->filename);
+            return -1;
+        }
+        if (spec->band_height > 0 || spec->page_lines > 0 ||
+            render_needs_tiling(code_layout, &output_opts)) {
+            fprintf(stderr,
+                    "%s: typing animations cannot be written in bands or "
+                    "pages.\n",
+                    spec->filename);
+            return -1;
+        }
+    }
+
+    // Only a single image is quantized: bands, pages and animation frames
+    // go through the row-oriented encoders.
+    if (format == OUTPUT_FORMAT_PNG && png_settings &&
+        png_settings->optimize_size &&
+        (spec->animation.fps > 0 || spec->page_lines > 0 ||
+         spec->band_height > 0 ||
+         render_needs_tiling(code_layout, &output_opts)))
+        fprintf(stderr,
+                "Warning: %s is written in bands, pages or frames, so "
+                "-optimize-size does not apply to it.\n",
+                spec->filename);
+
+    // Raster pages are written to numbered files of their own.
+    if (spec->page_lines > 0 && format != OUTPUT_FORMAT_PDF) {
+        if (spec->fd >= 0) {
+            fprintf(stderr,
+                    "%s: pages need a file name to be numbered; use PDF to "
+                    "stream several pages.\n",
+                    spec->filename);
+            return -1;
+        }
+        PngSettings default_png_settings;
+        png_settings_init(&default_png_settings);
+        return render_paged_image(
+            code_layout,
+            &output_opts,
+            spec->filename,
+            spec->page_lines,
+            spec->band_height > 0 ? spec->band_height : DEFAULT_BAND_HEIGHT,
+            format,
+            png_settings ? png_settings : &default_png_settings);
+    }
+
+    if (format == OUTPUT_FORMAT_RAW && spec->fd >= 0 &&
+        spec->band_height == 0 &&
+        !render_needs_tiling(code_layout, &output_opts) &&
+        raw_fd_is_mappable(spec->fd))
+        return write_raw_mapped(code_layout, &output_opts, spec->fd) ? 1 : -1;
+
+    // A single image can be encoded later, from the pixels alone, while the
+    // caller goes on with the next layout.
+    gboolean single = pending && spec->animation.fps == 0 &&
+                      (format == OUTPUT_FORMAT_PNG ||
+                       format == OUTPUT_FORMAT_QOI ||
+                       format == OUTPUT_FORMAT_RAW ||
+                       format == OUTPUT_FORMAT_WEBP);
+    gboolean tiled = format != OUTPUT_FORMAT_WEBP &&
+                     (spec->band_height > 0 ||
+                      render_needs_tiling(code_layout, &output_opts));
+    if (single && (!tiled || keep_bands)) {
+        cairo_surface_t *surface = NULL;
+        cairo_surface_t **bands = NULL;
+        int n_bands = 0;
+        if (tiled) {
+            TextRange range = {0, code_layout->text_height};
+            bands = render_tiled_bands(code_layout,
+                                       &output_opts,
+                                       &range,
+                                       spec->band_height > 0
+                                           ? spec->band_height
+                                           : DEFAULT_BAND_HEIGHT,
+                                       &n_bands);
+            if (!bands)
+                return -1;
+        } else {
+            surface = render_to_image_surface(code_layout, &output_opts);
+            if (!surface)
+                return -1;
+        }
+        *pending = g_new0(PendingOutput, 1);
+        (*pending)->surface = surface;
+        (*pending)->bands = bands;
+        (*pending)->n_bands = n_bands;
+        (*pending)->spec = spec;
+        (*pending)->format = format;
+        (*pending)->png_settings = png_settings;
+        return 1;
+    }
+
+    OutputStream *stream = output_spec_open_stream(spec);
+    if (!stream)
+        return -1;
+    int n_files = write_stream(code_layout,
+                               highlighted_text,
+                               &output_opts,
+                               spec,
+                               format,
+                               png_settings,
+                               stream);
+    if (!output_stream_close(stream))
+        n_files = -1;
+    return n_files;
+}
+
+/**
+ * @brief Like write_output, but a single raster image is only rendered: it
+ *        is returned in *pending, to be encoded and saved with
+ *        pending_output_finish, possibly on another thread. The layout is
+ *        no longer needed by then. Other outputs, including images drawn in
+ *        bands, are written at once and *pending is set to NULL.
+ * @return As write_output; a pending output counts as one file.
+ */
+int write_output_deferred(const CodeLayout *code_layout,
+                          const char *highlighted_text,
+                          const RenderOptions *opts,
+                          const OutputSpec *spec,
+                          const PngSettings *png_settings,
+                          PendingOutput **pending) {
+    return write_output_pending(code_layout,
+                                highlighted_text,
+                                opts,
+                                spec,
+                                png_settings,
+                                pending,
+                                FALSE);
+}
+
+/**
+ * @brief Like write_output_deferred, but an image too large for one
+ *        surface (or given a band height) is returned as well, its bands
+ *        all kept in memory, for a caller that draws on the pixels and
+ *        saves them again (-watch).
+ * @return As write_output_deferred.
+ */
+int write_output_kept(const CodeLayout *code_layout,
+                      const char *highlighted_text,
+                      const RenderOptions *opts,
+                      const OutputSpec *spec,
+                      const PngSettings *png_settings,
+                      PendingOutput **pending) {
+    return write_output_pending(code_layout,
+                                highlighted_text,
+                                opts,
+                                spec,
+                                png_settings,
+                                pending,
+                                TRUE);
+}
+
+/**
+ * @brief Encodes and saves an output rendered by write_output_deferred,
+ *        keeping the image, so that it can be drawn on and saved again.
+ * @return 1 on success, -1 on failure (an error is printed).
+ */
+int pending_output_write(const PendingOutput *pending) {
+    OutputStream *stream = output_spec_open_stream(pending->spec);
+    if (!stream)
+        return -1;
+    gboolean ok;
+    if (pending->bands) {
+        // Bands always go through the row-oriented encoders.
+        PngSettings default_png_settings;
+        png_settings_init(&default_png_settings);
+        ok = encode_tiled_bands(pending->bands,
+                                pending->n_bands,
+                                output_stream_write,
+                                stream,
+                                pending->format,
+                                pending->png_settings
+                                    ? pending->png_settings
+                                    : &default_png_settings);
+    } else {
+        ok = encode_surface(pending->surface,
+                            pending->format,
+                            pending->png_settings,
+                            stream,
+                            pending->spec->filename);
+    }
+    ok = output_stream_close(stream) && ok;
+    return ok ? 1 : -1;
+}
+
+/**
+ * @brief Returns the image of a pending output: a single surface, or the
+ *        bands of a tiled image from top to bottom. Each carries the device
+ *        scale it was rendered at, and a band the device offset of its
+ *        first row, so all are drawn on in the coordinates of the whole
+ *        image.
+ * @param n_surfaces Receives the number of surfaces.
+ */
+cairo_surface_t *const *pending_output_surfaces(const PendingOutput *pending,
+                                               int *n_surfaces) {
+    if (pending->bands) {
+        *n_surfaces = pending->n_bands;
+        return pending->bands;
+    }
+    *n_surfaces = 1;
+    return &pending->surface;
+}
+
+/**
+ * @brief Encodes and saves an output rendered by write_output_deferred, and
+ *        frees it. The spec and PNG settings it was rendered with must still
+ *        be valid.
+ * @return 1 on success, -1 on failure (an error is printed).
+ */
+int pending_output_finish(PendingOutput *pending) {
+    int n_files = pending_output_write(pending);
+    pending_output_free(pending);
+    return n_files;
+}
+
+/**
+ * @brief Frees a pending output without encoding it, when its job stops
+ *        before the image is saved.
+ */
+void pending_output_free(PendingOutput *pending) {
+    if (!pending)
+        return;
+    if (pending->surface)
+        cairo_surface_destroy(pending->surface);
+    tiled_bands_free(pending->bands, pending->n_bands);
+    g_free(pending);
+}
@@ -0,0 +1,87 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <glib.h>
+
+#include "animation.h"
+#include "output_stream.h"
+#include "png_writer.h"
+#include "render.h"
+#include "shared_buffer.h"
+
+// File formats an output can be written in. AUTO picks one from the file
+// name's extension, falling back to PNG.
+typedef enum {
+    OUTPUT_FORMAT_AUTO,
+    OUTPUT_FORMAT_PNG,
+    OUTPUT_FORMAT_QOI,
+    OUTPUT_FORMAT_WEBP,
+    OUTPUT_FORMAT_SVG,
+    OUTPUT_FORMAT_PDF,
+    OUTPUT_FORMAT_RAW,
+    OUTPUT_FORMAT_ANSI,
+    OUTPUT_FORMAT_HTML
+} OutputFormat;
+
+// One image to produce from the shared layout, parsed from an output
+// argument such as "out@2x.png:scale=2" or "thumb.png:width=320". The file
+// name "-" stands for stdout.
+typedef struct {
+    char *filename;
+    double scale;    // Device scale; 0 means use width or the -scale default
+    int width;       // Target width in pixels; 0 means unset
+    int band_height; // 0 means only tile images that need it
+    int page_lines;  // 0 means write a single image
+    OutputFormat format;
+    int fd; // Descriptor to write to instead of filename, or -1
+    AnimationSettings animation; // A typing animation (APNG) if fps > 0
+    GString *buffer; // If set, the bytes are collected here, not written
+    SharedBuffer *shared; // Likewise, in shared memory
+    GString *cache_copy;  // If set, also receives the bytes written to the
+                          // file, for the output cache
+    gboolean share_bands; // Idle batch threads may draw bands of it
+} OutputSpec;
+
+gboolean output_format_from_string(const char *name, OutputFormat *format);
+OutputFormat output_format_from_filename(const char *filename);
+OutputFormat output_spec_format(const OutputSpec *spec);
+gboolean output_format_needs_layout(OutputFormat format);
+
+void output_spec_init(OutputSpec *spec, const char *path);
+gboolean output_spec_parse(const char *arg, OutputSpec *spec);
+void output_spec_clear(OutputSpec *spec);
+OutputStream *output_spec_open_stream(const OutputSpec *spec);
+gint64 output_spec_pixels(const CodeLayout *code_layout,
+                          const RenderOptions *opts,
+                          const OutputSpec *spec);
+
+int write_output(const CodeLayout *code_layout,
+                 const char *highlighted_text,
+                 const RenderOptions *opts,
+                 const OutputSpec *spec,
+                 const PngSettings *png_settings);
+
+// A raster image rendered but not yet encoded, so that encoding can run on
+// another thread than the layout, which is tied to the thread it was made
+// on.
+typedef struct PendingOutput PendingOutput;
+
+int write_output_deferred(const CodeLayout *code_layout,
+                          const char *highlighted_text,
+                          const RenderOptions *opts,
+                          const OutputSpec *spec,
+                          const PngSettings *png_settings,
+                          PendingOutput **pending);
+int write_output_kept(const CodeLayout *code_layout,
+                      const char *highlighted_text,
+                      const RenderOptions *opts,
+                      const OutputSpec *spec,
+                      const PngSettings *png_settings,
+                      PendingOutput **pending);
+int pending_output_write(const PendingOutput *pending);
+cairo_surface_t *const *pending_output_surfaces(const PendingOutput *pending,
+                                               int *n_surfaces);
+int pending_output_finish(PendingOutput *pending);
+void pending_output_free(PendingOutput *pending);
+
+#endif // OUTPUT_H
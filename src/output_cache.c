@@ -0,0 +1,486 @@
+// link, utimensat, fstatat and the dirent calls are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include "output_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cairo.h>
+#include <pango/pango.h>
+
+#include "line_cache.h"
+#include "output_stream.h"
+
+// Bump when a change to the renderer or an encoder changes the bytes of
+// any output, so that entries made by older versions are never hit.
+#define OUTPUT_CACHE_VERSION 1
+
+// Eviction removes entries until the cache is this fraction of its limit,
+// so that it does not run again on the very next store.
+#define OUTPUT_CACHE_LOW_WATER 0.9
+
+// Temporary files are named with this prefix, and skipped when counting
+// and evicting entries.
+#define OUTPUT_CACHE_TMP_PREFIX ".tmp-"
+
+// One entry found while scanning the cache directory.
+typedef struct {
+    char *name;
+    gint64 size;
+    gint64 mtime; // Updated on every hit, so the oldest is the least used
+} CacheEntry;
+
+// The cache of the process. total_bytes counts what this process has seen;
+// other processes sharing the directory are accounted for by the scan that
+// eviction starts with.
+static struct {
+    char *dir;
+    gint64 max_bytes;
+    gboolean hard_links; // File outputs share the entry's inode
+    gint64 total_bytes;
+    int hits;
+    int misses;
+    int stores;
+    int evictions;
+} cache;
+static GMutex cache_mutex;
+static gint next_tmp_id;
+
+/**
+ * @brief Lists the entries of the cache directory, leaving out temporary
+ *        files.
+ * @return The entries (CacheEntry), or NULL if the directory cannot be
+ *         read.
+ */
+static GArray *scan_entries(void) {
+    DIR *dir = opendir(cache.dir);
+    if (!dir)
+        return NULL;
+    GArray *entries = g_array_new(FALSE, FALSE, sizeof(CacheEntry));
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+        struct stat st;
+        if (dirent->d_name[0] == '.' ||
+            fstatat(dirfd(dir), dirent->d_name, &st, 0) != 0 ||
+            !S_ISREG(st.st_mode))
+            continue;
+        CacheEntry entry = {
+            g_strdup(dirent->d_name), st.st_size, st.st_mtime};
+        g_array_append_val(entries, entry);
+    }
+    closedir(dir);
+    return entries;
+}
+
+static void free_entries(GArray *entries) {
+    for (guint i = 0; i < entries->len; i++)
+        g_free(g_array_index(entries, CacheEntry, i).name);
+    g_array_free(entries, TRUE);
+}
+
+static int compare_entries_by_age(const void *a, const void *b) {
+    const CacheEntry *entry_a = a;
+    const CacheEntry *entry_b = b;
+    if (entry_a->mtime != entry_b->mtime)
+        return entry_a->mtime < entry_b->mtime ? -1 : 1;
+    return strcmp(entry_a->name, entry_b->name);
+}
+
+/**
+ * @brief Removes the least recently used entries until the cache is back
+ *        under its low-water mark. Called with cache_mutex held.
+ */
+static void evict_entries(void) {
+    GArray *entries = scan_entries();
+    if (!entries)
+        return;
+    g_array_sort(entries, compare_entries_by_age);
+    gint64 total = 0;
+    for (guint i = 0; i < entries->len; i++)
+        total += g_array_index(entries, CacheEntry, i).size;
+
+    gint64 target = (gint64)(cache.max_bytes * OUTPUT_CACHE_LOW_WATER);
+    for (guint i = 0; i < entries->len && total > target; i++) {
+        CacheEntry *entry = &g_array_index(entries, CacheEntry, i);
+        char *path = g_build_filename(cache.dir, entry->name, NULL);
+        // Another process may have evicted it first.
+        if (unlink(path) == 0 || errno == ENOENT) {
+            total -= entry->size;
+            cache.evictions++;
+        }
+        g_free(path);
+    }
+    cache.total_bytes = total;
+    free_entries(entries);
+}
+
+/**
+ * @brief Opens (creating it if needed) the cache directory for the rest of
+ *        the process.
+ * @param max_bytes Size the entries may take before the least recently
+ *        used are evicted.
+ * @param hard_links Hard link entries and file outputs both ways instead
+ *        of copying them. The caller must then not rewrite those outputs
+ *        in place (this process replaces them instead, see
+ *        output_cache_prepare), or the entries change with them.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean output_cache_open(const char *dir,
+                           gint64 max_bytes,
+                           gboolean hard_links) {
+    if (g_mkdir_with_parents(dir, 0777) != 0) {
+        fprintf(stderr,
+                "Error: could not create cache directory %s: %s\n",
+                dir,
+                strerror(errno));
+        return FALSE;
+    }
+    cache.dir = g_strdup(dir);
+    cache.max_bytes = max_bytes;
+    cache.hard_links = hard_links;
+    GArray *entries = scan_entries();
+    if (!entries) {
+        fprintf(stderr,
+                "Error: could not read cache directory %s: %s\n",
+                dir,
+                strerror(errno));
+        g_free(cache.dir);
+        cache.dir = NULL;
+        return FALSE;
+    }
+    for (guint i = 0; i < entries->len; i++)
+        cache.total_bytes += g_array_index(entries, CacheEntry, i).size;
+    free_entries(entries);
+    if (cache.total_bytes > cache.max_bytes)
+        evict_entries();
+    return TRUE;
+}
+
+gboolean output_cache_enabled(void) {
+    return cache.dir != NULL;
+}
+
+static void hash_int(GChecksum *checksum, gint64 value) {
+    g_checksum_update(checksum, (const guchar *)&value, sizeof(value));
+}
+
+static void hash_double(GChecksum *checksum, double value) {
+    g_checksum_update(checksum, (const guchar *)&value, sizeof(value));
+}
+
+static void hash_string(GChecksum *checksum, const char *value) {
+    // The length keeps "ab" + "c" apart from "a" + "bc"; NULL hashes
+    // apart from "".
+    hash_int(checksum, value ? (gint64)strlen(value) : -1);
+    if (value)
+        g_checksum_update(checksum, (const guchar *)value, strlen(value));
+}
+
+/**
+ * @brief Computes the cache key of an output: a hash of the input text and
+ *        of every option its bytes depend on. The band height, encoder
+ *        threads and where the output is written are left out, as they do
+ *        not change the image; whether the line cache is open does.
+ * @param png_settings The PNG encoder's settings, or NULL for cairo's.
+ * @return The key in hex, to be freed with g_free, or NULL if the output
+ *         cannot be cached (numbered pages are several files).
+ */
+char *output_cache_key(const char *data,
+                       size_t length,
+                       const RenderOptions *opts,
+                       const PngSettings *png_settings,
+                       const OutputSpec *spec) {
+    if (spec->page_lines > 0)
+        return NULL;
+
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    hash_int(checksum, OUTPUT_CACHE_VERSION);
+    hash_string(checksum, cairo_version_string());
+    hash_string(checksum, pango_version_string());
+
+    hash_int(checksum, (gint64)length);
+    g_checksum_update(checksum, (const guchar *)data, length);
+
+    hash_int(checksum, opts->lang);
+    hash_int(checksum, opts->use_gradient_header);
+    hash_int(checksum, opts->show_line_numbers);
+    hash_int(checksum, opts->no_color);
+    hash_string(checksum, opts->title);
+    hash_int(checksum, opts->title_size);
+    hash_double(checksum, opts->scale);
+    hash_int(checksum, opts->quality);
+    // Lines drawn from the line cache sit at a quarter pixel.
+    hash_int(checksum, line_cache_enabled());
+
+    hash_int(checksum, png_settings != NULL);
+    if (png_settings) {
+        hash_int(checksum, png_settings->compression_level);
+        hash_int(checksum, png_settings->filter);
+        hash_int(checksum, png_settings->optimize_size);
+    }
+
+    hash_int(checksum, output_spec_format(spec));
+    hash_double(checksum, spec->scale);
+    hash_int(checksum, spec->width);
+    hash_int(checksum, spec->animation.fps);
+    hash_double(checksum, spec->animation.tokens_per_second);
+
+    char *key = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    return key;
+}
+
+/**
+ * @brief Tells whether an output is a named file, rather than a descriptor
+ *        or memory.
+ */
+static gboolean is_file_output(const OutputSpec *spec) {
+    return spec->fd < 0 && !spec->buffer && !spec->shared;
+}
+
+/**
+ * @brief Tells whether a file is one of the cache's entries under another
+ *        name, as an output hard linked by an earlier hit is.
+ */
+static gboolean is_cache_entry(const struct stat *st) {
+    struct stat dir_st;
+    if (stat(cache.dir, &dir_st) != 0 || dir_st.st_dev != st->st_dev)
+        return FALSE;
+    DIR *dir = opendir(cache.dir);
+    if (!dir)
+        return FALSE;
+    gboolean found = FALSE;
+    struct dirent *dirent;
+    while (!found && (dirent = readdir(dir))) {
+        struct stat entry_st;
+        found = dirent->d_name[0] != '.' &&
+                fstatat(dirfd(dir), dirent->d_name, &entry_st, 0) == 0 &&
+                entry_st.st_ino == st->st_ino;
+    }
+    closedir(dir);
+    return found;
+}
+
+/**
+ * @brief Removes a file output that is a hard link to a cache entry, so
+ *        that writing the output does not change the entry. Only -cache-link
+ *        makes such links; other hard links are the user's own and are
+ *        written through as usual.
+ */
+static void unlink_cache_link(const OutputSpec *spec) {
+    struct stat st;
+    if (cache.hard_links && is_file_output(spec) &&
+        lstat(spec->filename, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_nlink > 1 && is_cache_entry(&st))
+        unlink(spec->filename);
+}
+
+/**
+ * @brief Puts a hard link to an entry at a file output's path, replacing
+ *        whatever was there in one step.
+ * @return TRUE on success, FALSE on failure (e.g. across file systems).
+ */
+static gboolean link_into_place(const char *entry_path, const char *path) {
+    char *tmp_path = g_strdup_printf("%s%s%d-%d",
+                                     path,
+                                     OUTPUT_CACHE_TMP_PREFIX,
+                                     (int)getpid(),
+                                     g_atomic_int_add(&next_tmp_id, 1));
+    gboolean ok =
+        link(entry_path, tmp_path) == 0 && rename(tmp_path, path) == 0;
+    if (!ok)
+        unlink(tmp_path);
+    g_free(tmp_path);
+    return ok;
+}
+
+/**
+ * @brief Writes an entry, open as fd, to an output through its stream.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+static gboolean copy_to_output(int fd, const OutputSpec *spec) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return FALSE;
+    char *data = g_malloc(MAX(st.st_size, 1));
+    size_t done = 0;
+    while (done < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + done, st.st_size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    gboolean ok = FALSE;
+    OutputStream *stream =
+        done == (size_t)st.st_size ? output_spec_open_stream(spec) : NULL;
+    if (stream) {
+        output_stream_write(stream, (const unsigned char *)data, done);
+        ok = output_stream_close(stream);
+    }
+    g_free(data);
+    return ok;
+}
+
+/**
+ * @brief Writes an output from its cache entry, if there is one. The entry
+ *        is marked as just used.
+ * @return TRUE on a hit, FALSE on a miss (or if the entry could not be
+ *         written; then the output is rendered as usual).
+ */
+gboolean output_cache_fetch(const char *key, const OutputSpec *spec) {
+    char *entry_path = g_build_filename(cache.dir, key, NULL);
+    // Held open, the entry can still be copied if it is evicted meanwhile.
+    int fd = open(entry_path, O_RDONLY);
+    gboolean hit = FALSE;
+    if (fd >= 0) {
+        hit = cache.hard_links && is_file_output(spec) &&
+              link_into_place(entry_path, spec->filename);
+        if (!hit) {
+            unlink_cache_link(spec);
+            hit = copy_to_output(fd, spec);
+        }
+        close(fd);
+    }
+    if (hit)
+        utimensat(AT_FDCWD, entry_path, NULL, 0);
+    g_free(entry_path);
+
+    g_mutex_lock(&cache_mutex);
+    if (hit)
+        cache.hits++;
+    else
+        cache.misses++;
+    g_mutex_unlock(&cache_mutex);
+    return hit;
+}
+
+/**
+ * @brief Gets a file output ready to be written after a miss: a hard link
+ *        to an entry left by an earlier hit is removed rather than
+ *        overwritten, so that the entry stays intact. Unless outputs are
+ *        hard linked into the cache, the bytes are also kept in memory as
+ *        they are written, for output_cache_store.
+ */
+void output_cache_prepare(OutputSpec *spec) {
+    unlink_cache_link(spec);
+    if (is_file_output(spec) && !cache.hard_links && !spec->cache_copy)
+        spec->cache_copy = g_string_new(NULL);
+}
+
+/**
+ * @brief Writes data to a new file at path, which must not exist.
+ */
+static gboolean write_new_file(const char *path,
+                               const char *data,
+                               size_t length) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+        return FALSE;
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, data + done, length - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    gboolean ok = close(fd) == 0 && done == length;
+    if (!ok)
+        unlink(path);
+    return ok;
+}
+
+/**
+ * @brief Adds an output that was just written to the cache: a file output
+ *        is hard linked, or written from the copy output_cache_prepare had
+ *        it keep; one collected in memory is written out. Outputs written
+ *        to a descriptor cannot be read back and are not stored. Failures
+ *        only cost the entry.
+ */
+void output_cache_store(const char *key, OutputSpec *spec) {
+    if (spec->fd >= 0 && !spec->buffer && !spec->shared)
+        return;
+    char *tmp_name = g_strdup_printf("%s%d-%d",
+                                     OUTPUT_CACHE_TMP_PREFIX,
+                                     (int)getpid(),
+                                     g_atomic_int_add(&next_tmp_id, 1));
+    char *tmp_path = g_build_filename(cache.dir, tmp_name, NULL);
+    gboolean ok;
+    if (spec->buffer) {
+        ok = write_new_file(
+            tmp_path, spec->buffer->str, spec->buffer->len);
+    } else if (spec->shared) {
+        ok = write_new_file(tmp_path,
+                            shared_buffer_data(spec->shared),
+                            shared_buffer_length(spec->shared));
+    } else if (spec->cache_copy) {
+        ok = write_new_file(
+            tmp_path, spec->cache_copy->str, spec->cache_copy->len);
+    } else {
+        // A link across file systems fails; the file is read back then.
+        char *data = NULL;
+        gsize length;
+        ok = (cache.hard_links && link(spec->filename, tmp_path) == 0) ||
+             (g_file_get_contents(spec->filename, &data, &length, NULL) &&
+              write_new_file(tmp_path, data, length));
+        g_free(data);
+    }
+    if (spec->cache_copy) {
+        g_string_free(spec->cache_copy, TRUE);
+        spec->cache_copy = NULL;
+    }
+
+    // Another worker may have stored the same entry meanwhile; it is
+    // replaced by an identical one.
+    struct stat st;
+    struct stat old_st;
+    char *entry_path = g_build_filename(cache.dir, key, NULL);
+    gboolean replaced = stat(entry_path, &old_st) == 0;
+    if (ok && stat(tmp_path, &st) == 0 && rename(tmp_path, entry_path) == 0) {
+        g_mutex_lock(&cache_mutex);
+        cache.stores++;
+        cache.total_bytes += st.st_size - (replaced ? old_st.st_size : 0);
+        if (cache.total_bytes > cache.max_bytes)
+            evict_entries();
+        g_mutex_unlock(&cache_mutex);
+    } else {
+        unlink(tmp_path);
+    }
+    g_free(entry_path);
+    g_free(tmp_path);
+    g_free(tmp_name);
+}
+
+/**
+ * @brief Closes the cache, first printing how well it did if asked to.
+ */
+void output_cache_close(gboolean print_stats) {
+    if (!cache.dir)
+        return;
+    int lookups = cache.hits + cache.misses;
+    if (print_stats)
+        fprintf(stderr,
+                "Output cache: %d hit%s, %d miss%s (%d%% hit rate), %d "
+                "stored, %d evicted, %.1f MiB in %s.\n",
+                cache.hits,
+                cache.hits == 1 ? "" : "s",
+                cache.misses,
+                cache.misses == 1 ? "" : "es",
+                lookups > 0 ? cache.hits * 100 / lookups : 0,
+                cache.stores,
+                cache.evictions,
+                cache.total_bytes / (1024.0 * 1024.0),
+                cache.dir);
+    g_free(cache.dir);
+    cache.dir = NULL;
+}
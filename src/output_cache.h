@@ -0,0 +1,34 @@
+#ifndef OUTPUT_CACHE_H
+#define OUTPUT_CACHE_H
+
+#include <glib.h>
+
+#include "output.h"
+#include "png_writer.h"
+#include "render.h"
+
+// An on-disk cache of encoded outputs (-cache <dir>), shared by every job
+// of the process and by other processes using the same directory. Entries
+// are files named by a SHA-256 key of everything the output's bytes depend
+// on: the input text, the language, the render and encoder options, the
+// output's format and size, and the versions of this renderer, cairo and
+// Pango. A hit is written without highlighting, laying out or rendering
+// anything, copied from the entry or, if asked, hard linked. Entries are
+// written to a temporary name and renamed into place, so concurrent
+// writers never expose a partial file, and the least recently used ones
+// are evicted once the cache outgrows its size limit.
+gboolean output_cache_open(const char *dir,
+                           gint64 max_bytes,
+                           gboolean hard_links);
+gboolean output_cache_enabled(void);
+char *output_cache_key(const char *data,
+                       size_t length,
+                       const RenderOptions *opts,
+                       const PngSettings *png_settings,
+                       const OutputSpec *spec);
+gboolean output_cache_fetch(const char *key, const OutputSpec *spec);
+void output_cache_prepare(OutputSpec *spec);
+void output_cache_store(const char *key, OutputSpec *spec);
+void output_cache_close(gboolean print_stats);
+
+#endif // OUTPUT_CACHE_H
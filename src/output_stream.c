@@ -0,0 +1,152 @@
+// fdopen, fileno and dup are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include "output_stream.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct OutputStream {
+    FILE *fp;
+    GString *buffer;      // Collects the bytes instead of fp, if set
+    SharedBuffer *shared; // Or collects them in shared memory
+    GString *copy;        // Also receives the bytes written to fp, if set
+    char *name;           // The file name, or "fd N", for messages
+    gboolean ok;
+};
+
+/**
+ * @brief Opens a file for writing; "-" means stdout.
+ * @return A new stream, or NULL on failure (an error is printed).
+ */
+OutputStream *output_stream_open(const char *filename) {
+    if (strcmp(filename, "-") == 0)
+        return output_stream_open_fd(STDOUT_FILENO);
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr,
+                "Could not open %s for writing: %s\n",
+                filename,
+                strerror(errno));
+        return NULL;
+    }
+
+    OutputStream *stream = g_new0(OutputStream, 1);
+    stream->fp = fp;
+    stream->name = g_strdup(filename);
+    stream->ok = TRUE;
+    return stream;
+}
+
+/**
+ * @brief Wraps an open file descriptor, such as stdout or a pipe to an
+ *        upload step. The stream writes to a duplicate, so closing it
+ *        flushes the output but leaves fd itself open.
+ * @return A new stream, or NULL on failure (an error is printed).
+ */
+OutputStream *output_stream_open_fd(int fd) {
+    int dup_fd = dup(fd);
+    FILE *fp = dup_fd >= 0 ? fdopen(dup_fd, "wb") : NULL;
+    if (!fp) {
+        fprintf(stderr,
+                "Could not write to file descriptor %d: %s\n",
+                fd,
+                strerror(errno));
+        if (dup_fd >= 0)
+            close(dup_fd);
+        return NULL;
+    }
+
+    OutputStream *stream = g_new0(OutputStream, 1);
+    stream->fp = fp;
+    stream->name = g_strdup_printf("fd %d", fd);
+    stream->ok = TRUE;
+    return stream;
+}
+
+/**
+ * @brief Collects the bytes written in memory, appended to buffer, for the
+ *        caller to write out later (e.g. together with other files).
+ * @return A new stream.
+ */
+OutputStream *output_stream_open_buffer(GString *buffer, const char *name) {
+    OutputStream *stream = g_new0(OutputStream, 1);
+    stream->buffer = buffer;
+    stream->name = g_strdup(name);
+    stream->ok = TRUE;
+    return stream;
+}
+
+/**
+ * @brief Collects the bytes written in shared memory, for the caller to
+ *        hand the descriptor of to another process.
+ * @return A new stream.
+ */
+OutputStream *output_stream_open_shared(SharedBuffer *shared,
+                                        const char *name) {
+    OutputStream *stream = g_new0(OutputStream, 1);
+    stream->shared = shared;
+    stream->name = g_strdup(name);
+    stream->ok = TRUE;
+    return stream;
+}
+
+/**
+ * @brief Makes a file stream also append every byte it writes to copy, so
+ *        that the output can be kept without reading the file back.
+ */
+void output_stream_copy_to(OutputStream *stream, GString *copy) {
+    stream->copy = copy;
+}
+
+/**
+ * @brief Returns the file descriptor the stream writes to, or -1 for a
+ *        stream collected in memory.
+ */
+int output_stream_fd(const OutputStream *stream) {
+    return stream->fp ? fileno(stream->fp) : -1;
+}
+
+/**
+ * @brief Appends bytes to the stream. Matches cairo_write_func_t, with the
+ *        OutputStream as the closure.
+ */
+cairo_status_t output_stream_write(void *closure,
+                                   const unsigned char *data,
+                                   unsigned int length) {
+    OutputStream *stream = closure;
+    if (stream->buffer) {
+        g_string_append_len(stream->buffer, (const char *)data, length);
+    } else if (stream->shared) {
+        if (stream->ok && !shared_buffer_append(stream->shared, data, length))
+            stream->ok = FALSE;
+    } else if (stream->ok && fwrite(data, 1, length, stream->fp) != length) {
+        stream->ok = FALSE;
+    } else if (stream->copy) {
+        g_string_append_len(stream->copy, (const char *)data, length);
+    }
+    return stream->ok ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+}
+
+/**
+ * @brief Flushes and closes the stream and frees it. Failed writes are left
+ *        for the encoder that made them to report; this only reports a
+ *        failure to flush the last buffered bytes.
+ * @return TRUE if every write succeeded, FALSE otherwise.
+ */
+gboolean output_stream_close(OutputStream *stream) {
+    gboolean ok = stream->ok;
+    if (stream->fp && fclose(stream->fp) != 0 && ok) {
+        fprintf(stderr,
+                "Could not write %s: %s\n",
+                stream->name,
+                strerror(errno));
+        ok = FALSE;
+    }
+    g_free(stream->name);
+    g_free(stream);
+    return ok;
+}
@@ -0,0 +1,27 @@
+#ifndef OUTPUT_STREAM_H
+#define OUTPUT_STREAM_H
+
+#include <cairo.h>
+#include <glib.h>
+
+#include "shared_buffer.h"
+
+// Where an encoder's bytes go: a file, stdout, a file descriptor the
+// caller inherited to us, or memory. Encoders write through
+// output_stream_write, which is a cairo_write_func_t, so cairo's own stream
+// functions can use it too.
+typedef struct OutputStream OutputStream;
+
+OutputStream *output_stream_open(const char *filename);
+OutputStream *output_stream_open_fd(int fd);
+OutputStream *output_stream_open_buffer(GString *buffer, const char *name);
+OutputStream *output_stream_open_shared(SharedBuffer *shared,
+                                        const char *name);
+void output_stream_copy_to(OutputStream *stream, GString *copy);
+int output_stream_fd(const OutputStream *stream);
+cairo_status_t output_stream_write(void *closure,
+                                   const unsigned char *data,
+                                   unsigned int length);
+gboolean output_stream_close(OutputStream *stream);
+
+#endif // OUTPUT_STREAM_H
@@ -0,0 +1,182 @@
+#include "pipeline.h"
+
+#include <stdio.h>
+
+// Queue slots per thread of the stage a queue feeds: enough to keep each
+// thread busy while the stage before it works on the next job.
+#define PIPELINE_SLOTS_PER_THREAD 2
+
+// A job on its way through the pipeline.
+typedef struct {
+    JobProgress progress;
+    BatchItem *item;
+} PipelineJob;
+
+// A bounded queue of jobs between two stages. A full queue blocks the
+// stage feeding it; an empty one blocks the stage it feeds until a job
+// arrives or every thread feeding it is done.
+typedef struct {
+    GMutex mutex;
+    GCond not_empty;
+    GCond not_full;
+    PipelineJob **slots;
+    int capacity;
+    int head;
+    int count;
+    int n_producers; // Threads still feeding the queue
+} StageQueue;
+
+// One stage: the step it runs, where its jobs come from and go to. The
+// first stage takes its jobs from the items, the last one finishes them.
+typedef struct {
+    JobStep step;
+    StageQueue *in;  // NULL for the first stage
+    StageQueue *out; // NULL for the last stage
+    BatchItem *items;
+    int n_items;
+    gint *next_item;
+} Stage;
+
+static void stage_queue_init(StageQueue *queue, int capacity, int n_producers) {
+    g_mutex_init(&queue->mutex);
+    g_cond_init(&queue->not_empty);
+    g_cond_init(&queue->not_full);
+    queue->slots = g_new0(PipelineJob *, capacity);
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->n_producers = n_producers;
+}
+
+static void stage_queue_clear(StageQueue *queue) {
+    g_mutex_clear(&queue->mutex);
+    g_cond_clear(&queue->not_empty);
+    g_cond_clear(&queue->not_full);
+    g_free(queue->slots);
+}
+
+static void stage_queue_push(StageQueue *queue, PipelineJob *job) {
+    g_mutex_lock(&queue->mutex);
+    while (queue->count == queue->capacity)
+        g_cond_wait(&queue->not_full, &queue->mutex);
+    queue->slots[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    g_cond_signal(&queue->not_empty);
+    g_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Takes the oldest job from a queue, waiting for one if needed.
+ * @return The job, or NULL once the queue is empty and nothing feeds it.
+ */
+static PipelineJob *stage_queue_pop(StageQueue *queue) {
+    g_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && queue->n_producers > 0)
+        g_cond_wait(&queue->not_empty, &queue->mutex);
+    PipelineJob *job = NULL;
+    if (queue->count > 0) {
+        job = queue->slots[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        g_cond_signal(&queue->not_full);
+    }
+    g_mutex_unlock(&queue->mutex);
+    return job;
+}
+
+/**
+ * @brief Tells a queue that one of the threads feeding it is done.
+ */
+static void stage_queue_producer_done(StageQueue *queue) {
+    g_mutex_lock(&queue->mutex);
+    queue->n_producers--;
+    g_cond_broadcast(&queue->not_empty);
+    g_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Starts the next item that parsed successfully.
+ * @return Its job, or NULL when there are no more items.
+ */
+static PipelineJob *next_job(Stage *stage) {
+    for (;;) {
+        int index = g_atomic_int_add(stage->next_item, 1);
+        if (index >= stage->n_items)
+            return NULL;
+        BatchItem *item = &stage->items[index];
+        if (!item->ok)
+            continue;
+        PipelineJob *job = g_new0(PipelineJob, 1);
+        job->item = item;
+        job_progress_init(&job->progress, &item->job);
+        return job;
+    }
+}
+
+/**
+ * @brief Records the outcome of a job that completed or failed a step.
+ */
+static void finish_job(PipelineJob *job) {
+    job->item->ok = job->progress.ok;
+    job->item->over_limit = job->progress.over_limit;
+    if (!job->item->ok)
+        fprintf(stderr, "%s: item failed.\n", job->item->name);
+    job_progress_clear(&job->progress);
+    g_free(job);
+}
+
+static gpointer stage_worker(gpointer data) {
+    Stage *stage = data;
+    for (;;) {
+        PipelineJob *job =
+            stage->in ? stage_queue_pop(stage->in) : next_job(stage);
+        if (!job)
+            break;
+        if (job_run_step(&job->progress, stage->step) && stage->out)
+            stage_queue_push(stage->out, job);
+        else
+            finish_job(job);
+    }
+    if (stage->out)
+        stage_queue_producer_done(stage->out);
+    return NULL;
+}
+
+/**
+ * @brief Renders items through the stages of the pipeline and waits until
+ *        every one has completed or failed. Stage threads exit when their
+ *        input runs dry, releasing their Pango contexts.
+ */
+void run_pipeline(BatchItem *items,
+                  int n_items,
+                  const int stage_threads[JOB_N_STEPS]) {
+    Stage stages[JOB_N_STEPS];
+    StageQueue queues[JOB_N_STEPS - 1];
+    gint next_item = 0;
+
+    for (int i = 0; i < JOB_N_STEPS - 1; i++)
+        stage_queue_init(&queues[i],
+                         PIPELINE_SLOTS_PER_THREAD * stage_threads[i + 1],
+                         stage_threads[i]);
+    for (int i = 0; i < JOB_N_STEPS; i++) {
+        stages[i].step = (JobStep)i;
+        stages[i].in = i > 0 ? &queues[i - 1] : NULL;
+        stages[i].out = i < JOB_N_STEPS - 1 ? &queues[i] : NULL;
+        stages[i].items = items;
+        stages[i].n_items = n_items;
+        stages[i].next_item = &next_item;
+    }
+
+    GPtrArray *threads = g_ptr_array_new();
+    for (int i = 0; i < JOB_N_STEPS; i++) {
+        for (int j = 0; j < stage_threads[i]; j++)
+            g_ptr_array_add(threads,
+                            g_thread_new("pipeline", stage_worker, &stages[i]));
+    }
+    for (guint i = 0; i < threads->len; i++)
+        g_thread_join(threads->pdata[i]);
+    g_ptr_array_free(threads, TRUE);
+
+    for (int i = 0; i < JOB_N_STEPS - 1; i++)
+        stage_queue_clear(&queues[i]);
+}
@@ -0,0 +1,16 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "batch.h"
+
+// Runs the items of a batch through the steps of a job as a pipeline:
+// reading, highlighting, layout and rendering, and encoding each run as a
+// stage on threads of their own (stage_threads[step] of them). Stages are
+// connected by bounded queues, so a stage that gets ahead blocks instead of
+// piling up inputs or rendered images: the slowest stage sets the pace and
+// the number of jobs in flight stays bounded.
+void run_pipeline(BatchItem *items,
+                  int n_items,
+                  const int stage_threads[JOB_N_STEPS]);
+
+#endif // PIPELINE_H
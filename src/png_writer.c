@@ -0,0 +1,1286 @@
+#include "png_writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+// Rows are grouped into chunks of roughly this many uncompressed bytes. Each
+// chunk is filtered and deflated on its own worker thread, pigz-style, and
+// ends with a sync flush so the pieces concatenate into one zlib stream.
+#define CHUNK_TARGET_BYTES (256 * 1024)
+
+// Every chunk is primed with the last 32 KiB (the whole deflate window) of
+// the data before it, so splitting the stream costs almost no compression.
+#define DEFLATE_WINDOW_SIZE 32768
+
+// Bytes reserved around each compressed chunk for the zlib header (first
+// chunk) and the Adler-32 trailer (last chunk).
+#define ZLIB_HEADER_SIZE 2
+#define ZLIB_TRAILER_SIZE 4
+
+struct PngEncoder {
+    cairo_write_func_t write_func;
+    void *closure;
+    int width;
+    int height;
+    int rows_written;
+    gboolean has_alpha;
+    gboolean ok;
+    size_t row_bytes; // Converted bytes per row, without the filter byte
+    int bytes_per_pixel;
+    PngSettings settings;
+    int n_threads;
+    uLong adler;              // Adler-32 of all filtered data so far
+    unsigned char *prev_row;  // Last converted row of the previous batch
+    unsigned char *window;    // Tail of the previous batch's filtered data
+    size_t window_len;
+    guint32 *sequence;     // APNG frames after the first: next fdAT number
+    GThreadPool **pool;    // Deflate workers, kept for the encoder's life
+    GThreadPool *own_pool; // What pool points to, but for APNG frames
+};
+
+// A run of rows compressed independently of its neighbours.
+typedef struct {
+    PngEncoder *encoder;
+    const unsigned char *data; // First row of the chunk in the surface
+    int stride;
+    int n_rows;
+    const unsigned char *prev_src;       // Surface row above the chunk
+    const unsigned char *prev_converted; // Or its already converted form
+    gboolean first;                      // Starts the zlib stream
+    gboolean last;                       // Ends the zlib stream
+    unsigned char *filtered;
+    size_t filtered_len;
+    uLong adler;
+    const unsigned char *dict;
+    size_t dict_len;
+    unsigned char *compressed;
+    size_t compressed_len;
+    gboolean ok;
+} PngChunk;
+
+typedef void (*PngChunkFunc)(PngChunk *chunk);
+
+// Work shared by the threads processing one batch of chunks.
+typedef struct {
+    PngChunk *chunks;
+    int n_chunks;
+    gint next_chunk;
+    PngChunkFunc func;
+    GMutex mutex;
+    GCond cond;
+    int n_workers; // Pool threads yet to finish with the queue
+} PngChunkQueue;
+
+/**
+ * @brief Fills in the default writer settings: zlib level 6, adaptive row
+ * filters and one deflate thread per processor.
+ */
+void png_settings_init(PngSettings *settings) {
+    settings->compression_level = PNG_COMPRESSION_DEFAULT;
+    settings->filter = PNG_FILTER_ADAPTIVE;
+    settings->threads = 0;
+    settings->optimize_size = FALSE;
+    settings->verbose = FALSE;
+}
+
+/**
+ * @brief Parses a row filter name (none, sub, up, average, paeth, adaptive).
+ * @return TRUE if the name is known, FALSE otherwise.
+ */
+gboolean png_filter_from_string(const char *name, PngFilter *filter) {
+    static const char *names[] = {
+        "none", "sub", "up", "average", "paeth", "adaptive", NULL};
+    for (int i = 0; names[i] != NULL; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *filter = (PngFilter)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void put_u32_be(unsigned char *buf, guint32 value) {
+    buf[0] = (value >> 24) & 0xff;
+    buf[1] = (value >> 16) & 0xff;
+    buf[2] = (value >> 8) & 0xff;
+    buf[3] = value & 0xff;
+}
+
+static gboolean write_bytes(cairo_write_func_t write_func,
+                            void *closure,
+                            const unsigned char *data,
+                            size_t len) {
+    return write_func(closure, data, len) == CAIRO_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Writes a single PNG chunk (length, type, data and CRC).
+ * @return TRUE on success, FALSE on a write error.
+ */
+static gboolean write_chunk(cairo_write_func_t write_func,
+                            void *closure,
+                            const char *type,
+                            const unsigned char *data,
+                            guint32 len) {
+    unsigned char header[8];
+    unsigned char crc_buf[4];
+
+    put_u32_be(header, len);
+    memcpy(header + 4, type, 4);
+    uLong crc = crc32(0L, header + 4, 4);
+    if (len > 0)
+        crc = crc32(crc, data, len);
+    put_u32_be(crc_buf, (guint32)crc);
+
+    return write_bytes(write_func, closure, header, sizeof(header)) &&
+           (len == 0 || write_bytes(write_func, closure, data, len)) &&
+           write_bytes(write_func, closure, crc_buf, sizeof(crc_buf));
+}
+
+/**
+ * @brief Converts one row of cairo pixels (native-endian, premultiplied) into
+ * the non-premultiplied RGBA or RGB bytes PNG expects.
+ */
+static void convert_row(const guint32 *src,
+                        unsigned char *dst,
+                        int width,
+                        gboolean has_alpha) {
+    for (int x = 0; x < width; x++) {
+        guint32 pixel = src[x];
+        guint32 alpha = has_alpha ? (pixel >> 24) : 0xff;
+        guint32 r = (pixel >> 16) & 0xff;
+        guint32 g = (pixel >> 8) & 0xff;
+        guint32 b = pixel & 0xff;
+
+        if (alpha == 0) {
+            r = g = b = 0;
+        } else if (alpha != 0xff) {
+            r = (r * 255 + alpha / 2) / alpha;
+            g = (g * 255 + alpha / 2) / alpha;
+            b = (b * 255 + alpha / 2) / alpha;
+        }
+
+        *dst++ = r;
+        *dst++ = g;
+        *dst++ = b;
+        if (has_alpha)
+            *dst++ = alpha;
+    }
+}
+
+static int paeth_predictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+/**
+ * @brief Applies one of the five PNG filter types to a row.
+ * @param type The filter type (PNG_FILTER_NONE to PNG_FILTER_PAETH).
+ * @param cur The converted row to filter.
+ * @param prev The converted row above it (all zeros for the first row).
+ * @param out Receives len filtered bytes.
+ * @param len The number of bytes in a row.
+ * @param bpp The number of bytes per pixel.
+ */
+static void apply_filter(PngFilter type,
+                         const unsigned char *cur,
+                         const unsigned char *prev,
+                         unsigned char *out,
+                         size_t len,
+                         size_t bpp) {
+    size_t i;
+    switch (type) {
+    case PNG_FILTER_SUB:
+        memcpy(out, cur, bpp);
+        for (i = bpp; i < len; i++)
+            out[i] = cur[i] - cur[i - bpp];
+        break;
+    case PNG_FILTER_UP:
+        for (i = 0; i < len; i++)
+            out[i] = cur[i] - prev[i];
+        break;
+    case PNG_FILTER_AVERAGE:
+        for (i = 0; i < bpp; i++)
+            out[i] = cur[i] - (prev[i] >> 1);
+        for (; i < len; i++)
+            out[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+        break;
+    case PNG_FILTER_PAETH:
+        for (i = 0; i < bpp; i++)
+            out[i] = cur[i] - prev[i];
+        for (; i < len; i++)
+            out[i] = cur[i] - paeth_predictor(
+                                  cur[i - bpp], prev[i], prev[i - bpp]);
+        break;
+    default:
+        memcpy(out, cur, len);
+        break;
+    }
+}
+
+/**
+ * @brief Filters a row into out[0] (the filter type) and out[1..len]. The
+ *        adaptive strategy tries every filter and keeps the one with the
+ *        smallest sum of absolute signed bytes, the usual libpng heuristic.
+ * @param scratch Room for 5 * len bytes, used by the adaptive strategy.
+ */
+static void filter_row(PngFilter filter,
+                       const unsigned char *cur,
+                       const unsigned char *prev,
+                       unsigned char *out,
+                       size_t len,
+                       size_t bpp,
+                       unsigned char *scratch) {
+    if (filter != PNG_FILTER_ADAPTIVE) {
+        out[0] = filter;
+        apply_filter(filter, cur, prev, out + 1, len, bpp);
+        return;
+    }
+
+    int best_type = PNG_FILTER_NONE;
+    unsigned long best_score = (unsigned long)-1;
+    for (int type = PNG_FILTER_NONE; type <= PNG_FILTER_PAETH; type++) {
+        unsigned char *candidate = scratch + type * len;
+        apply_filter((PngFilter)type, cur, prev, candidate, len, bpp);
+        unsigned long score = 0;
+        for (size_t i = 0; i < len && score < best_score; i++)
+            score += abs((signed char)candidate[i]);
+        if (score < best_score) {
+            best_score = score;
+            best_type = type;
+        }
+    }
+    out[0] = best_type;
+    memcpy(out + 1, scratch + best_type * len, len);
+}
+
+/**
+ * @brief First pass over a chunk: converts its rows from cairo pixels and
+ * filters them into chunk->filtered.
+ */
+static void filter_chunk(PngChunk *chunk) {
+    PngEncoder *encoder = chunk->encoder;
+    size_t row_bytes = encoder->row_bytes;
+    size_t bpp = encoder->bytes_per_pixel;
+    unsigned char *prev = g_malloc0(row_bytes);
+    unsigned char *cur = g_malloc(row_bytes);
+    unsigned char *scratch = encoder->settings.filter == PNG_FILTER_ADAPTIVE
+                                 ? g_malloc(row_bytes * 5)
+                                 : NULL;
+
+    if (chunk->prev_src)
+        convert_row((const guint32 *)chunk->prev_src,
+                    prev,
+                    encoder->width,
+                    encoder->has_alpha);
+    else if (chunk->prev_converted)
+        memcpy(prev, chunk->prev_converted, row_bytes);
+
+    chunk->filtered_len = (row_bytes + 1) * chunk->n_rows;
+    chunk->filtered = g_malloc(chunk->filtered_len);
+    for (int y = 0; y < chunk->n_rows; y++) {
+        convert_row((const guint32 *)(chunk->data + (size_t)y * chunk->stride),
+                    cur,
+                    encoder->width,
+                    encoder->has_alpha);
+        filter_row(encoder->settings.filter,
+                   cur,
+                   prev,
+                   chunk->filtered + (row_bytes + 1) * y,
+                   row_bytes,
+                   bpp,
+                   scratch);
+        unsigned char *tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+    chunk->adler =
+        adler32(adler32(0L, Z_NULL, 0), chunk->filtered, chunk->filtered_len);
+
+    g_free(prev);
+    g_free(cur);
+    g_free(scratch);
+}
+
+/**
+ * @brief Second pass over a chunk: deflates its filtered rows as a raw
+ *        deflate fragment, primed with the preceding 32 KiB. Every chunk but
+ *        the last ends with a sync flush (byte aligned, not final); the last
+ *        one finishes the stream.
+ */
+static void deflate_chunk(PngChunk *chunk) {
+    PngEncoder *encoder = chunk->encoder;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    chunk->ok = FALSE;
+    if (deflateInit2(&zs,
+                     encoder->settings.compression_level,
+                     Z_DEFLATED,
+                     -15, // Raw deflate; the zlib wrapper is written by hand
+                     8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return;
+    if (chunk->dict_len > 0)
+        deflateSetDictionary(&zs, chunk->dict, chunk->dict_len);
+
+    size_t capacity = deflateBound(&zs, chunk->filtered_len) + 64 +
+                      ZLIB_HEADER_SIZE + ZLIB_TRAILER_SIZE;
+    unsigned char *buf = g_malloc(capacity);
+    size_t used = 0;
+    if (chunk->first) {
+        // zlib header: deflate with a 32K window, then the level hint with
+        // the check bits that make the 16-bit header a multiple of 31.
+        int level = encoder->settings.compression_level;
+        int flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+        unsigned int header = (0x78 << 8) | (flevel << 6);
+        header += 31 - header % 31;
+        buf[0] = header >> 8;
+        buf[1] = header & 0xff;
+        used = ZLIB_HEADER_SIZE;
+    }
+
+    int flush = chunk->last ? Z_FINISH : Z_SYNC_FLUSH;
+    zs.next_in = chunk->filtered;
+    zs.avail_in = chunk->filtered_len;
+    for (;;) {
+        zs.next_out = buf + used;
+        zs.avail_out = capacity - used - ZLIB_TRAILER_SIZE;
+        int zret = deflate(&zs, flush);
+        used = zs.next_out - buf;
+        if (zret == Z_STREAM_ERROR)
+            break;
+        if (flush == Z_FINISH ? zret == Z_STREAM_END
+                              : zs.avail_in == 0 && zs.avail_out > 0) {
+            chunk->ok = TRUE;
+            break;
+        }
+        capacity *= 2;
+        buf = g_realloc(buf, capacity);
+    }
+    deflateEnd(&zs);
+
+    chunk->compressed = buf;
+    chunk->compressed_len = used;
+}
+
+static void chunk_worker(PngChunkQueue *queue) {
+    for (;;) {
+        int index = g_atomic_int_add(&queue->next_chunk, 1);
+        if (index >= queue->n_chunks)
+            break;
+        queue->func(&queue->chunks[index]);
+    }
+}
+
+static void pool_chunk_worker(gpointer data, gpointer user_data) {
+    PngChunkQueue *queue = data;
+    (void)user_data;
+    chunk_worker(queue);
+    g_mutex_lock(&queue->mutex);
+    queue->n_workers--;
+    g_cond_signal(&queue->cond);
+    g_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Runs func over every chunk using up to encoder->n_threads threads,
+ *        the calling thread included. The other threads come from a pool
+ *        made by the first call that needs one and kept until the encoder
+ *        is freed, so that an image written band by band does not start
+ *        and join threads for every band.
+ */
+static void run_chunks(PngEncoder *encoder,
+                       PngChunk *chunks,
+                       int n_chunks,
+                       PngChunkFunc func) {
+    PngChunkQueue queue = {0};
+    queue.chunks = chunks;
+    queue.n_chunks = n_chunks;
+    queue.func = func;
+    int n_workers = MIN(encoder->n_threads, n_chunks) - 1;
+    if (n_workers > 0 && !*encoder->pool)
+        *encoder->pool = g_thread_pool_new(
+            pool_chunk_worker, NULL, encoder->n_threads - 1, TRUE, NULL);
+    if (n_workers <= 0 || !*encoder->pool) {
+        chunk_worker(&queue);
+        return;
+    }
+
+    // Workers count themselves out as soon as they are pushed.
+    queue.n_workers = n_workers;
+    g_mutex_init(&queue.mutex);
+    g_cond_init(&queue.cond);
+    for (int i = 0; i < n_workers; i++)
+        g_thread_pool_push(*encoder->pool, &queue, NULL);
+    chunk_worker(&queue);
+    g_mutex_lock(&queue.mutex);
+    while (queue.n_workers > 0)
+        g_cond_wait(&queue.cond, &queue.mutex);
+    g_mutex_unlock(&queue.mutex);
+    g_mutex_clear(&queue.mutex);
+    g_cond_clear(&queue.cond);
+}
+
+/**
+ * @brief Writes an APNG frame data chunk: like IDAT, but numbered.
+ * @return TRUE on success, FALSE on a write error.
+ */
+static gboolean write_fdat_chunk(cairo_write_func_t write_func,
+                                 void *closure,
+                                 guint32 sequence,
+                                 const unsigned char *data,
+                                 guint32 len) {
+    unsigned char header[12];
+    unsigned char crc_buf[4];
+
+    put_u32_be(header, len + 4);
+    memcpy(header + 4, "fdAT", 4);
+    put_u32_be(header + 8, sequence);
+    uLong crc = crc32(0L, header + 4, 8);
+    if (len > 0)
+        crc = crc32(crc, data, len);
+    put_u32_be(crc_buf, (guint32)crc);
+
+    return write_bytes(write_func, closure, header, sizeof(header)) &&
+           (len == 0 || write_bytes(write_func, closure, data, len)) &&
+           write_bytes(write_func, closure, crc_buf, sizeof(crc_buf));
+}
+
+/**
+ * @brief Sets up an encoder for one zlib stream of image data, without
+ *        writing anything yet.
+ */
+static PngEncoder *png_encoder_alloc(cairo_write_func_t write_func,
+                                     void *closure,
+                                     int width,
+                                     int height,
+                                     gboolean has_alpha,
+                                     const PngSettings *settings) {
+    PngEncoder *encoder = g_new0(PngEncoder, 1);
+    encoder->write_func = write_func;
+    encoder->closure = closure;
+    encoder->width = width;
+    encoder->height = height;
+    encoder->has_alpha = has_alpha;
+    encoder->bytes_per_pixel = has_alpha ? 4 : 3;
+    encoder->row_bytes = (size_t)width * encoder->bytes_per_pixel;
+    encoder->settings = *settings;
+    encoder->settings.compression_level =
+        CLAMP(settings->compression_level, 0, 9);
+    encoder->n_threads = settings->threads > 0 ? settings->threads
+                                               : (int)g_get_num_processors();
+    encoder->adler = adler32(0L, Z_NULL, 0);
+    encoder->window = g_malloc(DEFLATE_WINDOW_SIZE);
+    encoder->pool = &encoder->own_pool;
+    encoder->ok = TRUE;
+    return encoder;
+}
+
+static void png_encoder_free(PngEncoder *encoder) {
+    if (encoder->own_pool)
+        g_thread_pool_free(encoder->own_pool, FALSE, TRUE);
+    g_free(encoder->prev_row);
+    g_free(encoder->window);
+    g_free(encoder);
+}
+
+/**
+ * @brief Writes the PNG signature and the IHDR chunk.
+ */
+static gboolean write_png_header(cairo_write_func_t write_func,
+                                 void *closure,
+                                 int width,
+                                 int height,
+                                 gboolean has_alpha) {
+    static const unsigned char signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    unsigned char ihdr[13];
+    put_u32_be(ihdr, width);
+    put_u32_be(ihdr + 4, height);
+    ihdr[8] = 8;                 // Bit depth
+    ihdr[9] = has_alpha ? 6 : 2; // Color type: RGBA or RGB
+    ihdr[10] = 0;                // Compression method
+    ihdr[11] = 0;                // Filter method
+    ihdr[12] = 0;                // No interlacing
+
+    return write_bytes(write_func, closure, signature, sizeof(signature)) &&
+           write_chunk(write_func, closure, "IHDR", ihdr, sizeof(ihdr));
+}
+
+/**
+ * @brief Starts a PNG image that is filled in row by row, e.g. one band at a
+ *        time for images far taller than any single cairo surface.
+ * @param write_func Called with the encoded bytes, in order.
+ * @param closure Passed to write_func.
+ * @param width The image width in pixels.
+ * @param height The image height in pixels.
+ * @param has_alpha Whether to write RGBA (TRUE) or RGB (FALSE) pixels.
+ * @param settings Compression level, row filter and thread count.
+ * @return A new encoder.
+ */
+PngEncoder *png_encoder_new(cairo_write_func_t write_func,
+                            void *closure,
+                            int width,
+                            int height,
+                            gboolean has_alpha,
+                            const PngSettings *settings) {
+    PngEncoder *encoder = png_encoder_alloc(
+        write_func, closure, width, height, has_alpha, settings);
+    encoder->ok =
+        write_png_header(write_func, closure, width, height, has_alpha);
+    return encoder;
+}
+
+/**
+ * @brief Appends rows of cairo ARGB32/RGB24 pixels to the image. The rows
+ *        are split into chunks that are filtered and deflated in parallel,
+ *        then written in order as IDAT chunks.
+ * @param encoder The encoder returned by png_encoder_new.
+ * @param data The first row to encode.
+ * @param stride The distance in bytes between rows in data.
+ * @param n_rows The number of rows to encode.
+ * @return TRUE on success, FALSE on failure.
+ */
+gboolean png_encoder_write_rows(PngEncoder *encoder,
+                                const unsigned char *data,
+                                int stride,
+                                int n_rows) {
+    if (encoder->rows_written + n_rows > encoder->height)
+        encoder->ok = FALSE;
+    if (!encoder->ok || n_rows <= 0)
+        return encoder->ok;
+
+    size_t row_bytes = encoder->row_bytes;
+    int rows_per_chunk = MAX(1, (int)(CHUNK_TARGET_BYTES / (row_bytes + 1)));
+    int n_chunks = (n_rows + rows_per_chunk - 1) / rows_per_chunk;
+    PngChunk *chunks = g_new0(PngChunk, n_chunks);
+
+    for (int i = 0; i < n_chunks; i++) {
+        PngChunk *chunk = &chunks[i];
+        int first_row = i * rows_per_chunk;
+        chunk->encoder = encoder;
+        chunk->data = data + (size_t)first_row * stride;
+        chunk->stride = stride;
+        chunk->n_rows = MIN(rows_per_chunk, n_rows - first_row);
+        if (first_row > 0)
+            chunk->prev_src = data + (size_t)(first_row - 1) * stride;
+        else if (encoder->rows_written > 0)
+            chunk->prev_converted = encoder->prev_row;
+        chunk->first = encoder->rows_written == 0 && i == 0;
+        chunk->last = encoder->rows_written + first_row + chunk->n_rows ==
+                      encoder->height;
+    }
+
+    run_chunks(encoder, chunks, n_chunks, filter_chunk);
+
+    for (int i = 0; i < n_chunks; i++) {
+        const unsigned char *prev_data =
+            i > 0 ? chunks[i - 1].filtered : encoder->window;
+        size_t prev_len =
+            i > 0 ? chunks[i - 1].filtered_len : encoder->window_len;
+        chunks[i].dict_len = MIN(prev_len, DEFLATE_WINDOW_SIZE);
+        chunks[i].dict = prev_data + prev_len - chunks[i].dict_len;
+    }
+
+    run_chunks(encoder, chunks, n_chunks, deflate_chunk);
+
+    for (int i = 0; i < n_chunks; i++) {
+        PngChunk *chunk = &chunks[i];
+        encoder->ok = encoder->ok && chunk->ok;
+        encoder->adler = adler32_combine(
+            encoder->adler, chunk->adler, (z_off_t)chunk->filtered_len);
+        if (encoder->ok && chunk->last) {
+            put_u32_be(chunk->compressed + chunk->compressed_len,
+                       (guint32)encoder->adler);
+            chunk->compressed_len += ZLIB_TRAILER_SIZE;
+        }
+        if (encoder->sequence)
+            encoder->ok =
+                encoder->ok && write_fdat_chunk(encoder->write_func,
+                                                encoder->closure,
+                                                (*encoder->sequence)++,
+                                                chunk->compressed,
+                                                chunk->compressed_len);
+        else
+            encoder->ok = encoder->ok && write_chunk(encoder->write_func,
+                                                     encoder->closure,
+                                                     "IDAT",
+                                                     chunk->compressed,
+                                                     chunk->compressed_len);
+    }
+
+    // Keep what the next batch needs: the row above it for the filters and
+    // the deflate window to prime its first chunk with.
+    PngChunk *tail = &chunks[n_chunks - 1];
+    if (!encoder->prev_row)
+        encoder->prev_row = g_malloc(row_bytes);
+    convert_row((const guint32 *)(data + (size_t)(n_rows - 1) * stride),
+                encoder->prev_row,
+                encoder->width,
+                encoder->has_alpha);
+    encoder->window_len = MIN(tail->filtered_len, DEFLATE_WINDOW_SIZE);
+    memcpy(encoder->window,
+           tail->filtered + tail->filtered_len - encoder->window_len,
+           encoder->window_len);
+    encoder->rows_written += n_rows;
+
+    for (int i = 0; i < n_chunks; i++) {
+        g_free(chunks[i].filtered);
+        g_free(chunks[i].compressed);
+    }
+    g_free(chunks);
+    return encoder->ok;
+}
+
+/**
+ * @brief Writes the end of the image and frees the encoder. Fails if fewer
+ *        rows than the image height were written.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean png_encoder_finish(PngEncoder *encoder) {
+    gboolean ok = encoder->ok && encoder->rows_written == encoder->height &&
+                  write_chunk(encoder->write_func,
+                              encoder->closure,
+                              "IEND",
+                              NULL,
+                              0);
+    if (!ok)
+        fprintf(stderr, "Could not save PNG file: write error.\n");
+
+    png_encoder_free(encoder);
+    return ok;
+}
+
+struct ApngEncoder {
+    cairo_write_func_t write_func;
+    void *closure;
+    int width;
+    int height;
+    gboolean has_alpha;
+    PngSettings settings;
+    int n_frames;
+    int frames_written;
+    guint32 sequence;  // Next fcTL/fdAT sequence number
+    GThreadPool *pool; // Deflate workers shared by the frames
+    gboolean ok;
+};
+
+/**
+ * @brief Starts an animated PNG. Viewers without APNG support show the
+ *        first frame, which is stored as the ordinary image data.
+ * @param write_func Called with the encoded bytes, in order.
+ * @param closure Passed to write_func.
+ * @param width The canvas width in pixels.
+ * @param height The canvas height in pixels.
+ * @param has_alpha Whether to write RGBA (TRUE) or RGB (FALSE) pixels.
+ * @param n_frames The exact number of frames that will be added.
+ * @param settings Compression level, row filter and thread count.
+ * @return A new encoder.
+ */
+ApngEncoder *apng_encoder_new(cairo_write_func_t write_func,
+                              void *closure,
+                              int width,
+                              int height,
+                              gboolean has_alpha,
+                              int n_frames,
+                              const PngSettings *settings) {
+    ApngEncoder *encoder = g_new0(ApngEncoder, 1);
+    encoder->write_func = write_func;
+    encoder->closure = closure;
+    encoder->width = width;
+    encoder->height = height;
+    encoder->has_alpha = has_alpha;
+    encoder->settings = *settings;
+    encoder->n_frames = n_frames;
+
+    unsigned char actl[8];
+    put_u32_be(actl, n_frames);
+    put_u32_be(actl + 4, 0); // Loop forever
+    encoder->ok =
+        n_frames > 0 &&
+        write_png_header(write_func, closure, width, height, has_alpha) &&
+        write_chunk(write_func, closure, "acTL", actl, sizeof(actl));
+    return encoder;
+}
+
+/**
+ * @brief Adds a frame that replaces a rectangle of the previous frame. Only
+ *        that rectangle is compressed, so frames that change a few glyphs
+ *        cost next to nothing. The first frame must cover the whole canvas.
+ * @param encoder The encoder returned by apng_encoder_new.
+ * @param data The top-left pixel of the rectangle, in cairo's format.
+ * @param stride The distance in bytes between rows in data.
+ * @param x Left edge of the rectangle on the canvas.
+ * @param y Top edge of the rectangle on the canvas.
+ * @param width The rectangle width in pixels.
+ * @param height The rectangle height in pixels.
+ * @param delay_num How long the frame is shown, in units of 1/delay_den s.
+ * @param delay_den See delay_num.
+ * @return TRUE on success, FALSE on failure.
+ */
+gboolean apng_encoder_add_frame(ApngEncoder *encoder,
+                                const unsigned char *data,
+                                int stride,
+                                int x,
+                                int y,
+                                int width,
+                                int height,
+                                int delay_num,
+                                int delay_den) {
+    gboolean first = encoder->frames_written == 0;
+    if (encoder->frames_written >= encoder->n_frames || width <= 0 ||
+        height <= 0 || x < 0 || y < 0 || x + width > encoder->width ||
+        y + height > encoder->height ||
+        (first && (width != encoder->width || height != encoder->height)))
+        encoder->ok = FALSE;
+    if (!encoder->ok)
+        return FALSE;
+
+    unsigned char fctl[26];
+    put_u32_be(fctl, encoder->sequence++);
+    put_u32_be(fctl + 4, width);
+    put_u32_be(fctl + 8, height);
+    put_u32_be(fctl + 12, x);
+    put_u32_be(fctl + 16, y);
+    fctl[20] = (delay_num >> 8) & 0xff;
+    fctl[21] = delay_num & 0xff;
+    fctl[22] = (delay_den >> 8) & 0xff;
+    fctl[23] = delay_den & 0xff;
+    fctl[24] = 0; // Dispose: keep the frame for the next one to build on
+    fctl[25] = 0; // Blend: replace the rectangle
+    encoder->ok = write_chunk(
+        encoder->write_func, encoder->closure, "fcTL", fctl, sizeof(fctl));
+
+    // Each frame is a zlib stream of its own, in IDAT for the first frame
+    // and numbered fdAT chunks after it.
+    PngEncoder *frame = png_encoder_alloc(encoder->write_func,
+                                          encoder->closure,
+                                          width,
+                                          height,
+                                          encoder->has_alpha,
+                                          &encoder->settings);
+    frame->ok = encoder->ok;
+    frame->pool = &encoder->pool;
+    if (!first)
+        frame->sequence = &encoder->sequence;
+    encoder->ok = png_encoder_write_rows(frame, data, stride, height);
+    png_encoder_free(frame);
+
+    encoder->frames_written++;
+    return encoder->ok;
+}
+
+/**
+ * @brief Writes the end of the animation and frees the encoder. Fails if
+ *        fewer frames than announced were added.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean apng_encoder_finish(ApngEncoder *encoder) {
+    gboolean ok = encoder->ok &&
+                  encoder->frames_written == encoder->n_frames &&
+                  write_chunk(encoder->write_func,
+                              encoder->closure,
+                              "IEND",
+                              NULL,
+                              0);
+    if (!ok)
+        fprintf(stderr, "Could not save animated PNG file: write error.\n");
+
+    if (encoder->pool)
+        g_thread_pool_free(encoder->pool, FALSE, TRUE);
+    g_free(encoder);
+    return ok;
+}
+
+// Indexed-color output: at most 256 palette entries, of which up to this many
+// are the most frequent colors kept exactly (backgrounds, window chrome and
+// text colors). The rest approximate the antialiasing shades.
+#define PALETTE_SIZE 256
+#define PALETTE_EXACT_COLORS 128
+
+// A distinct color of the image (packed 0xRRGGBBAA, non-premultiplied) and
+// the number of pixels that use it.
+typedef struct {
+    guint32 color;
+    guint32 count;
+} PaletteColor;
+
+// One filter strategy tried on the index rows of an indexed-color image.
+typedef struct {
+    const unsigned char *indices;
+    int width;
+    int height;
+    PngFilter filter;
+    unsigned char *compressed;
+    size_t compressed_len;
+} IndexedCandidate;
+
+// The filter strategies of one image still to be compressed, taken in turn
+// by the threads compressing them.
+typedef struct {
+    IndexedCandidate *candidates;
+    int n_candidates;
+    gint next_candidate;
+} CandidateQueue;
+
+/**
+ * @brief Converts a cairo pixel to a packed, non-premultiplied 0xRRGGBBAA.
+ */
+static guint32 unpremultiply_pixel(guint32 pixel, gboolean has_alpha) {
+    unsigned char rgba[4];
+    convert_row(&pixel, rgba, 1, has_alpha);
+    if (!has_alpha)
+        rgba[3] = 0xff;
+    return ((guint32)rgba[0] << 24) | (rgba[1] << 16) | (rgba[2] << 8) |
+           rgba[3];
+}
+
+static int color_channel(guint32 color, int channel) {
+    return (color >> (24 - 8 * channel)) & 0xff;
+}
+
+static int compare_by_count(const void *a, const void *b) {
+    const PaletteColor *ca = a;
+    const PaletteColor *cb = b;
+    if (ca->count != cb->count)
+        return ca->count < cb->count ? 1 : -1;
+    return ca->color < cb->color ? -1 : ca->color > cb->color;
+}
+
+// One comparator per channel so median cut needs no shared sort state.
+#define DEFINE_CHANNEL_COMPARE(name, channel)                                  \
+    static int name(const void *a, const void *b) {                            \
+        return color_channel(((const PaletteColor *)a)->color, channel) -      \
+               color_channel(((const PaletteColor *)b)->color, channel);       \
+    }
+DEFINE_CHANNEL_COMPARE(compare_by_red, 0)
+DEFINE_CHANNEL_COMPARE(compare_by_green, 1)
+DEFINE_CHANNEL_COMPARE(compare_by_blue, 2)
+DEFINE_CHANNEL_COMPARE(compare_by_alpha, 3)
+
+/**
+ * @brief Finds the channel with the widest spread in a run of colors.
+ * @return The spread, with the channel index stored in *channel.
+ */
+static int widest_channel(const PaletteColor *colors, int n, int *channel) {
+    int best_range = -1;
+    for (int c = 0; c < 4; c++) {
+        int lo = 255, hi = 0;
+        for (int i = 0; i < n; i++) {
+            int value = color_channel(colors[i].color, c);
+            lo = MIN(lo, value);
+            hi = MAX(hi, value);
+        }
+        if (hi - lo > best_range) {
+            best_range = hi - lo;
+            *channel = c;
+        }
+    }
+    return best_range;
+}
+
+/**
+ * @brief Reduces colors to at most max_entries representatives with a
+ *        pixel-weighted median cut, appending them to palette.
+ * @return The number of entries added.
+ */
+static int median_cut(PaletteColor *colors,
+                      int n_colors,
+                      int max_entries,
+                      guint32 *palette) {
+    static int (*const compare_channel[4])(const void *, const void *) = {
+        compare_by_red, compare_by_green, compare_by_blue, compare_by_alpha};
+    int *box_start = g_new(int, max_entries);
+    int *box_len = g_new(int, max_entries);
+    int n_boxes = 1;
+    box_start[0] = 0;
+    box_len[0] = n_colors;
+
+    while (n_boxes < max_entries) {
+        // Split the box with the widest channel spread, weighted by size.
+        int best_box = -1, best_channel = 0;
+        double best_score = 0;
+        for (int b = 0; b < n_boxes; b++) {
+            if (box_len[b] < 2)
+                continue;
+            int channel;
+            int range =
+                widest_channel(colors + box_start[b], box_len[b], &channel);
+            double score = (double)range * box_len[b];
+            if (score > best_score) {
+                best_score = score;
+                best_box = b;
+                best_channel = channel;
+            }
+        }
+        if (best_box < 0)
+            break;
+
+        PaletteColor *box = colors + box_start[best_box];
+        int len = box_len[best_box];
+        qsort(box, len, sizeof(PaletteColor), compare_channel[best_channel]);
+
+        guint64 total = 0, running = 0;
+        for (int i = 0; i < len; i++)
+            total += box[i].count;
+        int split = 1;
+        for (int i = 0; i < len - 1; i++) {
+            running += box[i].count;
+            split = i + 1;
+            if (running * 2 >= total)
+                break;
+        }
+
+        box_start[n_boxes] = box_start[best_box] + split;
+        box_len[n_boxes] = len - split;
+        box_len[best_box] = split;
+        n_boxes++;
+    }
+
+    for (int b = 0; b < n_boxes; b++) {
+        double sum[4] = {0, 0, 0, 0};
+        double weight = 0;
+        for (int i = box_start[b]; i < box_start[b] + box_len[b]; i++) {
+            for (int c = 0; c < 4; c++)
+                sum[c] += (double)color_channel(colors[i].color, c) *
+                          colors[i].count;
+            weight += colors[i].count;
+        }
+        guint32 color = 0;
+        for (int c = 0; c < 4; c++)
+            color = (color << 8) | (guint32)(sum[c] / weight + 0.5);
+        palette[b] = color;
+    }
+
+    g_free(box_start);
+    g_free(box_len);
+    return n_boxes;
+}
+
+/**
+ * @brief Returns the index of the palette entry closest to color.
+ */
+static int nearest_palette_entry(guint32 color,
+                                 const guint32 *palette,
+                                 int n_entries) {
+    int best = 0;
+    long best_distance = -1;
+    for (int i = 0; i < n_entries; i++) {
+        long distance = 0;
+        for (int c = 0; c < 4; c++) {
+            long d = color_channel(color, c) - color_channel(palette[i], c);
+            distance += d * d;
+        }
+        if (best_distance < 0 || distance < best_distance) {
+            best_distance = distance;
+            best = i;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Filters the index rows with one strategy and deflates them.
+ */
+static void compress_indexed_candidate(IndexedCandidate *candidate) {
+    size_t width = candidate->width;
+    size_t filtered_len = (width + 1) * candidate->height;
+    unsigned char *filtered = g_malloc(filtered_len);
+    unsigned char *zero_row = g_malloc0(width);
+    unsigned char *scratch = g_malloc(width * 5);
+
+    for (int y = 0; y < candidate->height; y++) {
+        const unsigned char *row = candidate->indices + width * y;
+        filter_row(candidate->filter,
+                   row,
+                   y > 0 ? row - width : zero_row,
+                   filtered + (width + 1) * y,
+                   width,
+                   1,
+                   scratch);
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    candidate->compressed_len = 0;
+    if (deflateInit2(&zs,
+                     Z_BEST_COMPRESSION,
+                     Z_DEFLATED,
+                     15,
+                     9, // Maximum memory level for the best ratio
+                     Z_DEFAULT_STRATEGY) == Z_OK) {
+        size_t capacity = deflateBound(&zs, filtered_len);
+        candidate->compressed = g_malloc(capacity);
+        zs.next_in = filtered;
+        zs.avail_in = filtered_len;
+        zs.next_out = candidate->compressed;
+        zs.avail_out = capacity;
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+            candidate->compressed_len = capacity - zs.avail_out;
+        deflateEnd(&zs);
+    }
+
+    g_free(filtered);
+    g_free(zero_row);
+    g_free(scratch);
+}
+
+static void candidate_worker(gpointer data, gpointer user_data) {
+    CandidateQueue *queue = data;
+    (void)user_data;
+    int i;
+    while ((i = g_atomic_int_add(&queue->next_candidate, 1)) <
+           queue->n_candidates)
+        compress_indexed_candidate(&queue->candidates[i]);
+}
+
+/**
+ * @brief Compresses every candidate on up to n_threads threads, the calling
+ *        thread included, or on the calling thread alone if n_threads is 1.
+ *        The others come from GLib's shared threads, which later images
+ *        reuse.
+ */
+static void compress_candidates(IndexedCandidate *candidates,
+                                int n_candidates,
+                                int n_threads) {
+    CandidateQueue queue = {candidates, n_candidates, 0};
+    int n_workers = MIN(n_threads, n_candidates) - 1;
+    GThreadPool *pool =
+        n_workers > 0
+            ? g_thread_pool_new(candidate_worker, NULL, n_workers, FALSE, NULL)
+            : NULL;
+    for (int i = 0; pool && i < n_workers; i++)
+        g_thread_pool_push(pool, &queue, NULL);
+    candidate_worker(&queue, NULL);
+    if (pool)
+        g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+/**
+ * @brief Encodes an image surface as an 8-bit indexed-color PNG. Images with
+ *        at most 256 colors are stored losslessly. Otherwise the most
+ *        frequent colors (the flat regions) are kept exactly and the
+ *        remaining shades are reduced by median cut. Every row filter
+ *        strategy is then compressed at the best zlib level, on the
+ *        settings' threads, and the smallest result is kept.
+ * @param stats If not NULL, receives the sizes that were compared.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+static gboolean write_png_indexed(cairo_surface_t *surface,
+                                  cairo_write_func_t write_func,
+                                  void *closure,
+                                  const PngSettings *settings,
+                                  PngPaletteStats *stats) {
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    const unsigned char *data = cairo_image_surface_get_data(surface);
+    gboolean has_alpha =
+        cairo_image_surface_get_format(surface) == CAIRO_FORMAT_ARGB32;
+
+    // Histogram of the distinct colors. Runs of identical pixels, which make
+    // up most of a screenshot, cost a single hash lookup.
+    GHashTable *histogram = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (int y = 0; y < height; y++) {
+        const guint32 *row = (const guint32 *)(data + (size_t)y * stride);
+        int x = 0;
+        while (x < width) {
+            int run = 1;
+            while (x + run < width && row[x + run] == row[x])
+                run++;
+            gpointer key =
+                GUINT_TO_POINTER(unpremultiply_pixel(row[x], has_alpha));
+            guint count = GPOINTER_TO_UINT(g_hash_table_lookup(histogram, key));
+            g_hash_table_insert(histogram, key, GUINT_TO_POINTER(count + run));
+            x += run;
+        }
+    }
+
+    int n_colors = g_hash_table_size(histogram);
+    PaletteColor *colors = g_new(PaletteColor, n_colors);
+    GHashTableIter iter;
+    gpointer key, value;
+    int n = 0;
+    g_hash_table_iter_init(&iter, histogram);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        colors[n].color = GPOINTER_TO_UINT(key);
+        colors[n].count = GPOINTER_TO_UINT(value);
+        n++;
+    }
+    g_hash_table_unref(histogram);
+    qsort(colors, n_colors, sizeof(PaletteColor), compare_by_count);
+
+    guint32 palette[PALETTE_SIZE];
+    int n_exact = n_colors <= PALETTE_SIZE
+                      ? n_colors
+                      : MIN(n_colors, PALETTE_EXACT_COLORS);
+    for (int i = 0; i < n_exact; i++)
+        palette[i] = colors[i].color;
+    int n_entries = n_exact;
+    if (n_colors > n_exact) {
+        // median_cut only reorders the tail, so colors[i] for i < n_exact
+        // still matches palette[i] below.
+        n_entries += median_cut(colors + n_exact,
+                                n_colors - n_exact,
+                                PALETTE_SIZE - n_exact,
+                                palette + n_exact);
+    }
+
+    // Map every distinct color to its palette index (stored as index + 1).
+    GHashTable *index_of = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (int i = 0; i < n_colors; i++) {
+        int index = i < n_exact ? i
+                                : nearest_palette_entry(
+                                      colors[i].color, palette, n_entries);
+        g_hash_table_insert(index_of,
+                            GUINT_TO_POINTER(colors[i].color),
+                            GINT_TO_POINTER(index + 1));
+    }
+    g_free(colors);
+
+    unsigned char *indices = g_malloc((size_t)width * height);
+    for (int y = 0; y < height; y++) {
+        const guint32 *row = (const guint32 *)(data + (size_t)y * stride);
+        unsigned char *out = indices + (size_t)width * y;
+        guint32 last_pixel = 0;
+        int last_index = -1;
+        for (int x = 0; x < width; x++) {
+            if (last_index < 0 || row[x] != last_pixel) {
+                last_pixel = row[x];
+                last_index = GPOINTER_TO_INT(g_hash_table_lookup(
+                                 index_of,
+                                 GUINT_TO_POINTER(unpremultiply_pixel(
+                                     row[x], has_alpha)))) -
+                             1;
+            }
+            out[x] = last_index;
+        }
+    }
+    g_hash_table_unref(index_of);
+
+    // Try every filter strategy and keep the smallest stream.
+    IndexedCandidate candidates[PNG_FILTER_ADAPTIVE + 1];
+    int n_candidates = PNG_FILTER_ADAPTIVE + 1;
+    for (int i = 0; i < n_candidates; i++) {
+        candidates[i].indices = indices;
+        candidates[i].width = width;
+        candidates[i].height = height;
+        candidates[i].filter = (PngFilter)i;
+        candidates[i].compressed = NULL;
+    }
+    gint64 start = g_get_monotonic_time();
+    compress_candidates(candidates,
+                        n_candidates,
+                        settings->threads > 0 ? settings->threads
+                                              : (int)g_get_num_processors());
+    IndexedCandidate *best = NULL;
+    for (int i = 0; i < n_candidates; i++) {
+        if (candidates[i].compressed_len > 0 &&
+            (!best || candidates[i].compressed_len < best->compressed_len))
+            best = &candidates[i];
+    }
+    g_free(indices);
+    if (stats) {
+        stats->n_colors = n_colors;
+        for (int i = 0; i < n_candidates; i++)
+            stats->sizes[i] = candidates[i].compressed_len;
+        stats->chosen = best ? best->filter : PNG_FILTER_ADAPTIVE;
+        stats->microseconds = g_get_monotonic_time() - start;
+    }
+
+    gboolean ok = best != NULL;
+    if (ok) {
+        static const unsigned char signature[8] = {
+            0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        unsigned char ihdr[13];
+        put_u32_be(ihdr, width);
+        put_u32_be(ihdr + 4, height);
+        ihdr[8] = 8;  // Bit depth
+        ihdr[9] = 3;  // Color type: indexed
+        ihdr[10] = 0; // Compression method
+        ihdr[11] = 0; // Filter method
+        ihdr[12] = 0; // No interlacing
+
+        unsigned char plte[PALETTE_SIZE * 3];
+        unsigned char trns[PALETTE_SIZE];
+        int trns_len = 0;
+        for (int i = 0; i < n_entries; i++) {
+            plte[i * 3] = palette[i] >> 24;
+            plte[i * 3 + 1] = (palette[i] >> 16) & 0xff;
+            plte[i * 3 + 2] = (palette[i] >> 8) & 0xff;
+            trns[i] = palette[i] & 0xff;
+            if (trns[i] != 0xff)
+                trns_len = i + 1; // Trailing opaque entries can be omitted
+        }
+
+        ok = write_bytes(write_func, closure, signature, sizeof(signature)) &&
+             write_chunk(write_func, closure, "IHDR", ihdr, sizeof(ihdr)) &&
+             write_chunk(write_func, closure, "PLTE", plte, n_entries * 3) &&
+             (trns_len == 0 ||
+              write_chunk(write_func, closure, "tRNS", trns, trns_len)) &&
+             write_chunk(write_func,
+                         closure,
+                         "IDAT",
+                         best->compressed,
+                         best->compressed_len) &&
+             write_chunk(write_func, closure, "IEND", NULL, 0);
+        if (!ok)
+            fprintf(stderr, "Could not save PNG file: write error.\n");
+    }
+
+    for (int i = 0; i < n_candidates; i++)
+        g_free(candidates[i].compressed);
+    return ok;
+}
+
+/**
+ * @brief Encodes an image surface as PNG with the built-in encoder, as
+ *        truecolor or (with optimize_size) indexed color.
+ * @param surface An ARGB32 or RGB24 image surface.
+ * @param write_func Called with the encoded bytes, in order.
+ * @param closure Passed to write_func.
+ * @param settings Compression level, row filter and thread count.
+ * @param stats If not NULL, receives the sizes an indexed-color encode
+ *        compared; its n_colors is left at 0 for truecolor.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean write_png_stream(cairo_surface_t *surface,
+                          cairo_write_func_t write_func,
+                          void *closure,
+                          const PngSettings *settings,
+                          PngPaletteStats *stats) {
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+        fprintf(stderr, "Could not save PNG file: unsupported format.\n");
+        return FALSE;
+    }
+
+    cairo_surface_flush(surface);
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+    if (settings->optimize_size)
+        return write_png_indexed(
+            surface, write_func, closure, settings, stats);
+
+    int height = cairo_image_surface_get_height(surface);
+    PngEncoder *encoder =
+        png_encoder_new(write_func,
+                        closure,
+                        cairo_image_surface_get_width(surface),
+                        height,
+                        format == CAIRO_FORMAT_ARGB32,
+                        settings);
+
+    png_encoder_write_rows(encoder,
+                           cairo_image_surface_get_data(surface),
+                           cairo_image_surface_get_stride(surface),
+                           height);
+    return png_encoder_finish(encoder);
+}
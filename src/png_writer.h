@@ -0,0 +1,91 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <cairo.h>
+#include <glib.h>
+
+// zlib levels used by the rendering modes.
+#define PNG_COMPRESSION_DEFAULT 6
+#define PNG_COMPRESSION_FASTEST 1
+
+// PNG row filter strategies. Adaptive picks the best of the other five for
+// every row, like libpng does by default.
+typedef enum {
+    PNG_FILTER_NONE,
+    PNG_FILTER_SUB,
+    PNG_FILTER_UP,
+    PNG_FILTER_AVERAGE,
+    PNG_FILTER_PAETH,
+    PNG_FILTER_ADAPTIVE
+} PngFilter;
+
+// Settings for the built-in PNG writer.
+typedef struct {
+    int compression_level; // zlib level, 0 (none) to 9 (best)
+    PngFilter filter;
+    int threads;            // Deflate worker threads; 0 means one per processor
+    gboolean optimize_size; // Quantize to an 8-bit palette, smallest output
+    gboolean verbose;       // Report the sizes optimize_size compared
+} PngSettings;
+
+// What an optimize_size encode compared: the compressed size of the image
+// with every row filter, and the one that was kept.
+typedef struct {
+    int n_colors;                          // Distinct colors of the image
+    size_t sizes[PNG_FILTER_ADAPTIVE + 1]; // Bytes per filter, 0 on failure
+    PngFilter chosen;
+    gint64 microseconds; // Time spent compressing them
+} PngPaletteStats;
+
+void png_settings_init(PngSettings *settings);
+gboolean png_filter_from_string(const char *name, PngFilter *filter);
+
+// Incremental PNG encoder fed with rows of cairo pixels.
+typedef struct PngEncoder PngEncoder;
+
+PngEncoder *png_encoder_new(cairo_write_func_t write_func,
+                            void *closure,
+                            int width,
+                            int height,
+                            gboolean has_alpha,
+                            const PngSettings *settings);
+gboolean png_encoder_write_rows(PngEncoder *encoder,
+                                const unsigned char *data,
+                                int stride,
+                                int n_rows);
+gboolean png_encoder_finish(PngEncoder *encoder);
+
+// Animated PNG encoder. Each frame after the first replaces a rectangle of
+// the previous one, so only what changed has to be compressed.
+typedef struct ApngEncoder ApngEncoder;
+
+ApngEncoder *apng_encoder_new(cairo_write_func_t write_func,
+                              void *closure,
+                              int width,
+                              int height,
+                              gboolean has_alpha,
+                              int n_frames,
+                              const PngSettings *settings);
+gboolean apng_encoder_add_frame(ApngEncoder *encoder,
+                                const unsigned char *data,
+                                int stride,
+                                int x,
+                                int y,
+                                int width,
+                                int height,
+                                int delay_num,
+                                int delay_den);
+gboolean apng_encoder_finish(ApngEncoder *encoder);
+
+// Encodes an ARGB32 or RGB24 image surface as PNG, passing the bytes to
+// write_func like cairo_surface_write_to_png_stream. Unlike cairo's writer
+// this lets the caller pick the compression level and row filters, and
+// compresses on several threads. With optimize_size the image is written as
+// an indexed-color PNG instead, and stats (if not NULL) tells how.
+gboolean write_png_stream(cairo_surface_t *surface,
+                          cairo_write_func_t write_func,
+                          void *closure,
+                          const PngSettings *settings,
+                          PngPaletteStats *stats);
+
+#endif // PNG_WRITER_H
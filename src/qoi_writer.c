@@ -0,0 +1,283 @@
+#include "qoi_writer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Opcodes of the QOI format (https://qoiformat.org/qoi-specification.pdf).
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_RUN 62
+
+// Encoded bytes are collected here and written out whenever fewer than
+// QOI_MAX_OP_SIZE bytes (an RGBA op) of room are left.
+#define QOI_BUFFER_SIZE 65536
+#define QOI_MAX_OP_SIZE 5
+
+static const unsigned char qoi_end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+typedef struct {
+    unsigned char r, g, b, a;
+} QoiPixel;
+
+struct QoiEncoder {
+    cairo_write_func_t write_func;
+    void *closure;
+    int width;
+    int height;
+    int rows_written;
+    gboolean has_alpha;
+    gboolean ok;
+    QoiPixel index[64]; // Previously seen pixels, by QOI hash
+    QoiPixel prev;      // The last pixel encoded
+    guint32 prev_pixel; // The same pixel as read from the surface
+    gboolean have_prev_pixel;
+    int run;
+    unsigned char buf[QOI_BUFFER_SIZE];
+    size_t len;
+};
+
+static void put_u32_be(unsigned char *buf, guint32 value) {
+    buf[0] = (value >> 24) & 0xff;
+    buf[1] = (value >> 16) & 0xff;
+    buf[2] = (value >> 8) & 0xff;
+    buf[3] = value & 0xff;
+}
+
+static void flush_buffer(QoiEncoder *encoder) {
+    if (encoder->ok && encoder->len > 0 &&
+        encoder->write_func(encoder->closure, encoder->buf, encoder->len) !=
+            CAIRO_STATUS_SUCCESS)
+        encoder->ok = FALSE;
+    encoder->len = 0;
+}
+
+// Makes room for one more op in the output buffer.
+static void reserve_op(QoiEncoder *encoder) {
+    if (encoder->len > QOI_BUFFER_SIZE - QOI_MAX_OP_SIZE)
+        flush_buffer(encoder);
+}
+
+/**
+ * @brief Converts a cairo pixel (native-endian, premultiplied) into the
+ * non-premultiplied RGBA QOI expects.
+ */
+static QoiPixel unpremultiply(guint32 pixel, gboolean has_alpha) {
+    QoiPixel px;
+    guint32 alpha = has_alpha ? (pixel >> 24) : 0xff;
+    guint32 r = (pixel >> 16) & 0xff;
+    guint32 g = (pixel >> 8) & 0xff;
+    guint32 b = pixel & 0xff;
+
+    if (alpha == 0) {
+        r = g = b = 0;
+    } else if (alpha != 0xff) {
+        r = (r * 255 + alpha / 2) / alpha;
+        g = (g * 255 + alpha / 2) / alpha;
+        b = (b * 255 + alpha / 2) / alpha;
+    }
+    px.r = r;
+    px.g = g;
+    px.b = b;
+    px.a = alpha;
+    return px;
+}
+
+static gboolean pixel_equal(QoiPixel a, QoiPixel b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static void emit_run(QoiEncoder *encoder) {
+    reserve_op(encoder);
+    encoder->buf[encoder->len++] = QOI_OP_RUN | (encoder->run - 1);
+    encoder->run = 0;
+}
+
+/**
+ * @brief Appends the shortest op that turns the previous pixel into px.
+ */
+static void encode_pixel(QoiEncoder *encoder, QoiPixel px) {
+    reserve_op(encoder);
+    unsigned char *op = encoder->buf + encoder->len;
+    QoiPixel prev = encoder->prev;
+    int hash = (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+    encoder->prev = px;
+
+    if (pixel_equal(encoder->index[hash], px)) {
+        op[0] = QOI_OP_INDEX | hash;
+        encoder->len += 1;
+        return;
+    }
+    encoder->index[hash] = px;
+
+    if (px.a != prev.a) {
+        op[0] = QOI_OP_RGBA;
+        op[1] = px.r;
+        op[2] = px.g;
+        op[3] = px.b;
+        op[4] = px.a;
+        encoder->len += 5;
+        return;
+    }
+
+    signed char dr = px.r - prev.r;
+    signed char dg = px.g - prev.g;
+    signed char db = px.b - prev.b;
+    signed char dr_dg = dr - dg;
+    signed char db_dg = db - dg;
+
+    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+        op[0] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+        encoder->len += 1;
+    } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+               db_dg >= -8 && db_dg <= 7) {
+        op[0] = QOI_OP_LUMA | (dg + 32);
+        op[1] = (dr_dg + 8) << 4 | (db_dg + 8);
+        encoder->len += 2;
+    } else {
+        op[0] = QOI_OP_RGB;
+        op[1] = px.r;
+        op[2] = px.g;
+        op[3] = px.b;
+        encoder->len += 4;
+    }
+}
+
+/**
+ * @brief Starts a QOI image that is filled in row by row.
+ * @param write_func Called with the encoded bytes, in order.
+ * @param closure Passed to write_func.
+ * @param width The image width in pixels.
+ * @param height The image height in pixels.
+ * @param has_alpha Whether to write RGBA (TRUE) or RGB (FALSE) pixels.
+ * @return A new encoder.
+ */
+QoiEncoder *qoi_encoder_new(cairo_write_func_t write_func,
+                            void *closure,
+                            int width,
+                            int height,
+                            gboolean has_alpha) {
+    QoiEncoder *encoder = g_new0(QoiEncoder, 1);
+    encoder->write_func = write_func;
+    encoder->closure = closure;
+    encoder->width = width;
+    encoder->height = height;
+    encoder->has_alpha = has_alpha;
+    encoder->ok = TRUE;
+    encoder->prev.a = 0xff;
+
+    memcpy(encoder->buf, "qoif", 4);
+    put_u32_be(encoder->buf + 4, width);
+    put_u32_be(encoder->buf + 8, height);
+    encoder->buf[12] = has_alpha ? 4 : 3; // Channels
+    encoder->buf[13] = 0;                 // sRGB with linear alpha
+    encoder->len = QOI_HEADER_SIZE;
+
+    return encoder;
+}
+
+/**
+ * @brief Appends rows of cairo ARGB32/RGB24 pixels to the image, reading
+ *        them in place. Runs of identical cairo pixels are detected before
+ *        any conversion, so the flat backgrounds that make up most of a
+ *        screenshot cost one comparison per pixel.
+ * @param encoder The encoder returned by qoi_encoder_new.
+ * @param data The first row to encode.
+ * @param stride The distance in bytes between rows in data.
+ * @param n_rows The number of rows to encode.
+ * @return TRUE on success, FALSE on failure.
+ */
+gboolean qoi_encoder_write_rows(QoiEncoder *encoder,
+                                const unsigned char *data,
+                                int stride,
+                                int n_rows) {
+    if (encoder->rows_written + n_rows > encoder->height)
+        encoder->ok = FALSE;
+    if (!encoder->ok)
+        return FALSE;
+
+    // QOI treats the image as one stream of pixels, so runs and the previous
+    // pixel carry over from one row (and one batch of rows) to the next.
+    for (int y = 0; y < n_rows; y++) {
+        const guint32 *row = (const guint32 *)(data + (size_t)y * stride);
+        for (int x = 0; x < encoder->width; x++) {
+            guint32 pixel =
+                encoder->has_alpha ? row[x] : row[x] | 0xff000000;
+            if (!encoder->have_prev_pixel || pixel != encoder->prev_pixel) {
+                QoiPixel px = unpremultiply(pixel, encoder->has_alpha);
+                encoder->have_prev_pixel = TRUE;
+                encoder->prev_pixel = pixel;
+                if (!pixel_equal(px, encoder->prev)) {
+                    if (encoder->run > 0)
+                        emit_run(encoder);
+                    encode_pixel(encoder, px);
+                    continue;
+                }
+            }
+            if (++encoder->run == QOI_MAX_RUN)
+                emit_run(encoder);
+        }
+    }
+
+    encoder->rows_written += n_rows;
+    return encoder->ok;
+}
+
+/**
+ * @brief Writes the end of the image and frees the encoder. Fails if fewer
+ *        rows than the image height were written.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean qoi_encoder_finish(QoiEncoder *encoder) {
+    if (encoder->run > 0)
+        emit_run(encoder);
+    flush_buffer(encoder);
+
+    gboolean ok = encoder->ok && encoder->rows_written == encoder->height &&
+                  encoder->write_func(encoder->closure,
+                                      qoi_end_marker,
+                                      sizeof(qoi_end_marker)) ==
+                      CAIRO_STATUS_SUCCESS;
+    if (!ok)
+        fprintf(stderr, "Could not save QOI file: write error.\n");
+
+    g_free(encoder);
+    return ok;
+}
+
+/**
+ * @brief Encodes an image surface as QOI straight from its pixel rows.
+ * @param surface An ARGB32 or RGB24 image surface.
+ * @param write_func Called with the encoded bytes, in order.
+ * @param closure Passed to write_func.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean write_qoi_stream(cairo_surface_t *surface,
+                          cairo_write_func_t write_func,
+                          void *closure) {
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+        fprintf(stderr, "Could not save QOI file: unsupported format.\n");
+        return FALSE;
+    }
+
+    cairo_surface_flush(surface);
+    int height = cairo_image_surface_get_height(surface);
+    QoiEncoder *encoder =
+        qoi_encoder_new(write_func,
+                        closure,
+                        cairo_image_surface_get_width(surface),
+                        height,
+                        format == CAIRO_FORMAT_ARGB32);
+
+    qoi_encoder_write_rows(encoder,
+                           cairo_image_surface_get_data(surface),
+                           cairo_image_surface_get_stride(surface),
+                           height);
+    return qoi_encoder_finish(encoder);
+}
@@ -0,0 +1,28 @@
+#ifndef QOI_WRITER_H
+#define QOI_WRITER_H
+
+#include <cairo.h>
+#include <glib.h>
+
+// Incremental QOI ("Quite OK Image") encoder fed with rows of cairo pixels.
+// QOI is lossless and encodes an order of magnitude faster than PNG.
+typedef struct QoiEncoder QoiEncoder;
+
+QoiEncoder *qoi_encoder_new(cairo_write_func_t write_func,
+                            void *closure,
+                            int width,
+                            int height,
+                            gboolean has_alpha);
+gboolean qoi_encoder_write_rows(QoiEncoder *encoder,
+                                const unsigned char *data,
+                                int stride,
+                                int n_rows);
+gboolean qoi_encoder_finish(QoiEncoder *encoder);
+
+// Encodes an ARGB32 or RGB24 image surface as QOI, reading the pixels
+// straight from the surface data and passing the bytes to write_func.
+gboolean write_qoi_stream(cairo_surface_t *surface,
+                          cairo_write_func_t write_func,
+                          void *closure);
+
+#endif // QOI_WRITER_H
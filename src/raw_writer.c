@@ -0,0 +1,211 @@
+// ftruncate, fcntl and mmap are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include "raw_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct RawEncoder {
+    cairo_write_func_t write_func;
+    void *closure;
+    int width;
+    int height;
+    int rows_written;
+    gboolean ok;
+};
+
+// Unmaps a raw image when the surface drawn into it is destroyed.
+typedef struct {
+    void *data;
+    size_t size;
+} RawMapping;
+
+static const cairo_user_data_key_t raw_mapping_key;
+
+static void put_u32_le(unsigned char *buf, guint32 value) {
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+    buf[2] = (value >> 16) & 0xff;
+    buf[3] = (value >> 24) & 0xff;
+}
+
+static void fill_header(unsigned char *header, int width, int height) {
+    memcpy(header, "SCRW", 4);
+    put_u32_le(header + 4, width);
+    put_u32_le(header + 8, height);
+    put_u32_le(header + 12, (guint32)width * 4);
+}
+
+/**
+ * @brief Starts a raw image that is filled in row by row.
+ * @param write_func Called with the header and the pixel rows, in order.
+ * @param closure Passed to write_func.
+ * @param width The image width in pixels.
+ * @param height The image height in pixels.
+ * @return A new encoder.
+ */
+RawEncoder *raw_encoder_new(cairo_write_func_t write_func,
+                            void *closure,
+                            int width,
+                            int height) {
+    RawEncoder *encoder = g_new0(RawEncoder, 1);
+    encoder->write_func = write_func;
+    encoder->closure = closure;
+    encoder->width = width;
+    encoder->height = height;
+
+    unsigned char header[RAW_HEADER_SIZE];
+    fill_header(header, width, height);
+    encoder->ok = write_func(closure, header, sizeof(header)) ==
+                  CAIRO_STATUS_SUCCESS;
+    return encoder;
+}
+
+/**
+ * @brief Appends rows of cairo ARGB32 pixels as they are. Rows without
+ *        padding are written with a single call.
+ * @return TRUE on success, FALSE on failure.
+ */
+gboolean raw_encoder_write_rows(RawEncoder *encoder,
+                                const unsigned char *data,
+                                int stride,
+                                int n_rows) {
+    if (encoder->rows_written + n_rows > encoder->height)
+        encoder->ok = FALSE;
+    if (!encoder->ok)
+        return FALSE;
+
+    size_t row_bytes = (size_t)encoder->width * 4;
+    if ((size_t)stride == row_bytes) {
+        encoder->ok = encoder->write_func(encoder->closure,
+                                          data,
+                                          row_bytes * n_rows) ==
+                      CAIRO_STATUS_SUCCESS;
+    } else {
+        for (int y = 0; encoder->ok && y < n_rows; y++)
+            encoder->ok = encoder->write_func(encoder->closure,
+                                              data + (size_t)y * stride,
+                                              row_bytes) ==
+                          CAIRO_STATUS_SUCCESS;
+    }
+
+    encoder->rows_written += n_rows;
+    return encoder->ok;
+}
+
+/**
+ * @brief Frees the encoder. Fails if fewer rows than the image height were
+ *        written.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean raw_encoder_finish(RawEncoder *encoder) {
+    gboolean ok = encoder->ok && encoder->rows_written == encoder->height;
+    if (!ok)
+        fprintf(stderr, "Could not save raw image: write error.\n");
+    g_free(encoder);
+    return ok;
+}
+
+/**
+ * @brief Writes the header and the pixel rows of an ARGB32 image surface.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean write_raw_stream(cairo_surface_t *surface,
+                          cairo_write_func_t write_func,
+                          void *closure) {
+    if (cairo_image_surface_get_format(surface) != CAIRO_FORMAT_ARGB32) {
+        fprintf(stderr, "Could not save raw image: unsupported format.\n");
+        return FALSE;
+    }
+
+    cairo_surface_flush(surface);
+    int height = cairo_image_surface_get_height(surface);
+    RawEncoder *encoder =
+        raw_encoder_new(write_func,
+                        closure,
+                        cairo_image_surface_get_width(surface),
+                        height);
+    raw_encoder_write_rows(encoder,
+                           cairo_image_surface_get_data(surface),
+                           cairo_image_surface_get_stride(surface),
+                           height);
+    return raw_encoder_finish(encoder);
+}
+
+/**
+ * @brief Decides whether a raw image can be drawn straight into fd: it must
+ *        be a regular file (which includes memfds), positioned at its start
+ *        and not in append mode. Pipes and terminals are streamed instead.
+ */
+gboolean raw_fd_is_mappable(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return FALSE;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (flags & O_APPEND) || (flags & O_ACCMODE) != O_RDWR)
+        return FALSE;
+    return lseek(fd, 0, SEEK_CUR) == 0;
+}
+
+static void unmap_raw_image(void *data) {
+    RawMapping *mapping = data;
+    munmap(mapping->data, mapping->size);
+    g_free(mapping);
+}
+
+/**
+ * @brief Sizes fd to hold a width x height raw image, writes the header and
+ *        returns an ARGB32 surface whose pixels are a shared mapping of the
+ *        rest of the file. Whatever is drawn on the surface is the output;
+ *        destroying the surface unmaps it.
+ * @return The surface, or NULL on failure (an error is printed).
+ */
+cairo_surface_t *raw_surface_map_fd(int fd, int width, int height) {
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+    size_t size = RAW_HEADER_SIZE + (size_t)stride * height;
+    if (stride != width * 4) {
+        fprintf(stderr, "Could not map raw image: unexpected row stride.\n");
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)size) != 0) {
+        fprintf(stderr,
+                "Could not resize fd %d for the raw image: %s\n",
+                fd,
+                strerror(errno));
+        return NULL;
+    }
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map fd %d: %s\n", fd, strerror(errno));
+        return NULL;
+    }
+    fill_header(data, width, height);
+
+    cairo_surface_t *surface =
+        cairo_image_surface_create_for_data((unsigned char *)data +
+                                                RAW_HEADER_SIZE,
+                                            CAIRO_FORMAT_ARGB32,
+                                            width,
+                                            height,
+                                            stride);
+    RawMapping *mapping = g_new(RawMapping, 1);
+    mapping->data = data;
+    mapping->size = size;
+    if (cairo_surface_set_user_data(
+            surface, &raw_mapping_key, mapping, unmap_raw_image) !=
+        CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr,
+                "Could not map raw image: %s\n",
+                cairo_status_to_string(cairo_surface_status(surface)));
+        cairo_surface_destroy(surface);
+        unmap_raw_image(mapping);
+        return NULL;
+    }
+    return surface;
+}
@@ -0,0 +1,35 @@
+#ifndef RAW_WRITER_H
+#define RAW_WRITER_H
+
+#include <cairo.h>
+#include <glib.h>
+
+// Raw output is a RAW_HEADER_SIZE byte header followed by the pixel rows,
+// top to bottom. The header is the magic "SCRW" and then the width, height
+// and stride (bytes per row) as 32-bit little-endian integers. Pixels are
+// cairo ARGB32: premultiplied, one native-endian 32-bit word per pixel.
+#define RAW_HEADER_SIZE 16
+
+// Incremental raw encoder fed with rows of cairo ARGB32 pixels.
+typedef struct RawEncoder RawEncoder;
+
+RawEncoder *raw_encoder_new(cairo_write_func_t write_func,
+                            void *closure,
+                            int width,
+                            int height);
+gboolean raw_encoder_write_rows(RawEncoder *encoder,
+                                const unsigned char *data,
+                                int stride,
+                                int n_rows);
+gboolean raw_encoder_finish(RawEncoder *encoder);
+
+gboolean write_raw_stream(cairo_surface_t *surface,
+                          cairo_write_func_t write_func,
+                          void *closure);
+
+// Raw images written to a regular file or memfd are drawn straight into a
+// shared mapping of it, so the pixels are never copied.
+gboolean raw_fd_is_mappable(int fd);
+cairo_surface_t *raw_surface_map_fd(int fd, int width, int height);
+
+#endif // RAW_WRITER_H
@@ -0,0 +1,916 @@
+#include "render.h"
+
+#include <math.h>
+#include <stdio.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#include "line_cache.h"
+#include "screenshot.h"
+#include "title_drawing.h"
+
+// Strips are drawn with the line's origin snapped to a quarter of a device
+// pixel, so that a line is drawn at most 16 ways per device scale however
+// the windows and bands around it fall; glyphs move by an eighth of a pixel
+// at most, below what antialiasing shows.
+#define LINE_STRIP_PHASES 4
+
+// Strips wider or taller than this, in device pixels, are not cached: the
+// line is drawn straight onto the image instead.
+#define LINE_STRIP_MAX_SIZE 32767
+
+struct CodeLine {
+    char *key;           // Line cache key
+    const char *markup;  // The line's markup, owned by the CodeLayout
+    PangoLayout *shaped; // The line shaped on its own, once drawn, or NULL
+    LineMetrics metrics;
+    int top; // Pango units from the top of the text
+};
+
+/**
+ * @brief Fills in the default rendering options.
+ * @param opts The options structure to initialize.
+ */
+void render_options_init(RenderOptions *opts) {
+    opts->lang = LANG_UNKNOWN;
+    opts->use_gradient_header = TRUE;
+    opts->show_line_numbers = FALSE;
+    opts->no_color = FALSE;
+    opts->title = NULL;
+    opts->title_size = 12; // Default title font size
+    opts->scale = 1.0;
+    opts->quality = RENDER_QUALITY_DEFAULT;
+    opts->deadline = 0;
+}
+
+/**
+ * @brief Tells whether layout has run past the deadline in its options.
+ */
+static gboolean past_deadline(const RenderOptions *opts) {
+    return opts->deadline > 0 && g_get_monotonic_time() > opts->deadline;
+}
+
+// Pango objects shared by the layouts made on one thread: a context per
+// quality and the code font. Pango objects must stay on the thread that
+// made them, so each thread has its own, set up by its first layout and
+// kept until the thread exits (or render_shutdown), so that the fonts are
+// only resolved once per thread.
+typedef struct {
+    PangoContext *contexts[RENDER_QUALITY_DRAFT + 1];
+    PangoFontDescription *code_font;
+} RenderThreadState;
+
+static void render_thread_state_free(gpointer data) {
+    RenderThreadState *state = data;
+    for (int i = 0; i <= RENDER_QUALITY_DRAFT; i++) {
+        if (state->contexts[i])
+            g_object_unref(state->contexts[i]);
+    }
+    if (state->code_font)
+        pango_font_description_free(state->code_font);
+    g_free(state);
+}
+
+static GPrivate render_thread_state = G_PRIVATE_INIT(render_thread_state_free);
+
+static RenderThreadState *get_render_thread_state(void) {
+    RenderThreadState *state = g_private_get(&render_thread_state);
+    if (!state) {
+        state = g_new0(RenderThreadState, 1);
+        state->code_font = pango_font_description_from_string(FONT);
+        g_private_set(&render_thread_state, state);
+    }
+    return state;
+}
+
+/**
+ * @brief Returns this thread's Pango context for a rendering quality,
+ *        creating it on first use. It is created from the thread's default
+ *        font map, so no throwaway surface is needed, and metric hinting is
+ *        turned off so layouts stay identical whatever device scale they are
+ *        drawn at. Draft quality also turns off glyph antialiasing and
+ *        hinting.
+ */
+static PangoContext *shared_context(RenderThreadState *state,
+                                    RenderQuality quality) {
+    if (state->contexts[quality])
+        return state->contexts[quality];
+
+    PangoContext *context =
+        pango_font_map_create_context(pango_cairo_font_map_get_default());
+    cairo_font_options_t *font_options = cairo_font_options_create();
+    cairo_font_options_set_hint_metrics(font_options, CAIRO_HINT_METRICS_OFF);
+    if (quality == RENDER_QUALITY_DRAFT) {
+        cairo_font_options_set_antialias(font_options, CAIRO_ANTIALIAS_NONE);
+        cairo_font_options_set_hint_style(font_options,
+                                          CAIRO_HINT_STYLE_NONE);
+    }
+    pango_cairo_context_set_font_options(context, font_options);
+    cairo_font_options_destroy(font_options);
+    state->contexts[quality] = context;
+    return context;
+}
+
+/**
+ * @brief Releases the calling thread's Pango contexts and font. Layouts
+ *        still alive keep their own reference to their context.
+ */
+void render_shutdown(void) {
+    g_private_replace(&render_thread_state, NULL);
+}
+
+/**
+ * @brief Measures a line shaped on its own as its own layout would place
+ *        it in the whole text.
+ */
+static void measure_line(PangoLayout *layout, LineMetrics *metrics) {
+    PangoRectangle logical;
+    pango_layout_get_extents(layout, NULL, &logical);
+    metrics->x = logical.x;
+    metrics->width = logical.width;
+    metrics->height = logical.height;
+    metrics->baseline = pango_layout_get_baseline(layout);
+}
+
+static void free_lines(CodeLine *lines, int n_lines) {
+    for (int i = 0; i < n_lines; i++) {
+        g_free(lines[i].key);
+        if (lines[i].shaped)
+            g_object_unref(lines[i].shaped);
+    }
+    g_free(lines);
+}
+
+/**
+ * @brief Lays the text out one line at a time, taking the metrics of the
+ *        lines seen before (in this file or any other) from the line cache,
+ *        and shaping only the others. Lines are stacked as a layout of the
+ *        whole text would stack them, so the image has the same size.
+ * @return TRUE on success, FALSE if a line's markup does not stand on its
+ *         own, in which case the caller lays the whole text out instead, or
+ *         if the deadline passed, which is checked between lines.
+ */
+static gboolean lay_out_lines(CodeLayout *code_layout,
+                              const char *highlighted_text,
+                              const RenderOptions *opts) {
+    RenderQuality quality = opts->quality;
+    char **markup = g_strsplit(highlighted_text, "\n", -1);
+    int n_lines = g_strv_length(markup);
+    if (n_lines == 0) {
+        g_strfreev(markup);
+        return FALSE;
+    }
+
+    CodeLine *lines = g_new0(CodeLine, n_lines);
+    int top = 0, left = G_MAXINT, right = G_MININT;
+    for (int i = 0; i < n_lines; i++) {
+        CodeLine *line = &lines[i];
+        line->key = line_cache_key(markup[i], quality);
+        line->markup = markup[i];
+        line->top = top;
+        if (!line_cache_get_metrics(line->key, &line->metrics)) {
+            if (past_deadline(opts)) {
+                free_lines(lines, i + 1);
+                g_strfreev(markup);
+                return FALSE;
+            }
+            line->shaped = code_layout_shape_line(code_layout, markup[i]);
+            if (!line->shaped) {
+                free_lines(lines, i + 1);
+                g_strfreev(markup);
+                return FALSE;
+            }
+            measure_line(line->shaped, &line->metrics);
+            line_cache_put_metrics(line->key, &line->metrics);
+        }
+        top += line->metrics.height;
+        left = MIN(left, line->metrics.x);
+        right = MAX(right, line->metrics.x + line->metrics.width);
+    }
+
+    // Rounded outwards, as pango_layout_get_pixel_size does.
+    int text_width_pixels = PANGO_PIXELS_CEIL(right) - PANGO_PIXELS_FLOOR(left);
+    int text_height_pixels = PANGO_PIXELS_CEIL(top);
+    code_layout->lines = lines;
+    code_layout->markup = markup;
+    code_layout->width = text_width_pixels + (2 * PADDING);
+    code_layout->height = HEADER_HEIGHT + text_height_pixels + (2 * PADDING);
+    code_layout->text_height = text_height_pixels;
+    code_layout->line_count = n_lines;
+    return TRUE;
+}
+
+/**
+ * @brief Shapes the highlighted markup once and measures the image it needs.
+ *        The layout is made on the calling thread's context for its
+ *        quality, and must only be used on that thread. With the line cache
+ *        open, the text is laid out line by line instead, and lines are only
+ *        shaped when they are first seen or drawn.
+ * @param highlighted_text The Pango markup produced by highlight_syntax.
+ * @param opts The rendering options.
+ * @return A new CodeLayout, or NULL on failure or past opts->deadline.
+ */
+CodeLayout *code_layout_new(const char *highlighted_text,
+                            const RenderOptions *opts) {
+    CodeLayout *code_layout = g_new0(CodeLayout, 1);
+    if (!code_layout)
+        return NULL;
+
+    RenderThreadState *state = get_render_thread_state();
+    code_layout->context = g_object_ref(shared_context(state, opts->quality));
+    if (line_cache_enabled() &&
+        lay_out_lines(code_layout, highlighted_text, opts))
+        return code_layout;
+
+    // Shaping the whole text cannot be interrupted; the line by line layout
+    // above checks the deadline as it goes.
+    if (past_deadline(opts)) {
+        code_layout_free(code_layout);
+        return NULL;
+    }
+
+    code_layout->layout = pango_layout_new(code_layout->context);
+    pango_layout_set_font_description(code_layout->layout, state->code_font);
+    pango_layout_set_markup(code_layout->layout, highlighted_text, -1);
+
+    int text_width_pixels, text_height_pixels;
+    pango_layout_get_pixel_size(
+        code_layout->layout, &text_width_pixels, &text_height_pixels);
+
+    // Calculate image dimensions based on the text size
+    code_layout->width = text_width_pixels + (2 * PADDING);
+    code_layout->height = HEADER_HEIGHT + text_height_pixels + (2 * PADDING);
+    code_layout->text_height = text_height_pixels;
+    code_layout->line_count = pango_layout_get_line_count(code_layout->layout);
+
+    return code_layout;
+}
+
+/**
+ * @brief Estimates the logical size of the image of a text from its line
+ *        count and longest line, in characters, without shaping any of it:
+ *        every character is taken to be as wide as the code font's average
+ *        one, and every line as tall as the font.
+ * @return TRUE on success, FALSE if the font has no metrics.
+ */
+gboolean code_layout_estimate_size(const RenderOptions *opts,
+                                   gint64 n_lines,
+                                   gint64 longest_line,
+                                   double *width,
+                                   double *height) {
+    RenderThreadState *state = get_render_thread_state();
+    PangoFontMetrics *metrics =
+        pango_context_get_metrics(shared_context(state, opts->quality),
+                                  state->code_font,
+                                  NULL);
+    if (!metrics)
+        return FALSE;
+    double char_width =
+        (double)pango_font_metrics_get_approximate_char_width(metrics) /
+        PANGO_SCALE;
+    double line_height = (double)(pango_font_metrics_get_ascent(metrics) +
+                                  pango_font_metrics_get_descent(metrics)) /
+                         PANGO_SCALE;
+    pango_font_metrics_unref(metrics);
+    *width = longest_line * char_width + (2 * PADDING);
+    *height = HEADER_HEIGHT + n_lines * line_height + (2 * PADDING);
+    return TRUE;
+}
+
+/**
+ * @brief Shapes one line of markup on its own, with the context and font of
+ *        a code layout, so that it can replace that line of the layout
+ *        without shaping the rest again.
+ * @param code_layout The layout the line belongs to.
+ * @param markup The line's markup, without its newline.
+ * @return A new layout of exactly one line, or NULL if the markup is not
+ *         valid on its own or makes several lines.
+ */
+PangoLayout *code_layout_shape_line(const CodeLayout *code_layout,
+                                    const char *markup) {
+    PangoAttrList *attrs;
+    char *text;
+    if (!pango_parse_markup(markup, -1, 0, &attrs, &text, NULL, NULL))
+        return NULL;
+
+    PangoLayout *layout = pango_layout_new(code_layout->context);
+    pango_layout_set_font_description(layout,
+                                      get_render_thread_state()->code_font);
+    pango_layout_set_text(layout, text, -1);
+    pango_layout_set_attributes(layout, attrs);
+    pango_attr_list_unref(attrs);
+    g_free(text);
+    if (pango_layout_get_line_count(layout) != 1) {
+        g_object_unref(layout);
+        return NULL;
+    }
+    return layout;
+}
+
+/**
+ * @brief Gives the whole text as one Pango layout, for callers that walk
+ *        its characters. A layout laid out line by line shapes the whole
+ *        text for it.
+ * @return A new reference to the layout.
+ */
+PangoLayout *code_layout_pango_layout(const CodeLayout *code_layout) {
+    if (code_layout->layout)
+        return g_object_ref(code_layout->layout);
+
+    char *markup = g_strjoinv("\n", code_layout->markup);
+    PangoLayout *layout = pango_layout_new(code_layout->context);
+    pango_layout_set_font_description(layout,
+                                      get_render_thread_state()->code_font);
+    pango_layout_set_markup(layout, markup, -1);
+    g_free(markup);
+    return layout;
+}
+
+/**
+ * @brief Copies where every line of a layout sits, with each line's markup,
+ *        so that other threads can draw parts of the text without shaping
+ *        the rest (see code_layout_new_view). Must be called on the thread
+ *        that made the layout; the copy holds no Pango object and may be
+ *        used on any thread.
+ * @param highlighted_text The markup the layout was shaped from.
+ * @return The copy, to be freed with code_layout_free, or NULL if the
+ *         layout's lines are not the markup's lines (Pango also breaks
+ *         lines at carriage returns).
+ */
+CodeLayout *code_layout_export(const CodeLayout *code_layout,
+                               const char *highlighted_text) {
+    int n_lines = code_layout->line_count;
+    char **markup = code_layout->markup
+                        ? g_strdupv(code_layout->markup)
+                        : g_strsplit(highlighted_text, "\n", -1);
+    if ((int)g_strv_length(markup) != n_lines) {
+        g_strfreev(markup);
+        return NULL;
+    }
+
+    CodeLayout *exported = g_new0(CodeLayout, 1);
+    exported->lines = g_new0(CodeLine, n_lines);
+    exported->markup = markup;
+    exported->width = code_layout->width;
+    exported->height = code_layout->height;
+    exported->text_height = code_layout->text_height;
+    exported->line_count = n_lines;
+    if (code_layout->lines) {
+        for (int i = 0; i < n_lines; i++) {
+            exported->lines[i] = code_layout->lines[i];
+            exported->lines[i].key = g_strdup(code_layout->lines[i].key);
+            exported->lines[i].markup = markup[i];
+            exported->lines[i].shaped = NULL;
+        }
+        return exported;
+    }
+
+    // Lines of the whole text have no line cache key, so that they are
+    // drawn with their glyphs, exactly as the whole layout draws them.
+    PangoLayoutIter *iter = pango_layout_get_iter(code_layout->layout);
+    for (int i = 0; i < n_lines; i++) {
+        CodeLine *line = &exported->lines[i];
+        int y0, y1;
+        PangoRectangle logical;
+        pango_layout_iter_get_line_yrange(iter, &y0, &y1);
+        pango_layout_iter_get_line_extents(iter, NULL, &logical);
+        line->markup = markup[i];
+        line->top = y0;
+        line->metrics.x = logical.x;
+        line->metrics.width = logical.width;
+        line->metrics.height = y1 - y0;
+        line->metrics.baseline = pango_layout_iter_get_baseline(iter) - y0;
+        pango_layout_iter_next_line(iter);
+    }
+    pango_layout_iter_free(iter);
+    return exported;
+}
+
+/**
+ * @brief Makes a layout on the calling thread from one made by
+ *        code_layout_export, without shaping anything: each line is shaped
+ *        on its own when it is first drawn, so drawing a band of a long
+ *        text only shapes the band's lines. The view is only for drawing.
+ * @param exported The copy, which must outlive the view.
+ * @return A new CodeLayout.
+ */
+CodeLayout *code_layout_new_view(const CodeLayout *exported,
+                                 const RenderOptions *opts) {
+    CodeLayout *view = g_new0(CodeLayout, 1);
+    view->context = g_object_ref(
+        shared_context(get_render_thread_state(), opts->quality));
+    view->lines = g_new(CodeLine, exported->line_count);
+    for (int i = 0; i < exported->line_count; i++) {
+        view->lines[i] = exported->lines[i];
+        view->lines[i].key = g_strdup(exported->lines[i].key);
+    }
+    view->width = exported->width;
+    view->height = exported->height;
+    view->text_height = exported->text_height;
+    view->line_count = exported->line_count;
+    return view;
+}
+
+/**
+ * @brief Frees a CodeLayout and the Pango objects it owns.
+ */
+void code_layout_free(CodeLayout *code_layout) {
+    if (!code_layout)
+        return;
+    if (code_layout->layout)
+        g_object_unref(code_layout->layout);
+    if (code_layout->lines)
+        free_lines(code_layout->lines, code_layout->line_count);
+    g_strfreev(code_layout->markup);
+    if (code_layout->context)
+        g_object_unref(code_layout->context);
+    g_free(code_layout);
+}
+
+/**
+ * @brief Finds the vertical extent of a run of lines, so that a long file can
+ * be split into pages that never cut through a line.
+ * @param code_layout The shaped code text.
+ * @param first_line Index of the first line of the run.
+ * @param n_lines Number of lines in the run (clamped to the end of the text).
+ * @param range Receives the extent of the run in logical units.
+ * @return TRUE on success, FALSE if first_line is past the last line.
+ */
+gboolean code_layout_line_range(const CodeLayout *code_layout,
+                                int first_line,
+                                int n_lines,
+                                TextRange *range) {
+    if (first_line < 0 || first_line >= code_layout->line_count || n_lines < 1)
+        return FALSE;
+
+    int last_line = MIN(first_line + n_lines, code_layout->line_count) - 1;
+    if (code_layout->lines) {
+        const CodeLine *first = &code_layout->lines[first_line];
+        const CodeLine *last = &code_layout->lines[last_line];
+        int bottom = last->top + last->metrics.height;
+        range->top = (double)first->top / PANGO_SCALE;
+        range->height = (double)(bottom - first->top) / PANGO_SCALE;
+        return TRUE;
+    }
+
+    PangoLayoutIter *iter = pango_layout_get_iter(code_layout->layout);
+    int y0 = 0, y1 = 0;
+    for (int line = 0; line <= last_line; line++) {
+        int line_y0, line_y1;
+        pango_layout_iter_get_line_yrange(iter, &line_y0, &line_y1);
+        if (line == first_line)
+            y0 = line_y0;
+        y1 = line_y1;
+        if (!pango_layout_iter_next_line(iter))
+            break;
+    }
+    pango_layout_iter_free(iter);
+
+    range->top = (double)y0 / PANGO_SCALE;
+    range->height = (double)(y1 - y0) / PANGO_SCALE;
+    return TRUE;
+}
+
+/**
+ * @brief Returns the logical height of a window showing the given text range.
+ */
+double render_window_height(const TextRange *range) {
+    return HEADER_HEIGHT + range->height + (2 * PADDING);
+}
+
+/**
+ * @brief Gives the logical position of the top-left corner of the code text
+ *        inside a window.
+ */
+void render_text_origin(double *x, double *y) {
+    *x = PADDING;
+    *y = PADDING / 2 + HEADER_HEIGHT + (PADDING / 2);
+}
+
+/**
+ * @brief Draws one line of the code text in the default text color, with
+ *        the spans' own colors on top.
+ * @param cr The cairo drawing context.
+ * @param line The line to draw.
+ * @param x Logical x position of the start of the line.
+ * @param baseline Logical y position of the line's baseline.
+ */
+void render_code_line(cairo_t *cr,
+                      PangoLayoutLine *line,
+                      double x,
+                      double baseline) {
+    cairo_set_source_rgb(cr, 0.6627, 0.6941, 0.8392); // Text color
+    cairo_move_to(cr, x, baseline);
+    pango_cairo_show_layout_line(cr, line);
+}
+
+/**
+ * @brief Gives the Pango line of a line laid out on its own, shaping it on
+ *        first use.
+ * @return The line, or NULL if its markup does not parse.
+ */
+static PangoLayoutLine *shaped_line(const CodeLayout *code_layout,
+                                    CodeLine *line) {
+    if (!line->shaped)
+        line->shaped = code_layout_shape_line(code_layout, line->markup);
+    return line->shaped ? pango_layout_get_line_readonly(line->shaped, 0)
+                        : NULL;
+}
+
+/**
+ * @brief Draws a line into a new strip, with its origin at a sub-pixel
+ *        position, at a device scale.
+ * @return The strip, or NULL if the line could not be drawn or is too large
+ *         for one.
+ */
+static LineStrip *draw_strip(PangoLayoutLine *line,
+                             double scale,
+                             double phase_x,
+                             double phase_y) {
+    PangoRectangle ink;
+    pango_layout_line_get_extents(line, &ink, NULL);
+    if (ink.width <= 0 || ink.height <= 0)
+        return line_strip_new(0, 0, 0, 0);
+
+    // One pixel more on each side for the antialiasing of the glyphs' edges.
+    int x0 = (int)floor(phase_x + (double)ink.x / PANGO_SCALE * scale) - 1;
+    int y0 = (int)floor(phase_y + (double)ink.y / PANGO_SCALE * scale) - 1;
+    int x1 = (int)ceil(phase_x +
+                       (double)(ink.x + ink.width) / PANGO_SCALE * scale) +
+             1;
+    int y1 = (int)ceil(phase_y +
+                       (double)(ink.y + ink.height) / PANGO_SCALE * scale) +
+             1;
+    if (x1 - x0 > LINE_STRIP_MAX_SIZE || y1 - y0 > LINE_STRIP_MAX_SIZE)
+        return NULL;
+
+    LineStrip *strip = line_strip_new(x0, y0, x1 - x0, y1 - y0);
+    cairo_surface_t *surface =
+        cairo_image_surface_create_for_data(strip->pixels,
+                                            CAIRO_FORMAT_ARGB32,
+                                            strip->width,
+                                            strip->height,
+                                            strip->stride);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        line_strip_unref(strip);
+        return NULL;
+    }
+    cairo_surface_set_device_scale(surface, scale, scale);
+    cairo_surface_set_device_offset(surface, phase_x - x0, phase_y - y0);
+    cairo_t *cr = cairo_create(surface);
+    render_code_line(cr, line, 0, 0);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    return strip;
+}
+
+/**
+ * @brief Draws a line onto an image from its strip in the line cache,
+ *        drawing the strip first if it is not there.
+ * @param x Logical x position of the start of the line.
+ * @param baseline Logical y position of the line's baseline.
+ * @return TRUE if the line was drawn, FALSE if it has to be drawn with
+ *         Pango instead.
+ */
+static gboolean draw_line_strip(cairo_t *cr,
+                                const CodeLayout *code_layout,
+                                CodeLine *line,
+                                double x,
+                                double baseline) {
+    double scale = 1, skew = 0;
+    cairo_user_to_device_distance(cr, &scale, &skew);
+    double scale_y = 0, skew_y = 1;
+    cairo_user_to_device_distance(cr, &skew_y, &scale_y);
+    if (scale <= 0 || scale != scale_y || skew != 0 || skew_y != 0)
+        return FALSE;
+
+    double origin_x = x, origin_y = baseline;
+    cairo_user_to_device(cr, &origin_x, &origin_y);
+    double pixel_x = floor(origin_x), pixel_y = floor(origin_y);
+    int phase_x = (int)round((origin_x - pixel_x) * LINE_STRIP_PHASES);
+    int phase_y = (int)round((origin_y - pixel_y) * LINE_STRIP_PHASES);
+    if (phase_x == LINE_STRIP_PHASES) {
+        pixel_x++;
+        phase_x = 0;
+    }
+    if (phase_y == LINE_STRIP_PHASES) {
+        pixel_y++;
+        phase_y = 0;
+    }
+
+    char *key = line_cache_strip_key(line->key, scale, phase_x, phase_y);
+    LineStrip *strip = line_cache_get_strip(key);
+    if (!strip) {
+        PangoLayoutLine *pango_line = shaped_line(code_layout, line);
+        if (pango_line)
+            strip = draw_strip(pango_line,
+                               scale,
+                               (double)phase_x / LINE_STRIP_PHASES,
+                               (double)phase_y / LINE_STRIP_PHASES);
+        if (strip)
+            line_cache_put_strip(key, strip);
+    }
+    g_free(key);
+    if (!strip)
+        return FALSE;
+
+    if (strip->pixels) {
+        cairo_surface_t *surface =
+            cairo_image_surface_create_for_data(strip->pixels,
+                                                CAIRO_FORMAT_ARGB32,
+                                                strip->width,
+                                                strip->height,
+                                                strip->stride);
+        cairo_surface_set_device_scale(surface, scale, scale);
+        double strip_x = pixel_x + strip->x, strip_y = pixel_y + strip->y;
+        cairo_device_to_user(cr, &strip_x, &strip_y);
+        cairo_save(cr);
+        cairo_set_source_surface(cr, surface, strip_x, strip_y);
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+        cairo_paint(cr);
+        cairo_restore(cr);
+        cairo_surface_destroy(surface);
+    }
+    line_strip_unref(strip);
+    return TRUE;
+}
+
+/**
+ * @brief Draws the lines of a layout laid out line by line that fall inside
+ *        [visible_top, visible_bottom). Images are composited from the
+ *        lines' strips; other targets (PDF, SVG) get the glyphs.
+ */
+static void draw_cached_lines(cairo_t *cr,
+                              const CodeLayout *code_layout,
+                              double x,
+                              double y,
+                              const TextRange *range,
+                              double visible_top,
+                              double visible_bottom) {
+    gboolean raster = cairo_surface_get_type(cairo_get_target(cr)) ==
+                      CAIRO_SURFACE_TYPE_IMAGE;
+
+    // The first line ending below the top of the visible part.
+    int low = 0, high = code_layout->line_count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        const CodeLine *line = &code_layout->lines[mid];
+        if ((double)(line->top + line->metrics.height) / PANGO_SCALE <=
+            visible_top)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (int i = low; i < code_layout->line_count; i++) {
+        CodeLine *line = &code_layout->lines[i];
+        if ((double)line->top / PANGO_SCALE >= visible_bottom)
+            break;
+
+        double line_x = x + (double)line->metrics.x / PANGO_SCALE;
+        double baseline =
+            y + (double)(line->top + line->metrics.baseline) / PANGO_SCALE -
+            range->top;
+        if (raster && line->key &&
+            draw_line_strip(cr, code_layout, line, line_x, baseline))
+            continue;
+        PangoLayoutLine *pango_line = shaped_line(code_layout, line);
+        if (pango_line)
+            render_code_line(cr, pango_line, line_x, baseline);
+    }
+}
+
+/**
+ * @brief Draws the lines of the layout that fall inside a text range and the
+ *        current clip. Lines outside either are skipped without being drawn,
+ *        so rendering a band of a very long file only touches its own lines.
+ * @param cr The cairo drawing context.
+ * @param code_layout The shaped code text.
+ * @param x Logical x position of the text.
+ * @param y Logical y position where the top of the range is drawn.
+ * @param range The part of the text to draw.
+ */
+static void draw_code_lines(cairo_t *cr,
+                            const CodeLayout *code_layout,
+                            double x,
+                            double y,
+                            const TextRange *range) {
+    double clip_x1, clip_y1, clip_x2, clip_y2;
+    cairo_clip_extents(cr, &clip_x1, &clip_y1, &clip_x2, &clip_y2);
+    double visible_top = MAX(range->top, clip_y1 - y + range->top);
+    double visible_bottom =
+        MIN(range->top + range->height, clip_y2 - y + range->top);
+    if (code_layout->lines) {
+        draw_cached_lines(
+            cr, code_layout, x, y, range, visible_top, visible_bottom);
+        return;
+    }
+
+    PangoLayoutIter *iter = pango_layout_get_iter(code_layout->layout);
+    do {
+        int line_y0, line_y1;
+        pango_layout_iter_get_line_yrange(iter, &line_y0, &line_y1);
+        double top = (double)line_y0 / PANGO_SCALE;
+        double bottom = (double)line_y1 / PANGO_SCALE;
+        if (top >= visible_bottom)
+            break;
+        if (bottom <= visible_top)
+            continue;
+
+        PangoRectangle logical;
+        pango_layout_iter_get_line_extents(iter, NULL, &logical);
+        double baseline =
+            (double)pango_layout_iter_get_baseline(iter) / PANGO_SCALE;
+        render_code_line(cr,
+                         pango_layout_iter_get_line_readonly(iter),
+                         x + (double)logical.x / PANGO_SCALE,
+                         y + baseline - range->top);
+    } while (pango_layout_iter_next_line(iter));
+    pango_layout_iter_free(iter);
+}
+
+// Helper function to draw the window header with properly rounded bottom
+// corners.
+static void draw_header(cairo_t *cr,
+                        double x,
+                        double y,
+                        double width,
+                        double height,
+                        double radius,
+                        gboolean use_gradient) {
+    cairo_new_sub_path(cr);
+    cairo_arc(cr, x + width - radius, y + height - radius, radius, 0, M_PI / 2);
+    cairo_arc(cr, x + radius, y + height - radius, radius, M_PI / 2, M_PI);
+    cairo_line_to(cr, x, y);
+    cairo_line_to(cr, x + width, y);
+    cairo_close_path(cr);
+
+    if (use_gradient) {
+        cairo_pattern_t *header_pat =
+            cairo_pattern_create_linear(0, y, 0, y + height);
+        cairo_pattern_add_color_stop_rgb(header_pat, 0, 0.18, 0.19, 0.25);
+        cairo_pattern_add_color_stop_rgb(header_pat, 1, 0.141, 0.157, 0.231);
+        cairo_set_source(cr, header_pat);
+        cairo_pattern_destroy(header_pat);
+    } else {
+        cairo_set_source_rgb(cr, 0.141, 0.157, 0.231); // Solid color
+    }
+    cairo_fill(cr);
+}
+
+/**
+ * @brief Draws the background, window chrome, title and the whole code text.
+ * @param cr The cairo drawing context.
+ * @param code_layout The shaped code text and logical image size.
+ * @param opts The rendering options.
+ */
+void render_screenshot(cairo_t *cr,
+                       const CodeLayout *code_layout,
+                       const RenderOptions *opts) {
+    TextRange range = {0, code_layout->text_height};
+    render_text_range(cr, code_layout, opts, &range);
+}
+
+/**
+ * @brief Draws a window sized for a text range (background, shadow, frame,
+ *        header and title) without the code text itself. Draft quality
+ *        skips the shadow and replaces gradients with flat fills.
+ * @param cr The cairo drawing context.
+ * @param code_layout The shaped code text.
+ * @param opts The rendering options.
+ * @param range The part of the text the window is sized for.
+ */
+void render_window_chrome(cairo_t *cr,
+                          const CodeLayout *code_layout,
+                          const RenderOptions *opts,
+                          const TextRange *range) {
+    double img_width = code_layout->width;
+    double img_height = render_window_height(range);
+    gboolean draft = opts->quality == RENDER_QUALITY_DRAFT;
+
+    if (draft) {
+        cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+        cairo_set_source_rgb(cr, 0.102, 0.106, 0.149); // Flat background
+        cairo_paint(cr);
+    } else {
+        cairo_pattern_t *pat =
+            cairo_pattern_create_linear(0, 0, img_width, img_height);
+        cairo_pattern_add_color_stop_rgba(pat, 0, 0.102, 0.106, 0.149, 1);
+        cairo_pattern_add_color_stop_rgba(pat, 1, 0.141, 0.157, 0.231, 1);
+        cairo_rectangle(cr, 0, 0, img_width, img_height);
+        cairo_set_source(cr, pat);
+        cairo_fill(cr);
+        cairo_pattern_destroy(pat);
+
+        cairo_set_source_rgba(cr, 0, 0, 0, 0.4);
+        draw_rounded_rectangle(cr,
+                               PADDING / 2 + SHADOW_OFFSET,
+                               PADDING / 2 + SHADOW_OFFSET,
+                               img_width - PADDING,
+                               img_height - PADDING,
+                               BORDER_RADIUS);
+        cairo_fill(cr);
+    }
+
+    cairo_set_source_rgb(cr, 0.141, 0.157, 0.231);
+    draw_rounded_rectangle(cr,
+                           PADDING / 2,
+                           PADDING / 2,
+                           img_width - PADDING,
+                           img_height - PADDING,
+                           BORDER_RADIUS);
+    cairo_fill(cr);
+
+    draw_header(cr,
+                PADDING / 2,
+                PADDING / 2,
+                img_width - PADDING,
+                HEADER_HEIGHT,
+                BORDER_RADIUS,
+                opts->use_gradient_header && !draft);
+
+    cairo_set_source_rgb(cr, 0.9686, 0.4627, 0.5569); // Red
+    cairo_arc(
+        cr, PADDING / 2 + 20, PADDING / 2 + HEADER_HEIGHT / 2, 7, 0, 2 * M_PI);
+    cairo_fill(cr);
+
+    cairo_set_source_rgb(cr, 0.8784, 0.6863, 0.4078); // Yellow
+    cairo_arc(
+        cr, PADDING / 2 + 45, PADDING / 2 + HEADER_HEIGHT / 2, 7, 0, 2 * M_PI);
+    cairo_fill(cr);
+
+    cairo_set_source_rgb(cr, 0.6196, 0.8078, 0.4157); // Green
+    cairo_arc(
+        cr, PADDING / 2 + 70, PADDING / 2 + HEADER_HEIGHT / 2, 7, 0, 2 * M_PI);
+    cairo_fill(cr);
+
+    // Draw the custom title if provided
+    draw_window_title(cr, opts->title, img_width, opts->title_size);
+}
+
+/**
+ * @brief Draws a window showing part of the code text, with its own chrome.
+ *        Everything is drawn in logical units; callers that want a HiDPI
+ *        image set a device scale on the target surface instead, and callers
+ *        rendering in bands set a device offset and clip.
+ * @param cr The cairo drawing context.
+ * @param code_layout The shaped code text.
+ * @param opts The rendering options.
+ * @param range The part of the text shown in the window.
+ */
+void render_text_range(cairo_t *cr,
+                       const CodeLayout *code_layout,
+                       const RenderOptions *opts,
+                       const TextRange *range) {
+    render_window_chrome(cr, code_layout, opts, range);
+
+    double text_x, text_y;
+    render_text_origin(&text_x, &text_y);
+    draw_code_lines(cr, code_layout, text_x, text_y, range);
+}
+
+/**
+ * @brief Rasterizes a layout into an existing image surface of
+ *        ceil(width x scale) by ceil(height x scale) pixels, such as one
+ *        backed by shared memory.
+ */
+void render_into_image_surface(cairo_surface_t *surface,
+                               const CodeLayout *code_layout,
+                               const RenderOptions *opts) {
+    cairo_surface_set_device_scale(surface, opts->scale, opts->scale);
+
+    cairo_t *cr = cairo_create(surface);
+    render_screenshot(cr, code_layout, opts);
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+}
+
+/**
+ * @brief Rasterizes a layout into a new ARGB32 image surface.
+ *        The surface is opts->scale times larger than the logical size and
+ *        carries a matching device scale, so the chrome and the already
+ *        shaped text are scaled together without laying anything out again.
+ * @return The new surface, or NULL if it could not be created.
+ */
+cairo_surface_t *render_to_image_surface(const CodeLayout *code_layout,
+                                         const RenderOptions *opts) {
+    int pixel_width = (int)ceil(code_layout->width * opts->scale);
+    int pixel_height = (int)ceil(code_layout->height * opts->scale);
+
+    cairo_surface_t *surface = cairo_image_surface_create(
+        CAIRO_FORMAT_ARGB32, pixel_width, pixel_height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr,
+                "Could not create a %dx%d image surface: %s\n",
+                pixel_width,
+                pixel_height,
+                cairo_status_to_string(cairo_surface_status(surface)));
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+    render_into_image_surface(surface, code_layout, opts);
+    return surface;
+}
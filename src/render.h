@@ -0,0 +1,97 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <cairo.h>
+#include <glib.h>
+#include <pango/pangocairo.h>
+
+#include "syntax_highlighting.h"
+
+// Rendering quality. Draft trades antialiasing, hinting, the drop shadow and
+// gradients for the lowest possible latency per image.
+typedef enum { RENDER_QUALITY_DEFAULT, RENDER_QUALITY_DRAFT } RenderQuality;
+
+// Options that control how a single screenshot is rendered.
+typedef struct {
+    LanguageType lang;
+    gboolean use_gradient_header;
+    gboolean show_line_numbers;
+    gboolean no_color;
+    const char *title;
+    int title_size;
+    double scale; // Device scale used when rasterizing (1.0 means 1x).
+    RenderQuality quality;
+    gint64 deadline; // Monotonic time layout gives up at, or 0
+} RenderOptions;
+
+// A line of a layout laid out on its own, through the line cache.
+typedef struct CodeLine CodeLine;
+
+// The shaped code text together with the logical size of the final image.
+// All sizes are in logical units; the device scale only affects how many
+// pixels are produced when the layout is rasterized.
+typedef struct {
+    PangoContext *context;
+    PangoLayout *layout; // The whole text, or NULL if laid out line by line
+    CodeLine *lines;     // Per line if laid out line by line, or NULL
+    char **markup;       // Per line, likewise
+    double width;
+    double height;
+    double text_height;
+    int line_count;
+} CodeLayout;
+
+// A vertical slice of the code text, in logical units, shown in one window.
+// A full screenshot shows [0, text_height); pages show a run of lines.
+typedef struct {
+    double top;
+    double height;
+} TextRange;
+
+void render_options_init(RenderOptions *opts);
+
+CodeLayout *code_layout_new(const char *highlighted_text,
+                            const RenderOptions *opts);
+gboolean code_layout_estimate_size(const RenderOptions *opts,
+                                   gint64 n_lines,
+                                   gint64 longest_line,
+                                   double *width,
+                                   double *height);
+PangoLayout *code_layout_shape_line(const CodeLayout *code_layout,
+                                    const char *markup);
+PangoLayout *code_layout_pango_layout(const CodeLayout *code_layout);
+CodeLayout *code_layout_export(const CodeLayout *code_layout,
+                               const char *highlighted_text);
+CodeLayout *code_layout_new_view(const CodeLayout *exported,
+                                 const RenderOptions *opts);
+void code_layout_free(CodeLayout *code_layout);
+void render_shutdown(void);
+gboolean code_layout_line_range(const CodeLayout *code_layout,
+                                int first_line,
+                                int n_lines,
+                                TextRange *range);
+double render_window_height(const TextRange *range);
+
+void render_text_origin(double *x, double *y);
+void render_code_line(cairo_t *cr,
+                      PangoLayoutLine *line,
+                      double x,
+                      double baseline);
+void render_window_chrome(cairo_t *cr,
+                          const CodeLayout *code_layout,
+                          const RenderOptions *opts,
+                          const TextRange *range);
+void render_screenshot(cairo_t *cr,
+                       const CodeLayout *code_layout,
+                       const RenderOptions *opts);
+void render_text_range(cairo_t *cr,
+                       const CodeLayout *code_layout,
+                       const RenderOptions *opts,
+                       const TextRange *range);
+void render_into_image_surface(cairo_surface_t *surface,
+                               const CodeLayout *code_layout,
+                               const RenderOptions *opts);
+cairo_surface_t *render_to_image_surface(const CodeLayout *code_layout,
+                                         const RenderOptions *opts);
+
+#endif // RENDER_H
@@ -0,0 +1,361 @@
+#include "schedule.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "input_text.h"
+#include "screenshot.h"
+#include "tiled_render.h"
+
+// Rough size of a character cell and of a line of the code font (FONT at
+// 96 dpi), in logical units, to size images without laying them out.
+#define SCHEDULE_CHAR_WIDTH 9.6
+#define SCHEDULE_LINE_HEIGHT 19.0
+
+// Columns of the line number gutter, when line numbers are shown.
+#define SCHEDULE_LINE_NUMBER_COLUMNS 5
+
+// Average bytes per line of source code, and the columns its longest line
+// is assumed to have, to size images of texts whose lines were not counted.
+#define SCHEDULE_BYTES_PER_LINE 32
+#define SCHEDULE_ESTIMATED_COLUMNS 100
+
+// Bytes of text each byte of a compressed input is assumed to expand to,
+// when its format does not record the size of the text.
+#define SCHEDULE_COMPRESSION_RATIO 4
+
+// Time to highlight and lay out one byte of input, relative to the time to
+// rasterize and encode one pixel.
+#define SCHEDULE_PIXELS_PER_BYTE 100.0
+
+struct MemoryBudget {
+    GMutex mutex;
+    GCond cond;
+    gint64 total;
+    gint64 available;
+};
+
+// An item and its cost, to sort items by.
+typedef struct {
+    int index;
+    double cost;
+} ScheduledItem;
+
+// The items of a batch, estimated by several threads at once.
+typedef struct {
+    BatchItem *items;
+    int n_items;
+    JobCost *costs;
+    gboolean *known; // Per item: whether its input could be sized
+    gint next_item;
+} CostEstimates;
+
+/**
+ * @brief Fills in the size of a text from what is known of it: its lines
+ *        and longest line as counted, or else guessed from its length.
+ */
+static void estimate_text(const InputEstimate *input, JobCost *cost) {
+    size_t bytes = (size_t)input->length;
+    if (input->compressed)
+        bytes = MIN(bytes, G_MAXSIZE / SCHEDULE_COMPRESSION_RATIO) *
+                SCHEDULE_COMPRESSION_RATIO;
+    cost->bytes = bytes;
+    if (input->n_lines >= 0) {
+        cost->lines = (int)MIN(input->n_lines, G_MAXINT);
+        cost->longest_line = (int)MIN(input->longest_line, G_MAXINT);
+        return;
+    }
+    cost->lines = (int)MIN(bytes / SCHEDULE_BYTES_PER_LINE + (bytes > 0),
+                           G_MAXINT);
+    cost->longest_line = (int)MIN(bytes, SCHEDULE_ESTIMATED_COLUMNS);
+}
+
+/**
+ * @brief Resolves the format of an output as job_render will, with the
+ *        job's -format applying unless the output sets its own.
+ */
+static OutputFormat job_output_format(const Job *job, const OutputSpec *spec) {
+    OutputSpec resolved = *spec;
+    if (resolved.format == OUTPUT_FORMAT_AUTO)
+        resolved.format = job->format;
+    return output_spec_format(&resolved);
+}
+
+/**
+ * @brief Tells whether an output is a single image a row encoder can
+ *        write in bands: a still PNG, QOI or raw image of one page.
+ */
+static gboolean output_can_band(const Job *job, const OutputSpec *spec) {
+    OutputFormat format = job_output_format(job, spec);
+    return (format == OUTPUT_FORMAT_PNG || format == OUTPUT_FORMAT_QOI ||
+            format == OUTPUT_FORMAT_RAW) &&
+           spec->animation.fps == 0 && job->animation.fps == 0 &&
+           spec->page_lines == 0 && job->page_lines == 0;
+}
+
+/**
+ * @brief Estimates the size in pixels of an output's image from the size of
+ *        the job's text, as code_layout_new would measure it.
+ */
+static void estimate_image_size(const Job *job,
+                                const OutputSpec *spec,
+                                const JobCost *cost,
+                                double *pixel_width,
+                                double *pixel_height) {
+    int columns = cost->longest_line;
+    if (job->opts.show_line_numbers)
+        columns += SCHEDULE_LINE_NUMBER_COLUMNS;
+    double width = 2 * PADDING + columns * SCHEDULE_CHAR_WIDTH;
+    double height =
+        HEADER_HEIGHT + 2 * PADDING + cost->lines * SCHEDULE_LINE_HEIGHT;
+
+    double scale = job->opts.scale;
+    if (spec->scale > 0)
+        scale = spec->scale;
+    else if (spec->width > 0)
+        scale = spec->width / width;
+    *pixel_width = ceil(width * scale);
+    *pixel_height = ceil(height * scale);
+}
+
+/**
+ * @brief Estimates the pixels of every raster output of a job, and the
+ *        surface memory they hold at once: a full-size surface per image,
+ *        or a band for images drawn in bands.
+ */
+static void estimate_outputs(const Job *job, JobCost *cost) {
+    cost->pixels = 0;
+    cost->canvas_bytes = 0;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        const OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        OutputFormat format = job_output_format(job, spec);
+        // Text and vector outputs are not rasterized here.
+        if (!output_format_needs_layout(format) ||
+            format == OUTPUT_FORMAT_SVG || format == OUTPUT_FORMAT_PDF)
+            continue;
+
+        double pixel_width, pixel_height;
+        estimate_image_size(job, spec, cost, &pixel_width, &pixel_height);
+        double pixels = pixel_width * pixel_height;
+        cost->pixels += pixels;
+
+        int band_height =
+            spec->band_height > 0 ? spec->band_height : job->band_height;
+        gboolean banded = band_height > 0 || spec->page_lines > 0 ||
+                          job->page_lines > 0 ||
+                          (format != OUTPUT_FORMAT_WEBP &&
+                           spec->animation.fps == 0 &&
+                           job->animation.fps == 0 &&
+                           pixels > TILED_RENDER_PIXEL_THRESHOLD);
+        if (banded)
+            cost->canvas_bytes +=
+                (gint64)pixel_width *
+                (band_height > 0 ? band_height : DEFAULT_BAND_HEIGHT) * 4;
+        else
+            cost->canvas_bytes += (gint64)pixels * 4;
+    }
+    cost->cost = cost->bytes * SCHEDULE_PIXELS_PER_BYTE + cost->pixels;
+}
+
+/**
+ * @brief Estimates what a job will cost from its input text (its bytes,
+ *        lines and longest line) and its outputs (their scale). A
+ *        prefetched text, or a regular file within -max-bytes, is scanned
+ *        for its lines (see input_text_estimate); the length of compressed
+ *        files and git blobs is read from their headers and their lines are
+ *        guessed from it. An input that cannot be sized up front is
+ *        reported by the job when it opens it.
+ * @return TRUE on success, FALSE if the input cannot be sized up front
+ *         (stdin, a pipe, a missing file): its text then counts as empty.
+ */
+gboolean job_cost_estimate(const Job *job, JobCost *cost) {
+    memset(cost, 0, sizeof(*cost));
+    InputEstimate input = {0, -1, -1, FALSE};
+    gboolean known = TRUE;
+    if (job->prefetched_input) {
+        input.length = input_text_length(job->prefetched_input);
+        input_text_measure(
+            job->prefetched_input, &input.n_lines, &input.longest_line);
+    } else {
+        known = input_text_estimate(job->input_filename,
+                                    job->input_from_git,
+                                    job_input_limit(job).max_bytes,
+                                    &input);
+    }
+    if (known)
+        estimate_text(&input, cost);
+    estimate_outputs(job, cost);
+    return known;
+}
+
+/**
+ * @brief Estimates the items of a batch until none is left.
+ */
+static gpointer estimate_worker(gpointer data) {
+    CostEstimates *estimates = data;
+    int i;
+    while ((i = g_atomic_int_add(&estimates->next_item, 1)) <
+           estimates->n_items) {
+        BatchItem *item = &estimates->items[i];
+        if (item->ok)
+            estimates->known[i] =
+                job_cost_estimate(&item->job, &estimates->costs[i]);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Estimates every item of a batch, on n_threads threads, since each
+ *        file is scanned. An item whose input cannot be sized up front is
+ *        given the text of the largest one that can, so that it starts
+ *        early and reserves its share of the memory budget rather than
+ *        running last.
+ */
+static void estimate_items(BatchItem *items,
+                           int n_items,
+                           int n_threads,
+                           JobCost *costs) {
+    CostEstimates estimates = {
+        items, n_items, costs, g_new0(gboolean, MAX(n_items, 1)), 0};
+    n_threads = MIN(n_threads, n_items);
+    GThread **threads = g_new(GThread *, MAX(n_threads, 1));
+    for (int i = 1; i < n_threads; i++)
+        threads[i] = g_thread_new("estimate", estimate_worker, &estimates);
+    estimate_worker(&estimates);
+    for (int i = 1; i < n_threads; i++)
+        g_thread_join(threads[i]);
+    g_free(threads);
+
+    const JobCost *largest = NULL;
+    for (int i = 0; i < n_items; i++) {
+        if (estimates.known[i] &&
+            (!largest || costs[i].bytes > largest->bytes))
+            largest = &costs[i];
+    }
+    for (int i = 0; largest && i < n_items; i++) {
+        if (!items[i].ok || estimates.known[i])
+            continue;
+        costs[i].bytes = largest->bytes;
+        costs[i].lines = largest->lines;
+        costs[i].longest_line = largest->longest_line;
+        estimate_outputs(&items[i].job, &costs[i]);
+    }
+    g_free(estimates.known);
+}
+
+static int compare_scheduled_items(const void *a, const void *b) {
+    const ScheduledItem *item_a = a;
+    const ScheduledItem *item_b = b;
+    if (item_a->cost != item_b->cost)
+        return item_a->cost > item_b->cost ? -1 : 1;
+    return item_a->index - item_b->index;
+}
+
+/**
+ * @brief Plans a batch from the estimated cost of each item. With several
+ *        workers, items run longest first, so that the largest files start
+ *        early instead of keeping one thread busy after all the others are
+ *        done. An item
+ *        costing more than an even share of the whole batch per worker has
+ *        its images drawn in bands that idle workers help with, and an
+ *        image whose surface would not fit the memory budget is drawn in
+ *        bands. A single worker runs the items in the given order, one at
+ *        a time, so nothing is estimated for it and no memory is reserved.
+ * @param memory_budget Bytes of surfaces that may be held at once.
+ */
+void schedule_batch(BatchItem *items,
+                    int n_items,
+                    int n_workers,
+                    gint64 memory_budget,
+                    BatchSchedule *schedule) {
+    schedule->order = g_new(int, MAX(n_items, 1));
+    schedule->memory = g_new0(gint64, MAX(n_items, 1));
+    schedule->shared = g_new0(gboolean, MAX(n_items, 1));
+    if (n_workers <= 1) {
+        for (int i = 0; i < n_items; i++)
+            schedule->order[i] = i;
+        return;
+    }
+
+    ScheduledItem *sorted = g_new(ScheduledItem, MAX(n_items, 1));
+    JobCost *costs = g_new0(JobCost, MAX(n_items, 1));
+    estimate_items(items, n_items, n_workers, costs);
+    double total_cost = 0;
+    for (int i = 0; i < n_items; i++) {
+        total_cost += costs[i].cost;
+        sorted[i].index = i;
+        sorted[i].cost = costs[i].cost;
+    }
+    qsort(sorted, n_items, sizeof(*sorted), compare_scheduled_items);
+
+    for (int i = 0; i < n_items; i++) {
+        schedule->order[i] = sorted[i].index;
+        Job *job = &items[i].job;
+        if (!items[i].ok)
+            continue;
+
+        gboolean large = costs[i].cost > total_cost / n_workers;
+        for (guint j = 0; j < job->outputs->len; j++) {
+            OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, j);
+            if (!output_can_band(job, spec))
+                continue;
+            double pixel_width, pixel_height;
+            estimate_image_size(
+                job, spec, &costs[i], &pixel_width, &pixel_height);
+            if (!large && pixel_width * pixel_height * 4 <= memory_budget)
+                continue;
+            spec->share_bands = large;
+            schedule->shared[i] = schedule->shared[i] || large;
+            if (spec->band_height == 0 && job->band_height == 0)
+                spec->band_height = DEFAULT_BAND_HEIGHT;
+        }
+        estimate_outputs(job, &costs[i]);
+        schedule->memory[i] = MIN(costs[i].canvas_bytes, memory_budget);
+    }
+    g_free(sorted);
+    g_free(costs);
+}
+
+void batch_schedule_clear(BatchSchedule *schedule) {
+    g_free(schedule->order);
+    g_free(schedule->memory);
+    g_free(schedule->shared);
+}
+
+MemoryBudget *memory_budget_new(gint64 bytes) {
+    MemoryBudget *budget = g_new0(MemoryBudget, 1);
+    g_mutex_init(&budget->mutex);
+    g_cond_init(&budget->cond);
+    budget->total = bytes;
+    budget->available = bytes;
+    return budget;
+}
+
+/**
+ * @brief Reserves bytes of the budget, waiting until other items release
+ *        enough. A reservation larger than the whole budget waits for all
+ *        of it.
+ */
+void memory_budget_acquire(MemoryBudget *budget, gint64 bytes) {
+    bytes = MIN(bytes, budget->total);
+    g_mutex_lock(&budget->mutex);
+    while (budget->available < bytes)
+        g_cond_wait(&budget->cond, &budget->mutex);
+    budget->available -= bytes;
+    g_mutex_unlock(&budget->mutex);
+}
+
+void memory_budget_release(MemoryBudget *budget, gint64 bytes) {
+    bytes = MIN(bytes, budget->total);
+    g_mutex_lock(&budget->mutex);
+    budget->available += bytes;
+    g_cond_broadcast(&budget->cond);
+    g_mutex_unlock(&budget->mutex);
+}
+
+void memory_budget_free(MemoryBudget *budget) {
+    g_mutex_clear(&budget->mutex);
+    g_cond_clear(&budget->cond);
+    g_free(budget);
+}
@@ -0,0 +1,46 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <glib.h>
+
+#include "batch.h"
+#include "job.h"
+
+// What a job is expected to cost, estimated before it runs from its input
+// and outputs alone.
+typedef struct {
+    size_t bytes;        // Size of the input text, after decompression
+    int lines;           // Lines of the input, counted or guessed from bytes
+    int longest_line;    // Columns of its longest line, likewise
+    double pixels;       // Pixels rasterized over every output
+    gint64 canvas_bytes; // Full-size surfaces held at once while it runs
+    double cost;         // Relative run time
+} JobCost;
+
+gboolean job_cost_estimate(const Job *job, JobCost *cost);
+
+// How the items of a batch are run: longest first, with the bytes of
+// surface memory each reserves from the batch's budget while it runs.
+typedef struct {
+    int *order;       // Indices of the items, the costliest first
+    gint64 *memory;   // Per item: bytes reserved from the budget
+    gboolean *shared; // Per item: idle threads help draw its images
+} BatchSchedule;
+
+void schedule_batch(BatchItem *items,
+                    int n_items,
+                    int n_workers,
+                    gint64 memory_budget,
+                    BatchSchedule *schedule);
+void batch_schedule_clear(BatchSchedule *schedule);
+
+// Surface memory shared by the items rendered at once. An item waits until
+// what it reserves fits in what the others leave.
+typedef struct MemoryBudget MemoryBudget;
+
+MemoryBudget *memory_budget_new(gint64 bytes);
+void memory_budget_acquire(MemoryBudget *budget, gint64 bytes);
+void memory_budget_release(MemoryBudget *budget, gint64 bytes);
+void memory_budget_free(MemoryBudget *budget);
+
+#endif // SCHEDULE_H
@@ -0,0 +1,692 @@
+// sigaction, poll and the socket calls are POSIX, not C99; CMSG_SPACE and
+// the file sealing flags are GNU extensions.
+#define _GNU_SOURCE
+
+#include "serve.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "input_text.h"
+#include "render.h"
+#include "shared_buffer.h"
+#include "syntax_highlighting.h"
+
+// Largest frame a client may send: a command line or an input text.
+#define SERVE_MAX_FRAME (64 * 1024 * 1024)
+
+// Set in a frame's length when the payload is a file descriptor sent with
+// the header (SCM_RIGHTS) instead of bytes; the rest is the file's size.
+#define SERVE_FRAME_FD 0x80000000u
+
+// Connections the kernel queues before the daemon accepts them.
+#define SERVE_BACKLOG 64
+
+// Time a client has to send the whole of a request once it has begun, so
+// that one stalling in the middle of a frame does not hold a worker.
+#define SERVE_REQUEST_TIMEOUT_MS 10000
+
+// Time a write of a reply may block on a client that does not read it.
+#define SERVE_SEND_TIMEOUT_S 10
+
+// Pushed to the connection queue once per worker when the daemon stops.
+#define SERVE_STOP GINT_TO_POINTER(-1)
+
+// What the workers of a daemon share. Between requests, connections wait
+// in the accepting thread's poll set, so an idle client holds no worker.
+typedef struct {
+    const Job *defaults;
+    int listen_fd; // Non-blocking, so that a client that gave up between
+                   // poll and accept does not block the daemon
+    GAsyncQueue *connections; // Descriptors + 1 of connections with a
+                              // request waiting, or SERVE_STOP
+    GAsyncQueue *idle; // Descriptors + 1 handed back by the workers
+    int wake_pipe[2];  // Written to when a connection is handed back
+} Server;
+
+// Written to by the signal handler; readable once the daemon is stopping.
+static int stop_pipe[2] = {-1, -1};
+
+static void handle_stop_signal(int signum) {
+    (void)signum;
+    int saved_errno = errno;
+    ssize_t written = write(stop_pipe[1], "x", 1);
+    (void)written;
+    errno = saved_errno;
+}
+
+/**
+ * @brief Waits until fd is readable, the deadline passes or the daemon is
+ *        stopping.
+ * @param deadline Monotonic time in microseconds, or 0 for none.
+ * @return TRUE if fd is readable, FALSE otherwise.
+ */
+static gboolean wait_readable(int fd, gint64 deadline) {
+    struct pollfd fds[2] = {{fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+    for (;;) {
+        int timeout = -1;
+        if (deadline > 0) {
+            gint64 left = deadline - g_get_monotonic_time();
+            if (left <= 0) {
+                fprintf(stderr,
+                        "Error: a client took too long to send its "
+                        "request.\n");
+                return FALSE;
+            }
+            timeout = (int)MIN((left + 999) / 1000, G_MAXINT);
+        }
+        int n = poll(fds, 2, timeout);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || fds[1].revents)
+            return FALSE;
+        if (fds[0].revents)
+            return TRUE;
+    }
+}
+
+/**
+ * @brief Reads exactly length bytes, giving up at the deadline.
+ * @param deadline Monotonic time in microseconds, or 0 for none.
+ */
+static gboolean read_full(int fd, void *data, size_t length, gint64 deadline) {
+    size_t done = 0;
+    while (done < length) {
+        if (!wait_readable(fd, deadline))
+            return FALSE;
+        ssize_t n = read(fd, (char *)data + done, length - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        done += n;
+    }
+    return TRUE;
+}
+
+static gboolean write_full(int fd, const void *data, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, (const char *)data + done, length - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        done += n;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Reads a frame's header, and the descriptor sent with it, if any.
+ * @param payload_fd Receives the descriptor, or -1.
+ * @param deadline Monotonic time in microseconds to give up at.
+ * @return TRUE on success, FALSE at the end of the connection, on an error
+ *         or past the deadline.
+ */
+static gboolean read_header(int fd,
+                            guint32 *size,
+                            int *payload_fd,
+                            gint64 deadline) {
+    unsigned char header[4];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {header, sizeof(header)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = -1;
+    *payload_fd = -1;
+    if (!wait_readable(fd, deadline))
+        return FALSE;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(payload_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (n <= 0 || (msg.msg_flags & MSG_CTRUNC) ||
+        !read_full(fd, header + n, sizeof(header) - n, deadline)) {
+        if (*payload_fd >= 0)
+            close(*payload_fd);
+        return FALSE;
+    }
+    *size = (guint32)header[0] << 24 | (guint32)header[1] << 16 |
+            (guint32)header[2] << 8 | header[3];
+    return TRUE;
+}
+
+/**
+ * @brief Reads one frame.
+ * @param data Receives the bytes, followed by a NUL byte, allocated with
+ *        g_malloc, or NULL if the payload is a descriptor.
+ * @param payload_fd Receives the descriptor the payload is in, or -1. If
+ *        NULL, a descriptor is an error.
+ * @param deadline Monotonic time in microseconds to give up at.
+ * @return TRUE on success, FALSE at the end of the connection, on an error
+ *         or oversized frame, or past the deadline.
+ */
+static gboolean read_frame(int fd,
+                           char **data,
+                           size_t *length,
+                           int *payload_fd,
+                           gint64 deadline) {
+    guint32 size;
+    int received_fd;
+    if (!read_header(fd, &size, &received_fd, deadline))
+        return FALSE;
+    gboolean fd_frame = (size & SERVE_FRAME_FD) != 0;
+    if (fd_frame != (received_fd >= 0) || (fd_frame && !payload_fd)) {
+        fprintf(stderr, "Error: unexpected descriptor frame.\n");
+        if (received_fd >= 0)
+            close(received_fd);
+        return FALSE;
+    }
+    if (fd_frame) {
+        *data = NULL;
+        *length = size & ~SERVE_FRAME_FD;
+        *payload_fd = received_fd;
+        return TRUE;
+    }
+
+    if (size > SERVE_MAX_FRAME) {
+        fprintf(stderr,
+                "Error: request frame of %u bytes is too large.\n",
+                size);
+        return FALSE;
+    }
+    *data = g_malloc(size + 1);
+    if (!read_full(fd, *data, size, deadline)) {
+        g_free(*data);
+        return FALSE;
+    }
+    (*data)[size] = '\0';
+    *length = size;
+    if (payload_fd)
+        *payload_fd = -1;
+    return TRUE;
+}
+
+static gboolean write_frame(int fd, const char *data, size_t length) {
+    unsigned char header[4] = {(length >> 24) & 0xff,
+                               (length >> 16) & 0xff,
+                               (length >> 8) & 0xff,
+                               length & 0xff};
+    return write_full(fd, header, sizeof(header)) &&
+           write_full(fd, data, length);
+}
+
+/**
+ * @brief Sends a frame whose payload is the file behind payload_fd, of
+ *        length bytes; only the header and the descriptor cross the
+ *        socket.
+ */
+static gboolean write_fd_frame(int fd, int payload_fd, size_t length) {
+    guint32 size = (guint32)length | SERVE_FRAME_FD;
+    unsigned char header[4] = {(size >> 24) & 0xff,
+                               (size >> 16) & 0xff,
+                               (size >> 8) & 0xff,
+                               size & 0xff};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {header, sizeof(header)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &payload_fd, sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    return n > 0 && write_full(fd, header + n, sizeof(header) - n);
+}
+
+/**
+ * @brief Checks that a client's input descriptor is sealed against
+ *        shrinking, so that the client cannot truncate it while it is
+ *        mapped here.
+ */
+static gboolean input_fd_is_sealed(int fd) {
+#ifdef F_GET_SEALS
+    int seals = fcntl(fd, F_GET_SEALS);
+    return seals >= 0 && (seals & F_SEAL_SHRINK);
+#else
+    (void)fd;
+    return FALSE;
+#endif
+}
+
+/**
+ * @brief Checks that a request's limits are no looser than the daemon's,
+ *        so that a client cannot lift them.
+ */
+static gboolean limits_within(const JobLimits *limits,
+                              const JobLimits *bounds) {
+    const gint64 values[] = {limits->max_input_bytes,
+                             limits->max_lines,
+                             limits->max_pixels,
+                             limits->deadline_ms};
+    const gint64 maxima[] = {bounds->max_input_bytes,
+                             bounds->max_lines,
+                             bounds->max_pixels,
+                             bounds->deadline_ms};
+    for (size_t i = 0; i < G_N_ELEMENTS(values); i++) {
+        if (maxima[i] > 0 && (values[i] == 0 || values[i] > maxima[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Takes the option -shm out of a request's command line.
+ * @return TRUE if it was there.
+ */
+static gboolean take_shm_option(char **argv, int *argc) {
+    gboolean found = FALSE;
+    int kept = 0;
+    for (int i = 0; i < *argc; i++) {
+        if (strcmp(argv[i], "-shm") == 0) {
+            g_free(argv[i]);
+            found = TRUE;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = NULL;
+    *argc = kept;
+    return found;
+}
+
+/**
+ * @brief Parses a request's command line into a job. Outputs named "-"
+ *        are collected in memory to be sent back: in shared memory if
+ *        shared is set, in the daemon's own memory otherwise.
+ * @return NULL on success, or the reason the request is invalid (details
+ *         may have been printed).
+ */
+static const char *parse_request(Job *job,
+                                 const Job *defaults,
+                                 char **argv,
+                                 int argc,
+                                 gboolean shared) {
+    if (job_parse_args(job, argc, argv) != JOB_PARSE_OK)
+        return "invalid options";
+    if (job->batch_filename || job->serve_socket || job->watch ||
+        job->more_pairs || job->workers != defaults->workers ||
+        job->stage_threads[0] > 0 || job->io_uring != defaults->io_uring ||
+        job->memory_budget_mb != defaults->memory_budget_mb ||
+        job->max_queue != defaults->max_queue ||
+        !job_same_cache(job, defaults))
+        return "-batch, -serve, -watch, -j, -pipeline, -io, "
+               "-memory-budget, -max-queue and the -cache and -line-cache "
+               "options cannot be used in a request";
+    if (!limits_within(&job->limits, &defaults->limits))
+        return "limits cannot be raised above the daemon's";
+    if (!job_finish_args(job))
+        return "invalid output";
+    if (!job_is_complete(job))
+        return "expected [OPTIONS] <input_file> <output>";
+
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        if (spec->fd < 0)
+            continue;
+        // The descriptors a request names would be the daemon's own.
+        if (strcmp(spec->filename, "-") != 0)
+            return "-fd cannot be used in a request";
+        if (!shared)
+            spec->buffer = g_string_new(NULL);
+        else if (!(spec->shared = shared_buffer_new("screenCODE-output")))
+            return "out of shared memory";
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads one request from a connection, renders it and replies. The
+ *        request must arrive within SERVE_REQUEST_TIMEOUT_MS.
+ * @return TRUE if the connection can take another request, FALSE if it
+ *         ended or broke.
+ */
+static gboolean serve_request(const Server *server, int fd) {
+    gint64 deadline =
+        g_get_monotonic_time() + (gint64)SERVE_REQUEST_TIMEOUT_MS * 1000;
+    char *line;
+    size_t line_length;
+    if (!read_frame(fd, &line, &line_length, NULL, deadline))
+        return FALSE;
+    char *input_data;
+    size_t input_length;
+    int input_fd;
+    if (!read_frame(fd, &input_data, &input_length, &input_fd, deadline)) {
+        g_free(line);
+        return FALSE;
+    }
+
+    Job job;
+    job_init_from(&job, server->defaults);
+    char **argv = NULL;
+    int argc;
+    GError *error = NULL;
+    const char *failure = NULL;
+    if (!g_shell_parse_argv(line, &argc, &argv, &error)) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+        failure = "invalid command line";
+    } else {
+        gboolean shared = take_shm_option(argv, &argc);
+        failure = parse_request(&job, server->defaults, argv, argc, shared);
+    }
+
+    if (!failure && !job.input_from_git &&
+        strcmp(job.input_filename, "-") == 0) {
+        InputLimit limit = job_input_limit(&job);
+        if (input_fd < 0) {
+            job.prefetched_input = input_text_from_data(
+                input_data, input_length, "request", &limit);
+            input_data = NULL;
+        } else if (input_fd_is_sealed(input_fd)) {
+            job.prefetched_input =
+                input_text_open_fd(input_fd, "request", &limit);
+        } else {
+            failure = "input descriptor is not sealed against shrinking";
+        }
+        if (!failure && !job.prefetched_input)
+            failure = limit.exceeded ? "limit exceeded" : "invalid input";
+    }
+    g_free(input_data);
+    if (input_fd >= 0)
+        close(input_fd); // A mapped input keeps its own reference
+
+    // Unless the request says otherwise, the PNG encoders of the workers
+    // share the processors.
+    int n_workers = server->defaults->workers;
+    if (!failure && job.png_settings.threads == 0 && n_workers > 1)
+        job.png_settings.threads =
+            MAX(1, (int)g_get_num_processors() / n_workers);
+    if (!failure) {
+        int status = job_run(&job);
+        if (status == JOB_EXIT_LIMIT)
+            failure = "limit exceeded";
+        else if (status != 0)
+            failure = "render failed";
+    }
+
+    gboolean ok;
+    if (failure) {
+        char *status = g_strdup_printf("error: %s", failure);
+        fprintf(stderr, "Request failed (%s): %s\n", failure, line);
+        ok = write_frame(fd, status, strlen(status));
+        g_free(status);
+    } else {
+        ok = write_frame(fd, "ok", 2);
+        for (guint i = 0; ok && i < job.outputs->len; i++) {
+            OutputSpec *spec = &g_array_index(job.outputs, OutputSpec, i);
+            if (spec->buffer)
+                ok = write_frame(fd, spec->buffer->str, spec->buffer->len);
+            else if (spec->shared)
+                ok = shared_buffer_finish(spec->shared) &&
+                     write_fd_frame(fd,
+                                    shared_buffer_fd(spec->shared),
+                                    shared_buffer_length(spec->shared));
+        }
+    }
+
+    job_clear(&job);
+    g_strfreev(argv);
+    g_free(line);
+    return ok;
+}
+
+/**
+ * @brief Hands a connection back to the accepting thread, to wait for its
+ *        next request without holding a worker.
+ */
+static void hand_back(Server *server, int fd) {
+    g_async_queue_push(server->idle, GINT_TO_POINTER(fd + 1));
+    // The pipe is non-blocking: if it is full, a wake-up is pending anyway.
+    ssize_t written = write(server->wake_pipe[1], "x", 1);
+    (void)written;
+}
+
+/**
+ * @brief Serves one request at a time from the queued connections, until
+ *        the daemon stops. Each worker lays out a line once up front, so
+ *        that its fonts and Pango contexts are ready before the first
+ *        request.
+ */
+static gpointer serve_worker(gpointer data) {
+    Server *server = data;
+    code_layout_free(code_layout_new(" ", &server->defaults->opts));
+
+    for (;;) {
+        gpointer connection = g_async_queue_pop(server->connections);
+        if (connection == SERVE_STOP)
+            break;
+        int fd = GPOINTER_TO_INT(connection) - 1;
+        if (serve_request(server, fd))
+            hand_back(server, fd);
+        else
+            close(fd);
+    }
+    render_shutdown();
+    return NULL;
+}
+
+/**
+ * @brief Accepts a connection into the poll set of idle ones. Once
+ *        max_queue connections are waiting for a worker, new ones are
+ *        turned away with "error: busy" rather than left to pile up behind
+ *        them.
+ */
+static void accept_connection(Server *server, int max_queue, GArray *idle) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0)
+        return; // The client gave up
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    // The length is negative while workers are waiting.
+    if (g_async_queue_length(server->connections) >= max_queue) {
+        write_frame(fd, "error: busy", strlen("error: busy"));
+        close(fd);
+        return;
+    }
+    struct timeval send_timeout = {SERVE_SEND_TIMEOUT_S, 0};
+    setsockopt(
+        fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    struct pollfd entry = {fd, POLLIN, 0};
+    g_array_append_val(idle, entry);
+}
+
+/**
+ * @brief Accepts connections and watches the idle ones, queueing each for
+ *        the workers as soon as its next request arrives (or it hangs up),
+ *        until the daemon stops. Connections still idle then are closed.
+ */
+static void dispatch_connections(Server *server, int max_queue) {
+    // The stop pipe, the listening socket and the wake-up pipe come first,
+    // then the idle connections.
+    GArray *fds = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
+    struct pollfd fixed[3] = {{stop_pipe[0], POLLIN, 0},
+                              {server->listen_fd, POLLIN, 0},
+                              {server->wake_pipe[0], POLLIN, 0}};
+    g_array_append_vals(fds, fixed, 3);
+
+    for (;;) {
+        struct pollfd *all = (struct pollfd *)fds->data;
+        int n = poll(all, fds->len, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || all[0].revents)
+            break;
+
+        // Connections with something to read go to the workers.
+        for (guint i = fds->len; i-- > 3;) {
+            struct pollfd *entry = &g_array_index(fds, struct pollfd, i);
+            if (!entry->revents)
+                continue;
+            g_async_queue_push(server->connections,
+                               GINT_TO_POINTER(entry->fd + 1));
+            g_array_remove_index_fast(fds, i);
+        }
+        if (g_array_index(fds, struct pollfd, 2).revents) {
+            char drain[64];
+            while (read(server->wake_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+            gpointer connection;
+            while ((connection = g_async_queue_try_pop(server->idle))) {
+                struct pollfd entry = {GPOINTER_TO_INT(connection) - 1,
+                                       POLLIN,
+                                       0};
+                g_array_append_val(fds, entry);
+            }
+        }
+        if (g_array_index(fds, struct pollfd, 1).revents)
+            accept_connection(server, max_queue, fds);
+    }
+
+    for (guint i = 3; i < fds->len; i++)
+        close(g_array_index(fds, struct pollfd, i).fd);
+    g_array_free(fds, TRUE);
+}
+
+/**
+ * @brief Creates the listening socket, replacing a stale socket file left
+ *        at the path by a daemon that did not exit cleanly.
+ * @return The socket, or -1 on failure (an error is printed).
+ */
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path %s is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SERVE_BACKLOG) != 0) {
+        fprintf(stderr,
+                "Error: could not listen on %s: %s\n",
+                path,
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int run_server(const Job *defaults) {
+    if (pipe(stop_pipe) != 0) {
+        fprintf(stderr,
+                "Error: could not create a pipe: %s\n",
+                strerror(errno));
+        return 1;
+    }
+    Server server = {
+        defaults, listen_on(defaults->serve_socket), NULL, NULL, {-1, -1}};
+    if (server.listen_fd < 0) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        return 1;
+    }
+    if (pipe(server.wake_pipe) != 0) {
+        fprintf(stderr,
+                "Error: could not create a pipe: %s\n",
+                strerror(errno));
+        close(server.listen_fd);
+        unlink(defaults->serve_socket);
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(server.wake_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(server.wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // A client that hangs up must not kill the daemon.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Files named in requests may be truncated by other processes at any
+    // time, which would fault on a mapping and take the daemon down. Client
+    // memfds are still mapped: they are sealed against shrinking.
+    input_text_map_files(FALSE);
+
+    // Syntax tables are built once for every language, before any request.
+    for (int lang = 0; lang < LANG_UNKNOWN; lang++)
+        init_syntax_tables((LanguageType)lang);
+
+    server.connections = g_async_queue_new();
+    server.idle = g_async_queue_new();
+    int n_workers = defaults->workers;
+    GThread **workers = g_new(GThread *, n_workers);
+    for (int i = 0; i < n_workers; i++)
+        workers[i] = g_thread_new("serve", serve_worker, &server);
+    fprintf(stderr,
+            "Serving on %s with %d worker%s.\n",
+            defaults->serve_socket,
+            defaults->workers,
+            defaults->workers == 1 ? "" : "s");
+    dispatch_connections(&server, defaults->max_queue);
+
+    for (int i = 0; i < n_workers; i++)
+        g_async_queue_push(server.connections, SERVE_STOP);
+    for (int i = 0; i < n_workers; i++)
+        g_thread_join(workers[i]);
+    g_free(workers);
+    // Connections handed back after the dispatcher stopped, and those still
+    // queued for a worker.
+    gpointer connection;
+    while ((connection = g_async_queue_try_pop(server.idle)))
+        close(GPOINTER_TO_INT(connection) - 1);
+    while ((connection = g_async_queue_try_pop(server.connections)))
+        close(GPOINTER_TO_INT(connection) - 1);
+    g_async_queue_unref(server.idle);
+    g_async_queue_unref(server.connections);
+    close(server.wake_pipe[0]);
+    close(server.wake_pipe[1]);
+
+    close(server.listen_fd);
+    unlink(defaults->serve_socket);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "job.h"
+
+// Runs a render daemon on the Unix socket defaults->serve_socket until it
+// gets SIGINT or SIGTERM. Fonts, Pango contexts, syntax tables and the
+// worker threads (-j of them) stay warm from one request to the next.
+// Between requests a connection waits in the daemon's poll set, holding no
+// worker; once a request arrives it is queued for one. Past -max-queue
+// queued connections, new ones are sent "error: busy" and closed. A request
+// must arrive in full within 10 seconds of a worker starting to read it,
+// and a reply the client does not read within 10 seconds closes the
+// connection. Requests may tighten the daemon's limits but not lift them.
+//
+// Every message is a frame: a 4-byte big-endian length, then that many
+// bytes. A request is two frames: a command line written like a manifest
+// line (options, then <input> and outputs, e.g. `-l -format png - -`),
+// then the input text, which is used when the input is "-" and is empty
+// otherwise. The reply is a status frame, "ok" or "error: <reason>" (the
+// details go to the daemon's stderr), followed on success by one frame per
+// output named "-", holding its encoded bytes, in order. Other outputs are
+// written to their path by the daemon. A connection may send any number of
+// requests, one after the other.
+//
+// A frame whose length has its top bit set instead carries a file
+// descriptor, sent with its header (SCM_RIGHTS), and the rest of the length
+// is the file's size. The input frame may be one: a memfd sealed against
+// shrinking, which is mapped rather than copied. If the command line
+// contains -shm, outputs named "-" come back as such frames, each a sealed
+// memfd the encoder wrote into directly.
+int run_server(const Job *defaults);
+
+#endif // SERVE_H
@@ -0,0 +1,156 @@
+// memfd_create, ftruncate, mkstemp and mmap are not C99.
+#define _GNU_SOURCE
+
+#include "shared_buffer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Size of the file when the first byte is written; it doubles from there.
+#define SHARED_BUFFER_INITIAL_SIZE (64 * 1024)
+
+struct SharedBuffer {
+    int fd;
+    char *map; // Shared mapping of the first capacity bytes, or NULL
+    size_t capacity;
+    size_t length;
+};
+
+/**
+ * @brief Creates an anonymous file: a sealable memfd where there is one,
+ *        otherwise a temporary file that is unlinked at once.
+ * @return The descriptor, or -1 on failure.
+ */
+static int anonymous_file(const char *name) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0)
+        return fd;
+#endif
+    (void)name;
+    char path[] = "/tmp/screenCODE-XXXXXX";
+    int tmp_fd = mkstemp(path);
+    if (tmp_fd >= 0) {
+        unlink(path);
+        fcntl(tmp_fd, F_SETFD, FD_CLOEXEC);
+    }
+    return tmp_fd;
+}
+
+/**
+ * @brief Creates an empty shared buffer.
+ * @param name Names the memfd, as shown in /proc.
+ * @return The buffer, or NULL on failure (an error is printed).
+ */
+SharedBuffer *shared_buffer_new(const char *name) {
+    int fd = anonymous_file(name);
+    if (fd < 0) {
+        fprintf(stderr,
+                "Could not create a shared memory file: %s\n",
+                strerror(errno));
+        return NULL;
+    }
+    SharedBuffer *buffer = g_new0(SharedBuffer, 1);
+    buffer->fd = fd;
+    return buffer;
+}
+
+/**
+ * @brief Grows the file and its mapping to hold at least capacity bytes.
+ *        The bytes already written stay in the file across the new
+ *        mapping.
+ */
+static gboolean reserve(SharedBuffer *buffer, size_t capacity) {
+    if (capacity <= buffer->capacity)
+        return TRUE;
+    size_t new_capacity = MAX(buffer->capacity, SHARED_BUFFER_INITIAL_SIZE);
+    while (new_capacity < capacity)
+        new_capacity *= 2;
+
+    if (buffer->map)
+        munmap(buffer->map, buffer->capacity);
+    buffer->map = NULL;
+    buffer->capacity = 0;
+    if (ftruncate(buffer->fd, (off_t)new_capacity) != 0)
+        return FALSE;
+    void *map = mmap(NULL,
+                     new_capacity,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED,
+                     buffer->fd,
+                     0);
+    if (map == MAP_FAILED)
+        return FALSE;
+    buffer->map = map;
+    buffer->capacity = new_capacity;
+    return TRUE;
+}
+
+/**
+ * @brief Appends bytes, copied straight into the shared pages.
+ * @return TRUE on success, FALSE if the file could not grow.
+ */
+gboolean shared_buffer_append(SharedBuffer *buffer,
+                              const void *data,
+                              size_t length) {
+    if (!reserve(buffer, buffer->length + length))
+        return FALSE;
+    memcpy(buffer->map + buffer->length, data, length);
+    buffer->length += length;
+    return TRUE;
+}
+
+/**
+ * @brief Unmaps the buffer and trims the file to the bytes written. A memfd
+ *        is sealed as well, so that whoever maps it can rely on its size
+ *        and contents not changing.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean shared_buffer_finish(SharedBuffer *buffer) {
+    if (buffer->map)
+        munmap(buffer->map, buffer->capacity);
+    buffer->map = NULL;
+    buffer->capacity = 0;
+    if (ftruncate(buffer->fd, (off_t)buffer->length) != 0) {
+        fprintf(stderr,
+                "Could not trim a shared memory file: %s\n",
+                strerror(errno));
+        return FALSE;
+    }
+#ifdef F_ADD_SEALS
+    fcntl(buffer->fd,
+          F_ADD_SEALS,
+          F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    return TRUE;
+}
+
+/**
+ * @brief Returns the bytes written so far, readable until the buffer is
+ *        finished.
+ */
+const void *shared_buffer_data(const SharedBuffer *buffer) {
+    return buffer->map;
+}
+
+int shared_buffer_fd(const SharedBuffer *buffer) {
+    return buffer->fd;
+}
+
+size_t shared_buffer_length(const SharedBuffer *buffer) {
+    return buffer->length;
+}
+
+void shared_buffer_free(SharedBuffer *buffer) {
+    if (!buffer)
+        return;
+    if (buffer->map)
+        munmap(buffer->map, buffer->capacity);
+    close(buffer->fd);
+    g_free(buffer);
+}
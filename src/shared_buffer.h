@@ -0,0 +1,21 @@
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <glib.h>
+
+// A growable buffer in an anonymous shared memory file (a memfd on Linux),
+// written through a shared mapping. Its descriptor can be handed to another
+// process, which maps the bytes rather than having them copied to it.
+typedef struct SharedBuffer SharedBuffer;
+
+SharedBuffer *shared_buffer_new(const char *name);
+gboolean shared_buffer_append(SharedBuffer *buffer,
+                              const void *data,
+                              size_t length);
+gboolean shared_buffer_finish(SharedBuffer *buffer);
+const void *shared_buffer_data(const SharedBuffer *buffer);
+int shared_buffer_fd(const SharedBuffer *buffer);
+size_t shared_buffer_length(const SharedBuffer *buffer);
+void shared_buffer_free(SharedBuffer *buffer);
+
+#endif // SHARED_BUFFER_H
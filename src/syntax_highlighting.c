@@ -1,12 +1,57 @@
 #include "syntax_highlighting.h"
 
 #include <glib.h> // Using GLib for efficient hash tables.
+#include <string.h>
 
-// Use global hash tables for syntax elements (keywords, etc.)
-// This allows for quick lookups while parsing the code.
-GHashTable *keywords_ht = NULL;
-GHashTable *preprocessor_directives_ht = NULL;
-GHashTable *standard_functions_ht = NULL;
+// Which languages' syntax tables have been built, indexed by LanguageType.
+// Once built, the tables are only read, so any number of threads can
+// highlight at once; building them is serialized by the lock.
+static gboolean tables_ready[LANG_UNKNOWN];
+G_LOCK_DEFINE_STATIC(tables);
+
+/**
+ * @brief Builds the keyword and function tables of a language, unless they
+ *        already exist. They are kept until free_syntax_tables, so files of
+ *        the same language highlighted later in the process reuse them.
+ */
+void init_syntax_tables(LanguageType lang) {
+    if (lang >= LANG_UNKNOWN)
+        return;
+    G_LOCK(tables);
+    if (!tables_ready[lang]) {
+        if (lang == LANG_C)
+            init_syntax_tables_c();
+        else if (lang == LANG_PYTHON)
+            init_syntax_tables_python();
+        else if (lang == LANG_GO)
+            init_syntax_tables_go();
+        tables_ready[lang] = TRUE;
+    }
+    G_UNLOCK(tables);
+}
+
+/**
+ * @brief Frees the syntax tables of every language built so far. No other
+ *        thread may be highlighting.
+ */
+void free_syntax_tables(void) {
+    if (tables_ready[LANG_C])
+        free_syntax_tables_c();
+    if (tables_ready[LANG_PYTHON])
+        free_syntax_tables_python();
+    if (tables_ready[LANG_GO])
+        free_syntax_tables_go();
+    memset(tables_ready, 0, sizeof(tables_ready));
+}
+
+/**
+ * @brief Tells whether a highlighter given deadline has run past it. The
+ *        highlighters check between lines, so one step of a job cannot
+ *        outlive the job's -deadline by more than a line.
+ */
+gboolean highlight_past_deadline(gint64 deadline) {
+    return deadline > 0 && g_get_monotonic_time() > deadline;
+}
 
 /**
  * @brief Acts as a dispatcher, selecting the correct syntax highlighter based
@@ -15,24 +60,27 @@ GHashTable *standard_functions_ht = NULL;
  * @param lang The programming language (LANG_C or LANG_PYTHON).
  * @param show_line_numbers Boolean flag to indicate if line numbers should be
  * shown.
- * @return A new string containing the code with Pango markup for highlighting.
+ * @param deadline Monotonic time the highlighter gives up at, or 0.
+ * @return A new string containing the code with Pango markup for highlighting,
+ * or NULL on failure or past the deadline.
  */
 char *highlight_syntax(const char *code,
                        LanguageType lang,
                        gboolean show_line_numbers,
-                       gboolean no_color) {
+                       gboolean no_color,
+                       gint64 deadline) {
     if (no_color) {
         return g_markup_escape_text(code, -1);
     }
-    // The initialization and freeing of syntax tables is now handled in main.c.
+    // The syntax tables must have been built with init_syntax_tables.
     // This function now only dispatches to the correct highlighter.
 
     if (lang == LANG_C) {
-        return highlight_c_syntax(code, show_line_numbers);
+        return highlight_c_syntax(code, show_line_numbers, deadline);
     } else if (lang == LANG_PYTHON) {
-        return highlight_python_syntax(code, show_line_numbers);
+        return highlight_python_syntax(code, show_line_numbers, deadline);
     } else if (lang == LANG_GO) {
-        return highlight_go_syntax(code, show_line_numbers);
+        return highlight_go_syntax(code, show_line_numbers, deadline);
     } else {
         // Fallback for unknown languages: just escape the text without
         // highlighting.
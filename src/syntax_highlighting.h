@@ -6,34 +6,42 @@
 // Defines the supported programming languages for syntax highlighting.
 typedef enum { LANG_C, LANG_PYTHON, LANG_GO, LANG_UNKNOWN } LanguageType;
 
-// Declare global hash tables for syntax elements.
-// Using 'extern' makes them accessible from other files that include this
-// header.
-extern GHashTable *keywords_ht;
-extern GHashTable *preprocessor_directives_ht;
-extern GHashTable *standard_functions_ht;
-
 // --- Function Prototypes ---
 
 // C-specific syntax highlighting functions.
 void init_syntax_tables_c();
 void free_syntax_tables_c();
-char *highlight_c_syntax(const char *code, gboolean show_line_numbers);
+char *highlight_c_syntax(const char *code,
+                         gboolean show_line_numbers,
+                         gint64 deadline);
 
 // Python-specific syntax highlighting functions.
 void init_syntax_tables_python();
 void free_syntax_tables_python();
-char *highlight_python_syntax(const char *code, gboolean show_line_numbers);
+char *highlight_python_syntax(const char *code,
+                              gboolean show_line_numbers,
+                              gint64 deadline);
 
 // Go-specific syntax highlighting functions.
 void init_syntax_tables_go();
 void free_syntax_tables_go();
-char *highlight_go_syntax(const char *code, gboolean show_line_numbers);
+char *highlight_go_syntax(const char *code,
+                          gboolean show_line_numbers,
+                          gint64 deadline);
+
+// Builds the syntax tables of a language the first time it is used; later
+// calls do nothing. free_syntax_tables frees the tables of every language.
+void init_syntax_tables(LanguageType lang);
+void free_syntax_tables(void);
 
 // The main function that dispatches to the correct language highlighter.
+// The highlighters give up and return NULL once the monotonic time passes
+// deadline, unless it is 0.
 char *highlight_syntax(const char *code,
                        LanguageType lang,
                        gboolean show_line_numbers,
-                       gboolean no_color);
+                       gboolean no_color,
+                       gint64 deadline);
+gboolean highlight_past_deadline(gint64 deadline);
 
 #endif // SYNTAX_HIGHLIGHTING_H
@@ -6,10 +6,11 @@
 
 #include "syntax_highlighting.h"
 
-// Make the global hash tables available in this file.
-extern GHashTable *keywords_ht;
-extern GHashTable *preprocessor_directives_ht;
-extern GHashTable *standard_functions_ht;
+// Syntax tables of this language. Each language has its own, so that one
+// process can highlight files of several languages.
+static GHashTable *keywords_ht = NULL;
+static GHashTable *preprocessor_directives_ht = NULL;
+static GHashTable *standard_functions_ht = NULL;
 
 /**
  * @brief A helper function to simplify appending highlighted code.
@@ -647,10 +648,13 @@ static gboolean highlight_tokens_on_line(GString *highlighted_line_gstring,
  * @brief Main C syntax highlighting logic.
  *        It iterates through the code line by line, prepends line numbers if
  * enabled, and then highlights tokens on each line.
+ * @param deadline Monotonic time to give up at, checked between lines, or 0.
  * @return A new string containing the code with Pango markup for highlighting,
- * or NULL on memory allocation failure.
+ * or NULL on memory allocation failure or past the deadline.
  */
-char *highlight_c_syntax(const char *code, gboolean show_line_numbers) {
+char *highlight_c_syntax(const char *code,
+                         gboolean show_line_numbers,
+                         gint64 deadline) {
     GString *final_highlighted_code = g_string_new("");
     if (!final_highlighted_code)
         return NULL; // Memory allocation failed
@@ -692,6 +696,12 @@ char *highlight_c_syntax(const char *code, gboolean show_line_numbers) {
             continue;
         }
 
+        if (highlight_past_deadline(deadline)) {
+            g_strfreev(code_lines);
+            g_string_free(final_highlighted_code, TRUE);
+            return NULL;
+        }
+
         GString *current_line_gstring = g_string_new("");
         if (!current_line_gstring) {
             g_strfreev(code_lines);
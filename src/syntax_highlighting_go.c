@@ -5,8 +5,9 @@
 #include <stdlib.h>
 #include <string.h>
 
-extern GHashTable *keywords_ht;
-extern GHashTable *standard_functions_ht;
+// Built by init_syntax_tables_go() and freed by free_syntax_tables_go().
+static GHashTable *keywords_ht = NULL;
+static GHashTable *standard_functions_ht = NULL;
 
 static gboolean append_and_highlight(GString *highlighted_code,
                                      const char *start_of_plain_text,
@@ -473,7 +474,9 @@ static gboolean highlight_tokens_on_line(GString *highlighted_line_gstring,
     return TRUE;
 }
 
-char *highlight_go_syntax(const char *code, gboolean show_line_numbers) {
+char *highlight_go_syntax(const char *code,
+                          gboolean show_line_numbers,
+                          gint64 deadline) {
     GString *final_highlighted_code = g_string_new("");
     if (!final_highlighted_code)
         return NULL;
@@ -509,6 +512,12 @@ char *highlight_go_syntax(const char *code, gboolean show_line_numbers) {
             continue;
         }
 
+        if (highlight_past_deadline(deadline)) {
+            g_strfreev(code_lines);
+            g_string_free(final_highlighted_code, TRUE);
+            return NULL;
+        }
+
         GString *current_line_gstring = g_string_new("");
         if (!current_line_gstring) {
             g_strfreev(code_lines);
@@ -6,9 +6,9 @@
 
 #include "syntax_highlighting.h"
 
-// Make the global hash tables available in this file.
-extern GHashTable *keywords_ht;
-extern GHashTable *standard_functions_ht;
+// Built by init_syntax_tables_python(), freed by free_syntax_tables_python().
+static GHashTable *keywords_ht = NULL;
+static GHashTable *standard_functions_ht = NULL;
 
 /**
  * @brief A helper function to simplify appending highlighted code.
@@ -155,6 +155,15 @@ static const char *python_sorted_operators[] = {
     "^",   "~",   ".",  ":",  "[",  "]",  "{",  "}",  "(",  ")", // 1 char
     NULL};
 
+// Where the highlighter is within an f-string. It lives with the caller of
+// highlight_tokens_on_line_python, one per file, so that files can be
+// highlighted on several threads at once.
+typedef struct {
+    gboolean active;
+    char quote_char;
+    int brace_level;
+} FStringState;
+
 /**
  * @brief Highlights tokens on a single line of Python code, handling multi-line
  * string/comment state.
@@ -163,26 +172,23 @@ static const char *python_sorted_operators[] = {
  * @param line_content The content of the single line to highlight.
  * @param in_multiline_string A pointer to a gchar that tracks if we are inside
  * a multi-line string, and what quote char it is.
+ * @param f_string The f-string state, carried over from line to line.
  * @return TRUE on success, FALSE if memory allocation fails.
  */
 static gboolean
 highlight_tokens_on_line_python(GString *highlighted_line_gstring,
                                 const char *line_content,
-                                gchar *in_multiline_string) {
+                                gchar *in_multiline_string,
+                                FStringState *f_string) {
     gboolean expect_module_name = FALSE;
     gboolean expect_alias_name = FALSE;
     const char *ptr = line_content;
     const char *start_of_plain_text = line_content;
 
-    // State for f-strings (local to the line)
-    static gboolean in_f_string = FALSE;
-    static char f_string_quote_char = 0;
-    static int f_string_brace_level = 0;
-
     // Reset f-string state for a new line if not in a multi-line string
     if (*in_multiline_string == 0) {
-        in_f_string = FALSE;
-        f_string_brace_level = 0;
+        f_string->active = FALSE;
+        f_string->brace_level = 0;
     }
 
     while (*ptr != '\0') {
@@ -209,10 +215,10 @@ highlight_tokens_on_line_python(GString *highlighted_line_gstring,
                 *in_multiline_string =
                     0; // We are now out of the multi-line string.
             }
-        } else if (in_f_string) {
-            if (*ptr == f_string_quote_char &&
-                f_string_brace_level == 0) { // End of f-string
-                in_f_string = FALSE;
+        } else if (f_string->active) {
+            if (*ptr == f_string->quote_char &&
+                f_string->brace_level == 0) { // End of f-string
+                f_string->active = FALSE;
                 token_len = 1;
                 token_color = "#9ece6a"; // Green for closing quote
             } else if (*ptr == '{') {
@@ -220,7 +226,7 @@ highlight_tokens_on_line_python(GString *highlighted_line_gstring,
                     token_len = 2;
                     token_color = "#9ece6a";
                 } else {
-                    f_string_brace_level++;
+                    f_string->brace_level++;
                     token_len = 1;
                     token_color = "#bb9af7"; // Purple for brace
                 }
@@ -229,16 +235,16 @@ highlight_tokens_on_line_python(GString *highlighted_line_gstring,
                     token_len = 2;
                     token_color = "#9ece6a";
                 } else {
-                    if (f_string_brace_level > 0) {
-                        f_string_brace_level--;
+                    if (f_string->brace_level > 0) {
+                        f_string->brace_level--;
                     }
                     token_len = 1;
                     token_color = "#bb9af7"; // Purple for brace
                 }
-            } else if (f_string_brace_level ==
+            } else if (f_string->brace_level ==
                        0) { // Inside f-string, outside braces
                 const char *scan_ptr = ptr;
-                while (*scan_ptr != '\0' && *scan_ptr != f_string_quote_char &&
+                while (*scan_ptr != '\0' && *scan_ptr != f_string->quote_char &&
                        *scan_ptr != '{') {
                     scan_ptr++;
                 }
@@ -255,9 +261,9 @@ highlight_tokens_on_line_python(GString *highlighted_line_gstring,
             // 1. Strings (f-string, triple, double, single quoted)
             if ((*ptr == 'f' || *ptr == 'F') &&
                 (*(ptr + 1) == '"' || *(ptr + 1) == '\'')) { // f-string start
-                in_f_string = TRUE;
-                f_string_quote_char = *(ptr + 1);
-                f_string_brace_level = 0;
+                f_string->active = TRUE;
+                f_string->quote_char = *(ptr + 1);
+                f_string->brace_level = 0;
                 token_len = 2;           // f" or f'
                 token_color = "#9ece6a"; // Green
             } else if ((*ptr == '"' && *(ptr + 1) == '"' &&
@@ -463,10 +469,13 @@ highlight_tokens_on_line_python(GString *highlighted_line_gstring,
  * @brief Main Python syntax highlighting logic.
  *        It iterates through the code line by line, prepends line numbers if
  * enabled, and then highlights tokens on each line.
+ * @param deadline Monotonic time to give up at, checked between lines, or 0.
  * @return A new string containing the code with Pango markup for highlighting,
- * or NULL on memory allocation failure.
+ * or NULL on memory allocation failure or past the deadline.
  */
-char *highlight_python_syntax(const char *code, gboolean show_line_numbers) {
+char *highlight_python_syntax(const char *code,
+                              gboolean show_line_numbers,
+                              gint64 deadline) {
     GString *final_highlighted_code = g_string_new("");
     if (!final_highlighted_code)
         return NULL; // Memory allocation failed
@@ -501,6 +510,7 @@ char *highlight_python_syntax(const char *code, gboolean show_line_numbers) {
     int current_line_num = 1;
     gchar in_multiline_string = 0; // State tracking for multi-line strings, 0
                                    // means no, '"' or '\'' means yes
+    FStringState f_string = {FALSE, 0, 0};
 
     for (char **line_ptr = code_lines; *line_ptr != NULL; line_ptr++) {
         // Skip empty last line if it was a trailing newline
@@ -509,6 +519,12 @@ char *highlight_python_syntax(const char *code, gboolean show_line_numbers) {
             continue;
         }
 
+        if (highlight_past_deadline(deadline)) {
+            g_strfreev(code_lines);
+            g_string_free(final_highlighted_code, TRUE);
+            return NULL;
+        }
+
         GString *current_line_gstring = g_string_new("");
         if (!current_line_gstring) {
             g_strfreev(code_lines);
@@ -526,8 +542,10 @@ char *highlight_python_syntax(const char *code, gboolean show_line_numbers) {
         }
 
         // Highlight tokens on the current line
-        if (!highlight_tokens_on_line_python(
-                current_line_gstring, *line_ptr, &in_multiline_string)) {
+        if (!highlight_tokens_on_line_python(current_line_gstring,
+                                             *line_ptr,
+                                             &in_multiline_string,
+                                             &f_string)) {
             g_string_free(current_line_gstring, TRUE);
             g_strfreev(code_lines);
             g_string_free(final_highlighted_code, TRUE);
@@ -0,0 +1,340 @@
+#include "text_output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Output is collected in a buffer of this size before each write.
+#define TEXT_BUFFER_SIZE (64 * 1024)
+
+// Nesting depth of spans tracked for ANSI output.
+#define MAX_SPAN_DEPTH 16
+
+// The highlighters' colors and the HTML classes they become.
+typedef struct {
+    const char *color;
+    const char *class_name;
+} TokenClass;
+
+static const TokenClass token_classes[] = {
+    {"#545c7e", "comment"},
+    {"#9ece6a", "string"},
+    {"#ff9e64", "number"},
+    {"#f7768e", "keyword"},
+    {"#7aa2f7", "function"},
+    {"#bb9af7", "operator"},
+};
+
+// Window and default text colors of the screenshot.
+#define TEXT_BACKGROUND_COLOR "#24283b"
+#define TEXT_FOREGROUND_COLOR "#a9b1d6"
+
+// Callback for each piece of the markup: text (with its entities still
+// escaped), a span opening with its color (NULL if it has none), or a span
+// closing.
+typedef struct {
+    void (*text)(GString *out, const char *text, size_t len);
+    void (*open_span)(GString *out, const char *color, void *state);
+    void (*close_span)(GString *out, void *state);
+    void *state;
+} MarkupHandler;
+
+/**
+ * @brief Passes the buffered output to write_func once it is large enough,
+ *        or whatever is left when flush is set.
+ * @return TRUE on success, FALSE on a write error.
+ */
+static gboolean drain(GString *out,
+                      gboolean flush,
+                      cairo_write_func_t write_func,
+                      void *closure) {
+    if (out->len == 0 || (!flush && out->len < TEXT_BUFFER_SIZE))
+        return TRUE;
+    gboolean ok =
+        write_func(closure, (const unsigned char *)out->str, out->len) ==
+        CAIRO_STATUS_SUCCESS;
+    g_string_truncate(out, 0);
+    return ok;
+}
+
+/**
+ * @brief Finds the color of a "<span foreground='#rrggbb'>" tag.
+ * @param tag The tag, from '<' to just before '>'.
+ * @param len The length of the tag.
+ * @param color Receives the seven-character "#rrggbb" color.
+ * @return TRUE if the tag has a foreground color, FALSE otherwise.
+ */
+static gboolean span_color(const char *tag, size_t len, char color[8]) {
+    const char *attr = g_strstr_len(tag, len, "foreground=");
+    if (!attr || attr + 20 > tag + len ||
+        (attr[11] != '\'' && attr[11] != '"'))
+        return FALSE;
+    memcpy(color, attr + 12, 7);
+    color[7] = '\0';
+    return color[0] == '#';
+}
+
+/**
+ * @brief Walks the markup once, handing runs of text and span tags to the
+ *        handler and writing the result out as it fills up.
+ * @return TRUE on success, FALSE on a write error.
+ */
+static gboolean translate_markup(const char *markup,
+                                 const MarkupHandler *handler,
+                                 GString *out,
+                                 cairo_write_func_t write_func,
+                                 void *closure) {
+    const char *p = markup;
+    while (*p) {
+        size_t run = strcspn(p, "<");
+        if (run > 0) {
+            handler->text(out, p, run);
+            p += run;
+        }
+        if (*p == '<') {
+            const char *end = strchr(p, '>');
+            if (!end)
+                break;
+            char color[8];
+            if (strncmp(p, "</span", 6) == 0)
+                handler->close_span(out, handler->state);
+            else if (strncmp(p, "<span", 5) == 0)
+                handler->open_span(out,
+                                   span_color(p, end - p, color) ? color
+                                                                  : NULL,
+                                   handler->state);
+            p = end + 1;
+        }
+        if (!drain(out, FALSE, write_func, closure))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Tells whether a character would be acted on by a terminal rather
+ *        than shown: C0 controls other than tab and newline, and DEL.
+ */
+static gboolean is_terminal_control(gunichar c) {
+    return (c < 0x20 && c != '\t' && c != '\n') || c == 0x7f;
+}
+
+/**
+ * @brief Appends a control character in caret notation ("^[" for ESC,
+ *        "^?" for DEL), so that escape sequences in the source are shown
+ *        instead of reaching the terminal.
+ */
+static void append_caret(GString *out, gunichar c) {
+    g_string_append_c(out, '^');
+    g_string_append_c(out, (char)(c ^ 0x40));
+}
+
+/**
+ * @brief Appends text as it is, except for terminal controls. The carriage
+ *        return of a CRLF line ending is kept.
+ */
+static void append_for_terminal(GString *out, const char *text, size_t len) {
+    const char *end = text + len;
+    const char *run = text;
+    for (const char *p = text; p < end; p++) {
+        if (!is_terminal_control((unsigned char)*p) ||
+            (*p == '\r' && p + 1 < end && p[1] == '\n'))
+            continue;
+        g_string_append_len(out, run, p - run);
+        append_caret(out, (unsigned char)*p);
+        run = p + 1;
+    }
+    g_string_append_len(out, run, end - run);
+}
+
+/**
+ * @brief Appends text with the markup's entities decoded, for a terminal.
+ *        Control characters, written raw or as numeric entities, are shown
+ *        in caret notation.
+ */
+static void append_unescaped(GString *out, const char *text, size_t len) {
+    const char *end = text + len;
+    while (text < end) {
+        const char *amp = memchr(text, '&', end - text);
+        if (!amp) {
+            append_for_terminal(out, text, end - text);
+            return;
+        }
+        append_for_terminal(out, text, amp - text);
+        const char *semi = memchr(amp, ';', end - amp);
+        if (!semi) {
+            append_for_terminal(out, amp, end - amp);
+            return;
+        }
+        size_t name_len = semi - amp - 1;
+        const char *name = amp + 1;
+        if (name_len == 3 && strncmp(name, "amp", 3) == 0) {
+            g_string_append_c(out, '&');
+        } else if (name_len == 2 && strncmp(name, "lt", 2) == 0) {
+            g_string_append_c(out, '<');
+        } else if (name_len == 2 && strncmp(name, "gt", 2) == 0) {
+            g_string_append_c(out, '>');
+        } else if (name_len == 4 && strncmp(name, "quot", 4) == 0) {
+            g_string_append_c(out, '"');
+        } else if (name_len == 4 && strncmp(name, "apos", 4) == 0) {
+            g_string_append_c(out, '\'');
+        } else if (name_len > 1 && name[0] == '#') {
+            gunichar c = name[1] == 'x' ? strtoul(name + 2, NULL, 16)
+                                        : strtoul(name + 1, NULL, 10);
+            if (is_terminal_control(c))
+                append_caret(out, c);
+            else
+                g_string_append_unichar(out, c);
+        }
+        text = semi + 1;
+    }
+}
+
+// Colors of the ANSI spans currently open.
+typedef struct {
+    char colors[MAX_SPAN_DEPTH][8];
+    int depth;
+} AnsiState;
+
+static void append_ansi_color(GString *out, const char *color) {
+    if (!color) {
+        g_string_append(out, "\x1b[39m");
+        return;
+    }
+    unsigned long rgb = strtoul(color + 1, NULL, 16);
+    g_string_append_printf(out,
+                           "\x1b[38;2;%lu;%lu;%lum",
+                           (rgb >> 16) & 0xff,
+                           (rgb >> 8) & 0xff,
+                           rgb & 0xff);
+}
+
+static void ansi_open_span(GString *out, const char *color, void *data) {
+    AnsiState *state = data;
+    if (state->depth < MAX_SPAN_DEPTH)
+        strcpy(state->colors[state->depth], color ? color : "");
+    state->depth++;
+    if (color)
+        append_ansi_color(out, color);
+}
+
+static void ansi_close_span(GString *out, void *data) {
+    AnsiState *state = data;
+    if (state->depth == 0)
+        return;
+    state->depth--;
+    // Go back to the enclosing span's color, if any.
+    const char *color = NULL;
+    for (int i = MIN(state->depth, MAX_SPAN_DEPTH) - 1; i >= 0; i--) {
+        if (state->colors[i][0]) {
+            color = state->colors[i];
+            break;
+        }
+    }
+    append_ansi_color(out, color);
+}
+
+/**
+ * @brief Writes the highlighted code as text with 24-bit color escapes.
+ * @param markup The Pango markup produced by highlight_syntax.
+ * @param write_func Called with the output bytes, in order.
+ * @param closure Passed to write_func.
+ * @return TRUE on success, FALSE on a write error (an error is printed).
+ */
+gboolean write_ansi_stream(const char *markup,
+                           cairo_write_func_t write_func,
+                           void *closure) {
+    AnsiState state = {0};
+    MarkupHandler handler = {
+        append_unescaped, ansi_open_span, ansi_close_span, &state};
+    GString *out = g_string_sized_new(TEXT_BUFFER_SIZE + 1024);
+
+    gboolean ok = translate_markup(markup, &handler, out, write_func, closure);
+    g_string_append(out, "\x1b[0m");
+    ok = ok && drain(out, TRUE, write_func, closure);
+    g_string_free(out, TRUE);
+    if (!ok)
+        fprintf(stderr, "Could not write ANSI text: write error.\n");
+    return ok;
+}
+
+/**
+ * @brief Appends text as it is: the markup is already escaped the way HTML
+ *        needs it.
+ */
+static void append_escaped(GString *out, const char *text, size_t len) {
+    g_string_append_len(out, text, len);
+}
+
+static void html_open_span(GString *out, const char *color, void *data) {
+    (void)data;
+    if (color) {
+        for (size_t i = 0; i < G_N_ELEMENTS(token_classes); i++) {
+            if (g_ascii_strcasecmp(color, token_classes[i].color) == 0) {
+                g_string_append_printf(
+                    out, "<span class=\"%s\">", token_classes[i].class_name);
+                return;
+            }
+        }
+        g_string_append_printf(out, "<span style=\"color: %s\">", color);
+        return;
+    }
+    g_string_append(out, "<span>");
+}
+
+static void html_close_span(GString *out, void *data) {
+    (void)data;
+    g_string_append(out, "</span>");
+}
+
+/**
+ * @brief Writes the highlighted code as a standalone HTML page.
+ * @param markup The Pango markup produced by highlight_syntax.
+ * @param title The page and window title, or NULL for none.
+ * @param write_func Called with the output bytes, in order.
+ * @param closure Passed to write_func.
+ * @return TRUE on success, FALSE on a write error (an error is printed).
+ */
+gboolean write_html_stream(const char *markup,
+                           const char *title,
+                           cairo_write_func_t write_func,
+                           void *closure) {
+    MarkupHandler handler = {
+        append_escaped, html_open_span, html_close_span, NULL};
+    GString *out = g_string_sized_new(TEXT_BUFFER_SIZE + 1024);
+
+    g_string_append(out,
+                    "<!DOCTYPE html>\n<html>\n<head>\n"
+                    "<meta charset=\"utf-8\">\n");
+    if (title) {
+        char *escaped_title = g_markup_escape_text(title, -1);
+        g_string_append_printf(out, "<title>%s</title>\n", escaped_title);
+        g_free(escaped_title);
+    }
+    g_string_append(out,
+                    "<style>\n"
+                    "pre.screencode {\n"
+                    "  background: " TEXT_BACKGROUND_COLOR ";\n"
+                    "  color: " TEXT_FOREGROUND_COLOR ";\n"
+                    "  font-family: monospace;\n"
+                    "  padding: 1em;\n"
+                    "  border-radius: 8px;\n"
+                    "  overflow-x: auto;\n"
+                    "}\n");
+    for (size_t i = 0; i < G_N_ELEMENTS(token_classes); i++)
+        g_string_append_printf(out,
+                               ".screencode .%s { color: %s; }\n",
+                               token_classes[i].class_name,
+                               token_classes[i].color);
+    g_string_append(out,
+                    "</style>\n</head>\n<body>\n"
+                    "<pre class=\"screencode\"><code>");
+
+    gboolean ok = translate_markup(markup, &handler, out, write_func, closure);
+    g_string_append(out, "</code></pre>\n</body>\n</html>\n");
+    ok = ok && drain(out, TRUE, write_func, closure);
+    g_string_free(out, TRUE);
+    if (!ok)
+        fprintf(stderr, "Could not write HTML file: write error.\n");
+    return ok;
+}
@@ -0,0 +1,23 @@
+#ifndef TEXT_OUTPUT_H
+#define TEXT_OUTPUT_H
+
+#include <cairo.h>
+#include <glib.h>
+
+// Colorized text straight from the highlighter's Pango markup, for when no
+// image is needed. Nothing is laid out or rasterized; the markup is
+// translated in a single pass and passed to write_func in large pieces.
+
+// Writes the code with 24-bit ANSI color escapes, for a terminal.
+gboolean write_ansi_stream(const char *markup,
+                           cairo_write_func_t write_func,
+                           void *closure);
+
+// Writes a standalone HTML page: the code in a <pre> of class-based spans
+// and one stylesheet matching the screenshot's colors. title may be NULL.
+gboolean write_html_stream(const char *markup,
+                           const char *title,
+                           cairo_write_func_t write_func,
+                           void *closure);
+
+#endif // TEXT_OUTPUT_H
@@ -0,0 +1,553 @@
+#include "tiled_render.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "output_stream.h"
+#include "qoi_writer.h"
+#include "raw_writer.h"
+
+// Cairo refuses to create image surfaces taller or wider than this.
+#define CAIRO_MAX_IMAGE_SIZE 32767
+
+// The row-oriented encoder the bands of a tiled render are streamed to.
+// Exactly one of the three is set.
+typedef struct {
+    PngEncoder *png;
+    QoiEncoder *qoi;
+    RawEncoder *raw;
+} BandEncoder;
+
+static void band_encoder_init(BandEncoder *encoder,
+                              OutputFormat format,
+                              cairo_write_func_t write_func,
+                              void *closure,
+                              int width,
+                              int height,
+                              const PngSettings *png_settings) {
+    memset(encoder, 0, sizeof(*encoder));
+    if (format == OUTPUT_FORMAT_QOI)
+        encoder->qoi =
+            qoi_encoder_new(write_func, closure, width, height, TRUE);
+    else if (format == OUTPUT_FORMAT_RAW)
+        encoder->raw = raw_encoder_new(write_func, closure, width, height);
+    else
+        encoder->png = png_encoder_new(
+            write_func, closure, width, height, TRUE, png_settings);
+}
+
+static gboolean band_encoder_write_rows(BandEncoder *encoder,
+                                        const unsigned char *data,
+                                        int stride,
+                                        int n_rows) {
+    if (encoder->qoi)
+        return qoi_encoder_write_rows(encoder->qoi, data, stride, n_rows);
+    if (encoder->raw)
+        return raw_encoder_write_rows(encoder->raw, data, stride, n_rows);
+    return png_encoder_write_rows(encoder->png, data, stride, n_rows);
+}
+
+static gboolean band_encoder_finish(BandEncoder *encoder) {
+    if (encoder->qoi)
+        return qoi_encoder_finish(encoder->qoi);
+    if (encoder->raw)
+        return raw_encoder_finish(encoder->raw);
+    return png_encoder_finish(encoder->png);
+}
+
+// A tiled render whose bands any thread may draw. Pango layouts are tied to
+// the thread that made them, so helping threads draw from a view of their
+// own of the owner's lines (see code_layout_export), shaping only the lines
+// of the bands they draw. Bands are claimed in order and encoded in order,
+// so a thread that has drawn a band waits for the bands above it to be
+// encoded first. The owner only waits for the bands that were claimed: a
+// helper that comes late finds none left and just drops its reference.
+typedef struct {
+    gint refcount;
+    CodeLayout *lines; // The owner's lines, exported for the helpers
+    RenderOptions opts;
+    TextRange range;
+    int pixel_width;
+    int pixel_height;
+    int band_height;
+    int n_bands;
+    gint next_band; // Next band to claim, taken with an atomic increment
+    GMutex mutex;   // Guards the fields below
+    GCond cond;
+    int next_write; // Next band to encode
+    BandEncoder encoder;
+    gboolean ok;
+} SharedTiledRender;
+
+// Shared renders with bands left to claim, and the number of renders that
+// are expected to be shared but have not finished yet (see
+// tiled_render_share_begin). Guarded by shared_mutex.
+static GMutex shared_mutex;
+static GCond shared_cond;
+static GQueue open_renders = G_QUEUE_INIT;
+static int n_expected_renders;
+
+/**
+ * @brief Creates a surface for bands of band_height rows at a device scale.
+ * @return The surface, or NULL if it could not be created (an error is
+ *         printed).
+ */
+static cairo_surface_t *band_surface_new(int pixel_width,
+                                         int band_height,
+                                         double scale) {
+    cairo_surface_t *band = cairo_image_surface_create(
+        CAIRO_FORMAT_ARGB32, pixel_width, band_height);
+    if (cairo_surface_status(band) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr,
+                "Could not create a %dx%d band surface: %s\n",
+                pixel_width,
+                band_height,
+                cairo_status_to_string(cairo_surface_status(band)));
+        cairo_surface_destroy(band);
+        return NULL;
+    }
+    cairo_surface_set_device_scale(band, scale, scale);
+    return band;
+}
+
+/**
+ * @brief Draws image rows [band_y, band_y + band height) of a window
+ *        showing a text range into a band surface, replacing the last band.
+ */
+static void draw_band(cairo_surface_t *band,
+                      const CodeLayout *code_layout,
+                      const RenderOptions *opts,
+                      const TextRange *range,
+                      int band_y) {
+    // The device offset is in pixels, so it composes with the scale.
+    cairo_surface_set_device_offset(band, 0, -band_y);
+    cairo_t *cr = cairo_create(band);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    render_text_range(cr, code_layout, opts, range);
+    cairo_destroy(cr);
+    cairo_surface_flush(band);
+}
+
+/**
+ * @brief Decides whether an image is too large to render on one surface,
+ *        either because cairo cannot create it or because it would use too
+ *        much memory.
+ */
+gboolean render_needs_tiling(const CodeLayout *code_layout,
+                             const RenderOptions *opts) {
+    double pixel_width = ceil(code_layout->width * opts->scale);
+    double pixel_height = ceil(code_layout->height * opts->scale);
+    return pixel_height > CAIRO_MAX_IMAGE_SIZE ||
+           pixel_width * pixel_height > TILED_RENDER_PIXEL_THRESHOLD;
+}
+
+/**
+ * @brief Renders a window showing a text range as a PNG, QOI or raw image,
+ *        one band of rows at a time. A single band-sized surface is reused for
+ *        every band and each finished band is handed straight to the
+ *        row-oriented encoder, so peak memory is O(band height x width)
+ *        however long the file is.
+ * @param code_layout The shaped code text.
+ * @param opts The rendering options.
+ * @param range The part of the text to render.
+ * @param write_func Called with the encoded bytes, in order.
+ * @param closure Passed to write_func.
+ * @param band_height The height in pixels of each band.
+ * @param format OUTPUT_FORMAT_QOI or OUTPUT_FORMAT_RAW; anything else
+ * writes PNG.
+ * @param png_settings Compression level, row filter and thread count.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean render_tiled_image(const CodeLayout *code_layout,
+                            const RenderOptions *opts,
+                            const TextRange *range,
+                            cairo_write_func_t write_func,
+                            void *closure,
+                            int band_height,
+                            OutputFormat format,
+                            const PngSettings *png_settings) {
+    int pixel_width = (int)ceil(code_layout->width * opts->scale);
+    int pixel_height = (int)ceil(render_window_height(range) * opts->scale);
+    if (pixel_width > CAIRO_MAX_IMAGE_SIZE) {
+        fprintf(stderr,
+                "Error: Image is %d pixels wide; at most %d is supported.\n",
+                pixel_width,
+                CAIRO_MAX_IMAGE_SIZE);
+        return FALSE;
+    }
+
+    band_height =
+        CLAMP(band_height, 1, MIN(pixel_height, CAIRO_MAX_IMAGE_SIZE));
+    cairo_surface_t *band =
+        band_surface_new(pixel_width, band_height, opts->scale);
+    if (!band)
+        return FALSE;
+
+    BandEncoder encoder;
+    band_encoder_init(&encoder,
+                      format,
+                      write_func,
+                      closure,
+                      pixel_width,
+                      pixel_height,
+                      png_settings);
+
+    gboolean ok = TRUE;
+    for (int band_y = 0; ok && band_y < pixel_height; band_y += band_height) {
+        int rows = MIN(band_height, pixel_height - band_y);
+        draw_band(band, code_layout, opts, range, band_y);
+        ok = band_encoder_write_rows(&encoder,
+                                     cairo_image_surface_get_data(band),
+                                     cairo_image_surface_get_stride(band),
+                                     rows);
+    }
+
+    cairo_surface_destroy(band);
+    return band_encoder_finish(&encoder) && ok;
+}
+
+/**
+ * @brief Renders a window showing a text range in bands of rows like
+ *        render_tiled_image, but keeps every band on a surface of its own
+ *        instead of encoding it, for an image that is drawn on again and
+ *        saved several times (-watch). The whole image is held in memory.
+ *        Each band keeps the device offset of its first row, so it can be
+ *        drawn on in the coordinates of the whole image.
+ * @param n_bands Receives the number of bands.
+ * @return The bands, top to bottom, to be freed with tiled_bands_free, or
+ *         NULL on failure (an error is printed).
+ */
+cairo_surface_t **render_tiled_bands(const CodeLayout *code_layout,
+                                     const RenderOptions *opts,
+                                     const TextRange *range,
+                                     int band_height,
+                                     int *n_bands) {
+    int pixel_width = (int)ceil(code_layout->width * opts->scale);
+    int pixel_height = (int)ceil(render_window_height(range) * opts->scale);
+    if (pixel_width > CAIRO_MAX_IMAGE_SIZE) {
+        fprintf(stderr,
+                "Error: Image is %d pixels wide; at most %d is supported.\n",
+                pixel_width,
+                CAIRO_MAX_IMAGE_SIZE);
+        return NULL;
+    }
+
+    band_height =
+        CLAMP(band_height, 1, MIN(pixel_height, CAIRO_MAX_IMAGE_SIZE));
+    *n_bands = (pixel_height + band_height - 1) / band_height;
+    cairo_surface_t **bands = g_new0(cairo_surface_t *, *n_bands);
+    for (int i = 0; i < *n_bands; i++) {
+        int band_y = i * band_height;
+        int rows = MIN(band_height, pixel_height - band_y);
+        bands[i] = band_surface_new(pixel_width, rows, opts->scale);
+        if (!bands[i]) {
+            tiled_bands_free(bands, i);
+            return NULL;
+        }
+        draw_band(bands[i], code_layout, opts, range, band_y);
+    }
+    return bands;
+}
+
+/**
+ * @brief Encodes the bands made by render_tiled_bands as one PNG, QOI or
+ *        raw image, in order, as render_tiled_image would have.
+ * @param format OUTPUT_FORMAT_QOI or OUTPUT_FORMAT_RAW; anything else
+ * writes PNG.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean encode_tiled_bands(cairo_surface_t *const *bands,
+                            int n_bands,
+                            cairo_write_func_t write_func,
+                            void *closure,
+                            OutputFormat format,
+                            const PngSettings *png_settings) {
+    int pixel_height = 0;
+    for (int i = 0; i < n_bands; i++)
+        pixel_height += cairo_image_surface_get_height(bands[i]);
+
+    BandEncoder encoder;
+    band_encoder_init(&encoder,
+                      format,
+                      write_func,
+                      closure,
+                      cairo_image_surface_get_width(bands[0]),
+                      pixel_height,
+                      png_settings);
+    gboolean ok = TRUE;
+    for (int i = 0; ok && i < n_bands; i++)
+        ok = band_encoder_write_rows(&encoder,
+                                     cairo_image_surface_get_data(bands[i]),
+                                     cairo_image_surface_get_stride(bands[i]),
+                                     cairo_image_surface_get_height(bands[i]));
+    return band_encoder_finish(&encoder) && ok;
+}
+
+/**
+ * @brief Frees the bands made by render_tiled_bands.
+ */
+void tiled_bands_free(cairo_surface_t **bands, int n_bands) {
+    for (int i = 0; bands && i < n_bands; i++)
+        cairo_surface_destroy(bands[i]);
+    g_free(bands);
+}
+
+static void shared_render_unref(SharedTiledRender *render) {
+    if (!g_atomic_int_dec_and_test(&render->refcount))
+        return;
+    code_layout_free(render->lines);
+    g_mutex_clear(&render->mutex);
+    g_cond_clear(&render->cond);
+    g_free(render);
+}
+
+/**
+ * @brief Claims bands of a shared render until none are left, drawing each
+ *        into the band surface and encoding it once the bands above it are.
+ */
+static void draw_shared_bands(SharedTiledRender *render,
+                              const CodeLayout *code_layout,
+                              cairo_surface_t *band) {
+    for (;;) {
+        int index = g_atomic_int_add(&render->next_band, 1);
+        if (index >= render->n_bands)
+            break;
+        int band_y = index * render->band_height;
+        int rows = MIN(render->band_height, render->pixel_height - band_y);
+        draw_band(band, code_layout, &render->opts, &render->range, band_y);
+
+        g_mutex_lock(&render->mutex);
+        while (render->next_write != index)
+            g_cond_wait(&render->cond, &render->mutex);
+        if (render->ok)
+            render->ok = band_encoder_write_rows(
+                &render->encoder,
+                cairo_image_surface_get_data(band),
+                cairo_image_surface_get_stride(band),
+                rows);
+        render->next_write++;
+        g_cond_broadcast(&render->cond);
+        g_mutex_unlock(&render->mutex);
+    }
+}
+
+/**
+ * @brief Like render_tiled_image, but idle threads in tiled_render_help
+ *        may draw some of the bands, so that one very large image does not
+ *        keep a single thread busy while the others have nothing left to
+ *        do. The calling thread draws bands too, and returns once every
+ *        band is encoded.
+ * @param highlighted_text The markup code_layout was shaped from, which
+ *        helping threads shape the lines of their bands from.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean render_shared_tiled_image(const CodeLayout *code_layout,
+                                   const char *highlighted_text,
+                                   const RenderOptions *opts,
+                                   const TextRange *range,
+                                   cairo_write_func_t write_func,
+                                   void *closure,
+                                   int band_height,
+                                   OutputFormat format,
+                                   const PngSettings *png_settings) {
+    int pixel_width = (int)ceil(code_layout->width * opts->scale);
+    int pixel_height = (int)ceil(render_window_height(range) * opts->scale);
+    if (pixel_width > CAIRO_MAX_IMAGE_SIZE) {
+        fprintf(stderr,
+                "Error: Image is %d pixels wide; at most %d is supported.\n",
+                pixel_width,
+                CAIRO_MAX_IMAGE_SIZE);
+        return FALSE;
+    }
+    band_height =
+        CLAMP(band_height, 1, MIN(pixel_height, CAIRO_MAX_IMAGE_SIZE));
+    cairo_surface_t *band =
+        band_surface_new(pixel_width, band_height, opts->scale);
+    if (!band)
+        return FALSE;
+
+    // Without the lines, the image is drawn by this thread alone.
+    CodeLayout *lines = code_layout_export(code_layout, highlighted_text);
+    if (!lines) {
+        cairo_surface_destroy(band);
+        return render_tiled_image(code_layout,
+                                  opts,
+                                  range,
+                                  write_func,
+                                  closure,
+                                  band_height,
+                                  format,
+                                  png_settings);
+    }
+
+    SharedTiledRender *render = g_new0(SharedTiledRender, 1);
+    render->refcount = 1;
+    render->lines = lines;
+    render->opts = *opts;
+    render->range = *range;
+    render->pixel_width = pixel_width;
+    render->pixel_height = pixel_height;
+    render->band_height = band_height;
+    render->n_bands = (pixel_height + band_height - 1) / band_height;
+    render->ok = TRUE;
+    g_mutex_init(&render->mutex);
+    g_cond_init(&render->cond);
+    band_encoder_init(&render->encoder,
+                      format,
+                      write_func,
+                      closure,
+                      pixel_width,
+                      pixel_height,
+                      png_settings);
+
+    g_mutex_lock(&shared_mutex);
+    g_queue_push_tail(&open_renders, render);
+    g_cond_broadcast(&shared_cond);
+    g_mutex_unlock(&shared_mutex);
+
+    draw_shared_bands(render, code_layout, band);
+
+    // No thread can join once the render is closed; wait for the bands
+    // other threads claimed to be encoded.
+    g_mutex_lock(&shared_mutex);
+    g_queue_remove(&open_renders, render);
+    g_mutex_unlock(&shared_mutex);
+    g_mutex_lock(&render->mutex);
+    while (render->next_write < render->n_bands)
+        g_cond_wait(&render->cond, &render->mutex);
+    g_mutex_unlock(&render->mutex);
+
+    cairo_surface_destroy(band);
+    gboolean ok = band_encoder_finish(&render->encoder) && render->ok;
+    shared_render_unref(render);
+    return ok;
+}
+
+/**
+ * @brief Announces that a shared tiled render will start, so that threads
+ *        in tiled_render_help wait for it rather than return. Each call is
+ *        matched by tiled_render_share_end once the render is done or will
+ *        not happen.
+ */
+void tiled_render_share_begin(void) {
+    g_mutex_lock(&shared_mutex);
+    n_expected_renders++;
+    g_mutex_unlock(&shared_mutex);
+}
+
+void tiled_render_share_end(void) {
+    g_mutex_lock(&shared_mutex);
+    n_expected_renders--;
+    g_cond_broadcast(&shared_cond);
+    g_mutex_unlock(&shared_mutex);
+}
+
+/**
+ * @brief Draws bands of a shared render on the calling thread, from a view
+ *        of the owner's lines that shapes only the lines it draws.
+ */
+static void help_shared_render(SharedTiledRender *render) {
+    CodeLayout *view = code_layout_new_view(render->lines, &render->opts);
+    cairo_surface_t *band = band_surface_new(
+        render->pixel_width, render->band_height, render->opts.scale);
+    if (band) {
+        draw_shared_bands(render, view, band);
+        cairo_surface_destroy(band);
+    }
+    code_layout_free(view);
+    shared_render_unref(render);
+}
+
+/**
+ * @brief Lends the calling thread to shared tiled renders: it draws bands
+ *        of any render with at least two left to claim, and returns once
+ *        none is open or announced.
+ */
+void tiled_render_help(void) {
+    g_mutex_lock(&shared_mutex);
+    for (;;) {
+        SharedTiledRender *render = NULL;
+        for (GList *l = open_renders.head; l && !render; l = l->next) {
+            SharedTiledRender *open = l->data;
+            if (open->n_bands - g_atomic_int_get(&open->next_band) >= 2)
+                render = open;
+        }
+        if (render) {
+            g_atomic_int_inc(&render->refcount);
+            g_mutex_unlock(&shared_mutex);
+            help_shared_render(render);
+            g_mutex_lock(&shared_mutex);
+        } else if (n_expected_renders > 0) {
+            g_cond_wait(&shared_cond, &shared_mutex);
+        } else {
+            break;
+        }
+    }
+    g_mutex_unlock(&shared_mutex);
+}
+
+/**
+ * @brief Builds the name of one numbered page, e.g. "out.png" becomes
+ *        "out-01.png" for the first of a dozen pages.
+ * @return A newly allocated file name.
+ */
+static char *paged_filename(const char *filename, int page, int n_pages) {
+    char count_buf[12];
+    int digits = snprintf(count_buf, sizeof(count_buf), "%d", n_pages);
+
+    const char *dot = strrchr(filename, '.');
+    const char *slash = strrchr(filename, '/');
+    if (!dot || (slash && dot < slash))
+        return g_strdup_printf("%s-%0*d", filename, digits, page);
+
+    return g_strdup_printf("%.*s-%0*d%s",
+                           (int)(dot - filename),
+                           filename,
+                           digits,
+                           page,
+                           dot);
+}
+
+/**
+ * @brief Splits the code into windows of at most page_lines lines and writes
+ *        each as its own numbered PNG, QOI or raw file. Every page is rendered
+ *        in bands from the same layout, so nothing is shaped twice.
+ * @return The number of pages written, or -1 on failure.
+ */
+int render_paged_image(const CodeLayout *code_layout,
+                       const RenderOptions *opts,
+                       const char *filename,
+                       int page_lines,
+                       int band_height,
+                       OutputFormat format,
+                       const PngSettings *png_settings) {
+    int n_pages = (code_layout->line_count + page_lines - 1) / page_lines;
+
+    for (int page = 0; page < n_pages; page++) {
+        TextRange range;
+        if (!code_layout_line_range(
+                code_layout, page * page_lines, page_lines, &range))
+            return -1;
+
+        char *page_filename = paged_filename(filename, page + 1, n_pages);
+        OutputStream *stream = output_stream_open(page_filename);
+        g_free(page_filename);
+        if (!stream)
+            return -1;
+
+        gboolean ok = render_tiled_image(code_layout,
+                                         opts,
+                                         &range,
+                                         output_stream_write,
+                                         stream,
+                                         band_height,
+                                         format,
+                                         png_settings);
+        if (!output_stream_close(stream) || !ok)
+            return -1;
+    }
+    return n_pages;
+}
@@ -0,0 +1,59 @@
+#ifndef TILED_RENDER_H
+#define TILED_RENDER_H
+
+#include <glib.h>
+
+#include "output.h"
+#include "png_writer.h"
+#include "render.h"
+
+// Height in pixels of the bands a tiled render is drawn in by default.
+#define DEFAULT_BAND_HEIGHT 512
+
+// Above this many pixels a single full-size ARGB32 surface (4 bytes per
+// pixel) costs more memory than it is worth, so the image is drawn in bands.
+#define TILED_RENDER_PIXEL_THRESHOLD (4096 * 4096)
+
+gboolean render_needs_tiling(const CodeLayout *code_layout,
+                             const RenderOptions *opts);
+gboolean render_tiled_image(const CodeLayout *code_layout,
+                            const RenderOptions *opts,
+                            const TextRange *range,
+                            cairo_write_func_t write_func,
+                            void *closure,
+                            int band_height,
+                            OutputFormat format,
+                            const PngSettings *png_settings);
+gboolean render_shared_tiled_image(const CodeLayout *code_layout,
+                                   const char *highlighted_text,
+                                   const RenderOptions *opts,
+                                   const TextRange *range,
+                                   cairo_write_func_t write_func,
+                                   void *closure,
+                                   int band_height,
+                                   OutputFormat format,
+                                   const PngSettings *png_settings);
+cairo_surface_t **render_tiled_bands(const CodeLayout *code_layout,
+                                     const RenderOptions *opts,
+                                     const TextRange *range,
+                                     int band_height,
+                                     int *n_bands);
+gboolean encode_tiled_bands(cairo_surface_t *const *bands,
+                            int n_bands,
+                            cairo_write_func_t write_func,
+                            void *closure,
+                            OutputFormat format,
+                            const PngSettings *png_settings);
+void tiled_bands_free(cairo_surface_t **bands, int n_bands);
+void tiled_render_share_begin(void);
+void tiled_render_share_end(void);
+void tiled_render_help(void);
+int render_paged_image(const CodeLayout *code_layout,
+                       const RenderOptions *opts,
+                       const char *filename,
+                       int page_lines,
+                       int band_height,
+                       OutputFormat format,
+                       const PngSettings *png_settings);
+
+#endif // TILED_RENDER_H
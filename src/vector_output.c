@@ -0,0 +1,90 @@
+#include "vector_output.h"
+
+#include <cairo-pdf.h>
+#include <cairo-svg.h>
+#include <stdio.h>
+
+/**
+ * @brief Finishes a vector surface, which writes out the rest of the file,
+ *        and reports any error cairo ran into while drawing or writing.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+static gboolean finish_vector_surface(cairo_surface_t *surface,
+                                      const char *format_name) {
+    cairo_surface_finish(surface);
+    cairo_status_t status = cairo_surface_status(surface);
+    cairo_surface_destroy(surface);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr,
+                "Could not save %s file: %s\n",
+                format_name,
+                cairo_status_to_string(status));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Writes the whole screenshot as a single SVG image. The window
+ *        chrome is drawn by the same code as raster output; the text is
+ *        emitted as glyph outlines for just the glyphs it uses, so no pixel
+ *        buffer is allocated however long the file is.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean render_svg_stream(const CodeLayout *code_layout,
+                           const RenderOptions *opts,
+                           cairo_write_func_t write_func,
+                           void *closure) {
+    cairo_surface_t *surface = cairo_svg_surface_create_for_stream(
+        write_func, closure, code_layout->width, code_layout->height);
+    cairo_t *cr = cairo_create(surface);
+    render_screenshot(cr, code_layout, opts);
+    cairo_destroy(cr);
+    return finish_vector_surface(surface, "SVG");
+}
+
+/**
+ * @brief Writes the code as a multi-page PDF, one window of at most
+ *        page_lines lines per page. Each page is sized to its own window.
+ *        cairo embeds each font once as a subset holding only the glyphs
+ *        that are used.
+ * @param code_layout The shaped code text.
+ * @param opts The rendering options.
+ * @param write_func Called with the PDF data, in order.
+ * @param closure Passed to write_func.
+ * @param page_lines Lines per page; 0 means DEFAULT_PDF_PAGE_LINES.
+ * @return The number of pages written, or -1 on failure.
+ */
+int render_pdf_stream(const CodeLayout *code_layout,
+                      const RenderOptions *opts,
+                      cairo_write_func_t write_func,
+                      void *closure,
+                      int page_lines) {
+    if (page_lines <= 0)
+        page_lines = DEFAULT_PDF_PAGE_LINES;
+    int n_pages = (code_layout->line_count + page_lines - 1) / page_lines;
+
+    // The size is set again before each page is drawn.
+    cairo_surface_t *surface = cairo_pdf_surface_create_for_stream(
+        write_func, closure, code_layout->width, 1);
+    cairo_pdf_surface_set_metadata(
+        surface, CAIRO_PDF_METADATA_CREATOR, "screenCODE");
+    if (opts->title)
+        cairo_pdf_surface_set_metadata(
+            surface, CAIRO_PDF_METADATA_TITLE, opts->title);
+
+    cairo_t *cr = cairo_create(surface);
+    for (int page = 0; page < n_pages; page++) {
+        TextRange range;
+        if (!code_layout_line_range(
+                code_layout, page * page_lines, page_lines, &range))
+            break;
+        cairo_pdf_surface_set_size(
+            surface, code_layout->width, render_window_height(&range));
+        render_text_range(cr, code_layout, opts, &range);
+        cairo_show_page(cr);
+    }
+    cairo_destroy(cr);
+
+    return finish_vector_surface(surface, "PDF") ? n_pages : -1;
+}
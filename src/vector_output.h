@@ -0,0 +1,21 @@
+#ifndef VECTOR_OUTPUT_H
+#define VECTOR_OUTPUT_H
+
+#include <glib.h>
+
+#include "render.h"
+
+// Lines per page of PDF output when no page size is given.
+#define DEFAULT_PDF_PAGE_LINES 60
+
+gboolean render_svg_stream(const CodeLayout *code_layout,
+                           const RenderOptions *opts,
+                           cairo_write_func_t write_func,
+                           void *closure);
+int render_pdf_stream(const CodeLayout *code_layout,
+                      const RenderOptions *opts,
+                      cairo_write_func_t write_func,
+                      void *closure,
+                      int page_lines);
+
+#endif // VECTOR_OUTPUT_H
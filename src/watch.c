@@ -0,0 +1,588 @@
+// inotify is Linux-only, and poll and sigaction are POSIX, not C99.
+#define _GNU_SOURCE
+
+#include "watch.h"
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "input_text.h"
+#include "output.h"
+#include "render.h"
+
+// How long the input must stay untouched before it is rendered, so that an
+// editor saving in several steps causes a single render.
+#define WATCH_SETTLE_MS 30
+
+// Lines redrawn on either side of a changed one: glyphs may reach into the
+// rows of the lines next to theirs.
+#define WATCH_LINE_MARGIN 1
+
+// One line of the code text as last drawn. Positions are in Pango units,
+// relative to the top-left corner of the text.
+typedef struct {
+    PangoLayoutLine *line; // In the code layout, or in own once changed
+    PangoLayout *own;      // The line shaped on its own, or NULL
+    int x;
+    int right; // x plus the line's logical width
+    int top;
+    int bottom;
+    int baseline;
+} WatchLine;
+
+// What is kept from one render to the next.
+typedef struct {
+    Job *job;
+    CodeLayout *code_layout; // Layout of the last full render, if kept
+    char **markup;           // Per line: its markup as last drawn
+    WatchLine *lines;
+    int n_lines;
+    int text_width;         // Right edge of the widest line
+    gboolean incremental;   // Changed lines can be drawn into the images
+    PendingOutput **images; // Per output: its last image, or NULL
+} Watch;
+
+// Written to by the signal handler; readable once watching should stop.
+static int stop_pipe[2] = {-1, -1};
+
+static void handle_stop_signal(int signum) {
+    (void)signum;
+    int saved_errno = errno;
+    ssize_t written = write(stop_pipe[1], "x", 1);
+    (void)written;
+    errno = saved_errno;
+}
+
+/**
+ * @brief Frees everything kept from the last render.
+ */
+static void watch_forget(Watch *watch) {
+    for (guint i = 0; i < watch->job->outputs->len; i++) {
+        pending_output_free(watch->images[i]);
+        watch->images[i] = NULL;
+    }
+    for (int i = 0; watch->lines && i < watch->n_lines; i++) {
+        if (watch->lines[i].own)
+            g_object_unref(watch->lines[i].own);
+    }
+    g_free(watch->lines);
+    g_strfreev(watch->markup);
+    code_layout_free(watch->code_layout);
+    watch->lines = NULL;
+    watch->markup = NULL;
+    watch->code_layout = NULL;
+    watch->n_lines = 0;
+    watch->incremental = FALSE;
+}
+
+/**
+ * @brief Records where the line an iterator is on was laid out.
+ */
+static void measure_line(PangoLayoutIter *iter, WatchLine *line) {
+    PangoRectangle logical;
+    pango_layout_iter_get_line_extents(iter, NULL, &logical);
+    pango_layout_iter_get_line_yrange(iter, &line->top, &line->bottom);
+    line->line = pango_layout_iter_get_line_readonly(iter);
+    line->x = logical.x;
+    line->right = logical.x + logical.width;
+    line->baseline = pango_layout_iter_get_baseline(iter);
+}
+
+/**
+ * @brief Splits the markup of a full render into lines and records where
+ *        the layout put each of them.
+ * @return TRUE if every line of markup is a line of the layout, FALSE if
+ *         not (e.g. a lone carriage return starts a line of its own).
+ */
+static gboolean watch_split_lines(Watch *watch, const char *markup) {
+    watch->markup = g_strsplit(markup, "\n", -1);
+    watch->n_lines = (int)g_strv_length(watch->markup);
+    if (watch->n_lines != watch->code_layout->line_count)
+        return FALSE;
+
+    watch->lines = g_new0(WatchLine, watch->n_lines);
+    watch->text_width = 0;
+    PangoLayoutIter *iter = pango_layout_get_iter(watch->code_layout->layout);
+    for (int i = 0; i < watch->n_lines; i++) {
+        measure_line(iter, &watch->lines[i]);
+        watch->text_width = MAX(watch->text_width, watch->lines[i].right);
+        pango_layout_iter_next_line(iter);
+    }
+    pango_layout_iter_free(iter);
+    return TRUE;
+}
+
+/**
+ * @brief Highlights the current contents of the input.
+ * @return The markup, or NULL on failure (an error is printed).
+ */
+static char *read_markup(Job *job) {
+    JobProgress progress;
+    job_progress_init(&progress, job);
+    char *markup = NULL;
+    if (job_run_step(&progress, JOB_STEP_READ) &&
+        job_run_step(&progress, JOB_STEP_HIGHLIGHT)) {
+        markup = progress.highlighted_text;
+        progress.highlighted_text = NULL;
+    }
+    job_progress_clear(&progress);
+    return markup;
+}
+
+/**
+ * @brief Lays the markup out and writes every output from scratch. The
+ *        layout and the images are kept if later changes can be drawn
+ *        into them.
+ * @return TRUE if every output was written, FALSE if not (an error is
+ *         printed).
+ */
+static gboolean watch_render_all(Watch *watch, const char *markup) {
+    Job *job = watch->job;
+    const PngSettings *png_settings =
+        job->use_cairo_png ? NULL : &job->png_settings;
+    watch_forget(watch);
+
+    gboolean needs_layout = FALSE;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        if (output_format_needs_layout(output_spec_format(spec)))
+            needs_layout = TRUE;
+    }
+    if (needs_layout) {
+        watch->code_layout = code_layout_new(markup, &job->opts);
+        if (!watch->code_layout)
+            return FALSE;
+    }
+
+    // Only single raster images, tiled ones included, come back as pixels
+    // to draw into; any other output that needs the layout makes every
+    // change a full render.
+    gboolean ok = TRUE;
+    watch->incremental = needs_layout;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        int n_files = write_output_kept(watch->code_layout,
+                                        markup,
+                                        &job->opts,
+                                        spec,
+                                        png_settings,
+                                        &watch->images[i]);
+        if (watch->images[i])
+            n_files = pending_output_write(watch->images[i]);
+        else if (output_format_needs_layout(output_spec_format(spec)))
+            watch->incremental = FALSE;
+        if (n_files < 0)
+            ok = FALSE;
+    }
+
+    if (watch->incremental)
+        watch->incremental = watch_split_lines(watch, markup);
+    if (!watch->incremental)
+        watch_forget(watch);
+    return ok;
+}
+
+/**
+ * @brief Draws image rows [row0, row1) again on one surface of an image:
+ *        the window behind them, then the lines crossing them. Rows the
+ *        surface does not hold are clipped away.
+ */
+static void redraw_rows(const Watch *watch,
+                        cairo_surface_t *surface,
+                        int row0,
+                        int row1,
+                        int first_line,
+                        int last_line) {
+    const WatchLine *lines = watch->lines;
+    double scale, scale_y;
+    cairo_surface_get_device_scale(surface, &scale, &scale_y);
+    int width = cairo_image_surface_get_width(surface);
+    double text_x, text_y;
+    render_text_origin(&text_x, &text_y);
+    TextRange range = {0, watch->code_layout->text_height};
+
+    cairo_t *cr = cairo_create(surface);
+    cairo_rectangle(cr, 0, row0 / scale, width / scale, (row1 - row0) / scale);
+    cairo_clip(cr);
+    render_window_chrome(cr, watch->code_layout, &watch->job->opts, &range);
+    for (int i = first_line; i <= last_line; i++)
+        render_code_line(cr,
+                         lines[i].line,
+                         text_x + (double)lines[i].x / PANGO_SCALE,
+                         text_y + (double)lines[i].baseline / PANGO_SCALE);
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+}
+
+/**
+ * @brief Draws the bands of rows holding the changed lines into an image
+ *        of the last render: the window behind them, clipped to whole
+ *        device rows, then the lines crossing the band. A tiled image is
+ *        only drawn on where its bands hold those rows.
+ * @param surfaces The image, or its bands from top to bottom.
+ * @param changed Per line: non-NULL if it changed.
+ */
+static void redraw_lines(const Watch *watch,
+                         cairo_surface_t *const *surfaces,
+                         int n_surfaces,
+                         PangoLayout *const *changed) {
+    const WatchLine *lines = watch->lines;
+    int n_lines = watch->n_lines;
+    double scale, scale_y;
+    cairo_surface_get_device_scale(surfaces[0], &scale, &scale_y);
+    double text_x, text_y;
+    render_text_origin(&text_x, &text_y);
+
+    for (int first = 0; first < n_lines; first++) {
+        if (!changed[first])
+            continue;
+        // Changes closer together than the margins share one band.
+        int last = first;
+        for (int i = first + 1;
+             i < n_lines && i <= last + 2 * WATCH_LINE_MARGIN + 1;
+             i++) {
+            if (changed[i])
+                last = i;
+        }
+        int band_first = MAX(first - WATCH_LINE_MARGIN, 0);
+        int band_last = MIN(last + WATCH_LINE_MARGIN, n_lines - 1);
+        int row0 = (int)floor(
+            (text_y + (double)lines[band_first].top / PANGO_SCALE) * scale);
+        int row1 = (int)ceil(
+            (text_y + (double)lines[band_last].bottom / PANGO_SCALE) * scale);
+        int draw_first = MAX(band_first - WATCH_LINE_MARGIN, 0);
+        int draw_last = MIN(band_last + WATCH_LINE_MARGIN, n_lines - 1);
+
+        int surface_y = 0;
+        for (int i = 0; i < n_surfaces && surface_y < row1; i++) {
+            int rows = cairo_image_surface_get_height(surfaces[i]);
+            if (surface_y + rows > row0)
+                redraw_rows(
+                    watch, surfaces[i], row0, row1, draw_first, draw_last);
+            surface_y += rows;
+        }
+        first = last;
+    }
+}
+
+/**
+ * @brief Shapes the lines of new markup that differ from the last render,
+ *        as long as each still fits in the rows of the line it replaces and
+ *        the text stays as wide.
+ * @param changed Receives, per line, its new layout, or NULL if the line is
+ *        unchanged.
+ * @return The number of changed lines, or -1 if they do not fit.
+ */
+static int shape_changed_lines(const Watch *watch,
+                               char **markup,
+                               PangoLayout **changed) {
+    int n_changed = 0;
+    int text_width = 0;
+    for (int i = 0; i < watch->n_lines; i++) {
+        const WatchLine *old = &watch->lines[i];
+        if (strcmp(markup[i], watch->markup[i]) == 0) {
+            text_width = MAX(text_width, old->right);
+            continue;
+        }
+        changed[i] = code_layout_shape_line(watch->code_layout, markup[i]);
+        if (!changed[i])
+            return -1;
+        n_changed++;
+
+        WatchLine line;
+        PangoLayoutIter *iter = pango_layout_get_iter(changed[i]);
+        measure_line(iter, &line);
+        pango_layout_iter_free(iter);
+        if (line.bottom - line.top != old->bottom - old->top ||
+            line.baseline - line.top != old->baseline - old->top)
+            return -1;
+        text_width = MAX(text_width, line.right);
+    }
+    // The image is as wide as the text in whole pixels.
+    if (PANGO_PIXELS_CEIL(text_width) != PANGO_PIXELS_CEIL(watch->text_width))
+        return -1;
+    return n_changed;
+}
+
+/**
+ * @brief Brings the outputs up to date with new markup: the changed lines
+ *        are drawn into the kept images if they fit where the old ones
+ *        were, and everything is laid out again if not.
+ * @param n_redrawn Receives the number of lines drawn again, or -1 after a
+ *        full render.
+ * @return TRUE if every output was written, FALSE if not (an error is
+ *         printed).
+ */
+static gboolean watch_update(Watch *watch,
+                             const char *markup,
+                             int *n_redrawn) {
+    *n_redrawn = -1;
+    if (!watch->incremental)
+        return watch_render_all(watch, markup);
+    char **lines = g_strsplit(markup, "\n", -1);
+    if ((int)g_strv_length(lines) != watch->n_lines) {
+        g_strfreev(lines);
+        return watch_render_all(watch, markup);
+    }
+
+    // Every changed line is shaped before the images are touched, so a
+    // change that does not fit leaves them as they were.
+    PangoLayout **changed = g_new0(PangoLayout *, watch->n_lines);
+    int n_changed = shape_changed_lines(watch, lines, changed);
+    if (n_changed <= 0) {
+        for (int i = 0; i < watch->n_lines; i++) {
+            if (changed[i])
+                g_object_unref(changed[i]);
+        }
+        g_free(changed);
+        g_strfreev(lines);
+        // A save that changed nothing the outputs show leaves them alone.
+        if (n_changed == 0) {
+            *n_redrawn = 0;
+            return TRUE;
+        }
+        return watch_render_all(watch, markup);
+    }
+
+    for (int i = 0; i < watch->n_lines; i++) {
+        if (!changed[i])
+            continue;
+        WatchLine *line = &watch->lines[i];
+        WatchLine shaped;
+        PangoLayoutIter *iter = pango_layout_get_iter(changed[i]);
+        measure_line(iter, &shaped);
+        pango_layout_iter_free(iter);
+        if (line->own)
+            g_object_unref(line->own);
+        line->own = changed[i];
+        line->line = shaped.line;
+        line->x = shaped.x;
+        line->right = shaped.right;
+    }
+    watch->text_width = 0;
+    for (int i = 0; i < watch->n_lines; i++)
+        watch->text_width = MAX(watch->text_width, watch->lines[i].right);
+    g_strfreev(watch->markup);
+    watch->markup = lines;
+
+    Job *job = watch->job;
+    gboolean ok = TRUE;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        int n_files;
+        if (watch->images[i]) {
+            int n_surfaces;
+            cairo_surface_t *const *surfaces =
+                pending_output_surfaces(watch->images[i], &n_surfaces);
+            redraw_lines(watch, surfaces, n_surfaces, changed);
+            n_files = pending_output_write(watch->images[i]);
+        } else {
+            n_files = write_output(NULL,
+                                   markup,
+                                   &job->opts,
+                                   spec,
+                                   job->use_cairo_png ? NULL
+                                                      : &job->png_settings);
+        }
+        if (n_files < 0)
+            ok = FALSE;
+    }
+    g_free(changed);
+    *n_redrawn = n_changed;
+    return ok;
+}
+
+/**
+ * @brief Reads the events waiting on an inotify descriptor.
+ * @return 1 if one of them is about the file named base, 0 if none is, -1
+ *         if the directory stopped being watched or reading failed.
+ */
+static int read_events(int fd, const char *base) {
+    char buffer[4096];
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    if (length < 0)
+        return errno == EINTR ? 0 : -1;
+
+    int found = 0;
+    for (ssize_t offset = 0; offset < length;) {
+        // Copied out, since events are only aligned as the kernel packs
+        // them.
+        struct inotify_event event;
+        memcpy(&event, buffer + offset, sizeof(event));
+        if (event.mask & IN_IGNORED)
+            return -1;
+        if ((event.mask & IN_Q_OVERFLOW) ||
+            (event.len > 0 &&
+             strcmp(buffer + offset + sizeof(event), base) == 0))
+            found = 1;
+        offset += sizeof(event) + event.len;
+    }
+    return found;
+}
+
+/**
+ * @brief Renders the input again after it changed, and reports how.
+ */
+static void watch_changed(Watch *watch) {
+    const char *name = watch->job->input_filename;
+    gint64 start = g_get_monotonic_time();
+    char *markup = read_markup(watch->job);
+    if (!markup)
+        return;
+    int n_redrawn;
+    gboolean ok = watch_update(watch, markup, &n_redrawn);
+    g_free(markup);
+    double elapsed_ms = (g_get_monotonic_time() - start) / 1000.0;
+    if (!ok)
+        fprintf(stderr, "%s changed but could not be rendered.\n", name);
+    else if (n_redrawn < 0)
+        printf("%s rendered again in %.1f ms\n", name, elapsed_ms);
+    else
+        printf("%s: %d of %d lines redrawn in %.1f ms\n",
+               name,
+               n_redrawn,
+               watch->n_lines,
+               elapsed_ms);
+    fflush(stdout);
+}
+
+/**
+ * @brief Waits for changes to the input and renders each, until a stop
+ *        signal arrives.
+ * @return 0 once stopped, 1 if the input could not be watched.
+ */
+static int watch_loop(Watch *watch, int inotify_fd) {
+    char *base = g_path_get_basename(watch->job->input_filename);
+    struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+    int exit_code = 0;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+            exit_code = 1;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        // Editors often write a file in several steps; render once they
+        // are done.
+        int changed = read_events(inotify_fd, base);
+        while (changed >= 0 && poll(fds, 1, WATCH_SETTLE_MS) > 0) {
+            int more = read_events(inotify_fd, base);
+            changed = more < 0 ? -1 : (changed || more);
+        }
+        if (changed < 0) {
+            fprintf(stderr,
+                    "Error: stopped watching %s.\n",
+                    watch->job->input_filename);
+            exit_code = 1;
+            break;
+        }
+        if (changed)
+            watch_changed(watch);
+    }
+    g_free(base);
+    return exit_code;
+}
+
+/**
+ * @brief Starts watching the directory holding a file for files written or
+ *        moved into it.
+ * @return An inotify descriptor, or -1 on failure (an error is printed).
+ */
+static int watch_directory(const char *filename) {
+    char *dir = g_path_get_dirname(filename);
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 ||
+        inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr,
+                "Error: could not watch %s: %s\n",
+                dir,
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+    g_free(dir);
+    return fd;
+}
+
+/**
+ * @brief Renders the input once, then every time it changes, until a stop
+ *        signal arrives.
+ * @return 0 once stopped, 1 on failure (an error is printed).
+ */
+static int watch_input(Watch *watch, int inotify_fd) {
+    Job *job = watch->job;
+    char *markup = read_markup(job);
+    gboolean ok = markup && watch_render_all(watch, markup);
+    g_free(markup);
+    if (!ok)
+        return 1;
+    for (guint i = 0; i < job->outputs->len; i++) {
+        printf("Screenshot saved to %s\n",
+               g_array_index(job->outputs, OutputSpec, i).filename);
+    }
+    fflush(stdout);
+
+    if (pipe(stop_pipe) != 0) {
+        fprintf(stderr,
+                "Error: could not create a pipe: %s\n",
+                strerror(errno));
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    fprintf(stderr, "Watching %s for changes.\n", job->input_filename);
+    int exit_code = watch_loop(watch, inotify_fd);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    return exit_code;
+}
+
+int run_watch(Job *job) {
+    if (job->input_from_git || strcmp(job->input_filename, "-") == 0) {
+        fprintf(stderr, "Error: -watch needs an input file.\n");
+        return 1;
+    }
+    for (guint i = 0; i < job->outputs->len; i++) {
+        OutputSpec *spec = &g_array_index(job->outputs, OutputSpec, i);
+        if (spec->fd >= 0) {
+            fprintf(stderr,
+                    "Error: %s: with -watch, outputs must be files.\n",
+                    spec->filename);
+            return 1;
+        }
+    }
+
+    // Editors may rewrite the file in place while it is being highlighted,
+    // which would fault on a mapping of it.
+    input_text_map_files(FALSE);
+
+    // The watch starts before the first render, so that no save is missed.
+    int inotify_fd = watch_directory(job->input_filename);
+    if (inotify_fd < 0)
+        return 1;
+    Watch watch;
+    memset(&watch, 0, sizeof(watch));
+    watch.job = job;
+    watch.images = g_new0(PendingOutput *, job->outputs->len);
+    int exit_code = watch_input(&watch, inotify_fd);
+    watch_forget(&watch);
+    g_free(watch.images);
+    close(inotify_fd);
+    return exit_code;
+}
@@ -0,0 +1,17 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "job.h"
+
+// Renders the job's input once, then again every time the file is saved,
+// until SIGINT or SIGTERM. The directory holding the input is watched with
+// inotify, so editors that save by writing a new file and renaming it over
+// the old one are seen too. The layout and the pixels of every single
+// raster image (PNG, QOI, raw or WebP, not tiled, paged or animated) are
+// kept between renders: when a save leaves the number of lines and the
+// width of the text as they were, only the bands of rows holding the lines
+// that changed are drawn again, and the images are encoded again from the
+// kept pixels. Any other change lays the text out again in full.
+int run_watch(Job *job);
+
+#endif // WATCH_H
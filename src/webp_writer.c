@@ -0,0 +1,135 @@
+#include "webp_writer.h"
+
+#include <stdio.h>
+
+#ifdef HAVE_WEBP
+#include <webp/encode.h>
+
+// Lossless effort, from 0 (fastest) to 9 (smallest). Screenshots are mostly
+// flat color, so the low presets already compress them well.
+#define WEBP_LOSSLESS_PRESET 1
+
+// Where libwebp's writer callback passes the encoded bytes on to.
+typedef struct {
+    cairo_write_func_t write_func;
+    void *closure;
+} WebPOutput;
+
+static int write_to_stream(const uint8_t *data,
+                           size_t data_size,
+                           const WebPPicture *picture) {
+    const WebPOutput *output = picture->custom_ptr;
+    return output->write_func(output->closure, data, data_size) ==
+           CAIRO_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Turns cairo's premultiplied pixels into the straight ARGB libwebp
+ *        expects, in place. Both use native-endian 32-bit ARGB words, so
+ *        nothing else needs converting.
+ */
+static void unpremultiply_in_place(unsigned char *data,
+                                   int width,
+                                   int height,
+                                   int stride,
+                                   gboolean has_alpha) {
+    for (int y = 0; y < height; y++) {
+        guint32 *row = (guint32 *)(data + (size_t)y * stride);
+        for (int x = 0; x < width; x++) {
+            guint32 pixel = row[x];
+            guint32 alpha = has_alpha ? (pixel >> 24) : 0xff;
+            if (alpha == 0xff) {
+                row[x] = pixel | 0xff000000;
+            } else if (alpha == 0) {
+                row[x] = 0;
+            } else {
+                guint32 r = (pixel >> 16) & 0xff;
+                guint32 g = (pixel >> 8) & 0xff;
+                guint32 b = pixel & 0xff;
+                r = (r * 255 + alpha / 2) / alpha;
+                g = (g * 255 + alpha / 2) / alpha;
+                b = (b * 255 + alpha / 2) / alpha;
+                row[x] = (alpha << 24) | (r << 16) | (g << 8) | b;
+            }
+        }
+    }
+}
+#endif
+
+/**
+ * @brief Encodes an image surface as lossless WebP. libwebp reads the
+ *        surface rows directly through the picture's ARGB pointer and
+ *        stride, and the encoded bytes go straight to write_func.
+ * @param surface An ARGB32 or RGB24 image surface.
+ * @param write_func Called with the encoded bytes, in order.
+ * @param closure Passed to write_func.
+ * @return TRUE on success, FALSE on failure (an error is printed).
+ */
+gboolean write_webp_stream(cairo_surface_t *surface,
+                           cairo_write_func_t write_func,
+                           void *closure) {
+#ifdef HAVE_WEBP
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+        fprintf(stderr, "Could not save WebP file: unsupported format.\n");
+        return FALSE;
+    }
+
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    if (width > WEBP_MAX_DIMENSION || height > WEBP_MAX_DIMENSION) {
+        fprintf(stderr,
+                "Could not save WebP file: %dx%d exceeds the %d pixel "
+                "limit.\n",
+                width,
+                height,
+                WEBP_MAX_DIMENSION);
+        return FALSE;
+    }
+
+    WebPConfig config;
+    WebPPicture picture;
+    if (!WebPConfigInit(&config) ||
+        !WebPConfigLosslessPreset(&config, WEBP_LOSSLESS_PRESET) ||
+        !WebPPictureInit(&picture)) {
+        fprintf(stderr,
+                "Could not save WebP file: libwebp version mismatch.\n");
+        return FALSE;
+    }
+    config.thread_level = 1;
+
+    WebPOutput output = {write_func, closure};
+    cairo_surface_flush(surface);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    unpremultiply_in_place(
+        data, width, height, stride, format == CAIRO_FORMAT_ARGB32);
+    cairo_surface_mark_dirty(surface);
+
+    picture.use_argb = 1;
+    picture.width = width;
+    picture.height = height;
+    picture.argb = (uint32_t *)data;
+    picture.argb_stride = stride / 4;
+    picture.writer = write_to_stream;
+    picture.custom_ptr = &output;
+
+    gboolean ok = WebPEncode(&config, &picture);
+    if (!ok)
+        fprintf(stderr,
+                "Could not save WebP file: encoder error %d.\n",
+                picture.error_code);
+    // The pixels belong to the surface; only drop libwebp's own state.
+    picture.argb = NULL;
+    WebPPictureFree(&picture);
+    return ok;
+#else
+    (void)surface;
+    (void)write_func;
+    (void)closure;
+    fprintf(stderr,
+            "Could not save WebP file: screenCODE was built without WebP "
+            "support (libwebp).\n");
+    return FALSE;
+#endif
+}
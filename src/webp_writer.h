@@ -0,0 +1,16 @@
+#ifndef WEBP_WRITER_H
+#define WEBP_WRITER_H
+
+#include <cairo.h>
+#include <glib.h>
+
+// Encodes an ARGB32 or RGB24 image surface as lossless WebP, passing the
+// bytes to write_func. This needs screenCODE to be built with libwebp
+// (HAVE_WEBP); otherwise an error is printed and FALSE returned. The surface
+// is handed to libwebp as is, so its pixels are unpremultiplied in place and
+// it should not be drawn on again.
+gboolean write_webp_stream(cairo_surface_t *surface,
+                           cairo_write_func_t write_func,
+                           void *closure);
+
+#endif // WEBP_WRITER_H